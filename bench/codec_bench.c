@@ -0,0 +1,324 @@
+/*
+Copyright (c) 2014 Shin Hiroe
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/*
+ * Microbenchmark of the packet codec and the socket layer.
+ *
+ * Messages are published with MQTTPacket_send_publish on one end of a socketpair, and read
+ * back with MQTTPacket_Factory on the other, together with the acks of their QoS flow, so that
+ * the remaining length codec, the SocketBuffer partial read paths and the pending write paths
+ * are all driven as the client drives them, without a network or a broker.  Large payloads
+ * do not fit in the socket buffers, so they are written and read in pieces.
+ *
+ * System calls and allocations are counted by wrapping the C library functions at link time
+ * (see the Makefile), so only those made by the client code are counted.
+ *
+ * Usage: codec_bench [iterations]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "Clients.h"
+#include "MQTTPacket.h"
+#include "Socket.h"
+#include "SocketBuffer.h"
+
+extern ClientStates* bstate;
+int Socket_addSocket(int newSd);
+
+/**
+ * Counts of the calls made through the wrapped C library functions
+ */
+static struct
+{
+	unsigned long syscalls;
+	unsigned long allocs;
+} counts;
+
+ssize_t __real_recv(int fd, void* buf, size_t len, int flags);
+ssize_t __real_send(int fd, const void* buf, size_t len, int flags);
+ssize_t __real_read(int fd, void* buf, size_t len);
+ssize_t __real_write(int fd, const void* buf, size_t len);
+ssize_t __real_writev(int fd, const struct iovec* iov, int count);
+int __real_select(int n, fd_set* r, fd_set* w, fd_set* e, struct timeval* tv);
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t n, size_t size);
+void* __real_realloc(void* p, size_t size);
+
+ssize_t __wrap_recv(int fd, void* buf, size_t len, int flags)
+{
+	++counts.syscalls;
+	return __real_recv(fd, buf, len, flags);
+}
+
+ssize_t __wrap_send(int fd, const void* buf, size_t len, int flags)
+{
+	++counts.syscalls;
+	return __real_send(fd, buf, len, flags);
+}
+
+ssize_t __wrap_read(int fd, void* buf, size_t len)
+{
+	++counts.syscalls;
+	return __real_read(fd, buf, len);
+}
+
+ssize_t __wrap_write(int fd, const void* buf, size_t len)
+{
+	++counts.syscalls;
+	return __real_write(fd, buf, len);
+}
+
+ssize_t __wrap_writev(int fd, const struct iovec* iov, int count)
+{
+	++counts.syscalls;
+	return __real_writev(fd, iov, count);
+}
+
+int __wrap_select(int n, fd_set* r, fd_set* w, fd_set* e, struct timeval* tv)
+{
+	++counts.syscalls;
+	return __real_select(n, r, w, e, tv);
+}
+
+void* __wrap_malloc(size_t size)
+{
+	++counts.allocs;
+	return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t n, size_t size)
+{
+	++counts.allocs;
+	return __real_calloc(n, size);
+}
+
+void* __wrap_realloc(void* p, size_t size)
+{
+	++counts.allocs;
+	return __real_realloc(p, size);
+}
+
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+
+static Clients* new_client(int socket)
+{
+	Clients* client = calloc(1, sizeof(Clients));
+
+	client->clientID = "bench";
+	client->net.socket = socket;
+	client->net.MQTTVersion = MQTTVERSION_3_1_1;
+	ListAppend(bstate->clients, client, sizeof(Clients));
+	Socket_addSocket(socket);
+	return client;
+}
+
+
+/**
+ * Read the next packet from a socket, continuing any interrupted writes while it is incomplete
+ * @param net the network handles of the reading end
+ * @param type the packet type expected
+ * @return the packet, or NULL on error
+ */
+static void* read_packet(networkHandles* net, int type)
+{
+	struct timeval tv = {1L, 0L};
+	void* pack = NULL;
+	int error = 0;
+
+	while ((pack = MQTTPacket_Factory(net, &error)) == NULL)
+	{
+		if (error != TCPSOCKET_INTERRUPTED && error != TCPSOCKET_COMPLETE)
+		{
+			fprintf(stderr, "read of packet type %d failed, rc %d\n", type, error);
+			return NULL;
+		}
+		Socket_getReadySocket(0, &tv);
+	}
+	if (((MQTTPacket*)pack)->header.bits.type != type)
+	{
+		fprintf(stderr, "expected packet type %d, read %d\n", type, ((MQTTPacket*)pack)->header.bits.type);
+		MQTTPacket_free_packet(pack);
+		return NULL;
+	}
+	return pack;
+}
+
+
+/**
+ * Publish one message from the writer to the reader, and complete its QoS flow
+ * @return 0 on success
+ */
+static int flow(Clients* writer, Clients* reader, Publish* pub, int qos)
+{
+	MQTTPacket* pack = NULL;
+	int rc = 0;
+
+	if (MQTTPacket_send_publish(pub, 0, qos, 0, &writer->net, writer->clientID) == SOCKET_ERROR)
+		return -1;
+	if ((pack = read_packet(&reader->net, PUBLISH)) == NULL)
+		return -1;
+	MQTTPacket_free_packet(pack);
+	if (qos == 1)
+	{
+		rc = MQTTPacket_send_puback(pub->msgId, &reader->net, reader->clientID);
+		if (rc == SOCKET_ERROR || (pack = read_packet(&writer->net, PUBACK)) == NULL)
+			return -1;
+		MQTTPacket_free_packet(pack);
+	}
+	else if (qos == 2)
+	{
+		rc = MQTTPacket_send_pubrec(pub->msgId, &reader->net, reader->clientID);
+		if (rc == SOCKET_ERROR || (pack = read_packet(&writer->net, PUBREC)) == NULL)
+			return -1;
+		MQTTPacket_free_packet(pack);
+		rc = MQTTPacket_send_pubrel(pub->msgId, 0, &writer->net, writer->clientID);
+		if (rc == SOCKET_ERROR || (pack = read_packet(&reader->net, PUBREL)) == NULL)
+			return -1;
+		MQTTPacket_free_packet(pack);
+		rc = MQTTPacket_send_pubcomp(pub->msgId, &reader->net, reader->clientID);
+		if (rc == SOCKET_ERROR || (pack = read_packet(&writer->net, PUBCOMP)) == NULL)
+			return -1;
+		MQTTPacket_free_packet(pack);
+	}
+	return 0;
+}
+
+
+static int bench_flow(Clients* writer, Clients* reader, int qos, int payloadlen, int iterations)
+{
+	static const int packets[] = {1, 2, 4};
+	Publish pub;
+	double start, elapsed;
+	unsigned long syscalls, allocs, npackets;
+	int i;
+
+	memset(&pub, '\0', sizeof(pub));
+	pub.topic = "bench/codec";
+	pub.payload = malloc(payloadlen);
+	pub.payloadlen = payloadlen;
+	memset(pub.payload, 'x', payloadlen);
+
+	pub.msgId = 1;
+	if (flow(writer, reader, &pub, qos) != 0) /* warm up the buffers and pools */
+		return -1;
+
+	counts.syscalls = counts.allocs = 0;
+	start = now_ns();
+	for (i = 0; i < iterations; ++i)
+	{
+		pub.msgId = (i % 65535) + 1;
+		if (flow(writer, reader, &pub, qos) != 0)
+			return -1;
+	}
+	elapsed = now_ns() - start;
+	syscalls = counts.syscalls;
+	allocs = counts.allocs;
+	free(pub.payload);
+
+	npackets = (unsigned long)iterations * packets[qos];
+	printf("%3d %8d %7d %8d %12.0f %10.1f %12.2f %10.2f\n", qos, payloadlen, iterations, packets[qos],
+		elapsed / npackets, (double)payloadlen * iterations / elapsed * 1e3,
+		(double)syscalls / npackets, (double)allocs / npackets);
+	return 0;
+}
+
+
+static void bench_remaining_length(int iterations)
+{
+	static const int lengths[] = {0, 127, 128, 16383, 16384, 2097151, 2097152, 268435455};
+	char buf[MQTTPACKET_HEADER_LEN];
+	double start, elapsed;
+	volatile int sink = 0; /* keeps the decoded values live */
+	int i;
+
+	start = now_ns();
+	for (i = 0; i < iterations; ++i)
+	{
+		char* ptr = buf;
+		int value = 0;
+
+		MQTTPacket_encode(buf, lengths[i % 8] - (i & 63));
+		MQTTPacket_decodeBuf(&ptr, buf + sizeof(buf), &value);
+		sink += value;
+	}
+	elapsed = now_ns() - start;
+	printf("remaining length encode + decode: %.1f ns\n\n", elapsed / iterations);
+}
+
+
+int main(int argc, char** argv)
+{
+	static const int sizes[] = {16, 256, 4096, 65536, 1048576};
+	int max_iterations = (argc > 1) ? atoi(argv[1]) : 20000;
+	int sv[2], qos, i;
+	Clients* writer = NULL;
+	Clients* reader = NULL;
+
+	if (max_iterations < 1)
+	{
+		fprintf(stderr, "usage: %s [iterations]\n", argv[0]);
+		return 1;
+	}
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0)
+	{
+		perror("socketpair");
+		return 1;
+	}
+	Socket_outInitialize();
+	bstate->clients = ListInitialize();
+	writer = new_client(sv[0]);
+	reader = new_client(sv[1]);
+
+	bench_remaining_length(max_iterations * 100);
+	printf("qos  payload    msgs pkts/msg       ns/pkt       MB/s syscalls/pkt allocs/pkt\n");
+	for (qos = 0; qos <= 2; ++qos)
+	{
+		for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i)
+		{
+			int iterations = (64 * 1024 * 1024) / sizes[i];
+
+			if (iterations > max_iterations)
+				iterations = max_iterations;
+			else if (iterations < 16)
+				iterations = 16;
+			if (bench_flow(writer, reader, qos, sizes[i], iterations) != 0)
+				return 2;
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,375 @@
+/*
+Copyright (c) 2014 Shin Hiroe
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/*
+ * End to end benchmark of the MQTTAsync client, against the in-process broker stub.
+ *
+ * Each client connects, subscribes to a topic of its own, and publishes messages to it with
+ * the send time in the payload, keeping at most a window of messages outstanding.  The time
+ * from MQTTAsync_send to the messageArrived callback is the latency of a message, so each
+ * one goes through the send thread, the broker, the receive thread and the acks of its QoS.
+ * The clients publish at the same time, each from its own thread.
+ *
+ * Usage: e2e_bench [-n messages] [-q qos] [-s payload] [-w window] [-c clients] [-r] [-b batch]
+ *
+ * With -r the topics are registered with MQTTAsync_registerTopic() and published to with
+ * MQTTAsync_sendTo(), rather than MQTTAsync_send().
+ *
+ * With -b up to batch messages are packed into each publication, with the default linger
+ * and size of MQTTAsync_batchOptions, and unpacked again before messageArrived.  The window
+ * should be larger than the batch, or each batch only fills when its linger runs out.
+ *
+ * By default every combination of QoS 0/1/2, payloads of 16 B, 1 KB and 64 KB, windows of
+ * 1, 16 and 256 and 1 or 4 clients is run, with 2000 messages per client.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "MQTTAsync.h"
+#include "broker_stub.h"
+
+#define BENCH_MAX_CLIENTS 32
+
+/**
+ * The state of one benchmark client
+ */
+typedef struct
+{
+	MQTTAsync handle;
+	char topic[32];
+	MQTTAsync_topicHandle registered;	/**< the registered topic, or NULL to publish with MQTTAsync_send */
+	int qos;
+	int payloadlen;
+	int window;
+	int count;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int connected;	/**< 1 when connected and subscribed, -1 on failure */
+	int disconnected;
+	int sent;
+	int arrived;
+	double* latencies;	/**< in nanoseconds, one for each message arrived */
+} BenchClient;
+
+static int port = 0;
+static int use_registered = 0;
+static int batch_messages = 0;
+
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+
+static void set_state(BenchClient* client, int* field, int value)
+{
+	pthread_mutex_lock(&client->mutex);
+	*field = value;
+	pthread_cond_broadcast(&client->cond);
+	pthread_mutex_unlock(&client->mutex);
+}
+
+
+/**
+ * Wait until a field of a client has changed from a value, or until a timeout
+ * @return the value of the field
+ */
+static int wait_state(BenchClient* client, int* field, int value, int seconds)
+{
+	struct timespec deadline;
+	int rc;
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += seconds;
+	pthread_mutex_lock(&client->mutex);
+	while (*field == value && pthread_cond_timedwait(&client->cond, &client->mutex, &deadline) == 0)
+		;
+	rc = *field;
+	pthread_mutex_unlock(&client->mutex);
+	return rc;
+}
+
+
+/**
+ * Wait until all the messages a client has sent have arrived, or until a timeout
+ */
+static void wait_arrived(BenchClient* client, int seconds)
+{
+	struct timespec deadline;
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += seconds;
+	pthread_mutex_lock(&client->mutex);
+	while (client->arrived < client->sent &&
+		pthread_cond_timedwait(&client->cond, &client->mutex, &deadline) == 0)
+		;
+	pthread_mutex_unlock(&client->mutex);
+}
+
+
+static int message_arrived(void* context, char* topicName, int topicLen, MQTTAsync_message* message)
+{
+	BenchClient* client = context;
+	double sent;
+
+	memcpy(&sent, message->payload, sizeof(sent));
+	pthread_mutex_lock(&client->mutex);
+	if (client->arrived < client->count)
+		client->latencies[client->arrived++] = now_ns() - sent;
+	pthread_cond_broadcast(&client->cond);
+	pthread_mutex_unlock(&client->mutex);
+	MQTTAsync_freeMessage(&message);
+	MQTTAsync_free(topicName);
+	return 1;
+}
+
+
+static void on_subscribe(void* context, MQTTAsync_successData* response)
+{
+	BenchClient* client = context;
+
+	set_state(client, &client->connected, 1);
+}
+
+
+static void on_failure(void* context, MQTTAsync_failureData* response)
+{
+	BenchClient* client = context;
+
+	set_state(client, &client->connected, -1);
+}
+
+
+static void on_connect(void* context, MQTTAsync_successData* response)
+{
+	BenchClient* client = context;
+	MQTTAsync_responseOptions opts = MQTTAsync_responseOptions_initializer;
+
+	opts.onSuccess = on_subscribe;
+	opts.onFailure = on_failure;
+	opts.context = client;
+	if (MQTTAsync_subscribe(client->handle, client->topic, client->qos, &opts) != MQTTASYNC_SUCCESS)
+		set_state(client, &client->connected, -1);
+}
+
+
+static void on_disconnect(void* context, MQTTAsync_successData* response)
+{
+	BenchClient* client = context;
+
+	set_state(client, &client->disconnected, 1);
+}
+
+
+static void* publisher(void* arg)
+{
+	BenchClient* client = arg;
+	char* payload = calloc(1, client->payloadlen);
+	int i, rc;
+
+	for (i = 0; i < client->count; ++i)
+	{
+		double sent;
+
+		pthread_mutex_lock(&client->mutex);
+		while (client->sent - client->arrived >= client->window)
+			pthread_cond_wait(&client->cond, &client->mutex);
+		pthread_mutex_unlock(&client->mutex);
+
+		sent = now_ns();
+		memcpy(payload, &sent, sizeof(sent));
+		while ((rc = (client->registered) ?
+				MQTTAsync_sendTo(client->registered, client->payloadlen, payload, client->qos, 0, NULL) :
+				MQTTAsync_send(client->handle, client->topic, client->payloadlen, payload, client->qos, 0, NULL))
+				== MQTTASYNC_WOULD_BLOCK)
+			usleep(100);
+		if (rc != MQTTASYNC_SUCCESS)
+		{
+			fprintf(stderr, "send failed, rc %d\n", rc);
+			break;
+		}
+		pthread_mutex_lock(&client->mutex);
+		++(client->sent);
+		pthread_mutex_unlock(&client->mutex);
+	}
+	free(payload);
+	return NULL;
+}
+
+
+static int compare_doubles(const void* a, const void* b)
+{
+	double x = *(const double*)a, y = *(const double*)b;
+
+	return (x > y) - (x < y);
+}
+
+
+static int bench_case(int qos, int payloadlen, int window, int nclients, int count)
+{
+	BenchClient clients[BENCH_MAX_CLIENTS];
+	pthread_t threads[BENCH_MAX_CLIENTS];
+	double* latencies = NULL;
+	double start, elapsed;
+	int i, total = 0, rc = 0;
+
+	memset(clients, '\0', sizeof(clients));
+	for (i = 0; i < nclients; ++i)
+	{
+		BenchClient* client = &clients[i];
+		MQTTAsync_connectOptions opts = MQTTAsync_connectOptions_initializer;
+		MQTTAsync_batchOptions batch = MQTTAsync_batchOptions_initializer;
+		char uri[32], clientid[32];
+
+		sprintf(uri, "tcp://127.0.0.1:%d", port);
+		sprintf(clientid, "bench%d", i);
+		sprintf(client->topic, "bench/%d", i);
+		client->qos = qos;
+		client->payloadlen = payloadlen;
+		client->window = window;
+		client->count = count;
+		client->latencies = malloc(count * sizeof(double));
+		pthread_mutex_init(&client->mutex, NULL);
+		pthread_cond_init(&client->cond, NULL);
+		MQTTAsync_create(&client->handle, uri, clientid, MQTTCLIENT_PERSISTENCE_NONE, NULL);
+		MQTTAsync_setCallbacks(client->handle, client, NULL, message_arrived, NULL);
+		opts.onSuccess = on_connect;
+		opts.onFailure = on_failure;
+		opts.context = client;
+		opts.maxInflight = window;
+		if (batch_messages > 0)
+		{
+			batch.maxMessages = batch_messages;
+			opts.batch = &batch;
+		}
+		if (MQTTAsync_connect(client->handle, &opts) != MQTTASYNC_SUCCESS ||
+			wait_state(client, &client->connected, 0, 10) != 1)
+		{
+			fprintf(stderr, "client %d failed to connect\n", i);
+			rc = -1;
+			nclients = i + 1;
+			goto exit;
+		}
+		if (use_registered)
+			MQTTAsync_registerTopic(client->handle, client->topic, &client->registered);
+	}
+
+	start = now_ns();
+	for (i = 0; i < nclients; ++i)
+		pthread_create(&threads[i], NULL, publisher, &clients[i]);
+	for (i = 0; i < nclients; ++i)
+	{
+		pthread_join(threads[i], NULL);
+		wait_arrived(&clients[i], 30);
+	}
+	elapsed = now_ns() - start;
+
+	latencies = malloc(nclients * count * sizeof(double));
+	for (i = 0; i < nclients; ++i)
+	{
+		memcpy(&latencies[total], clients[i].latencies, clients[i].arrived * sizeof(double));
+		total += clients[i].arrived;
+	}
+	if (total < nclients * count)
+		fprintf(stderr, "%d messages lost\n", nclients * count - total);
+	qsort(latencies, total, sizeof(double), compare_doubles);
+	if (total > 0)
+		printf("%3d %8d %6d %7d %7d %10.0f %9.1f %9.1f %9.1f\n", qos, payloadlen, window, nclients, total,
+			total / elapsed * 1e9, latencies[total / 2] / 1e3, latencies[(int)(total * 0.99)] / 1e3,
+			latencies[(int)(total * 0.999)] / 1e3);
+	free(latencies);
+
+exit:
+	for (i = 0; i < nclients; ++i)
+	{
+		MQTTAsync_disconnectOptions opts = MQTTAsync_disconnectOptions_initializer;
+
+		opts.onSuccess = on_disconnect;
+		opts.context = &clients[i];
+		if (MQTTAsync_disconnect(clients[i].handle, &opts) == MQTTASYNC_SUCCESS)
+			wait_state(&clients[i], &clients[i].disconnected, 0, 10);
+		MQTTAsync_unregisterTopic(&clients[i].registered);
+		MQTTAsync_destroy(&clients[i].handle);
+		free(clients[i].latencies);
+		pthread_mutex_destroy(&clients[i].mutex);
+		pthread_cond_destroy(&clients[i].cond);
+	}
+	return rc;
+}
+
+
+int main(int argc, char** argv)
+{
+	int qoss[] = {0, 1, 2}, payloads[] = {16, 1024, 65536}, windows[] = {1, 16, 256}, nclients[] = {1, 4};
+	int nqos = 3, npayloads = 3, nwindows = 3, nnclients = 2;
+	int count = 2000, opt, q, p, w, c;
+
+	while ((opt = getopt(argc, argv, "n:q:s:w:c:rb:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'n': count = atoi(optarg); break;
+		case 'q': qoss[0] = atoi(optarg); nqos = 1; break;
+		case 's': payloads[0] = atoi(optarg); npayloads = 1; break;
+		case 'w': windows[0] = atoi(optarg); nwindows = 1; break;
+		case 'c': nclients[0] = atoi(optarg); nnclients = 1; break;
+		case 'r': use_registered = 1; break;
+		case 'b': batch_messages = atoi(optarg); break;
+		default:
+			fprintf(stderr, "usage: %s [-n messages] [-q qos] [-s payload] [-w window] [-c clients] [-r] [-b batch]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (count < 1 || qoss[0] < 0 || qoss[0] > 2 || payloads[0] < (int)sizeof(double) || windows[0] < 1 ||
+		nclients[0] < 1 || nclients[0] > BENCH_MAX_CLIENTS)
+	{
+		fprintf(stderr, "invalid option value\n");
+		return 1;
+	}
+	if ((port = broker_stub_start(0)) < 0)
+	{
+		perror("broker_stub_start");
+		return 1;
+	}
+
+	printf("qos  payload window clients    msgs     msgs/s   p50(us)   p99(us)  p999(us)\n");
+	for (q = 0; q < nqos; ++q)
+		for (p = 0; p < npayloads; ++p)
+			for (w = 0; w < nwindows; ++w)
+				for (c = 0; c < nnclients; ++c)
+				{
+					if (bench_case(qoss[q], payloads[p], windows[w], nclients[c], count) != 0)
+						return 2;
+					fflush(stdout);
+				}
+	broker_stub_stop();
+	return 0;
+}
@@ -0,0 +1,64 @@
+# End to end benchmark of the mruby binding, against the broker stub.
+#
+#   make -C bench broker_stub
+#   bench/broker_stub 18830 &
+#   mruby bench/e2e_bench.rb [port] [messages] [qos] [payload] [window]
+#
+# Messages are published to a topic the client subscribes to, with the send time at the
+# start of the payload, and the time until on_message is called is the latency of each.
+# At most window messages are outstanding at once.  The output has the same columns as
+# bench/e2e_bench, with one client, since the binding has only one per process.
+
+port    = (ARGV[0] || 1883).to_i
+count   = (ARGV[1] || 1000).to_i
+qos     = (ARGV[2] || 0).to_i
+size    = (ARGV[3] || 16).to_i
+window  = (ARGV[4] || 1).to_i
+topic   = "bench/mruby"
+
+latencies = []
+subscribed = false
+
+client = MQTTClient.connect("tcp://127.0.0.1:#{port}", "mruby-bench") do |c|
+  c.max_inflight = window
+  c.on_connect   = -> { c.subscribe(topic, :qos => qos) }
+  c.on_subscribe = -> { subscribed = true }
+  c.on_message   = ->(message) { latencies << Time.now.to_f - message.payload.to_f }
+end
+
+waited = 0
+until subscribed
+  raise "not subscribed to #{topic}" if waited > 10_000
+  usleep 1000
+  waited += 1
+end
+
+sent = 0
+start = Time.now.to_f
+while sent < count
+  [window, count - sent].min.times do
+    payload = sprintf("%.6f", Time.now.to_f)
+    payload += "x" * (size - payload.size) if size > payload.size
+    client.publish(topic, payload, :qos => qos)
+    sent += 1
+  end
+
+  waited = 0
+  while latencies.size < sent and waited < 10_000
+    usleep 100
+    waited += 1
+  end
+  break if latencies.size < sent
+end
+elapsed = Time.now.to_f - start
+client.disconnect
+
+latencies.sort!
+total = latencies.size
+percentile = ->(p) { latencies[(total * p).to_i] * 1_000_000 }
+puts "qos  payload window clients    msgs     msgs/s   p50(us)   p99(us)  p999(us)"
+if total > 0
+  printf("%3d %8d %6d %7d %7d %10.0f %9.1f %9.1f %9.1f\n", qos, size, window, 1, total,
+         total / elapsed, percentile.call(0.5), percentile.call(0.99), percentile.call(0.999))
+end
+puts "#{count - total} messages lost" if total < count
@@ -0,0 +1,188 @@
+/*
+Copyright (c) 2014 Shin Hiroe
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/*
+ * Benchmark of UTF-8 validation of topics, for each implementation the processor supports.
+ *
+ * Corpora of topics are generated from lists of the kinds of level names seen in practice:
+ * short device topics, long hierarchical ones, and ones with some levels in Japanese or
+ * accented Latin, so that the multi-byte path is measured too.  Before timing, every
+ * implementation is checked to agree with the scalar one on the corpora and on random bytes.
+ *
+ * Usage: utf8_bench [iterations]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "utf-8.h"
+
+#define CORPUS_SIZE 1000
+
+static const char* short_levels[] = {"home", "sensor", "temp", "humidity", "status", "cmd", "light",
+	"kitchen", "garage", "door", "battery", "rssi", "state", "set", "get", "v1", "42", "dev-7f3a"};
+
+static const char* long_levels[] = {"factory", "plant-07", "assembly-line-3", "station-12", "robot-arm-4",
+	"joint-2", "telemetry", "torque", "raw", "spBv1.0", "edge-node-eu-west-1a", "device-00c0ffee1234",
+	"measurements", "vibration-spectrum", "firmware", "diagnostics", "2024-06-01T12:00:00Z", "batch-000981"};
+
+static const char* japanese_levels[] = {"工場", "ライン3", "温度", "湿度", "センサー", "東京", "大阪",
+	"status", "telemetry", "機械-12"};
+
+static const char* latin_levels[] = {"capteurs", "bâtiment-é", "température", "pièce-3", "état", "Straße",
+	"größe", "niño", "status", "données"};
+
+/**
+ * A corpus of generated topics
+ */
+typedef struct
+{
+	const char* name;
+	char* topics[CORPUS_SIZE];
+	size_t bytes;
+} Corpus;
+
+
+static void generate(Corpus* corpus, const char* name, const char** levels, int nlevels, int min, int max)
+{
+	int i;
+
+	corpus->name = name;
+	corpus->bytes = 0;
+	for (i = 0; i < CORPUS_SIZE; ++i)
+	{
+		char topic[1024] = "";
+		int depth = min + rand() % (max - min + 1), j;
+
+		for (j = 0; j < depth; ++j)
+		{
+			if (j > 0)
+				strcat(topic, "/");
+			strcat(topic, levels[rand() % nlevels]);
+		}
+		corpus->topics[i] = strdup(topic);
+		corpus->bytes += strlen(topic);
+	}
+}
+
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+
+/**
+ * Check that an implementation gives the same answers as the scalar one
+ * @return the number of disagreements
+ */
+static int check(int implementation, Corpus* corpora, int ncorpora)
+{
+	int errors = 0, i, j;
+
+	for (i = 0; i < ncorpora; ++i)
+	{
+		for (j = 0; j < CORPUS_SIZE; ++j)
+		{
+			const char* topic = corpora[i].topics[j];
+
+			if (!UTF8_validateString(topic) || !UTF8_validate(strlen(topic), topic))
+				++errors;
+		}
+	}
+	for (i = 0; i < 100000; ++i)
+	{	/* mostly ASCII, with some bytes anywhere in the range */
+		char buf[80];
+		int len = rand() % (sizeof(buf) - 1), scalar, vector;
+
+		for (j = 0; j < len; ++j)
+			buf[j] = (rand() % 8) ? 1 + rand() % 127 : 1 + rand() % 255;
+		buf[len] = '\0';
+		UTF8_setImplementation(UTF8_SCALAR);
+		scalar = UTF8_validateString(buf);
+		UTF8_setImplementation(implementation);
+		vector = UTF8_validateString(buf);
+		if (vector != scalar || UTF8_validate(len, buf) != scalar)
+			++errors;
+	}
+	return errors;
+}
+
+
+int main(int argc, char** argv)
+{
+	static const char* names[] = {"scalar", "sse2", "avx2"};
+	int iterations = (argc > 1) ? atoi(argv[1]) : 500;
+	Corpus corpora[4];
+	int impl, i;
+
+	if (iterations < 1)
+	{
+		fprintf(stderr, "usage: %s [iterations]\n", argv[0]);
+		return 1;
+	}
+	srand(1);
+	generate(&corpora[0], "short ascii", short_levels, sizeof(short_levels) / sizeof(char*), 2, 4);
+	generate(&corpora[1], "long ascii", long_levels, sizeof(long_levels) / sizeof(char*), 6, 12);
+	generate(&corpora[2], "japanese", japanese_levels, sizeof(japanese_levels) / sizeof(char*), 3, 6);
+	generate(&corpora[3], "latin-1", latin_levels, sizeof(latin_levels) / sizeof(char*), 3, 6);
+
+	printf("%-8s %-12s %10s %10s %10s\n", "impl", "corpus", "avg bytes", "ns/topic", "MB/s");
+	for (impl = UTF8_SCALAR; impl <= UTF8_AVX2; ++impl)
+	{
+		int errors;
+
+		if (UTF8_setImplementation(impl) != impl)
+			break;
+		if ((errors = check(impl, corpora, 4)) != 0)
+		{
+			fprintf(stderr, "%s: %d results differ from the scalar implementation\n", names[impl], errors);
+			return 2;
+		}
+		UTF8_setImplementation(impl);
+		for (i = 0; i < 4; ++i)
+		{
+			double start, elapsed;
+			int valid = 0, n, j;
+
+			start = now_ns();
+			for (n = 0; n < iterations; ++n)
+				for (j = 0; j < CORPUS_SIZE; ++j)
+					valid += UTF8_validateString(corpora[i].topics[j]);
+			elapsed = now_ns() - start;
+			if (valid != iterations * CORPUS_SIZE)
+			{
+				fprintf(stderr, "%s: valid topics rejected\n", names[impl]);
+				return 2;
+			}
+			printf("%-8s %-12s %10.1f %10.1f %10.0f\n", names[impl], corpora[i].name,
+				(double)corpora[i].bytes / CORPUS_SIZE, elapsed / ((double)iterations * CORPUS_SIZE),
+				corpora[i].bytes * (double)iterations / elapsed * 1e3);
+		}
+	}
+	return 0;
+}
@@ -8,7 +8,7 @@ MRuby::Build.new do |conf|
   conf.gem '../mruby-mqtt'
 
   conf.linker do |linker|
-    linker.link_options = "%{flags} -o %{outfile} %{objs} %{libs} -lpthread -Wl -lm"
+    linker.link_options = "%{flags} -o %{outfile} %{objs} %{libs} -lpthread -lz -Wl -lm"
   end
 
 end
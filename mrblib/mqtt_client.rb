@@ -28,6 +28,7 @@
 #   c.on_connect   = -> { c.subscribe("/temp/shimane")}
 #   c.on_subscribe = -> { puts "subscribe success"}
 #   c.on_publish   = -> { puts "publish success"}
+#   c.on_writable  = -> { puts "publish queue drained"}
 # end
 # 
 # Publish other scope
@@ -38,9 +39,16 @@
 class MQTTClient
   include Singleton
 
+  # Lanes of the publish and subscribe queue, see MQTTASYNC_PRIORITY_* in MQTTAsync.h
+  PRIORITIES = {:normal => 0, :high => 1, :bulk => 2}
+
+  # Passed to on_publish_failure when request_timeout expires, see MQTTASYNC_OPERATION_TIMEOUT in MQTTAsync.h
+  OPERATION_TIMEOUT = -12
+
   attr_accessor :on_connect, :on_subscribe, :on_publish, :on_disconnect
-  attr_accessor :on_connect_failure, :on_subscribe_failure, :on_connlost
-  attr_accessor :on_message
+  attr_accessor :on_connect_failure, :on_subscribe_failure, :on_publish_failure
+  attr_accessor :on_connlost
+  attr_accessor :on_message, :on_writable
   attr_accessor :debug
 
   class << self
@@ -83,19 +91,218 @@ class MQTTClient
     @clean_session = val
   end
 
-  def publish(topic, payload, opts = {})
-    qos = opts[:qos] || 0
-    retain = opts[:retain] || false
+  def max_inflight
+    @max_inflight ||= 0 # default unlimited
+  end
 
-    unless [0,1,2].include?(qos)
-      raise ArgumentError.new("invalid qos:#{qos}")
+  def max_inflight=(val)
+    unless val.kind_of?(Integer) and val >= 0
+      raise ArgumentError.new("invalid max_inflight:#{val}")
     end
 
-    unless [true, false].include?(retain)
-      raise ArgumentError.new("invalid retain:#{retain}")
+    @max_inflight = val
+  end
+
+  def max_queued_bytes
+    @max_queued_bytes ||= 0 # default unlimited
+  end
+
+  def max_queued_bytes=(val)
+    unless val.kind_of?(Integer) and val >= 0
+      raise ArgumentError.new("invalid max_queued_bytes:#{val}")
+    end
+
+    @max_queued_bytes = val
+  end
+
+  def low_watermark_bytes
+    @low_watermark_bytes ||= 0 # default half of max_queued_bytes
+  end
+
+  def low_watermark_bytes=(val)
+    unless val.kind_of?(Integer) and val >= 0
+      raise ArgumentError.new("invalid low_watermark_bytes:#{val}")
+    end
+
+    @low_watermark_bytes = val
+  end
+
+  def mqtt_version
+    @mqtt_version ||= 0 # default 3.1.1, falling back to 3.1
+  end
+
+  def mqtt_version=(val)
+    if connected?
+      raise ArgumentError.new("Can't set mqtt_version after connected")
+    end
+
+    unless [0, 3, 4, 5].include?(val)
+      raise ArgumentError.new("invalid mqtt_version:#{val}")
+    end
+
+    @mqtt_version = val
+  end
+
+  def topic_alias_maximum
+    @topic_alias_maximum ||= 0 # MQTT 5 only, default no aliases from the server
+  end
+
+  def topic_alias_maximum=(val)
+    unless val.kind_of?(Integer) and val >= 0 and val <= 65535
+      raise ArgumentError.new("invalid topic_alias_maximum:#{val}")
+    end
+
+    @topic_alias_maximum = val
+  end
+
+  def batch_messages
+    @batch_messages ||= 0 # default not packed
+  end
+
+  def batch_messages=(val)
+    unless val.kind_of?(Integer) and val >= 0
+      raise ArgumentError.new("invalid batch_messages:#{val}")
+    end
+
+    @batch_messages = val
+  end
+
+  def batch_linger
+    @batch_linger ||= 1000 # microseconds
+  end
+
+  def batch_linger=(val)
+    unless val.kind_of?(Integer) and val >= 0
+      raise ArgumentError.new("invalid batch_linger:#{val}")
+    end
+
+    @batch_linger = val
+  end
+
+  def batch_bytes
+    @batch_bytes ||= 4096
+  end
+
+  def batch_bytes=(val)
+    unless val.kind_of?(Integer) and val > 4
+      raise ArgumentError.new("invalid batch_bytes:#{val}")
+    end
+
+    @batch_bytes = val
+  end
+
+  def unpack_batches
+    return false if @unpack_batches.nil? # default false
+    @unpack_batches
+  end
+
+  def unpack_batches=(val)
+    unless [true, false].include?(val)
+      raise ArgumentError.new("invalid unpack_batches:#{val}")
+    end
+
+    @unpack_batches = val
+  end
+
+  def max_inbound_messages
+    @max_inbound_messages ||= 0 # default unlimited
+  end
+
+  def max_inbound_messages=(val)
+    unless val.kind_of?(Integer) and val >= 0
+      raise ArgumentError.new("invalid max_inbound_messages:#{val}")
+    end
+
+    @max_inbound_messages = val
+  end
+
+  def max_inbound_bytes
+    @max_inbound_bytes ||= 0 # default unlimited
+  end
+
+  def max_inbound_bytes=(val)
+    unless val.kind_of?(Integer) and val >= 0
+      raise ArgumentError.new("invalid max_inbound_bytes:#{val}")
     end
 
-    publish_internal(topic, payload, qos, retain)
+    @max_inbound_bytes = val
+  end
+
+  def max_inbound_packet
+    @max_inbound_packet ||= 0 # default unlimited
+  end
+
+  def max_inbound_packet=(val)
+    unless val.kind_of?(Integer) and val >= 0
+      raise ArgumentError.new("invalid max_inbound_packet:#{val}")
+    end
+
+    @max_inbound_packet = val
+  end
+
+  def inbound_policy
+    @inbound_policy ||= :drop_oldest
+  end
+
+  def inbound_policy=(val)
+    unless [:drop_oldest, :drop_newest, :pause].include?(val)
+      raise ArgumentError.new("invalid inbound_policy:#{val}")
+    end
+
+    @inbound_policy = val
+  end
+
+  # Compresses payloads published to topics matching the filter, and
+  # decompresses them when they arrive. Set before connecting.
+  def compress(filter, opts = {})
+    if connected?
+      raise ArgumentError.new("Can't set compression after connected")
+    end
+
+    min_bytes = opts[:min_bytes] || 256
+    level = opts[:level] || -1
+    dictionary = opts[:dictionary]
+
+    unless filter.kind_of?(String)
+      raise ArgumentError.new("invalid topic filter:#{filter}")
+    end
+
+    unless min_bytes.kind_of?(Integer) and min_bytes >= 0
+      raise ArgumentError.new("invalid min_bytes:#{min_bytes}")
+    end
+
+    unless level == -1 or (1..9).include?(level)
+      raise ArgumentError.new("invalid level:#{level}")
+    end
+
+    unless dictionary.nil? or dictionary.kind_of?(String)
+      raise ArgumentError.new("invalid dictionary:#{dictionary}")
+    end
+
+    compressions << [filter, min_bytes, level, dictionary]
+  end
+
+  def compressions
+    @compressions ||= []
+  end
+
+  def publish(topic, payload, opts = {})
+    qos, retain, priority = publish_options(opts)
+    publish_internal(topic, payload, qos, retain, priority)
+  end
+
+  # Returns an MQTTTopic for publishing to the same topic many times.
+  def topic(name)
+    unless name.kind_of?(String)
+      raise ArgumentError.new("invalid topic:#{name}")
+    end
+
+    MQTTTopic.new(self, name)
+  end
+
+  def publish_to(topic, payload, opts = {})
+    qos, retain, priority = publish_options(opts)
+    topic.publish_internal(payload, qos, retain, priority)
   end
 
   def subscribe(topic, opts = {})
@@ -105,7 +312,7 @@ class MQTTClient
       raise ArgumentError.new("invalid qos:#{qos}")
     end
 
-    subscribe_internal(topic, qos)
+    subscribe_internal(topic, qos, priority_option(opts))
   end
 
   def on_connect_callback
@@ -144,6 +351,22 @@ class MQTTClient
     @on_publish.call if @on_publish
   end
 
+  def on_publish_failure_callback(code)
+    debug_out "on_publish_failure_callback"
+    return unless @on_publish_failure
+
+    if @on_publish_failure.arity == 0
+      @on_publish_failure.call
+    else
+      @on_publish_failure.call(code)
+    end
+  end
+
+  def on_writable_callback
+    debug_out "on_writable_callback"
+    @on_writable.call if @on_writable
+  end
+
   def on_disconnect_callback
     debug_out "on_disconnect_callback"
     @on_disconnect.call if @on_disconnect
@@ -162,9 +385,57 @@ class MQTTClient
 
   private
 
+  def publish_options(opts)
+    qos = opts[:qos] || 0
+    retain = opts[:retain] || false
+
+    unless [0,1,2].include?(qos)
+      raise ArgumentError.new("invalid qos:#{qos}")
+    end
+
+    unless [true, false].include?(retain)
+      raise ArgumentError.new("invalid retain:#{retain}")
+    end
+
+    [qos, retain, priority_option(opts)]
+  end
+
+  def priority_option(opts)
+    priority = opts[:priority] || :normal
+
+    unless PRIORITIES.has_key?(priority)
+      raise ArgumentError.new("invalid priority:#{priority}")
+    end
+
+    PRIORITIES[priority]
+  end
+
   def debug_out(str, *args)
     return unless @debug
     printf(str + "\n", *args)
   end
 
 end
+
+
+# The MQTTTopic class is a topic registered for repeated publishing. The topic
+# is checked and encoded once, rather than on every publish.
+#
+# == Usage
+#
+# temp = MQTTClient.instance.topic("/temp/shimane")
+# temp.publish("23.5", qos:1)
+
+class MQTTTopic
+  attr_reader :name
+
+  def initialize(client, name)
+    @client = client
+    @name = name
+  end
+
+  def publish(payload, opts = {})
+    @client.publish_to(self, payload, opts)
+  end
+
+end
@@ -29,6 +29,8 @@
 #include "MQTTClient.h"
 #include "LinkedList.h"
 #include "MQTTClientPersistence.h"
+#include "Timer.h"
+#include "MQTTTopicAliases.h"
 /*BE
 include "LinkedList"
 BE*/
@@ -42,6 +44,19 @@ def PUBLICATIONS
    n32 dec "refcount"
 }
 BE*/
+/**
+ * A topic registered for repeated publishing.  It is checked once when registered, and held
+ * after its two byte encoded length, so that both can be sent as they are.  Commands and
+ * publications to it hold references rather than copies of the topic.
+ */
+typedef struct
+{
+	volatile int refcount;
+	int topiclen;
+	char* topic; /**< the null terminated topic, which follows its encoded length */
+	void* owner; /**< the client the topic was registered with */
+} RegisteredTopics;
+
 /**
  * Stored publication data to minimize copying
  */
@@ -52,6 +67,8 @@ typedef struct
 	char* payload;
 	int payloadlen;
 	int refcount;
+	char* buffer; /**< reference to the input buffer holding the payload, or NULL if the payload is allocated on its own */
+	RegisteredTopics* registered; /**< reference to the registered topic, or NULL if the topic is allocated on its own */
 } Publications;
 
 /*BE
@@ -88,6 +105,10 @@ typedef struct
 	time_t lastTouch;		/**> used for retry and expiry */
 	char nextMessageType;	/**> PUBREC, PUBREL, PUBCOMP */
 	int len;				/**> length of the whole structure+data */
+	Timer retryTimer;		/**> when to resend the current packet of the flow */
+	unsigned int replay : 1;	/**> is the packet still to be resent after reconnecting? */
+	unsigned int ackHeld : 1;	/**> is the PUBREC waiting for the received message to be durable? */
+	ListElement link;		/**> links the message into outboundMsgs or inboundMsgs */
 } Messages;
 
 
@@ -155,6 +176,11 @@ typedef struct
 	SSL* ssl;
 	SSL_CTX* ctx;
 #endif
+	int MQTTVersion;			/**< the MQTT version of the current connection */
+	MQTTTopicAliases aliases;	/**< MQTT 5.0 topic aliases of the current connection */
+	int maxInboundPacket;		/**< the largest packet read, 0 for no limit */
+	int readPaused;				/**< is reading stopped, so that TCP flow control holds the server back? */
+	int oversizedPackets;		/**< packets larger than maxInboundPacket that the server sent */
 } networkHandles;
 
 /**
@@ -175,6 +201,7 @@ typedef struct
 	int keepAliveInterval;
 	int retryInterval;
 	int maxInflightMessages;
+	Timer keepAliveTimer;			/**< when to next check whether a PINGREQ is needed */
 	willMessages* will;
 	List* inboundMsgs;
 	List* outboundMsgs;				/**< in flight */
@@ -184,6 +211,18 @@ typedef struct
 	MQTTClient_persistence* persistence; /* a persistence implementation */
 	void* context; /* calling context - used when calling disconnect_internal */
 	int MQTTVersion;
+	int topicAliasMaximum;			/**< MQTT 5.0 topic aliases the server may use when publishing to us */
+	int serverReceiveMaximum;		/**< MQTT 5.0 QoS 1 and 2 publications the server accepts in flight, 0 for no limit */
+	int maximumPacketSize;			/**< MQTT 5.0 largest packet the server accepts, 0 for no limit */
+	int replayBytes;				/**< bytes of in-flight messages resent per replay cycle after reconnecting, 0 for no limit */
+	int replayRate;					/**< in-flight messages resent per second after reconnecting, 0 for no limit */
+	Timer replayTimer;				/**< when to continue resending in-flight messages after reconnecting */
+	Messages* replayNext;			/**< the next in-flight message to resend, NULL when the replay is finished */
+	int replayTotal;				/**< in-flight messages to resend when the client last reconnected */
+	int replaySent;					/**< of those, the ones resent, or acknowledged before their turn, so far */
+	unsigned long replayStart;		/**< when the replay started, in milliseconds from Timer_now() */
+	int syncAcks;					/**< are PUBRECs held until the messages they acknowledge are durable? */
+	int heldAcks;					/**< PUBRECs held for that */
 #if defined(OPENSSL)
 	MQTTClient_SSLOptions *sslopts;
 	SSL_SESSION* session;    /***< SSL session pointer for fast handhake */
@@ -31,6 +31,9 @@
 #include <memory.h>
 
 #include "Heap.h"
+#include "Pool.h"
+
+static Pool element_pool = POOL_INITIALIZER(POOL_LIST_ELEMENTS, "list elements", ListElement);
 
 
 /**
@@ -90,7 +93,7 @@ void ListAppendNoMalloc(List* aList, void* content, ListElement* newel, int size
  */
 void ListAppend(List* aList, void* content, int size)
 {
-	ListElement* newel = malloc(sizeof(ListElement));
+	ListElement* newel = Pool_alloc(&element_pool);
 	ListAppendNoMalloc(aList, content, newel, size);
 }
 
@@ -105,8 +108,23 @@ void ListAppend(List* aList, void* content, int size)
  */
 void ListInsert(List* aList, void* content, int size, ListElement* index)
 {
-	ListElement* newel = malloc(sizeof(ListElement));
+	ListInsertNoMalloc(aList, content, Pool_alloc(&element_pool), size, index);
+}
 
+
+/**
+ * Insert an already allocated ListElement and content to a list at a specific position.
+ * The ListElement is normally embedded in the content, so that it can later be removed
+ * with ListDetachElement without searching the list.
+ * @param aList the list to which the item is to be added
+ * @param content the list item content itself
+ * @param newel the ListElement to be used in adding the new item
+ * @param size the size of the element
+ * @param index the position in the list. If NULL, this function is equivalent
+ * to ListAppendNoMalloc.
+ */
+void ListInsertNoMalloc(List* aList, void* content, ListElement* newel, int size, ListElement* index)
+{
 	if ( index == NULL )
 		ListAppendNoMalloc(aList, content, newel, size);
 	else
@@ -219,7 +237,7 @@ int ListUnlink(List* aList, void* content, int(*callback)(void*, void*), int fre
 		free(aList->current->content);
 	if (saved == aList->current)
 		saveddeleted = 1;
-	free(aList->current);
+	Pool_free(&element_pool, aList->current);
 	if (saveddeleted)
 		aList->current = next;
 	else
@@ -241,6 +259,47 @@ int ListDetach(List* aList, void* content)
 }
 
 
+/**
+ * Removes an element which is known to be in a list, without searching for it.  Neither the
+ * element nor its content is freed, so this is how elements added with ListAppendNoMalloc or
+ * ListInsertNoMalloc must be removed.
+ * @param aList the list containing the element
+ * @param elem the element to remove
+ */
+void ListDetachElement(List* aList, ListElement* elem)
+{
+	if (elem->prev == NULL)
+		aList->first = elem->next;
+	else
+		elem->prev->next = elem->next;
+	if (elem->next == NULL)
+		aList->last = elem->prev;
+	else
+		elem->next->prev = elem->prev;
+	if (aList->current == elem)
+		aList->current = elem->next;
+	elem->prev = elem->next = NULL;
+	--(aList->count);
+}
+
+
+/**
+ * Removes the first element of a list, without freeing it.  Used to empty lists whose
+ * elements are embedded in their contents.
+ * @param aList the list from which the item is to be removed
+ * @return the content of the first element, or NULL if the list is empty
+ */
+void* ListDetachHeadElement(List* aList)
+{
+	ListElement* first = aList->first;
+
+	if (first == NULL)
+		return NULL;
+	ListDetachElement(aList, first);
+	return first->content;
+}
+
+
 /**
  * Removes and frees an item in a list by comparing the pointer to the content.
  * @param aList the list from which the item is to be removed
@@ -272,7 +331,7 @@ void* ListDetachHead(List* aList)
 		aList->first = aList->first->next;
 		if (aList->first)
 			aList->first->prev = NULL;
-		free(first);
+		Pool_free(&element_pool, first);
 		--(aList->count);
 	}
 	return content;
@@ -310,7 +369,7 @@ void* ListPopTail(List* aList)
 		aList->last = aList->last->prev;
 		if (aList->last)
 			aList->last->next = NULL;
-		free(last);
+		Pool_free(&element_pool, last);
 		--(aList->count);
 	}
 	return content;
@@ -357,7 +416,7 @@ void ListEmpty(List* aList)
 		if (first->content != NULL)
 			free(first->content);
 		aList->first = first->next;
-		free(first);
+		Pool_free(&element_pool, first);
 	}
 	aList->count = aList->size = 0;
 	aList->current = aList->first = aList->last = NULL;
@@ -384,7 +443,7 @@ void ListFreeNoContent(List* aList)
 	{
 		ListElement* first = aList->first;
 		aList->first = first->next;
-		free(first);
+		Pool_free(&element_pool, first);
 	}
 	free(aList);
 }
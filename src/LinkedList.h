@@ -76,6 +76,7 @@ List* ListInitialize(void);
 void ListAppend(List* aList, void* content, int size);
 void ListAppendNoMalloc(List* aList, void* content, ListElement* newel, int size);
 void ListInsert(List* aList, void* content, int size, ListElement* index);
+void ListInsertNoMalloc(List* aList, void* content, ListElement* newel, int size, ListElement* index);
 
 int ListRemove(List* aList, void* content);
 int ListRemoveItem(List* aList, void* content, int(*callback)(void*, void*));
@@ -85,6 +86,8 @@ void* ListPopTail(List* aList);
 
 int ListDetach(List* aList, void* content);
 int ListDetachItem(List* aList, void* content, int(*callback)(void*, void*));
+void ListDetachElement(List* aList, ListElement* elem);
+void* ListDetachHeadElement(List* aList);
 
 void ListFree(List* aList);
 void ListEmpty(List* aList);
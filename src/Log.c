@@ -64,6 +64,20 @@
 #define min(A,B) ( (A) < (B) ? (A):(B))
 #endif
 
+#if defined(WIN32) || defined(WIN64)
+#define LOG_THREAD_LOCAL __declspec(thread)
+#define Log_publish(p, v) InterlockedExchange((volatile LONG*)(p), (LONG)(v))
+#define Log_acquire(p) ((unsigned int)InterlockedCompareExchange((volatile LONG*)(p), 0, 0))
+#define Log_storeFence() MemoryBarrier()
+#define Log_loadFence() MemoryBarrier()
+#else
+#define LOG_THREAD_LOCAL __thread
+#define Log_publish(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define Log_acquire(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define Log_storeFence() __atomic_thread_fence(__ATOMIC_RELEASE)
+#define Log_loadFence() __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#endif
+
 trace_settings_type trace_settings =
 {
 	TRACE_MINIMUM,
@@ -71,8 +85,32 @@ trace_settings_type trace_settings =
 	-1
 };
 
-#define MAX_FUNCTION_NAME_LENGTH 256
+#define TRACE_MAX_ARGS 8		/* most printf arguments kept in a trace entry */
+#define TRACE_STRINGS_SIZE 128	/* space for copies of string arguments in a trace entry */
+
+/**
+ * The kinds of trace entry
+ */
+enum
+{
+	TRACE_ENTRY_STACK,		/**< function entry or exit */
+	TRACE_ENTRY_STACK_RC,	/**< function exit with a return code */
+	TRACE_ENTRY_FORMAT,		/**< Log() message with its format and arguments */
+	TRACE_ENTRY_TEXT		/**< Log() message formatted when it was logged */
+};
+
+typedef union
+{
+	long long i;
+	double d;
+	const void* p;
+} traceArg;
 
+/**
+ * A trace record.  Nothing is formatted when it is written: the function name and the Log()
+ * format are kept as pointers, as they are literals, and the arguments are copied, so that
+ * the entry is only turned into text when it is output or dumped.
+ */
 typedef struct
 {
 #if defined(GETTIMEOFDAY)
@@ -84,17 +122,42 @@ typedef struct
 	int number;
 	int thread_id;
 	int depth;
-	char name[MAX_FUNCTION_NAME_LENGTH + 1];
+	const char* name;		/**< function name, or Log() format */
 	int line;
-	int has_rc;
 	int rc;
-	int level;
+	short level;
+	char type;
+	char nargs;
+	union
+	{
+		struct
+		{
+			traceArg args[TRACE_MAX_ARGS];
+			char strings[TRACE_STRINGS_SIZE];
+		} a;
+		char text[TRACE_MAX_ARGS * sizeof(traceArg) + TRACE_STRINGS_SIZE];
+	} u;
 } traceEntry;
 
-static int start_index = -1,
-			next_index = 0;
-static traceEntry* trace_queue = NULL;
-static int trace_queue_size = 0;
+/**
+ * The trace entries of one thread.  Only the owning thread writes entries and moves the head on,
+ * overwriting the oldest entries when the ring is full, so no lock is needed to trace.  A reader
+ * copies entries out and then checks the head again to drop any that were overwritten meanwhile.
+ */
+typedef struct traceRing
+{
+	struct traceRing* next;		/**< the next ring in trace_rings */
+	unsigned int head;			/**< count of entries written, changed by the owning thread only */
+	unsigned int tail;			/**< entries before this have been discarded, changed under log_mutex */
+	unsigned int size;			/**< number of entries, a power of 2 */
+	int in_use;					/**< does a thread own this ring? */
+	traceEntry entries[1];
+} traceRing;
+
+static traceRing* trace_rings = NULL;	/**< all rings, never freed, so that they can be reused by new threads */
+static unsigned int trace_ring_size = 0;	/**< size of new rings, from trace_settings.max_trace_entries */
+static int trace_active = 0;			/**< set between Log_initialize and Log_terminate */
+static LOG_THREAD_LOCAL traceRing* my_ring = NULL;
 
 static FILE* trace_destination = NULL;	/**< flag to indicate if trace is to be sent to a stream */
 static char* trace_destination_name = NULL; /**< the name of the trace file */
@@ -105,11 +168,11 @@ static int trace_output_level = -1;
 static Log_traceCallback* trace_callback = NULL;
 static void Log_output(int log_level, char* msg);
 
-static int sametime_count = 0;
+static LOG_THREAD_LOCAL int sametime_count = 0;
 #if defined(GETTIMEOFDAY)
-struct timeval ts, last_ts;
+static LOG_THREAD_LOCAL struct timeval ts, last_ts;
 #else
-struct timeb ts, last_ts;
+static LOG_THREAD_LOCAL struct timeb ts, last_ts;
 #endif
 static char msg_buf[512];
 
@@ -118,17 +181,45 @@ mutex_type log_mutex;
 #else
 static pthread_mutex_t log_mutex_store = PTHREAD_MUTEX_INITIALIZER;
 static mutex_type log_mutex = &log_mutex_store;
+static pthread_key_t log_thread_key;
+static pthread_once_t log_key_once = PTHREAD_ONCE_INIT;
 #endif
 
 
+#if !defined(WIN32) && !defined(WIN64)
+static void Log_threadDestructor(void* arg)
+{
+	Log_threadEnd();
+}
+
+
+static void Log_createKey(void)
+{
+	pthread_key_create(&log_thread_key, Log_threadDestructor);
+}
+#endif
+
+
+/**
+ * The number of entries in a new ring: trace_settings.max_trace_entries rounded up to a power of 2.
+ */
+static unsigned int Log_ringSize(void)
+{
+	unsigned int size = 16;
+
+	while (size < (unsigned int)trace_settings.max_trace_entries)
+		size *= 2;
+	return size;
+}
+
+
 int Log_initialize(Log_nameValue* info)
 {
 	int rc = -1;
 	char* envval = NULL;
 
-	if ((trace_queue = malloc(sizeof(traceEntry) * trace_settings.max_trace_entries)) == NULL)
-		return rc;
-	trace_queue_size = trace_settings.max_trace_entries;
+	trace_ring_size = Log_ringSize();
+	trace_active = 1;
 
 	if ((envval = getenv("MQTT_C_CLIENT_TRACE")) != NULL && strlen(envval) > 0)
 	{
@@ -212,9 +303,14 @@ void Log_setTraceLevel(enum LOG_LEVELS level)
 
 void Log_terminate()
 {
-	free(trace_queue);
-	trace_queue = NULL;
-	trace_queue_size = 0;
+	traceRing* ring = NULL;
+
+	/* the rings are kept for reuse, as threads may still hold them, but their entries are discarded */
+	Thread_lock_mutex(log_mutex);
+	trace_active = 0;
+	for (ring = trace_rings; ring != NULL; ring = ring->next)
+		ring->tail = Log_acquire(&ring->head);
+	Thread_unlock_mutex(log_mutex);
 	if (trace_destination)
 	{
 		if (trace_destination != stdout)
@@ -225,19 +321,68 @@ void Log_terminate()
 		free(trace_destination_name);
 	if (trace_destination_backup_name)
 		free(trace_destination_backup_name);
-	start_index = -1;
-	next_index = 0;
 	trace_output_level = -1;
-	sametime_count = 0;
 }
 
 
-static traceEntry* Log_pretrace()
+/**
+ * Find the trace ring of the calling thread, taking a free ring or creating one the
+ * first time a thread traces.
+ * @return the ring, or NULL if there is no memory for one
+ */
+static traceRing* Log_getRing(void)
+{
+	traceRing* ring = NULL;
+
+	if (my_ring)
+		return my_ring;
+	Thread_lock_mutex(log_mutex);
+	for (ring = trace_rings; ring != NULL; ring = ring->next)
+	{
+		if (!Log_acquire(&ring->in_use) && ring->size == trace_ring_size)
+			break;
+	}
+	if (ring == NULL && (ring = malloc(sizeof(traceRing) + (trace_ring_size - 1) * sizeof(traceEntry))) != NULL)
+	{
+		ring->head = ring->tail = 0;
+		ring->size = trace_ring_size;
+		ring->next = trace_rings;
+		trace_rings = ring;
+	}
+	if (ring)
+	{
+		ring->in_use = 1;
+#if !defined(WIN32) && !defined(WIN64)
+		pthread_once(&log_key_once, Log_createKey);
+		pthread_setspecific(log_thread_key, ring);
+#endif
+		my_ring = ring;
+	}
+	Thread_unlock_mutex(log_mutex);
+	return ring;
+}
+
+
+/**
+ * Give up the calling thread's trace ring so that a new thread can reuse it.  Its entries
+ * stay until they are overwritten.  On Windows, this is called from DllMain.
+ */
+void Log_threadEnd(void)
+{
+	if (my_ring)
+	{
+		Log_publish(&my_ring->in_use, 0);
+		my_ring = NULL;
+	}
+}
+
+
+static traceEntry* Log_pretrace(traceRing* ring)
 {
 	traceEntry *cur_entry = NULL;
 
 	/* calling ftime/gettimeofday seems to be comparatively expensive, so we need to limit its use */
-	if (++sametime_count % 20 == 0)
+	if (++sametime_count % 20 == 0 || sametime_count == 1)
 	{
 #if defined(GETTIMEOFDAY)
 		gettimeofday(&ts, NULL);
@@ -247,44 +392,256 @@ static traceEntry* Log_pretrace()
 		if (ts.time != last_ts.time || ts.millitm != last_ts.millitm)
 #endif
 		{
-			sametime_count = 0;
+			sametime_count = 1;
 			last_ts = ts;
 		}
 	}
 
-	if (trace_queue_size != trace_settings.max_trace_entries)
+	/* the entry may be the oldest one, which a reader could still be copying */
+	Log_storeFence();
+	cur_entry = &ring->entries[ring->head & (ring->size - 1)];
+	memcpy(&(cur_entry->ts), &ts, sizeof(ts));
+	cur_entry->sametime_count = sametime_count;
+	return cur_entry;
+}
+
+
+/**
+ * The conversion specification of a printf format
+ */
+typedef struct
+{
+	int star_width;		/**< is the width a * argument? */
+	int star_precision;	/**< is the precision a * argument? */
+	int precision;		/**< a numeric precision, or -1 */
+	char length;		/**< 0, 'h', 'l', 'q' (for ll) or 'z' */
+	char conversion;
+	int speclen;		/**< length of the whole specification */
+} traceSpec;
+
+
+/**
+ * Parse a printf conversion specification.
+ * @param format points at the % which starts the specification
+ * @param spec the specification
+ * @return boolean - is the specification one which a trace entry can keep the arguments of?
+ */
+static int Log_parseSpec(const char* format, traceSpec* spec)
+{
+	const char* p = format + 1;
+
+	memset(spec, '\0', sizeof(traceSpec));
+	spec->precision = -1;
+	p += strspn(p, "-+ #0");
+	if (*p == '*')
 	{
-		traceEntry* new_trace_queue = malloc(sizeof(traceEntry) * trace_settings.max_trace_entries);
+		spec->star_width = 1;
+		++p;
+	}
+	else
+		p += strspn(p, "0123456789");
+	if (*p == '.')
+	{
+		if (*++p == '*')
+		{
+			spec->star_precision = 1;
+			++p;
+		}
+		else
+		{
+			spec->precision = atoi(p);
+			p += strspn(p, "0123456789");
+		}
+	}
+	if (*p == 'h')
+	{
+		spec->length = 'h';
+		if (*++p == 'h')
+			++p;
+	}
+	else if (*p == 'l')
+	{
+		spec->length = 'l';
+		if (*++p == 'l')
+		{
+			spec->length = 'q';
+			++p;
+		}
+	}
+	else if (*p == 'z')
+	{
+		spec->length = 'z';
+		++p;
+	}
+	spec->conversion = *p;
+	spec->speclen = (int)(p - format) + 1;
+	return *p != '\0' && strchr("diouxXcspeEfFgG%", *p) != NULL;
+}
+
 
-		memcpy(new_trace_queue, trace_queue, min(trace_queue_size, trace_settings.max_trace_entries) * sizeof(traceEntry));
-		free(trace_queue);
-		trace_queue = new_trace_queue;
-		trace_queue_size = trace_settings.max_trace_entries;
+/**
+ * Keep the arguments of a Log() message in its trace entry, so that it can be formatted later.
+ * String arguments are copied, truncated if there is not enough room.  That only shortens
+ * dumps: a message which is output at once is formatted from its original arguments.
+ * @param entry the trace entry, with the format in entry->name
+ * @param args the arguments
+ * @return boolean - could all the arguments be kept?  If not, the message must be formatted now.
+ */
+static int Log_keepArgs(traceEntry* entry, va_list args)
+{
+	const char* p = entry->name;
+	traceArg* arg = entry->u.a.args;
+	int strpos = 0;
 
-		if (start_index > trace_settings.max_trace_entries + 1 ||
-				next_index > trace_settings.max_trace_entries + 1)
+	while ((p = strchr(p, '%')) != NULL)
+	{
+		traceSpec spec;
+
+		if (!Log_parseSpec(p, &spec) ||
+				(arg - entry->u.a.args) + spec.star_width + spec.star_precision + 1 > TRACE_MAX_ARGS)
+			return 0;
+		p += spec.speclen;
+		if (spec.conversion == '%')
+			continue;
+		if (spec.star_width)
+			(arg++)->i = va_arg(args, int);
+		if (spec.star_precision)
+			spec.precision = (int)((arg++)->i = va_arg(args, int));
+		switch (spec.conversion)
 		{
-			start_index = -1;
-			next_index = 0;
+		case 's':
+			{
+				const char* str = va_arg(args, const char*);
+				int len = TRACE_STRINGS_SIZE - strpos - 1;
+
+				if (str == NULL)
+				{
+					(arg++)->i = -1;
+					break;
+				}
+				if (spec.precision >= 0 && spec.precision < len)
+					len = spec.precision;
+				if (len > 0)
+				{
+					const char* end = memchr(str, '\0', len);
+
+					if (end)
+						len = (int)(end - str);
+					memcpy(&entry->u.a.strings[strpos], str, len);
+				}
+				else
+					len = 0;
+				entry->u.a.strings[strpos + len] = '\0';
+				(arg++)->i = strpos;
+				strpos += len + ((strpos + len < TRACE_STRINGS_SIZE - 1) ? 1 : 0);
+			}
+			break;
+		case 'p':
+			(arg++)->p = va_arg(args, void*);
+			break;
+		case 'e': case 'E': case 'f': case 'F': case 'g': case 'G':
+			(arg++)->d = va_arg(args, double);
+			break;
+		default:
+			if (spec.length == 'q')
+				(arg++)->i = va_arg(args, long long);
+			else if (spec.length == 'l')
+				(arg++)->i = va_arg(args, long);
+			else if (spec.length == 'z')
+				(arg++)->i = (long long)va_arg(args, size_t);
+			else
+				(arg++)->i = va_arg(args, int);
 		}
 	}
+	entry->nargs = (char)(arg - entry->u.a.args);
+	return 1;
+}
 
-	/* add to trace buffer */
-	cur_entry = &trace_queue[next_index];
-	if (next_index == start_index) /* means the buffer is full */
+
+/**
+ * Format a Log() message from the format and arguments kept in its trace entry.
+ * @param entry the trace entry
+ * @param buf the buffer to format the message into
+ * @param bufsize the size of the buffer
+ */
+static void Log_formatArgs(traceEntry* entry, char* buf, size_t bufsize)
+{
+	const char* p = entry->name;
+	traceArg* arg = entry->u.a.args;
+	size_t pos = 0;
+
+	while (*p && pos < bufsize - 1)
 	{
-		if (++start_index == trace_settings.max_trace_entries)
-			start_index = 0;
-	} else if (start_index == -1)
-		start_index = 0;
-	if (++next_index == trace_settings.max_trace_entries)
-		next_index = 0;
+		traceSpec spec;
+		char fmt[32];
+		int stars[2] = {0, 0}, nstars = 0;
+		int len = 0;
 
-	return cur_entry;
+		if (*p != '%')
+		{
+			buf[pos++] = *p++;
+			continue;
+		}
+		Log_parseSpec(p, &spec);
+		if (spec.conversion == '%' || spec.speclen >= sizeof(fmt))
+		{
+			buf[pos++] = '%';
+			p += spec.speclen;
+			continue;
+		}
+		memcpy(fmt, p, spec.speclen);
+		fmt[spec.speclen] = '\0';
+		p += spec.speclen;
+		if (spec.star_width)
+			stars[nstars++] = (int)(arg++)->i;
+		if (spec.star_precision)
+			stars[nstars++] = (int)(arg++)->i;
+
+#define Log_formatArg(value) \
+		((nstars == 2) ? snprintf(&buf[pos], bufsize - pos, fmt, stars[0], stars[1], value) : \
+		 (nstars == 1) ? snprintf(&buf[pos], bufsize - pos, fmt, stars[0], value) : \
+		 snprintf(&buf[pos], bufsize - pos, fmt, value))
+
+		switch (spec.conversion)
+		{
+		case 's':
+			len = Log_formatArg((arg->i == -1) ? "(null)" : &entry->u.a.strings[arg->i]);
+			break;
+		case 'p':
+			len = Log_formatArg(arg->p);
+			break;
+		case 'e': case 'E': case 'f': case 'F': case 'g': case 'G':
+			len = Log_formatArg(arg->d);
+			break;
+		default:
+			if (spec.length == 'q')
+				len = Log_formatArg(arg->i);
+			else if (spec.length == 'l')
+				len = Log_formatArg((long)arg->i);
+			else if (spec.length == 'z')
+				len = Log_formatArg((size_t)arg->i);
+			else
+				len = Log_formatArg((int)arg->i);
+		}
+#undef Log_formatArg
+		++arg;
+		if (len < 0 || (size_t)len >= bufsize - pos)
+			pos = bufsize - 1;
+		else
+			pos += len;
+	}
+	buf[pos] = '\0';
 }
 
 
-static char* Log_formatTraceEntry(traceEntry* cur_entry)
+/**
+ * Format a trace entry into msg_buf, after the 7 characters of its sametime count.
+ * @param cur_entry the trace entry
+ * @param args the arguments of a Log() message, formatted in full instead of those kept in
+ * the entry, whose strings may have been shortened, or NULL
+ * @return msg_buf
+ */
+static char* Log_formatTraceEntry(traceEntry* cur_entry, va_list* args)
 {
 	struct tm *timeinfo;
 	int buf_pos = 31;
@@ -305,12 +662,16 @@ static char* Log_formatTraceEntry(traceEntry* cur_entry)
 	sprintf(msg_buf, "(%.4d)", cur_entry->sametime_count);
 	msg_buf[6] = ' ';
 
-	if (cur_entry->has_rc == 2)
-		strncpy(&msg_buf[buf_pos], cur_entry->name, sizeof(msg_buf)-buf_pos);
+	if (args && (cur_entry->type == TRACE_ENTRY_TEXT || cur_entry->type == TRACE_ENTRY_FORMAT))
+		vsnprintf(&msg_buf[buf_pos], sizeof(msg_buf)-buf_pos, cur_entry->name, *args);
+	else if (cur_entry->type == TRACE_ENTRY_TEXT)
+		strncpy(&msg_buf[buf_pos], cur_entry->u.text, sizeof(msg_buf)-buf_pos);
+	else if (cur_entry->type == TRACE_ENTRY_FORMAT)
+		Log_formatArgs(cur_entry, &msg_buf[buf_pos], sizeof(msg_buf)-buf_pos);
 	else
 	{
 		char* format = Messages_get(cur_entry->number, cur_entry->level);
-		if (cur_entry->has_rc == 1)
+		if (cur_entry->type == TRACE_ENTRY_STACK_RC)
 			snprintf(&msg_buf[buf_pos], sizeof(msg_buf)-buf_pos, format, cur_entry->thread_id,
 					cur_entry->depth, "", cur_entry->depth, cur_entry->name, cur_entry->line, cur_entry->rc);
 		else
@@ -347,44 +708,33 @@ static void Log_output(int log_level, char* msg)
 }
 
 
-static void Log_posttrace(int log_level, traceEntry* cur_entry)
+/**
+ * Make a trace entry visible to readers, and output it if its level requires.  Formatting the
+ * entry and writing it out is the only part of tracing which takes the log mutex.
+ * @param ring the calling thread's trace ring
+ * @param log_level the log level of the entry
+ * @param cur_entry the trace entry
+ * @param args the arguments of a Log() message, so that it is output in full, or NULL
+ */
+static void Log_posttrace(traceRing* ring, int log_level, traceEntry* cur_entry, va_list* args)
 {
-	if (((trace_output_level == -1) ? log_level >= trace_settings.trace_level : log_level >= trace_output_level))
+	Log_publish(&ring->head, ring->head + 1);
+	if (((trace_output_level == -1) ? log_level >= trace_settings.trace_level : log_level >= trace_output_level)
+			&& (trace_destination || trace_callback))
 	{
-		char* msg = NULL;
-		
-		if (trace_destination || trace_callback)
-			msg = &Log_formatTraceEntry(cur_entry)[7];
-		
-		Log_output(log_level, msg);
+		Thread_lock_mutex(log_mutex);
+		Log_output(log_level, &Log_formatTraceEntry(cur_entry, args)[7]);
+		Thread_unlock_mutex(log_mutex);
 	}
 }
 
 
-static void Log_trace(int log_level, char* buf)
-{
-	traceEntry *cur_entry = NULL;
-
-	if (trace_queue == NULL)
-		return;
-
-	cur_entry = Log_pretrace();
-
-	memcpy(&(cur_entry->ts), &ts, sizeof(ts));
-	cur_entry->sametime_count = sametime_count;
-
-	cur_entry->has_rc = 2;
-	strncpy(cur_entry->name, buf, sizeof(cur_entry->name));
-	cur_entry->name[MAX_FUNCTION_NAME_LENGTH] = '\0';
-
-	Log_posttrace(log_level, cur_entry);
-}
-
-
 /**
  * Log a message.  If possible, all messages should be indexed by message number, and
  * the use of the format string should be minimized or negated altogether.  If format is
- * provided, the message number is only used as a message label.
+ * provided, the message number is only used as a message label.  The message is not
+ * formatted unless it is output: the format and the arguments are kept in the calling
+ * thread's trace ring.
  * @param log_level the log level of the message
  * @param msgno the id of the message to use if the format string is NULL
  * @param aFormat the printf format string to be used if the message id does not exist
@@ -395,20 +745,36 @@ void Log(int log_level, int msgno, char* format, ...)
 	if (log_level >= trace_settings.trace_level)
 	{
 		char* temp = NULL;
-		static char msg_buf[512];
+		traceRing* ring = NULL;
+		traceEntry* cur_entry = NULL;
 		va_list args;
 
-		/* we're using a static character buffer, so we need to make sure only one thread uses it at a time */
-		Thread_lock_mutex(log_mutex); 
+		if (!trace_active || (ring = Log_getRing()) == NULL)
+			return;
 		if (format == NULL && (temp = Messages_get(msgno, log_level)) != NULL)
 			format = temp;
-
+		if (format == NULL)
+			return;
+
+		cur_entry = Log_pretrace(ring);
+		cur_entry->number = msgno;
+		cur_entry->thread_id = (int)Thread_getid();
+		cur_entry->level = log_level;
+		cur_entry->name = format;
+		cur_entry->type = TRACE_ENTRY_FORMAT;
 		va_start(args, format);
-		vsnprintf(msg_buf, sizeof(msg_buf), format, args);
+		if (!Log_keepArgs(cur_entry, args))
+		{
+			va_end(args);
+			va_start(args, format);
+			vsnprintf(cur_entry->u.text, sizeof(cur_entry->u.text), format, args);
+			cur_entry->type = TRACE_ENTRY_TEXT;
+		}
+		va_end(args);
 
-		Log_trace(log_level, msg_buf);
+		va_start(args, format);
+		Log_posttrace(ring, log_level, cur_entry, &args);
 		va_end(args);
-		Thread_unlock_mutex(log_mutex); 
 	}
 
 	/*if (log_level >= LOG_ERROR)
@@ -431,35 +797,31 @@ void Log(int log_level, int msgno, char* format, ...)
  */
 void Log_stackTrace(int log_level, int msgno, int thread_id, int current_depth, const char* name, int line, int* rc)
 {
+	traceRing* ring = NULL;
 	traceEntry *cur_entry = NULL;
 
-	if (trace_queue == NULL)
+	if (!trace_active || log_level < trace_settings.trace_level)
 		return;
 
-	if (log_level < trace_settings.trace_level)
+	if ((ring = Log_getRing()) == NULL)
 		return;
+	cur_entry = Log_pretrace(ring);
 
-	Thread_lock_mutex(log_mutex);
-	cur_entry = Log_pretrace();
-
-	memcpy(&(cur_entry->ts), &ts, sizeof(ts));
-	cur_entry->sametime_count = sametime_count;
 	cur_entry->number = msgno;
 	cur_entry->thread_id = thread_id;
 	cur_entry->depth = current_depth;
-	strcpy(cur_entry->name, name);
+	cur_entry->name = name;
 	cur_entry->level = log_level;
 	cur_entry->line = line;
 	if (rc == NULL)
-		cur_entry->has_rc = 0;
+		cur_entry->type = TRACE_ENTRY_STACK;
 	else
 	{
-		cur_entry->has_rc = 1;
+		cur_entry->type = TRACE_ENTRY_STACK_RC;
 		cur_entry->rc = *rc;
 	}
 
-	Log_posttrace(log_level, cur_entry);
-	Thread_unlock_mutex(log_mutex);
+	Log_posttrace(ring, log_level, cur_entry, NULL);
 }
 
 
@@ -482,80 +844,95 @@ FILE* Log_destToFile(char* dest)
 }
 
 
-int Log_compareEntries(char* entry1, char* entry2)
+static int Log_compareEntries(const void* a, const void* b)
 {
-	int comp = strncmp(&entry1[7], &entry2[7], 19);
+	const traceEntry* entry1 = a;
+	const traceEntry* entry2 = b;
+	int comp = 0;
 
+#if defined(GETTIMEOFDAY)
+	if ((comp = (entry1->ts.tv_sec > entry2->ts.tv_sec) - (entry1->ts.tv_sec < entry2->ts.tv_sec)) == 0)
+		comp = (entry1->ts.tv_usec > entry2->ts.tv_usec) - (entry1->ts.tv_usec < entry2->ts.tv_usec);
+#else
+	if ((comp = (entry1->ts.time > entry2->ts.time) - (entry1->ts.time < entry2->ts.time)) == 0)
+		comp = entry1->ts.millitm - entry2->ts.millitm;
+#endif
 	/* if timestamps are equal, use the sequence numbers */
 	if (comp == 0)
-		comp = strncmp(&entry1[1], &entry2[1], 4);
+		comp = entry1->sametime_count - entry2->sametime_count;
 
 	return comp;
 }
 
 
-#if 0
 /**
- * Write the contents of the stored trace to a stream
+ * Copy the entries of a trace ring, oldest first.  Called with the log mutex locked.
+ * @param ring the ring
+ * @param entries where to copy the entries to, with room for ring->size entries
+ * @return the number of entries copied
+ */
+static int Log_readRing(traceRing* ring, traceEntry* entries)
+{
+	unsigned int head = Log_acquire(&ring->head);
+	unsigned int first = (head - ring->tail > ring->size) ? head - ring->size : ring->tail;
+	unsigned int later, i;
+	int count = 0, skip = 0;
+
+	for (i = first; i != head; ++i)
+		memcpy(&entries[count++], &ring->entries[i & (ring->size - 1)], sizeof(traceEntry));
+
+	/* drop any entries which the owning thread started to overwrite while they were copied */
+	Log_loadFence();
+	later = Log_acquire(&ring->head);
+	if (later - first >= ring->size)
+		skip = min((int)(later - first - ring->size + 1), count);
+	if (skip > 0)
+		memmove(entries, &entries[skip], (count - skip) * sizeof(traceEntry));
+	return count - skip;
+}
+
+
+/**
+ * Write the contents of the trace rings of all threads to a stream, formatting the entries
+ * and merging them in time order.
  * @param dest string which contains a file name or the special strings stdout or stderr
+ * @return 0 on success, -1 if the destination could not be opened
  */
 int Log_dumpTrace(char* dest)
 {
 	FILE* file = NULL;
-	ListElement* cur_trace_entry = NULL;
-	const int msgstart = 7;
+	traceEntry* entries = NULL;
+	traceRing* ring = NULL;
+	int count = 0, i;
 	int rc = -1;
-	int trace_queue_index = 0;
 
 	if ((file = Log_destToFile(dest)) == NULL)
-	{
-		Log(LOG_ERROR, 9, NULL, "trace", dest, "trace entries");
 		goto exit;
-	}
 
-	fprintf(file, "=========== Start of trace dump ==========\n");
-	/* Interleave the log and trace entries together appropriately */
-	ListNextElement(trace_buffer, &cur_trace_entry);
-	trace_queue_index = start_index;
-	if (trace_queue_index == -1)
-		trace_queue_index = next_index;
-	else
+	Thread_lock_mutex(log_mutex);
+	for (ring = trace_rings; ring != NULL; ring = ring->next)
+		count += ring->size;
+	if (count > 0 && (entries = malloc(count * sizeof(traceEntry))) == NULL)
 	{
-		Log_formatTraceEntry(&trace_queue[trace_queue_index++]);
-		if (trace_queue_index == trace_settings.max_trace_entries)
-			trace_queue_index = 0;
+		Thread_unlock_mutex(log_mutex);
+		goto close;
 	}
-	while (cur_trace_entry || trace_queue_index != next_index)
-	{
-		if (cur_trace_entry && trace_queue_index != -1)
-		{	/* compare these timestamps */
-			if (Log_compareEntries((char*)cur_trace_entry->content, msg_buf) > 0)
-				cur_trace_entry = NULL;
-		}
+	count = 0;
+	for (ring = trace_rings; ring != NULL; ring = ring->next)
+		count += Log_readRing(ring, &entries[count]);
+	qsort(entries, count, sizeof(traceEntry), Log_compareEntries);
 
-		if (cur_trace_entry)
-		{
-			fprintf(file, "%s\n", &((char*)(cur_trace_entry->content))[msgstart]);
-			ListNextElement(trace_buffer, &cur_trace_entry);
-		}
-		else
-		{
-			fprintf(file, "%s\n", &msg_buf[7]);
-			if (trace_queue_index != next_index)
-			{
-				Log_formatTraceEntry(&trace_queue[trace_queue_index++]);
-				if (trace_queue_index == trace_settings.max_trace_entries)
-					trace_queue_index = 0;
-			}
-		}
-	}
+	fprintf(file, "=========== Start of trace dump ==========\n");
+	for (i = 0; i < count; ++i)
+		fprintf(file, "%s\n", &Log_formatTraceEntry(&entries[i], NULL)[7]);
 	fprintf(file, "========== End of trace dump ==========\n\n");
-	if (file != stdout && file != stderr && file != NULL)
-		fclose(file);
+	Thread_unlock_mutex(log_mutex);
+	if (entries)
+		free(entries);
 	rc = 0;
+close:
+	if (file != stdout && file != stderr)
+		fclose(file);
 exit:
 	return rc;
 }
-#endif
-
-
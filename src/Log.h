@@ -76,6 +76,8 @@ void Log_terminate();
 
 void Log(int, int, char *, ...);
 void Log_stackTrace(int, int, int, int, const char*, int, int*);
+int Log_dumpTrace(char* dest);
+void Log_threadEnd(void);
 
 typedef void Log_traceCallback(enum LOG_LEVELS level, char* message);
 void Log_setTraceCallback(Log_traceCallback* callback);
@@ -34,6 +34,7 @@
 
 #define _GNU_SOURCE /* for pthread_mutexattr_settype */
 #include <stdlib.h>
+#include <limits.h>
 #if !defined(WIN32) && !defined(WIN64)
 	#include <sys/time.h>
 #endif
@@ -45,10 +46,12 @@
 #include "utf-8.h"
 #include "MQTTProtocol.h"
 #include "MQTTProtocolOut.h"
+#include "MQTTCompression.h"
 #include "Thread.h"
 #include "SocketBuffer.h"
 #include "StackTrace.h"
 #include "Heap.h"
+#include "Pool.h"
 
 #define URI_TCP "tcp://"
 
@@ -87,6 +90,7 @@ static sem_type send_sem = NULL;
 extern mutex_type stack_mutex;
 extern mutex_type heap_mutex;
 extern mutex_type log_mutex;
+extern mutex_type pool_mutex;
 BOOL APIENTRY DllMain(HANDLE hModule,
 					  DWORD  ul_reason_for_call,
 					  LPVOID lpReserved)
@@ -108,11 +112,14 @@ BOOL APIENTRY DllMain(HANDLE hModule,
 				stack_mutex = CreateMutex(NULL, 0, NULL);
 				heap_mutex = CreateMutex(NULL, 0, NULL);
 				log_mutex = CreateMutex(NULL, 0, NULL);
+				pool_mutex = CreateMutex(NULL, 0, NULL);
 			}
 		case DLL_THREAD_ATTACH:
 			Log(TRACE_MAX, -1, "DLL thread attach");
 		case DLL_THREAD_DETACH:
 			Log(TRACE_MAX, -1, "DLL thread detach");
+			Pool_threadEnd(); /* return the thread's cached objects to the pools */
+			Log_threadEnd(); /* let a new thread reuse the thread's trace ring */
 		case DLL_PROCESS_DETACH:
 			Log(TRACE_MAX, -1, "DLL process detach");
 	}
@@ -123,7 +130,7 @@ static pthread_mutex_t mqttasync_mutex_store = PTHREAD_MUTEX_INITIALIZER;
 static mutex_type mqttasync_mutex = &mqttasync_mutex_store;
 static pthread_mutex_t mqttcommand_mutex_store = PTHREAD_MUTEX_INITIALIZER;
 static mutex_type mqttcommand_mutex = &mqttcommand_mutex_store;
-static cond_type_struct send_cond_store = { PTHREAD_COND_INITIALIZER, PTHREAD_MUTEX_INITIALIZER };
+static cond_type_struct send_cond_store = { PTHREAD_COND_INITIALIZER, PTHREAD_MUTEX_INITIALIZER, 0 };
 static cond_type send_cond = &send_cond_store;
 
 void MQTTAsync_init()
@@ -146,6 +153,30 @@ static volatile int initialized = 0;
 static List* handles = NULL;
 static int tostop = 0;
 static List* commands = NULL;
+static List* batches = NULL; /* publish commands whose batches are still being filled, protected by mqttcommand_mutex */
+static long replay_due = 0; /* milliseconds until the next paced publication is due, set by the send thread */
+static int batch_durable = 0; /* clients with MQTTASYNC_DURABILITY_BATCH, protected by mqttasync_mutex */
+static long sync_interval = 0; /* the shortest interval of the clients with MQTTASYNC_DURABILITY_INTERVAL, 0 for none */
+
+/*
+ * The command queue is served in lanes: high priority, normal and bulk.  Each has a number of turns
+ * in each round of a weighted round robin, so that bulk commands are delayed but not starved.
+ * The counts and turns are protected by mqttcommand_mutex.
+ */
+#define MQTTASYNC_LANES 3
+static const int lane_weights[MQTTASYNC_LANES] = {16, 4, 1};
+static int lane_turns[MQTTASYNC_LANES] = {16, 4, 1};
+static int lane_counts[MQTTASYNC_LANES] = {0, 0, 0}; /* commands in the command queue in each lane */
+
+/** The start of the payload of a batch of publications, followed by the length and data of each */
+static const char MQTTAsync_batchMarker[] = {'\0', 'M', 'Q', 'B'};
+#define MQTTASYNC_BATCH_MARKER_LEN 4
+
+/** Milliseconds before messages the application did not take are offered again */
+#define MQTTASYNC_REDELIVERY_INTERVAL 10L
+
+/** Packets read before what was persisted with MQTTASYNC_DURABILITY_BATCH is synced, if the socket is not drained first */
+#define MQTTASYNC_COMMIT_PACKETS 64
 
 MQTTPacket* MQTTAsync_cycle(int* sock, unsigned long timeout, int* rc);
 int MQTTAsync_cleanSession(Clients* client);
@@ -186,6 +217,11 @@ long MQTTAsync_elapsed(DWORD milliseconds)
 {
 	return GetTickCount() - milliseconds;
 }
+
+long MQTTAsync_elapsedMicros(DWORD milliseconds)
+{
+	return (GetTickCount() - milliseconds) * 1000L;
+}
 #elif defined(AIX)
 #define assert(a)
 long MQTTAsync_elapsed(struct timespec start)
@@ -196,6 +232,15 @@ long MQTTAsync_elapsed(struct timespec start)
 	ntimersub(now, start, res);
 	return (res.tv_sec)*1000L + (res.tv_nsec)/1000000L;
 }
+
+long MQTTAsync_elapsedMicros(struct timespec start)
+{
+	struct timespec now, res;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	ntimersub(now, start, res);
+	return (res.tv_sec)*1000000L + (res.tv_nsec)/1000L;
+}
 #else
 long MQTTAsync_elapsed(struct timeval start)
 {
@@ -205,15 +250,38 @@ long MQTTAsync_elapsed(struct timeval start)
 	timersub(&now, &start, &res);
 	return (res.tv_sec)*1000 + (res.tv_usec)/1000;
 }
+
+long MQTTAsync_elapsedMicros(struct timeval start)
+{
+	struct timeval now, res;
+
+	gettimeofday(&now, NULL);
+	timersub(&now, &start, &res);
+	return (res.tv_sec)*1000000L + res.tv_usec;
+}
 #endif
 
 
+/**
+ * A message created for the application, whose payload may be a view of the input buffer it
+ * was read into.  The layout must match MQTTPersistence_message, so that restored messages
+ * can be freed in the same way.
+ */
+typedef struct
+{
+	MQTTAsync_message msg;
+	char* buffer; /* reference to the input buffer holding the payload, or NULL if the payload was allocated */
+} MQTTAsync_receivedMessage;
+
+
 typedef struct
 {
 	MQTTAsync_message* msg;
 	char* topicName;
 	int topicLen;
 	unsigned int seqno; /* only used on restore */
+	ListElement link; /* links the entry into the message queue */
+	int size; /* bytes counted against the client's inbound limit */
 } qEntry;
 
 typedef struct
@@ -224,6 +292,8 @@ typedef struct
 	MQTTAsync_token token;
 	void* context;
 	START_TIME_TYPE start_time;
+	int timeout; /* milliseconds to wait for completion, 0 for no limit */
+	int priority; /* MQTTASYNC_PRIORITY_NORMAL, _HIGH or _BULK */
 	union
 	{
 		struct
@@ -244,6 +314,9 @@ typedef struct
 			void* payload;
 			int qos;
 			int retained;
+			Publications* stored; /* owns the topic and payload once the publish is started */
+			RegisteredTopics* registered; /* reference to the registered topic destinationName points into, or NULL */
+			int count; /* the number of publications packed into the payload, 0 if it is not a batch */
 		} pub;
 		struct
 		{
@@ -273,13 +346,54 @@ typedef struct MQTTAsync_struct
 	MQTTAsync_messageArrived* ma;
 	MQTTAsync_deliveryComplete* dc;
 	void* context; /* the context to be associated with the main callbacks*/
+	MQTTAsync_writable* writable;
+	void* writable_context; /* the context to be associated with the writable callback */
+	MQTTAsync_messageArrivedBatch* mab;
+	void* mab_context;      /* the context to be associated with the batch messageArrived callback */
+	MQTTAsync_arrivedMessage* arrived; /* the messages passed to the batch messageArrived callback */
+	int arrived_max;        /* the most messages passed to one call */
+
+	int inbound_max_messages; /* most messages waiting for the application, 0 for no limit */
+	int inbound_max_bytes;  /* most bytes of messages waiting for the application, 0 for no limit */
+	int inbound_policy;     /* what happens when either limit is reached */
+	int inbound_bytes;      /* bytes of messages waiting for the application */
+	int inbound_dropped;    /* messages dropped because the queue was full */
+	int inbound_dropped_bytes;
+	int inbound_pauses;     /* times reading was paused because the queue was full */
 	
 	MQTTAsync_command connect;				/* Connect operation properties */
 	MQTTAsync_command disconnect;			/* Disconnect operation properties */
 	MQTTAsync_command* pending_write;       /* Is there a socket write pending? */
+	Timer connect_timer;					/* expires when the connect times out */
+	Timer disconnect_timer;					/* expires when the disconnect stops waiting for in-flight messages */
 	
 	List* responses;
 	unsigned int command_seqno;						
+	int qos0_token;         /* last token given to a QoS 0 publication, above MAX_MSG_ID so as not to clash with message ids */
+
+	int queued_bytes;       /* publication data waiting in the command queue */
+	int max_queued_bytes;   /* high watermark, 0 for no limit */
+	int low_water_bytes;    /* the writable callback is called when queued_bytes drains to this */
+	int write_blocked;      /* has MQTTAsync_send returned MQTTASYNC_WOULD_BLOCK? */
+	int queued_publishes;   /* publications waiting in the command queue */
+
+	int offline_buffer;     /* are publications accepted while disconnected? */
+	int offline_max_messages; /* most publications buffered while disconnected, 0 for no limit */
+	int offline_max_bytes;  /* most bytes of publications buffered while disconnected, 0 for no limit */
+	int replay_rate;        /* publications per second sent after reconnecting, 0 for no pacing */
+	int replay_count;       /* publications still to be paced after reconnecting */
+	int replay_sent;        /* publications sent since reconnecting */
+	START_TIME_TYPE replay_start; /* when the client reconnected */
+
+	int batch_messages;     /* most publications packed into one, 0 for no batching */
+	int batch_bytes;        /* most bytes of envelope in one publication */
+	long batch_linger;      /* microseconds the first publication of a batch waits for others */
+	int batch_unpack;       /* are batches received unpacked for messageArrived? */
+	MQTTCompression* compression; /* topic filters payloads are compressed for, or NULL */
+
+	int durability;         /* when persisted messages are synced to the disk */
+	int sync_interval;      /* milliseconds between syncs with MQTTASYNC_DURABILITY_INTERVAL */
+	Timer sync_timer;       /* when to sync next */
 
 	MQTTPacket* pack;
 
@@ -291,11 +405,37 @@ typedef struct
 	MQTTAsync_command command;
 	MQTTAsyncs* client;
 	unsigned int seqno; /* only used on restore */
+	Timer timer; /* expires when the command times out */
+	ListElement link; /* links the command into commands or its client's responses */
+	int sent; /* has the command been moved from commands to responses? */
 } MQTTAsync_queuedCommand;
 
+static Pool command_pool = POOL_INITIALIZER(POOL_COMMANDS, "commands", MQTTAsync_queuedCommand);
+
+/**
+ * The lane of the command queue a command is served in.  Connects and disconnects are always high priority.
+ * @param command the command
+ * @return 0 for high priority, 1 for normal, 2 for bulk
+ */
+static int MQTTAsync_lane(MQTTAsync_command* command)
+{
+	if (command->type == CONNECT || command->type == DISCONNECT || command->priority == MQTTASYNC_PRIORITY_HIGH)
+		return 0;
+	return (command->priority == MQTTASYNC_PRIORITY_BULK) ? 2 : 1;
+}
+
+static MQTTAsync_queuedCommand* MQTTAsync_newCommand(void);
+static int MQTTAsync_flushBatches(MQTTAsyncs* m);
 void MQTTAsync_freeCommand(MQTTAsync_queuedCommand *command);
 void MQTTAsync_freeCommand1(MQTTAsync_queuedCommand *command);
+static void MQTTAsync_connectTimeout(void* context, void* content);
+static void MQTTAsync_disconnectTimeout(void* context, void* content);
+static void MQTTAsync_commandTimeout(void* context, void* content);
+static void MQTTAsync_syncTimeout(void* context, void* content);
+static void MQTTAsync_countDurability(void);
+static void MQTTAsync_commit(void);
 int MQTTAsync_deliverMessage(MQTTAsyncs* m, char* topicName, size_t topicLen, MQTTAsync_message* mm);
+static int MQTTAsync_drainMessageQueues(void);
 #if !defined(NO_PERSISTENCE)
 int MQTTAsync_restoreCommands(MQTTAsyncs* client);
 #endif
@@ -385,6 +525,7 @@ int MQTTAsync_create(MQTTAsync* handle, const char* serverURI, const char* clien
 		Socket_setWriteCompleteCallback(MQTTAsync_writeComplete);
 		handles = ListInitialize();
 		commands = ListInitialize();
+		batches = ListInitialize();
 #if defined(OPENSSL)
 		SSLSocket_initialize();
 #endif
@@ -404,6 +545,9 @@ int MQTTAsync_create(MQTTAsync* handle, const char* serverURI, const char* clien
 #endif
 	m->serverURI = MQTTStrdup(serverURI);
 	m->responses = ListInitialize();
+	Timer_init(&m->connect_timer, MQTTAsync_connectTimeout, m, NULL);
+	Timer_init(&m->disconnect_timer, MQTTAsync_disconnectTimeout, m, NULL);
+	Timer_init(&m->sync_timer, MQTTAsync_syncTimeout, m, NULL);
 	ListAppend(handles, m, sizeof(MQTTAsyncs));
 
 	m->c = malloc(sizeof(Clients));
@@ -441,12 +585,16 @@ void MQTTAsync_terminate(void)
 	MQTTAsync_stop();
 	if (initialized)
 	{
-		ListElement* elem = NULL;
+		MQTTAsync_queuedCommand* command = NULL;
 		ListFree(bstate->clients);
 		ListFree(handles);
-		while (ListNextElement(commands, &elem))
-			MQTTAsync_freeCommand1((MQTTAsync_queuedCommand*)(elem->content));
+		while ((command = ListDetachHeadElement(commands)) != NULL)
+			MQTTAsync_freeCommand(command);
 		ListFree(commands);
+		memset(lane_counts, '\0', sizeof(lane_counts));
+		while ((command = ListDetachHeadElement(batches)) != NULL)
+			MQTTAsync_freeCommand(command);
+		ListFree(batches);
 		handles = NULL;
 		Socket_outTerminate();
 #if defined(OPENSSL)
@@ -455,6 +603,7 @@ void MQTTAsync_terminate(void)
 		#if defined(HEAP_H)
 			Heap_terminate();
 		#endif
+		Pool_logStats();
 		Log_terminate();
 		initialized = 0;
 	}
@@ -591,8 +740,7 @@ MQTTAsync_queuedCommand* MQTTAsync_restoreCommand(char* buffer, int buflen)
 	int i, data_size;
 	
 	FUNC_ENTRY;
-	qcommand = malloc(sizeof(MQTTAsync_queuedCommand));
-	memset(qcommand, '\0', sizeof(MQTTAsync_queuedCommand));
+	qcommand = MQTTAsync_newCommand();
 	command = &qcommand->command;
 	
 	command->type = *(int*)ptr;
@@ -666,23 +814,63 @@ MQTTAsync_queuedCommand* MQTTAsync_restoreCommand(char* buffer, int buflen)
 }
 
 
-void MQTTAsync_insertInOrder(List* list, void* content, int size)
+/**
+ * Merges restored commands, already sorted by sequence number, into the command list.
+ * Each command goes before the first command with a higher sequence number, as if they
+ * had been inserted in order one by one, but the list is only walked once.
+ * @param list the command list
+ * @param cmds the sorted commands
+ * @param count the number of commands
+ */
+static void MQTTAsync_mergeInOrder(List* list, MQTTAsync_queuedCommand** cmds, int count)
 {
-	ListElement* index = NULL;
-	ListElement* current = NULL;
+	ListElement* current = NULL;	/* the last command merged - the next one cannot go before it */
+	int i;
 
 	FUNC_ENTRY;
-	while (ListNextElement(list, &current) != NULL && index == NULL)
+	for (i = 0; i < count; ++i)
 	{
-		if (((MQTTAsync_queuedCommand*)content)->seqno < ((MQTTAsync_queuedCommand*)current->content)->seqno)
-			index = current;
-	}
+		ListElement* index = (current) ? current->next : list->first;
 
-	ListInsert(list, content, size, index);
+		while (index && ((MQTTAsync_queuedCommand*)index->content)->seqno <= cmds[i]->seqno)
+			index = index->next;
+		ListInsertNoMalloc(list, cmds[i], &cmds[i]->link, sizeof(MQTTAsync_queuedCommand), index);
+		current = &cmds[i]->link;
+	}
 	FUNC_EXIT;
 }
 
 
+/**
+ * qsort callback ordering restored commands by sequence number
+ */
+static int MQTTAsync_seqnoCompare(const void* a, const void* b)
+{
+	return (*(MQTTAsync_queuedCommand**)a)->seqno - (*(MQTTAsync_queuedCommand**)b)->seqno;
+}
+
+
+/**
+ * The number of bytes a queued command counts against the client's queued bytes limit.
+ * @param command the command
+ * @return the topic plus payload length of a publish command, otherwise 0
+ */
+static int MQTTAsync_commandBytes(MQTTAsync_command* command)
+{
+	int bytes = 0;
+
+	if (command->type == PUBLISH)
+	{
+		bytes = command->details.pub.payloadlen;
+		if (command->details.pub.registered)
+			bytes += command->details.pub.registered->topiclen;
+		else if (command->details.pub.destinationName)
+			bytes += strlen(command->details.pub.destinationName);
+	}
+	return bytes;
+}
+
+
 int MQTTAsync_restoreCommands(MQTTAsyncs* client)
 {
 	int rc = 0;
@@ -691,10 +879,13 @@ int MQTTAsync_restoreCommands(MQTTAsyncs* client)
 	int i = 0;
 	Clients* c = client->c;
 	int commands_restored = 0;
+	MQTTAsync_queuedCommand** cmds = NULL;
 
 	FUNC_ENTRY;
 	if (c->persistence && (rc = c->persistence->pkeys(c->phandle, &msgkeys, &nkeys)) == 0)
 	{
+		if (nkeys > 0)
+			cmds = malloc(nkeys * sizeof(MQTTAsync_queuedCommand*));
 		while (rc == 0 && i < nkeys)
 		{
 			char *buffer = NULL;
@@ -710,18 +901,26 @@ int MQTTAsync_restoreCommands(MQTTAsyncs* client)
 				{
 					cmd->client = client;	
 					cmd->seqno = atoi(msgkeys[i]+2);
-					MQTTPersistence_insertInOrder(commands, cmd, sizeof(MQTTAsync_queuedCommand));
+					cmds[commands_restored] = cmd;
+					++lane_counts[MQTTAsync_lane(&cmd->command)];
+					client->queued_bytes += MQTTAsync_commandBytes(&cmd->command);
+					if (cmd->command.type == PUBLISH)
+						++(client->queued_publishes);
 					free(buffer);
 					client->command_seqno = max(client->command_seqno, cmd->seqno);
 					commands_restored++;
 				}
 			}
-			if (msgkeys[i])
-				free(msgkeys[i]);
 			i++;
 		}
+		qsort(cmds, commands_restored, sizeof(MQTTAsync_queuedCommand*), MQTTAsync_seqnoCompare);
+		MQTTAsync_mergeInOrder(commands, cmds, commands_restored);
+		for (i = 0; i < nkeys; ++i)
+			free(msgkeys[i]);
 		if (msgkeys != NULL)
 			free(msgkeys);
+		if (cmds)
+			free(cmds);
 	}
 	Log(TRACE_MINIMUM, -1, "%d commands restored for client %s", commands_restored, c->clientID);
 	FUNC_EXIT_RC(rc);
@@ -730,13 +929,78 @@ int MQTTAsync_restoreCommands(MQTTAsyncs* client)
 #endif
 
 
-int MQTTAsync_addCommand(MQTTAsync_queuedCommand* command, int command_size)
+/**
+ * Wake the send thread so that it looks at the command queue without waiting for its timeout.
+ */
+static void MQTTAsync_signalSendThread(void)
 {
-	int rc = 0;
-	
-	FUNC_ENTRY;
-	MQTTAsync_lock_mutex(mqttcommand_mutex);
+#if !defined(WIN32) && !defined(WIN64)
+	Thread_signal_cond(send_cond);
+#else
+	if (!Thread_check_sem(send_sem))
+		Thread_post_sem(send_sem);
+#endif
+}
+
+
+/**
+ * Account for a command which has been taken off the command queue, before it is sent or
+ * when it is abandoned.  Must be called with mqttcommand_mutex locked.
+ * @param command the command
+ * @return the client if its writable callback is now due, otherwise NULL
+ */
+static MQTTAsyncs* MQTTAsync_dequeued(MQTTAsync_queuedCommand* command)
+{
+	MQTTAsyncs* m = command->client;
+	MQTTAsyncs* writable = NULL;
+
+	m->queued_bytes -= MQTTAsync_commandBytes(&command->command);
+	if (command->command.type == PUBLISH)
+		--(m->queued_publishes);
+	--lane_counts[MQTTAsync_lane(&command->command)];
+	if (m->write_blocked && m->queued_bytes <= m->low_water_bytes)
+	{
+		m->write_blocked = 0;
+		writable = m;
+	}
+#if !defined(NO_PERSISTENCE)
+	if (m->c->persistence)
+		MQTTAsync_unpersistCommand(command);
+#endif
+	return writable;
+}
+
+
+/**
+ * Call the writable callback of a client, if it has one.  Must be called without
+ * mqttcommand_mutex locked, as the callback may queue more commands.
+ * @param m the client returned by MQTTAsync_dequeued, or NULL
+ */
+static void MQTTAsync_callWritable(MQTTAsyncs* m)
+{
+	if (m && m->writable)
+	{
+		Log(TRACE_MIN, -1, "Calling writable for client %s", m->c->clientID);
+		(*(m->writable))(m->writable_context);
+	}
+}
+
+
+/**
+ * Add a command to the command queue.  mqttcommand_mutex must be locked, and so must
+ * mqttasync_mutex if the command has a timeout, as it protects the timer wheel.
+ * @param command the command
+ * @param command_size the size to record for the command in the queue
+ */
+static void MQTTAsync_enqueueCommand(MQTTAsync_queuedCommand* command, int command_size)
+{
+	if (command->command.timeout > 0)
+	{
+		Timer_init(&command->timer, MQTTAsync_commandTimeout, command->client, command);
+		Timer_setIn(&state.timers, &command->timer, command->command.timeout);
+	}
 	command->command.start_time = MQTTAsync_start_clock();
+	command->sent = 0;
 	if (command->command.type == CONNECT || 
 		(command->command.type == DISCONNECT && command->command.details.dis.internal))
 	{
@@ -748,23 +1012,49 @@ int MQTTAsync_addCommand(MQTTAsync_queuedCommand* command, int command_size)
 		if (head != NULL && head->client == command->client && head->command.type == command->command.type)
 			MQTTAsync_freeCommand(command); /* ignore duplicate connect or disconnect command */
 		else
-			ListInsert(commands, command, command_size, commands->first); /* add to the head of the list */
+		{
+			ListInsertNoMalloc(commands, command, &command->link, command_size, commands->first); /* add to the head of the list */
+			++lane_counts[MQTTAsync_lane(&command->command)];
+		}
 	}
 	else
 	{
-		ListAppend(commands, command, command_size);
+		ListAppendNoMalloc(commands, command, &command->link, command_size);
+		++lane_counts[MQTTAsync_lane(&command->command)];
+		command->client->queued_bytes += MQTTAsync_commandBytes(&command->command);
+		if (command->command.type == PUBLISH)
+			++(command->client->queued_publishes);
 #if !defined(NO_PERSISTENCE)
 		if (command->client->c->persistence)
 			MQTTAsync_persistCommand(command);
 #endif
 	}
+}
+
+
+int MQTTAsync_addCommand(MQTTAsync_queuedCommand* command, int command_size)
+{
+	int rc = 0;
+	int locked = 0;
+	
+	FUNC_ENTRY;
+	if (command->command.timeout > 0)
+	{
+		thread_id_type thread_id = Thread_getid();
+
+		/* the timer wheel is protected by mqttasync_mutex, which is already locked if we are called in a callback */
+		if (thread_id != sendThread_id && thread_id != receiveThread_id)
+		{
+			MQTTAsync_lock_mutex(mqttasync_mutex);
+			locked = 1;
+		}
+	}
+	MQTTAsync_lock_mutex(mqttcommand_mutex);
+	MQTTAsync_enqueueCommand(command, command_size);
 	MQTTAsync_unlock_mutex(mqttcommand_mutex);
-#if !defined(WIN32) && !defined(WIN64)
-	Thread_signal_cond(send_cond);
-#else
-	if (!Thread_check_sem(send_sem))
-		Thread_post_sem(send_sem);
-#endif
+	if (locked)
+		MQTTAsync_unlock_mutex(mqttasync_mutex);
+	MQTTAsync_signalSendThread();
 	FUNC_EXIT_RC(rc);
 	return rc;
 }
@@ -808,15 +1098,15 @@ void MQTTProtocol_checkPendingWrites()
 		ListElement* le = state.pending_writes.first;
 		while (le)
 		{
-			if (Socket_noPendingWrites(((pending_write*)(le->content))->socket))
+			pending_write* pw = (pending_write*)(le->content);
+
+			le = le->next;
+			if (Socket_noPendingWrites(pw->socket))
 			{
-				MQTTProtocol_removePublication(((pending_write*)(le->content))->p);
-				state.pending_writes.current = le;
-				ListRemove(&(state.pending_writes), le->content); /* does NextElement itself */
-				le = state.pending_writes.current;
+				MQTTProtocol_removePublication(pw->p);
+				ListDetachElement(&(state.pending_writes), &pw->link);
+				free(pw);
 			}
-			else
-				ListNextElement(&(state.pending_writes), &le);
 		}
 	}
 	FUNC_EXIT;
@@ -837,8 +1127,22 @@ void MQTTAsync_freeConnect(MQTTAsync_command command)
 }
 
 
+/**
+ * Allocate a command, with all fields zeroed.
+ * @return the command
+ */
+static MQTTAsync_queuedCommand* MQTTAsync_newCommand(void)
+{
+	MQTTAsync_queuedCommand* command = Pool_alloc(&command_pool);
+
+	memset(command, '\0', sizeof(MQTTAsync_queuedCommand));
+	return command;
+}
+
+
 void MQTTAsync_freeCommand1(MQTTAsync_queuedCommand *command)
 {
+	Timer_cancel(&state.timers, &command->timer);
 	if (command->command.type == SUBSCRIBE)
 	{
 		int i;
@@ -860,17 +1164,23 @@ void MQTTAsync_freeCommand1(MQTTAsync_queuedCommand *command)
 	}
 	else if (command->command.type == PUBLISH)
 	{
-		/* qos 1 and 2 topics are freed in the protocol code when the flows are completed */
-		if (command->command.details.pub.destinationName)
-			free(command->command.details.pub.destinationName); 
-		free(command->command.details.pub.payload);
+		if (command->command.details.pub.stored)
+			MQTTProtocol_removePublication(command->command.details.pub.stored);
+		else
+		{
+			if (command->command.details.pub.registered)
+				MQTTProtocol_releaseTopic(command->command.details.pub.registered);
+			else
+				free(command->command.details.pub.destinationName);
+			free(command->command.details.pub.payload);
+		}
 	}
 }
 
 void MQTTAsync_freeCommand(MQTTAsync_queuedCommand *command)
 {
 	MQTTAsync_freeCommand1(command);
-	free(command);
+	Pool_free(&command_pool, command);
 }
 
 
@@ -900,7 +1210,7 @@ void MQTTAsync_writeComplete(int socket)
 			while (ListNextElement(m->responses, &cur_response))
 			{
 				com = (MQTTAsync_queuedCommand*)(cur_response->content);
-				if (com->client->pending_write == m->pending_write)
+				if (&com->command == m->pending_write)
 					break;
 			}
 					
@@ -919,63 +1229,198 @@ void MQTTAsync_writeComplete(int socket)
 			}		
 			m->pending_write = NULL;
 			
-			ListDetach(m->responses, com);
-			MQTTAsync_freeCommand(com);
+			if (cur_response)
+			{
+				ListDetachElement(m->responses, cur_response);
+				MQTTAsync_freeCommand(com);
+			}
 		}
 	}
 	FUNC_EXIT;
 }
-			
+
+
+
+/**
+ * How long the next publication of a client must wait, while the publications buffered when it
+ * was offline are paced after reconnecting.
+ * @param m the client
+ * @return the number of milliseconds, or 0 if it can be sent now
+ */
+static long MQTTAsync_replayWait(MQTTAsyncs* m)
+{
+	long wait = 0;
+
+	if (m->replay_count > 0 && m->replay_rate > 0)
+	{
+		wait = (long)((double)m->replay_sent * 1000L / m->replay_rate) - MQTTAsync_elapsed(m->replay_start);
+		if (wait < 0)
+			wait = 0;
+		else if (wait > 0 && (replay_due == 0 || wait < replay_due))
+			replay_due = wait;
+	}
+	return wait;
+}
+
+
+
+/**
+ * Can a command be sent now, if it is the first for its client in its lane?
+ * @param cmd the command
+ * @return boolean
+ */
+static int MQTTAsync_commandReady(MQTTAsync_queuedCommand* cmd)
+{
+	int rc = 0;
+
+	if (cmd->command.type == CONNECT || cmd->command.type == DISCONNECT || (cmd->client->c->connected && 
+		cmd->client->c->connect_state == 0 && Socket_noPendingWrites(cmd->client->c->net.socket)))
+	{
+		if ((cmd->command.type == PUBLISH || cmd->command.type == SUBSCRIBE || cmd->command.type == UNSUBSCRIBE) &&
+			cmd->client->c->outboundMsgs->count >= MAX_MSG_ID - 1)
+			; /* no more message ids available */
+		else if (cmd->command.type == PUBLISH && cmd->command.details.pub.qos > 0 &&
+			cmd->client->c->maxInflightMessages > 0 &&
+			cmd->client->c->outboundMsgs->count >= cmd->client->c->maxInflightMessages)
+			; /* in-flight window is full, wait for an acknowledgement */
+		else if (cmd->command.type == PUBLISH && cmd->command.details.pub.qos > 0 &&
+			cmd->client->c->serverReceiveMaximum > 0 &&
+			cmd->client->c->outboundMsgs->count >= cmd->client->c->serverReceiveMaximum)
+			; /* the server's receive maximum is reached, wait for an acknowledgement */
+		else if (cmd->command.type == PUBLISH && MQTTAsync_replayWait(cmd->client) > 0)
+			; /* replaying the offline buffer, and this one is not due yet */
+		else
+			rc = 1;
+	}
+	return rc;
+}
+
+
+/**
+ * The lane the send thread would serve next if it has a command ready, starting a new round of
+ * the weighted round robin if no lane with commands has any turns left in this one.
+ * Must be called with mqttcommand_mutex locked.
+ * @return the lane
+ */
+static int MQTTAsync_preferredLane(void)
+{
+	int lane;
+
+	for (lane = 0; lane < MQTTASYNC_LANES; ++lane)
+		if (lane_counts[lane] > 0 && lane_turns[lane] > 0)
+			return lane;
+	for (lane = 0; lane < MQTTASYNC_LANES; ++lane)
+		lane_turns[lane] = lane_weights[lane];
+	for (lane = 0; lane < MQTTASYNC_LANES; ++lane)
+		if (lane_counts[lane] > 0)
+			return lane;
+	return 0;
+}
+
+
+/**
+ * Choose the command to send from the first ready command of each lane: the one in the highest
+ * lane with turns left in this round, or if there is none, in the highest lane in a new round.
+ * Must be called with mqttcommand_mutex locked.
+ * @param candidates the first command ready to send in each lane, or NULL
+ * @return the command, or NULL if none is ready
+ */
+static MQTTAsync_queuedCommand* MQTTAsync_chooseLane(MQTTAsync_queuedCommand** candidates)
+{
+	int lane, chosen = -1;
+
+	for (lane = 0; lane < MQTTASYNC_LANES && chosen == -1; ++lane)
+		if (candidates[lane] && lane_turns[lane] > 0)
+			chosen = lane;
+	if (chosen == -1)
+	{
+		for (lane = 0; lane < MQTTASYNC_LANES; ++lane)
+			lane_turns[lane] = lane_weights[lane];
+		for (lane = 0; lane < MQTTASYNC_LANES && chosen == -1; ++lane)
+			if (candidates[lane])
+				chosen = lane;
+	}
+	if (chosen == -1)
+		return NULL;
+	--lane_turns[chosen];
+	return candidates[chosen];
+}
+
 
 void MQTTAsync_processCommand()
 {
 	int rc = 0;
 	MQTTAsync_queuedCommand* command = NULL;
+	MQTTAsync_queuedCommand* candidates[MQTTASYNC_LANES];
 	ListElement* cur_command = NULL;
-	List* ignored_clients = NULL;
+	List* ignored_clients[MQTTASYNC_LANES];
+	List* seen_clients = NULL;
+	MQTTAsyncs* writable = NULL;
+	int lane, preferred;
 	
 	FUNC_ENTRY;
 	MQTTAsync_lock_mutex(mqttasync_mutex);
 	MQTTAsync_lock_mutex(mqttcommand_mutex);
 	
-	/* only the first command in the list must be processed for any particular client, so if we skip
-	   a command for a client, we must skip all following commands for that client.  Use a list of 
-	   ignored clients to keep track
+	/* only the first command in each lane must be processed for any particular client, so if we skip
+	   a command for a client, we must skip all following commands for that client in that lane.  Use
+	   a list of ignored clients for each lane to keep track
 	*/
-	ignored_clients = ListInitialize();
+	for (lane = 0; lane < MQTTASYNC_LANES; ++lane)
+	{
+		ignored_clients[lane] = ListInitialize();
+		candidates[lane] = NULL;
+	}
+	seen_clients = ListInitialize();
+	replay_due = 0;
+	preferred = MQTTAsync_preferredLane();
 	
 	/* don't try a command until there isn't a pending write for that client, and we are not connecting */
 	while (ListNextElement(commands, &cur_command))
 	{
 		MQTTAsync_queuedCommand* cmd = (MQTTAsync_queuedCommand*)(cur_command->content);
+		int seen = (ListFind(seen_clients, cmd->client) != NULL);
 		
-		if (ListFind(ignored_clients, cmd->client))
+		lane = MQTTAsync_lane(&cmd->command);
+		if (!seen)
+			ListAppend(seen_clients, cmd->client, sizeof(cmd->client));
+		if (candidates[lane] || ListFind(ignored_clients[lane], cmd->client))
 			continue;
 		
-		if (cmd->command.type == CONNECT || cmd->command.type == DISCONNECT || (cmd->client->c->connected && 
-			cmd->client->c->connect_state == 0 && Socket_noPendingWrites(cmd->client->c->net.socket)))
+		if (cmd->command.type == DISCONNECT && !cmd->command.details.dis.internal)
+		{	/* the client's earlier commands, in any lane, go first, and none of its later ones overtake it */
+			if (!seen && MQTTAsync_commandReady(cmd))
+				candidates[lane] = cmd;
+			for (lane = 0; lane < MQTTASYNC_LANES; ++lane)
+				ListAppend(ignored_clients[lane], cmd->client, sizeof(cmd->client));
+			if (candidates[preferred])
+				break;
+		}
+		else if (MQTTAsync_commandReady(cmd))
 		{
-			if ((cmd->command.type == PUBLISH || cmd->command.type == SUBSCRIBE || cmd->command.type == UNSUBSCRIBE) &&
-				cmd->client->c->outboundMsgs->count >= MAX_MSG_ID - 1)
-				; /* no more message ids available */
-			else
-			{
-				command = cmd;
+			candidates[lane] = cmd;
+			if (lane == preferred)
 				break;
-			}
 		}
-		ListAppend(ignored_clients, cmd->client, sizeof(cmd->client));
+		else
+			ListAppend(ignored_clients[lane], cmd->client, sizeof(cmd->client));
 	}
-	ListFreeNoContent(ignored_clients);
+	for (lane = 0; lane < MQTTASYNC_LANES; ++lane)
+		ListFreeNoContent(ignored_clients[lane]);
+	ListFreeNoContent(seen_clients);
+	command = MQTTAsync_chooseLane(candidates);
 	if (command)
 	{
-		ListDetach(commands, command);
-#if !defined(NO_PERSISTENCE)
-		if (command->client->c->persistence)
-			MQTTAsync_unpersistCommand(command);
-#endif
+		if (command->command.type == PUBLISH && command->client->replay_count > 0 &&
+			++(command->client->replay_sent) >= command->client->replay_count)
+			command->client->replay_count = 0; /* the offline buffer has been replayed */
+		ListDetachElement(commands, &command->link);
+		command->sent = 1;
+		writable = MQTTAsync_dequeued(command);
 	}
 	MQTTAsync_unlock_mutex(mqttcommand_mutex);
+
+	MQTTAsync_callWritable(writable);
 	
 	if (!command)
 		goto exit; /* nothing to do */
@@ -1066,19 +1511,20 @@ void MQTTAsync_processCommand()
 		rc = MQTTProtocol_unsubscribe(command->client->c, topics, command->command.token);
 		ListFreeNoContent(topics);
 	}
+	else if (command->command.type == PUBLISH && command->client->c->maximumPacketSize > 0 &&
+		MQTTPacket_publishLength(command->client->c->net.MQTTVersion, command->command.details.pub.destinationName,
+			command->command.details.pub.qos, command->command.details.pub.payloadlen) > command->client->c->maximumPacketSize)
+		rc = MQTTASYNC_PACKET_TOO_LARGE;
 	else if (command->command.type == PUBLISH)
 	{
 		Messages* msg = NULL;
-		Publish* p = NULL;
-	
-		p = malloc(sizeof(Publish));
-
-		p->payload = command->command.details.pub.payload;
-		p->payloadlen = command->command.details.pub.payloadlen;
-		p->topic = command->command.details.pub.destinationName;
-		p->msgId = command->command.token;
 
-		rc = MQTTProtocol_startPublish(command->client->c, p, command->command.details.pub.qos, command->command.details.pub.retained, &msg);
+		/* move the topic and payload into a stored publication shared by the command and the message flow */
+		command->command.details.pub.stored = MQTTProtocol_adoptPublication(command->command.details.pub.destinationName,
+			command->command.details.pub.registered, command->command.details.pub.payload, command->command.details.pub.payloadlen);
+		rc = MQTTProtocol_startStoredPublish(command->client->c, command->command.details.pub.stored,
+			(command->command.details.pub.qos > 0) ? command->command.token : 0, command->command.details.pub.qos,
+			command->command.details.pub.retained, &msg);
 		
 		if (command->command.details.pub.qos == 0)
 		{ 
@@ -1099,14 +1545,8 @@ void MQTTAsync_processCommand()
 				}
 			}
 			else
-			{
-				command->command.details.pub.destinationName = NULL; /* this will be freed by the protocol code */
 				command->client->pending_write = &command->command;
-			}
 		}
-		else
-			command->command.details.pub.destinationName = NULL; /* this will be freed by the protocol code */
-		free(p); /* should this be done if the write isn't complete? */
 	}
 	else if (command->command.type == DISCONNECT)
 	{
@@ -1117,20 +1557,41 @@ void MQTTAsync_processCommand()
 		}
 	}
 
-	if (command->command.type == CONNECT && rc != SOCKET_ERROR && rc != MQTTASYNC_PERSISTENCE_ERROR)
+	if (rc == MQTTASYNC_PACKET_TOO_LARGE)
+	{
+		Log(TRACE_MIN, -1, "Publication with token %d is larger than the maximum packet size %d of client %s",
+			command->command.token, command->client->c->maximumPacketSize, command->client->c->clientID);
+		if (command->command.onFailure)
+		{
+			MQTTAsync_failureData data;
+
+			data.token = command->command.token;
+			data.code = MQTTASYNC_PACKET_TOO_LARGE;
+			data.message = NULL;
+			(*(command->command.onFailure))(command->command.context, &data);
+		}
+		MQTTAsync_freeCommand(command);
+	}
+	else if (command->command.type == CONNECT && rc != SOCKET_ERROR && rc != MQTTASYNC_PERSISTENCE_ERROR)
 	{
 		command->client->connect = command->command;
+		if (command->client->c->connect_state != 0)
+			Timer_setIn(&state.timers, &command->client->connect_timer, 
+				command->client->connect.details.conn.timeout * 1000L - MQTTAsync_elapsed(command->client->connect.start_time));
 		MQTTAsync_freeCommand(command);
 	}
 	else if (command->command.type == DISCONNECT)
 	{
 		command->client->disconnect = command->command;
+		if (command->client->c->connect_state == -2)
+			Timer_setIn(&state.timers, &command->client->disconnect_timer, 
+				command->client->disconnect.details.dis.timeout - MQTTAsync_elapsed(command->client->disconnect.start_time));
 		MQTTAsync_freeCommand(command);
 	}
 	else if (command->command.type == PUBLISH && command->command.details.pub.qos == 0)
 	{
 		if (rc == TCPSOCKET_INTERRUPTED)
-			ListAppend(command->client->responses, command, sizeof(command));
+			ListAppendNoMalloc(command->client->responses, command, &command->link, sizeof(command));
 		else
 			MQTTAsync_freeCommand(command);
 	}
@@ -1162,7 +1623,7 @@ void MQTTAsync_processCommand()
 		}
 	}
 	else /* put the command into a waiting for response queue for each client, indexed by msgid */
-		ListAppend(command->client->responses, command, sizeof(command));
+		ListAppendNoMalloc(command->client->responses, command, &command->link, sizeof(command));
 
 exit:
 	MQTTAsync_unlock_mutex(mqttasync_mutex);
@@ -1170,116 +1631,170 @@ exit:
 }
 
 
-void MQTTAsync_checkTimeouts()
+/**
+ * Called when a command has not completed within the timeout set in its response options.
+ * The command is abandoned, whether it is still queued or waiting for its acknowledgement,
+ * and its failure callback called.
+ * @param context the client
+ * @param content the command
+ */
+static void MQTTAsync_commandTimeout(void* context, void* content)
 {
-	ListElement* current = NULL;
-	static time_t last = 0L;
-	time_t now;
+	MQTTAsyncs* m = context;
+	MQTTAsync_queuedCommand* command = content;
+	MQTTAsyncs* writable = NULL;
 
 	FUNC_ENTRY;
-	time(&(now));
-	if (difftime(now, last) < 3)
-		goto exit;
-
-	MQTTAsync_lock_mutex(mqttasync_mutex);
-	last = now;
-	while (ListNextElement(handles, &current))		/* for each client */
+	if (!command->sent)
 	{
-		ListElement* cur_response = NULL;
-		int i = 0, 
-			timed_out_count = 0;
-		
-		MQTTAsyncs* m = (MQTTAsyncs*)(current->content);
-		
-		/* check connect timeout */
-		if (m->c->connect_state != 0 && MQTTAsync_elapsed(m->connect.start_time) > (m->connect.details.conn.timeout * 1000))
-		{
-			if (MQTTAsync_checkConn(&m->connect, m))
-			{
-				MQTTAsync_queuedCommand* conn;
-				
-				MQTTAsync_closeOnly(m->c);
-				/* put the connect command back to the head of the command queue, using the next serverURI */
-				conn = malloc(sizeof(MQTTAsync_queuedCommand));
-				memset(conn, '\0', sizeof(MQTTAsync_queuedCommand));
-				conn->client = m;
-				conn->command = m->connect;
-				Log(TRACE_MIN, -1, "Connect failed with timeout, more to try");
-				MQTTAsync_addCommand(conn, sizeof(m->connect));
-			}
-			else
-			{
-				MQTTAsync_closeSession(m->c);
-				MQTTAsync_freeConnect(m->connect);
-				if (m->connect.onFailure)
-				{
-					Log(TRACE_MIN, -1, "Calling connect failure for client %s", m->c->clientID);
-					(*(m->connect.onFailure))(m->connect.context, NULL);
-				}
-			}
-			continue;
-		}
-	
-		/* check disconnect timeout */
-		if (m->c->connect_state == -2)
-			MQTTAsync_checkDisconnect(m, &m->disconnect);
-	
-		timed_out_count = 0;
-		/* check response timeouts */
-		while (ListNextElement(m->responses, &cur_response))
-		{
-			MQTTAsync_queuedCommand* com = (MQTTAsync_queuedCommand*)(cur_response->content);
-			
-			if (1 /*MQTTAsync_elapsed(com->command.start_time) < 120000*/)	
-				break; /* command has not timed out */
-			else
-			{
-				if (com->command.onFailure)
-				{		
-					Log(TRACE_MIN, -1, "Calling %s failure for client %s", 
-								MQTTPacket_name(com->command.type), m->c->clientID);
-					(*(com->command.onFailure))(com->command.context, NULL);
-				}
-				timed_out_count++;
-			}
-		}
-		for (i = 0; i < timed_out_count; ++i)
-			ListRemoveHead(m->responses);	/* remove the first response in the list */
+		MQTTAsync_lock_mutex(mqttcommand_mutex);
+		ListDetachElement(commands, &command->link);
+		writable = MQTTAsync_dequeued(command);
+		MQTTAsync_unlock_mutex(mqttcommand_mutex);
 	}
-	MQTTAsync_unlock_mutex(mqttasync_mutex);
-exit:
+	else
+	{
+		ListDetachElement(m->responses, &command->link);
+		if (m->pending_write == &command->command)
+			m->pending_write = NULL; /* the write completes without its command */
+	}
+	Log(TRACE_MIN, -1, "Command with token %d timed out for client %s", command->command.token, m->c->clientID);
+	if (command->command.onFailure)
+	{
+		MQTTAsync_failureData data;
+
+		data.token = command->command.token;
+		data.code = MQTTASYNC_OPERATION_TIMEOUT;
+		data.message = NULL;
+		Log(TRACE_MIN, -1, "Calling command failure for client %s", m->c->clientID);
+		(*(command->command.onFailure))(command->command.context, &data);
+	}
+	MQTTAsync_freeCommand(command);
+	MQTTAsync_callWritable(writable);
 	FUNC_EXIT;
 }
 
 
-thread_return_type WINAPI MQTTAsync_sendThread(void* n)
+/**
+ * Sync what a client has persisted, every sync_interval milliseconds with
+ * MQTTASYNC_DURABILITY_INTERVAL.  Called by the timer wheel with mqttasync_mutex locked.
+ * @param context the client
+ * @param content unused
+ */
+static void MQTTAsync_syncTimeout(void* context, void* content)
 {
+	MQTTAsyncs* m = (MQTTAsyncs*)context;
+
 	FUNC_ENTRY;
-	MQTTAsync_lock_mutex(mqttasync_mutex);
-	sendThread_state = RUNNING;
-	sendThread_id = Thread_getid();
-	MQTTAsync_unlock_mutex(mqttasync_mutex);
-	while (!tostop)
-	{
-		int rc;
-		
-		while (commands->count > 0)
-		{
-			int before = commands->count;
-			MQTTAsync_processCommand();
-			if (before == commands->count)
-				break;  /* no commands were processed, so go into a wait */
+	MQTTPersistence_sync(m->c);
+	Timer_setIn(&state.timers, &m->sync_timer, m->sync_interval);
+	FUNC_EXIT;
+}
+
+
+/**
+ * Called when the connect timer of a client expires.
+ * @param context the client
+ * @param content unused
+ */
+static void MQTTAsync_connectTimeout(void* context, void* content)
+{
+	MQTTAsyncs* m = (MQTTAsyncs*)context;
+	long remaining = 0L;
+
+	FUNC_ENTRY;
+	if (m->c->connect_state == 0)
+		goto exit; /* the connect has completed or been abandoned */
+	if ((remaining = m->connect.details.conn.timeout * 1000L - MQTTAsync_elapsed(m->connect.start_time)) > 0)
+	{	/* set for an earlier connect attempt */
+		Timer_setIn(&state.timers, &m->connect_timer, remaining);
+		goto exit;
+	}
+	if (MQTTAsync_checkConn(&m->connect, m))
+	{
+		MQTTAsync_queuedCommand* conn;
+
+		MQTTAsync_closeOnly(m->c);
+		/* put the connect command back to the head of the command queue, using the next serverURI */
+		conn = MQTTAsync_newCommand();
+		conn->client = m;
+		conn->command = m->connect;
+		Log(TRACE_MIN, -1, "Connect failed with timeout, more to try");
+		MQTTAsync_addCommand(conn, sizeof(m->connect));
+	}
+	else
+	{
+		MQTTAsync_closeSession(m->c);
+		MQTTAsync_freeConnect(m->connect);
+		if (m->connect.onFailure)
+		{
+			Log(TRACE_MIN, -1, "Calling connect failure for client %s", m->c->clientID);
+			(*(m->connect.onFailure))(m->connect.context, NULL);
+		}
+	}
+exit:
+	FUNC_EXIT;
+}
+
+
+/**
+ * Called when the disconnect timer of a client expires.
+ * @param context the client
+ * @param content unused
+ */
+static void MQTTAsync_disconnectTimeout(void* context, void* content)
+{
+	MQTTAsyncs* m = (MQTTAsyncs*)context;
+
+	FUNC_ENTRY;
+	if (m->c->connect_state == -2)
+		MQTTAsync_checkDisconnect(m, &m->disconnect);
+	FUNC_EXIT;
+}
+
+
+thread_return_type WINAPI MQTTAsync_sendThread(void* n)
+{
+	FUNC_ENTRY;
+	MQTTAsync_lock_mutex(mqttasync_mutex);
+	sendThread_state = RUNNING;
+	sendThread_id = Thread_getid();
+	MQTTAsync_unlock_mutex(mqttasync_mutex);
+	while (!tostop)
+	{
+		int rc, timeout = 1000, processed = 0;
+		
+		if (batches->count > 0)
+		{
+			MQTTAsync_lock_mutex(mqttasync_mutex);
+			MQTTAsync_lock_mutex(mqttcommand_mutex);
+			timeout = MQTTAsync_flushBatches(NULL);
+			MQTTAsync_unlock_mutex(mqttcommand_mutex);
+			MQTTAsync_unlock_mutex(mqttasync_mutex);
+		}
+		while (commands->count > 0)
+		{
+			int before = commands->count;
+			MQTTAsync_processCommand();
+			if (before == commands->count)
+				break;  /* no commands were processed, so go into a wait */
+			processed = 1;
+		}
+		if (processed && batch_durable > 0)
+		{	/* one sync for everything persisted while the commands were sent */
+			MQTTAsync_lock_mutex(mqttasync_mutex);
+			MQTTAsync_commit();
+			MQTTAsync_unlock_mutex(mqttasync_mutex);
 		}
+		if (replay_due > 0 && replay_due < timeout)
+			timeout = (int)replay_due; /* wake up for the next paced publication */
 #if !defined(WIN32) && !defined(WIN64)
-		rc =  Thread_wait_cond(send_cond, 1);
-		if ((rc = Thread_wait_cond(send_cond, 1)) != 0 && rc != ETIMEDOUT)
+		if ((rc = Thread_wait_cond(send_cond, timeout)) != 0 && rc != ETIMEDOUT)
 			Log(LOG_ERROR, -1, "Error %d waiting for condition variable", rc);
 #else
-		if ((rc = Thread_wait_sem(send_sem, 1000)) != 0 && rc != ETIMEDOUT)
+		if ((rc = Thread_wait_sem(send_sem, timeout)) != 0 && rc != ETIMEDOUT)
 			Log(LOG_ERROR, -1, "Error %d waiting for semaphore", rc);
 #endif
-			
-		MQTTAsync_checkTimeouts();
 	}
 	sendThread_state = STOPPING;
 	MQTTAsync_lock_mutex(mqttasync_mutex);
@@ -1297,21 +1812,26 @@ void MQTTAsync_emptyMessageQueue(Clients* client)
 	/* empty message queue */
 	if (client->messageQueue->count > 0)
 	{
-		ListElement* current = NULL;
-		while (ListNextElement(client->messageQueue, &current))
+		qEntry* qe = NULL;
+
+		while ((qe = ListDetachHeadElement(client->messageQueue)) != NULL)
 		{
-			qEntry* qe = (qEntry*)(current->content);
 			free(qe->topicName);
-			free(qe->msg->payload);
-			free(qe->msg);
+			MQTTAsync_freeMessage(&qe->msg);
+			free(qe);
 		}
-		ListEmpty(client->messageQueue);
 	}
 	FUNC_EXIT;
 }
 
 
-void MQTTAsync_removeResponsesAndCommands(MQTTAsyncs* m)
+/**
+ * Remove the commands of a client from the command queue and its responses list.
+ * @param m the client
+ * @param keepPublishes boolean - leave the publications that have not been sent on the command
+ * queue, and in the batches being filled, as when they are buffered while the client is offline
+ */
+void MQTTAsync_removeResponsesAndCommands(MQTTAsyncs* m, int keepPublishes)
 {
 	int count = 0;	
 	ListElement* current = NULL;
@@ -1320,15 +1840,14 @@ void MQTTAsync_removeResponsesAndCommands(MQTTAsyncs* m)
 	FUNC_ENTRY;
 	if (m->responses)
 	{
-		ListElement* elem = NULL;
+		MQTTAsync_queuedCommand* command = NULL;
 
-		while (ListNextElement(m->responses, &elem))
+		while ((command = ListDetachHeadElement(m->responses)) != NULL)
 		{
-			MQTTAsync_freeCommand1((MQTTAsync_queuedCommand*) (elem->content));
+			MQTTAsync_freeCommand(command);
 			count++;
 		}
 	}
-	ListEmpty(m->responses);
 	Log(TRACE_MINIMUM, -1, "%d responses removed for client %s", count, m->c->clientID);
 	
 	/* remove commands in the command queue relating to this client */
@@ -1339,15 +1858,40 @@ void MQTTAsync_removeResponsesAndCommands(MQTTAsyncs* m)
 	{
 		MQTTAsync_queuedCommand* cmd = (MQTTAsync_queuedCommand*)(current->content);
 		
-		if (cmd->client == m)
+		if (cmd->client == m && !(keepPublishes && cmd->command.type == PUBLISH))
 		{
-			ListDetach(commands, cmd);
+			ListDetachElement(commands, &cmd->link);
+			--lane_counts[MQTTAsync_lane(&cmd->command)];
 			MQTTAsync_freeCommand(cmd);
 			count++;
 		}
 		current = next;
 		ListNextElement(commands, &next);
 	}
+
+	/* and the batches being filled */
+	current = NULL;
+	next = NULL;
+	current = ListNextElement(batches, &next);
+	ListNextElement(batches, &next);
+	while (current)
+	{
+		MQTTAsync_queuedCommand* cmd = (MQTTAsync_queuedCommand*)(current->content);
+
+		if (cmd->client == m && !keepPublishes)
+		{
+			ListDetachElement(batches, &cmd->link);
+			MQTTAsync_freeCommand(cmd);
+			count++;
+		}
+		current = next;
+		ListNextElement(batches, &next);
+	}
+	if (!keepPublishes)
+	{
+		m->queued_bytes = m->queued_publishes = 0;
+		m->write_blocked = 0;
+	}
 	Log(TRACE_MINIMUM, -1, "%d commands removed for client %s", count, m->c->clientID);
 	FUNC_EXIT;
 }
@@ -1363,14 +1907,23 @@ void MQTTAsync_destroy(MQTTAsync* handle)
 	if (m == NULL)
 		goto exit;
 
-	MQTTAsync_removeResponsesAndCommands(m);
+	MQTTAsync_removeResponsesAndCommands(m, 0);
 	ListFree(m->responses);
+	if (m->compression)
+		MQTTCompression_free(m->compression);
+	if (m->arrived)
+		free(m->arrived);
+	Timer_cancel(&state.timers, &m->connect_timer);
+	Timer_cancel(&state.timers, &m->disconnect_timer);
+	Timer_cancel(&state.timers, &m->sync_timer);
 	
 	if (m->c)
 	{
 		int saved_socket = m->c->net.socket;
 		char* saved_clientid = MQTTStrdup(m->c->clientID);
 #if !defined(NO_PERSISTENCE)
+		if (m->durability != MQTTASYNC_DURABILITY_NONE)
+			MQTTPersistence_sync(m->c);
 		MQTTPersistence_close(m->c);
 #endif
 		MQTTAsync_emptyMessageQueue(m->c);
@@ -1387,6 +1940,7 @@ void MQTTAsync_destroy(MQTTAsync* handle)
 	if (!ListRemove(handles, m))
 		Log(LOG_ERROR, -1, "free error");
 	*handle = NULL;
+	MQTTAsync_countDurability();
 	if (bstate->clients->count == 0)
 		MQTTAsync_terminate();
 
@@ -1398,8 +1952,13 @@ exit:
 
 void MQTTAsync_freeMessage(MQTTAsync_message** message)
 {
+	MQTTAsync_receivedMessage* received = (MQTTAsync_receivedMessage*)*message;
+
 	FUNC_ENTRY;
-	free((*message)->payload);
+	if (received->buffer)
+		SocketBuffer_releaseData(received->buffer);
+	else
+		free((*message)->payload);
 	free(*message);
 	*message = NULL;
 	FUNC_EXIT;
@@ -1423,27 +1982,41 @@ int MQTTAsync_completeConnection(MQTTAsyncs* m, MQTTPacket* pack)
 	{
 		Connack* connack = (Connack*)pack;
 		Log(LOG_PROTOCOL, 1, NULL, m->c->net.socket, m->c->clientID, connack->rc);
-		if ((rc = connack->rc) == MQTTASYNC_SUCCESS)
+		if ((rc = (unsigned char)connack->rc) == MQTTASYNC_SUCCESS)
 		{
 			m->c->connected = 1;
 			m->c->good = 1;
 			m->c->connect_state = 0;
+			m->c->serverReceiveMaximum = m->c->maximumPacketSize = 0;
+			if (m->c->net.MQTTVersion >= MQTTVERSION_5)
+			{
+				MQTTProperties* props = &connack->properties;
+
+				m->c->serverReceiveMaximum = MQTTProperties_getNumericValue(props, MQTTPROPERTY_CODE_RECEIVE_MAXIMUM, 65535);
+				m->c->maximumPacketSize = MQTTProperties_getNumericValue(props, MQTTPROPERTY_CODE_MAXIMUM_PACKET_SIZE, 0);
+				MQTTTopicAliases_setOutboundMax(&m->c->net.aliases,
+					MQTTProperties_getNumericValue(props, MQTTPROPERTY_CODE_TOPIC_ALIAS_MAXIMUM, 0));
+			}
+			Timer_cancel(&state.timers, &m->connect_timer);
+			MQTTProtocol_startKeepalive(m->c);
 			if (m->c->cleansession)
 				rc = MQTTAsync_cleanSession(m->c);
+			if (m->replay_rate > 0)
+			{	/* pace the publications buffered while we were disconnected */
+				MQTTAsync_lock_mutex(mqttcommand_mutex);
+				m->replay_count = m->queued_publishes;
+				MQTTAsync_unlock_mutex(mqttcommand_mutex);
+				m->replay_sent = 0;
+				m->replay_start = MQTTAsync_start_clock();
+			}
 			if (m->c->outboundMsgs->count > 0)
 			{
-				ListElement* outcurrent = NULL;
-
-				while (ListNextElement(m->c->outboundMsgs, &outcurrent))
-				{
-					Messages* m = (Messages*)(outcurrent->content);
-					m->lastTouch = 0;
-				}
-				MQTTProtocol_retry((time_t)0, 1, 1);
+				MQTTProtocol_retries(m->c);
 				if (m->c->connected != 1)
 					rc = MQTTASYNC_DISCONNECTED;
 			}
 		}
+		MQTTProperties_free(&connack->properties);
 		free(connack);
 		m->pack = NULL;
 	}
@@ -1451,10 +2024,55 @@ int MQTTAsync_completeConnection(MQTTAsyncs* m, MQTTPacket* pack)
 	return rc;
 }
 
+/**
+ * Sync what the clients with MQTTASYNC_DURABILITY_BATCH have persisted, with one sync for each
+ * client however many messages there are, and then send the PUBRECs which were waiting for it.
+ * If a sync fails, the PUBRECs stay held until a later one succeeds.  mqttasync_mutex must be
+ * locked.
+ */
+static void MQTTAsync_commit(void)
+{
+	ListElement* current = NULL;
+
+	FUNC_ENTRY;
+	while (ListNextElement(handles, &current))
+	{
+		MQTTAsyncs* m = (MQTTAsyncs*)(current->content);
+
+		if (m->durability == MQTTASYNC_DURABILITY_BATCH && MQTTPersistence_sync(m->c) == 0 && m->c->heldAcks > 0)
+			MQTTProtocol_releaseAcks(m->c);
+	}
+	FUNC_EXIT;
+}
+
+
+/**
+ * Count the clients which sync in batches, and find the shortest interval of those which sync
+ * at intervals, for the send and receive threads.  mqttasync_mutex must be locked.
+ */
+static void MQTTAsync_countDurability(void)
+{
+	ListElement* current = NULL;
+
+	batch_durable = 0;
+	sync_interval = 0;
+	while (ListNextElement(handles, &current))
+	{
+		MQTTAsyncs* m = (MQTTAsyncs*)(current->content);
+
+		if (m->durability == MQTTASYNC_DURABILITY_BATCH)
+			++batch_durable;
+		else if (m->durability == MQTTASYNC_DURABILITY_INTERVAL && (sync_interval == 0 || m->sync_interval < sync_interval))
+			sync_interval = m->sync_interval;
+	}
+}
+
+
 /* This is the thread function that handles the calling of callback functions if set */
 thread_return_type WINAPI MQTTAsync_receiveThread(void* n)
 {
 	long timeout = 10L; /* first time in we have a small timeout.  Gets things started more quickly */
+	int commit_count = 0; /* packets read since PUBRECs were first held for a sync */
 
 	FUNC_ENTRY;
 	MQTTAsync_lock_mutex(mqttasync_mutex);
@@ -1468,11 +2086,21 @@ thread_return_type WINAPI MQTTAsync_receiveThread(void* n)
 		MQTTPacket* pack = NULL;
 
 		MQTTAsync_unlock_mutex(mqttasync_mutex);
-		pack = MQTTAsync_cycle(&sock, timeout, &rc);
+		pack = MQTTAsync_cycle(&sock, (commit_count > 0) ? 0L : timeout, &rc);
 		MQTTAsync_lock_mutex(mqttasync_mutex);
 		if (tostop)
 			break;
-		timeout = 1000L;
+		if (commit_count > 0 && (sock == 0 || commit_count >= MQTTASYNC_COMMIT_PACKETS))
+		{	/* nothing more to read for now, or enough has been, so sync it all and acknowledge it */
+			MQTTAsync_commit();
+			commit_count = 0;
+		}
+		/* offer messages the application has not taken again soon, rather than after the next packet */
+		timeout = (MQTTAsync_drainMessageQueues()) ? MQTTASYNC_REDELIVERY_INTERVAL : 1000L;
+		if (MQTTProtocol_replaying())
+			timeout = TIMER_TICK_MS; /* in-flight messages are being resent a few at a time */
+		if (sync_interval > 0 && sync_interval < timeout)
+			timeout = sync_interval; /* the timer wheel only runs between reads */
 
 		if (sock == 0)
 			continue;
@@ -1490,6 +2118,8 @@ thread_return_type WINAPI MQTTAsync_receiveThread(void* n)
 			Socket_close(sock);
 			continue;
 		}
+		if (m->c->heldAcks > 0)
+			++commit_count;
 		if (rc == SOCKET_ERROR)
 		{
 			Log(TRACE_MINIMUM, -1, "Error from MQTTAsync_cycle() - removing socket %d", sock);
@@ -1504,31 +2134,6 @@ thread_return_type WINAPI MQTTAsync_receiveThread(void* n)
 		}
 		else
 		{
-			if (m->c->messageQueue->count > 0)
-			{
-				qEntry* qe = (qEntry*)(m->c->messageQueue->first->content);
-				int topicLen = qe->topicLen;
-
-				if (strlen(qe->topicName) == topicLen)
-					topicLen = 0;
-
-				if (m->ma)
-					rc = MQTTAsync_deliverMessage(m, qe->topicName, topicLen, qe->msg);
-				else 
-					rc = 1;
-					
-				if (rc)
-				{
-					ListRemove(m->c->messageQueue, qe);
-#if !defined(NO_PERSISTENCE)
-					if (m->c->persistence)
-						MQTTPersistence_unpersistQueueEntry(m->c, (MQTTPersistence_qEntry*)qe);
-#endif
-				}
-				else
-					Log(TRACE_MIN, -1, "False returned from messageArrived for client %s, message remains on queue",
-						m->c->clientID);
-			}
 			if (pack)
 			{
 				if (pack->header.bits.type == CONNACK)
@@ -1564,8 +2169,7 @@ thread_return_type WINAPI MQTTAsync_receiveThread(void* n)
 							
 							MQTTAsync_closeOnly(m->c);
 							/* put the connect command back to the head of the command queue, using the next serverURI */
-							conn = malloc(sizeof(MQTTAsync_queuedCommand));
-							memset(conn, '\0', sizeof(MQTTAsync_queuedCommand));
+							conn = MQTTAsync_newCommand();
 							conn->client = m;
 							conn->command = m->connect; 
 							Log(TRACE_MIN, -1, "Connect failed, more to try");
@@ -1599,8 +2203,7 @@ thread_return_type WINAPI MQTTAsync_receiveThread(void* n)
 						if (command->command.token == ((Suback*)pack)->msgId)
 						{	
 							Suback* sub = (Suback*)pack;
-							if (!ListDetach(m->responses, command)) /* remove the response from the list */
-								Log(LOG_ERROR, -1, "Subscribe command not removed from command list");
+							ListDetachElement(m->responses, &command->link); /* remove the response from the list */
 
 							/* Call the failure callback if there is one subscribe in the MQTT packet and
 							 * the return code is 0x80 (failure).  If the MQTT packet contains >1 subscription
@@ -1656,8 +2259,7 @@ thread_return_type WINAPI MQTTAsync_receiveThread(void* n)
 						MQTTAsync_queuedCommand* command = (MQTTAsync_queuedCommand*)(current->content);
 						if (command->command.token == ((Unsuback*)pack)->msgId)
 						{		
-							if (!ListDetach(m->responses, command)) /* remove the response from the list */
-								Log(LOG_ERROR, -1, "Unsubscribe command not removed from command list");
+							ListDetachElement(m->responses, &command->link); /* remove the response from the list */
 							if (command->command.onSuccess)
 							{
 								rc = MQTTProtocol_handleUnsubacks(pack, m->c->net.socket);
@@ -1758,119 +2360,694 @@ int MQTTAsync_setCallbacks(MQTTAsync handle, void* context,
 }
 
 
-void MQTTAsync_closeOnly(Clients* client)
+int MQTTAsync_setWritable(MQTTAsync handle, void* context, MQTTAsync_writable* ow)
 {
+	int rc = MQTTASYNC_SUCCESS;
+	MQTTAsyncs* m = handle;
+
 	FUNC_ENTRY;
-	client->good = 0;
-	client->ping_outstanding = 0;
-	if (client->net.socket > 0)
+	MQTTAsync_lock_mutex(mqttasync_mutex);
+
+	if (m == NULL)
+		rc = MQTTASYNC_FAILURE;
+	else
 	{
-		if (client->connected)
-			MQTTPacket_send_disconnect(&client->net, client->clientID);
-#if defined(OPENSSL)
-		SSLSocket_close(&client->net);
-#endif
-		Socket_close(client->net.socket);
-		client->net.socket = 0;
-#if defined(OPENSSL)
-		client->net.ssl = NULL;
-#endif
+		m->writable_context = context;
+		m->writable = ow;
 	}
-	client->connected = 0;
-	client->connect_state = 0;		
-	FUNC_EXIT;
+
+	MQTTAsync_unlock_mutex(mqttasync_mutex);
+	FUNC_EXIT_RC(rc);
+	return rc;
 }
 
 
-void MQTTAsync_closeSession(Clients* client)
+int MQTTAsync_setMessageArrivedBatch(MQTTAsync handle, void* context, MQTTAsync_messageArrivedBatch* mab,
+									int maxCount)
 {
-	FUNC_ENTRY;
-	MQTTAsync_closeOnly(client);
+	int rc = MQTTASYNC_SUCCESS;
+	MQTTAsyncs* m = handle;
 
-	if (client->cleansession)
-		MQTTAsync_cleanSession(client);
-		
-	FUNC_EXIT;
-}
+	FUNC_ENTRY;
+	MQTTAsync_lock_mutex(mqttasync_mutex);
 
+	if (m == NULL || (mab && maxCount < 1) || m->c->connected || m->c->connect_state != 0)
+		rc = MQTTASYNC_FAILURE;
+	else
+	{
+		if (m->arrived)
+			free(m->arrived);
+		m->arrived = (mab) ? malloc(sizeof(MQTTAsync_arrivedMessage) * maxCount) : NULL;
+		m->arrived_max = (mab) ? maxCount : 0;
+		m->mab_context = context;
+		m->mab = mab;
+	}
 
-/**
- * List callback function for comparing clients by client structure
- * @param a Async structure
- * @param b Client structure
- * @return boolean indicating whether a and b are equal
- */
-int clientStructCompare(void* a, void* b)
-{
-	MQTTAsyncs* m = (MQTTAsyncs*)a;
-	return m->c == (Clients*)b;
+	MQTTAsync_unlock_mutex(mqttasync_mutex);
+	FUNC_EXIT_RC(rc);
+	return rc;
 }
 
 
-int MQTTAsync_cleanSession(Clients* client)
+int MQTTAsync_setOfflineBuffer(MQTTAsync handle, const MQTTAsync_offlineOptions* options)
 {
-	int rc = 0;
-	ListElement* found = NULL;
+	int rc = MQTTASYNC_SUCCESS;
+	MQTTAsyncs* m = handle;
 
 	FUNC_ENTRY;
-#if !defined(NO_PERSISTENCE)
-	rc = MQTTPersistence_clear(client);
-#endif
-	MQTTProtocol_emptyMessageList(client->inboundMsgs);
-	MQTTProtocol_emptyMessageList(client->outboundMsgs);
-	MQTTAsync_emptyMessageQueue(client);
-	client->msgID = 0;
-	
-	if ((found = ListFindItem(handles, client, clientStructCompare)) != NULL)
+	if (m == NULL)
 	{
-		MQTTAsyncs* m = (MQTTAsyncs*)(found->content);
-		MQTTAsync_removeResponsesAndCommands(m);
+		rc = MQTTASYNC_FAILURE;
+		goto exit;
 	}
-	else
-		Log(LOG_ERROR, -1, "cleanSession: did not find client structure in handles list");
+	if (options && (strncmp(options->struct_id, "MQTO", 4) != 0 || options->struct_version != 0 ||
+		options->maxMessages < 0 || options->maxBytes < 0 || options->replayRate < 0))
+	{
+		rc = MQTTASYNC_BAD_STRUCTURE;
+		goto exit;
+	}
+	MQTTAsync_lock_mutex(mqttasync_mutex);
+	MQTTAsync_lock_mutex(mqttcommand_mutex);
+	m->offline_buffer = (options != NULL);
+	m->offline_max_messages = (options) ? options->maxMessages : 0;
+	m->offline_max_bytes = (options) ? options->maxBytes : 0;
+	m->replay_rate = (options) ? options->replayRate : 0;
+	if (m->replay_rate == 0)
+		m->replay_count = 0;
+	MQTTAsync_unlock_mutex(mqttcommand_mutex);
+	MQTTAsync_unlock_mutex(mqttasync_mutex);
+exit:
 	FUNC_EXIT_RC(rc);
 	return rc;
 }
 
 
-
-
-
-int MQTTAsync_deliverMessage(MQTTAsyncs* m, char* topicName, size_t topicLen, MQTTAsync_message* mm)
+int MQTTAsync_setReplayOptions(MQTTAsync handle, const MQTTAsync_replayOptions* options)
 {
-	int rc;
-					
-	Log(TRACE_MIN, -1, "Calling messageArrived for client %s, queue depth %d",
-					m->c->clientID, m->c->messageQueue->count);
-	rc = (*(m->ma))(m->context, topicName, topicLen, mm);
-	/* if 0 (false) is returned by the callback then it failed, so we don't remove the message from
-	 * the queue, and it will be retried later.  If 1 is returned then the message data may have been freed,
-	 * so we must be careful how we use it.
-	 */
+	int rc = MQTTASYNC_SUCCESS;
+	MQTTAsyncs* m = handle;
+	thread_id_type thread_id = 0;
+	int locked = 0;
+
+	FUNC_ENTRY;
+	if (m == NULL)
+	{
+		rc = MQTTASYNC_FAILURE;
+		goto exit;
+	}
+	if (options && (strncmp(options->struct_id, "MQTP", 4) != 0 || options->struct_version != 0 ||
+		options->maxBytes < 0 || options->maxRate < 0))
+	{
+		rc = MQTTASYNC_BAD_STRUCTURE;
+		goto exit;
+	}
+	/* We might be called in a callback. In which case, this mutex will be already locked. */
+	thread_id = Thread_getid();
+	if (thread_id != sendThread_id && thread_id != receiveThread_id)
+	{
+		MQTTAsync_lock_mutex(mqttasync_mutex);
+		locked = 1;
+	}
+	m->c->replayBytes = (options) ? options->maxBytes : 0;
+	m->c->replayRate = (options) ? options->maxRate : 0;
+	if (locked)
+		MQTTAsync_unlock_mutex(mqttasync_mutex);
+exit:
+	FUNC_EXIT_RC(rc);
 	return rc;
 }
 
 
-void Protocol_processPublication(Publish* publish, Clients* client)
+int MQTTAsync_getReplayProgress(MQTTAsync handle, MQTTAsync_replayProgress* progress)
 {
-	MQTTAsync_message* mm = NULL;
-	int rc = 0;
+	int rc = MQTTASYNC_SUCCESS;
+	MQTTAsyncs* m = handle;
+	thread_id_type thread_id = 0;
+	int locked = 0;
 
 	FUNC_ENTRY;
-	mm = malloc(sizeof(MQTTAsync_message));
-
-	/* If the message is QoS 2, then we have already stored the incoming payload
-	 * in an allocated buffer, so we don't need to copy again.
-	 */
-	if (publish->header.bits.qos == 2)
-		mm->payload = publish->payload;
-	else
+	if (m == NULL || progress == NULL)
 	{
-		mm->payload = malloc(publish->payloadlen);
-		memcpy(mm->payload, publish->payload, publish->payloadlen);
-	}
+		rc = MQTTASYNC_FAILURE;
+		goto exit;
+	}
+	/* We might be called in a callback. In which case, this mutex will be already locked. */
+	thread_id = Thread_getid();
+	if (thread_id != sendThread_id && thread_id != receiveThread_id)
+	{
+		MQTTAsync_lock_mutex(mqttasync_mutex);
+		locked = 1;
+	}
+	progress->total = m->c->replayTotal;
+	progress->sent = m->c->replaySent;
+	progress->remaining = (m->c->replayNext) ? m->c->replayTotal - m->c->replaySent : 0;
+	if (locked)
+		MQTTAsync_unlock_mutex(mqttasync_mutex);
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+int MQTTAsync_setDurability(MQTTAsync handle, const MQTTAsync_durabilityOptions* options)
+{
+	int rc = MQTTASYNC_SUCCESS;
+	MQTTAsyncs* m = handle;
+	thread_id_type thread_id = 0;
+	int locked = 0;
+	int mode = (options) ? options->mode : MQTTASYNC_DURABILITY_NONE;
+
+	FUNC_ENTRY;
+	if (m == NULL)
+	{
+		rc = MQTTASYNC_FAILURE;
+		goto exit;
+	}
+	if (options && (strncmp(options->struct_id, "MQTD", 4) != 0 || options->struct_version != 0 ||
+		mode < MQTTASYNC_DURABILITY_NONE || mode > MQTTASYNC_DURABILITY_BATCH ||
+		(mode == MQTTASYNC_DURABILITY_INTERVAL && options->interval <= 0)))
+	{
+		rc = MQTTASYNC_BAD_STRUCTURE;
+		goto exit;
+	}
+	if (mode != MQTTASYNC_DURABILITY_NONE && !MQTTPersistence_syncable(m->c))
+	{
+		rc = MQTTASYNC_PERSISTENCE_ERROR;
+		goto exit;
+	}
+	/* We might be called in a callback. In which case, this mutex will be already locked. */
+	thread_id = Thread_getid();
+	if (thread_id != sendThread_id && thread_id != receiveThread_id)
+	{
+		MQTTAsync_lock_mutex(mqttasync_mutex);
+		locked = 1;
+	}
+	Timer_cancel(&state.timers, &m->sync_timer);
+	if (m->c->heldAcks > 0 && mode != MQTTASYNC_DURABILITY_BATCH)
+	{	/* no longer waiting for syncs */
+		MQTTPersistence_sync(m->c);
+		MQTTProtocol_releaseAcks(m->c);
+	}
+	m->durability = mode;
+	m->sync_interval = (mode == MQTTASYNC_DURABILITY_INTERVAL) ? options->interval : 0;
+	m->c->syncAcks = (mode == MQTTASYNC_DURABILITY_BATCH);
+	if (m->sync_interval > 0)
+		Timer_setIn(&state.timers, &m->sync_timer, m->sync_interval);
+	MQTTAsync_countDurability();
+	if (locked)
+		MQTTAsync_unlock_mutex(mqttasync_mutex);
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+int MQTTAsync_snapshot(MQTTAsync handle)
+{
+	int rc = MQTTASYNC_SUCCESS;
+	MQTTAsyncs* m = handle;
+	thread_id_type thread_id = 0;
+	int locked = 0;
+
+	FUNC_ENTRY;
+	if (m == NULL)
+	{
+		rc = MQTTASYNC_FAILURE;
+		goto exit;
+	}
+	/* We might be called in a callback. In which case, this mutex will be already locked. */
+	thread_id = Thread_getid();
+	if (thread_id != sendThread_id && thread_id != receiveThread_id)
+	{
+		MQTTAsync_lock_mutex(mqttasync_mutex);
+		locked = 1;
+	}
+	if (MQTTPersistence_snapshot(m->c) != 0)
+		rc = MQTTASYNC_PERSISTENCE_ERROR;
+	if (locked)
+		MQTTAsync_unlock_mutex(mqttasync_mutex);
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+int MQTTAsync_getInboundStats(MQTTAsync handle, MQTTAsync_inboundStats* stats)
+{
+	int rc = MQTTASYNC_SUCCESS;
+	MQTTAsyncs* m = handle;
+	thread_id_type thread_id = 0;
+	int locked = 0;
+
+	FUNC_ENTRY;
+	if (m == NULL || stats == NULL)
+	{
+		rc = MQTTASYNC_FAILURE;
+		goto exit;
+	}
+	/* We might be called in a callback. In which case, this mutex will be already locked. */
+	thread_id = Thread_getid();
+	if (thread_id != sendThread_id && thread_id != receiveThread_id)
+	{
+		MQTTAsync_lock_mutex(mqttasync_mutex);
+		locked = 1;
+	}
+	stats->queuedMessages = m->c->messageQueue->count;
+	stats->queuedBytes = m->inbound_bytes;
+	stats->droppedMessages = m->inbound_dropped;
+	stats->droppedBytes = m->inbound_dropped_bytes;
+	stats->oversizedPackets = m->c->net.oversizedPackets;
+	stats->pauses = m->inbound_pauses;
+	if (locked)
+		MQTTAsync_unlock_mutex(mqttasync_mutex);
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+int MQTTAsync_setCompression(MQTTAsync handle, int count, MQTTAsync_compressionOptions* options)
+{
+	int rc = MQTTASYNC_SUCCESS;
+	MQTTAsyncs* m = handle;
+	MQTTCompression* compression = NULL;
+	int i;
+
+	FUNC_ENTRY;
+	if (m == NULL || count < 0 || (count > 0 && options == NULL))
+	{
+		rc = MQTTASYNC_FAILURE;
+		goto exit;
+	}
+	for (i = 0; i < count; ++i)
+	{
+		if (strncmp(options[i].struct_id, "MQTZ", 4) != 0 || options[i].struct_version != 0 ||
+			options[i].topicFilter == NULL)
+		{
+			rc = MQTTASYNC_BAD_STRUCTURE;
+			goto exit;
+		}
+		if (!UTF8_validateString(options[i].topicFilter))
+		{
+			rc = MQTTASYNC_BAD_UTF8_STRING;
+			goto exit;
+		}
+	}
+	if (count > 0)
+	{
+		compression = MQTTCompression_create(count);
+		for (i = 0; i < count; ++i)
+		{
+			if (MQTTCompression_setFilter(compression, i, options[i].topicFilter, options[i].minBytes,
+				options[i].level, options[i].dictionary, options[i].dictionaryLen) != 0)
+			{
+				MQTTCompression_free(compression);
+				rc = MQTTASYNC_BAD_STRUCTURE;
+				goto exit;
+			}
+		}
+	}
+
+	MQTTAsync_lock_mutex(mqttasync_mutex);
+	if (m->c->connected || m->c->connect_state != 0)
+	{
+		rc = MQTTASYNC_FAILURE;
+		if (compression)
+			MQTTCompression_free(compression);
+	}
+	else
+	{
+		if (m->compression)
+			MQTTCompression_free(m->compression);
+		m->compression = compression;
+	}
+	MQTTAsync_unlock_mutex(mqttasync_mutex);
+
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+void MQTTAsync_closeOnly(Clients* client)
+{
+	FUNC_ENTRY;
+	client->good = 0;
+	client->ping_outstanding = 0;
+	client->net.readPaused = 0; /* the socket is removed from the read set anyway */
+	MQTTProtocol_stopReplay(client); /* in-flight messages are resent from the start on reconnect */
+	if (client->net.socket > 0)
+	{
+		if (client->connected)
+			MQTTPacket_send_disconnect(&client->net, client->clientID);
+#if defined(OPENSSL)
+		SSLSocket_close(&client->net);
+#endif
+		Socket_close(client->net.socket);
+		client->net.socket = 0;
+#if defined(OPENSSL)
+		client->net.ssl = NULL;
+#endif
+	}
+	client->connected = 0;
+	client->connect_state = 0;		
+	if (client->heldAcks > 0)
+		MQTTProtocol_releaseAcks(client); /* dropped: the server sends the messages again */
+	FUNC_EXIT;
+}
+
+
+void MQTTAsync_closeSession(Clients* client)
+{
+	FUNC_ENTRY;
+	MQTTAsync_closeOnly(client);
 
-	mm->payloadlen = publish->payloadlen;
+	if (client->cleansession)
+		MQTTAsync_cleanSession(client);
+		
+	FUNC_EXIT;
+}
+
+
+/**
+ * List callback function for comparing clients by client structure
+ * @param a Async structure
+ * @param b Client structure
+ * @return boolean indicating whether a and b are equal
+ */
+int clientStructCompare(void* a, void* b)
+{
+	MQTTAsyncs* m = (MQTTAsyncs*)a;
+	return m->c == (Clients*)b;
+}
+
+
+int MQTTAsync_cleanSession(Clients* client)
+{
+	int rc = 0;
+	ListElement* found = NULL;
+
+	FUNC_ENTRY;
+#if !defined(NO_PERSISTENCE)
+	rc = MQTTPersistence_clear(client);
+#endif
+	MQTTProtocol_stopReplay(client);
+	MQTTProtocol_emptyMessageList(client->inboundMsgs);
+	MQTTProtocol_emptyMessageList(client->outboundMsgs);
+	MQTTAsync_emptyMessageQueue(client);
+	client->msgID = 0;
+	
+	if ((found = ListFindItem(handles, client, clientStructCompare)) != NULL)
+	{
+		MQTTAsyncs* m = (MQTTAsyncs*)(found->content);
+		MQTTAsync_removeResponsesAndCommands(m, m->offline_buffer);
+#if !defined(NO_PERSISTENCE)
+		if (m->offline_buffer && client->persistence)
+		{	/* the buffered publications were cleared from persistence with the session */
+			ListElement* current = NULL;
+
+			while (ListNextElement(commands, &current))
+			{
+				MQTTAsync_queuedCommand* cmd = (MQTTAsync_queuedCommand*)(current->content);
+
+				if (cmd->client == m)
+					MQTTAsync_persistCommand(cmd);
+			}
+		}
+#endif
+	}
+	else
+		Log(LOG_ERROR, -1, "cleanSession: did not find client structure in handles list");
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+
+
+
+int MQTTAsync_deliverMessage(MQTTAsyncs* m, char* topicName, size_t topicLen, MQTTAsync_message* mm)
+{
+	int rc;
+					
+	Log(TRACE_MIN, -1, "Calling messageArrived for client %s, queue depth %d",
+					m->c->clientID, m->c->messageQueue->count);
+	rc = (*(m->ma))(m->context, topicName, topicLen, mm);
+	/* if 0 (false) is returned by the callback then it failed, so we don't remove the message from
+	 * the queue, and it will be retried later.  If 1 is returned then the message data may have been freed,
+	 * so we must be careful how we use it.
+	 */
+	return rc;
+}
+
+
+/**
+ * The bytes a queued message counts against the client's inbound limit
+ * @param qe the queue entry, whose message still belongs to the queue
+ * @return the number of bytes
+ */
+static int MQTTAsync_qEntrySize(qEntry* qe)
+{
+	return (int)sizeof(qEntry) + (int)sizeof(MQTTAsync_message) + qe->msg->payloadlen + qe->topicLen + 1;
+}
+
+
+/**
+ * Count the bytes of the messages on the queue of a client, such as those restored from persistence.
+ * @param m the client handle
+ */
+static void MQTTAsync_countInbound(MQTTAsyncs* m)
+{
+	ListElement* current = NULL;
+
+	m->inbound_bytes = 0;
+	while (ListNextElement(m->c->messageQueue, &current))
+	{
+		qEntry* qe = (qEntry*)(current->content);
+
+		qe->size = MQTTAsync_qEntrySize(qe);
+		m->inbound_bytes += qe->size;
+	}
+}
+
+
+/**
+ * Would a message of this size take the queue of a client past its limits?
+ * @param m the client handle
+ * @param size the bytes of the message to be queued, or 0 to check whether the queue is already full
+ * @return boolean
+ */
+static int MQTTAsync_inboundFull(MQTTAsyncs* m, int size)
+{
+	int count = m->c->messageQueue->count;
+
+	if (size == 0)
+		return (m->inbound_max_messages > 0 && count >= m->inbound_max_messages) ||
+			(m->inbound_max_bytes > 0 && m->inbound_bytes >= m->inbound_max_bytes);
+	return (m->inbound_max_messages > 0 && count + 1 > m->inbound_max_messages) ||
+		(m->inbound_max_bytes > 0 && m->inbound_bytes + size > m->inbound_max_bytes);
+}
+
+
+/**
+ * Free a message that is dropped because the queue is full, and count it.
+ * @param m the client handle
+ * @param topic the topic of the message
+ * @param mm the message
+ * @param size the bytes of the message
+ */
+static void MQTTAsync_dropMessage(MQTTAsyncs* m, char* topic, MQTTAsync_message* mm, int size)
+{
+	Log(TRACE_MIN, -1, "Inbound queue full for client %s, dropping message of QoS %d on %s",
+		m->c->clientID, mm->qos, topic);
+	++(m->inbound_dropped);
+	m->inbound_dropped_bytes += size;
+	free(topic);
+	MQTTAsync_freeMessage(&mm);
+}
+
+
+/**
+ * Make room on the queue of a client for a message of this size by dropping the oldest QoS 0 messages.
+ * @param m the client handle
+ * @param size the bytes of the message to be queued
+ * @return boolean - is there room now?
+ */
+static int MQTTAsync_dropOldest(MQTTAsyncs* m, int size)
+{
+	List* queue = m->c->messageQueue;
+	ListElement* current = queue->first;
+
+	while (current && MQTTAsync_inboundFull(m, size))
+	{
+		qEntry* qe = (qEntry*)(current->content);
+
+		current = current->next;
+		if (qe->msg->qos != 0)
+			continue;
+		ListDetachElement(queue, &qe->link);
+#if !defined(NO_PERSISTENCE)
+		if (m->c->persistence)
+			MQTTPersistence_unpersistQueueEntry(m->c, (MQTTPersistence_qEntry*)qe);
+#endif
+		m->inbound_bytes -= qe->size;
+		MQTTAsync_dropMessage(m, qe->topicName, qe->msg, qe->size);
+		free(qe);
+	}
+	return !MQTTAsync_inboundFull(m, size);
+}
+
+
+/**
+ * Pass the messages on the queue of a client to the application, for as long as it takes
+ * any, up to the client's limit at a time if it takes them in batches.
+ * Called on the receive thread, with the mutex locked.
+ * @param m the client handle
+ * @return the number of messages left on the queue
+ */
+static int MQTTAsync_drainMessageQueue(MQTTAsyncs* m)
+{
+	List* queue = m->c->messageQueue;
+
+	FUNC_ENTRY;
+	while (queue->count > 0 && m->c->connected)
+	{
+		int offered = 0, taken = 0;
+
+		if (m->mab)
+		{
+			ListElement* current = NULL;
+
+			while (offered < m->arrived_max && ListNextElement(queue, &current))
+			{
+				qEntry* qe = (qEntry*)(current->content);
+
+				m->arrived[offered].topicName = qe->topicName;
+				m->arrived[offered].topicLen = (strlen(qe->topicName) == qe->topicLen) ? 0 : qe->topicLen;
+				m->arrived[offered].message = qe->msg;
+				++offered;
+			}
+			Log(TRACE_MIN, -1, "Calling messageArrivedBatch for client %s with %d messages, queue depth %d",
+				m->c->clientID, offered, queue->count);
+			taken = (*(m->mab))(m->mab_context, m->arrived, offered);
+			if (taken < 0)
+				taken = 0;
+			else if (taken > offered)
+				taken = offered;
+		}
+		else
+		{
+			qEntry* qe = (qEntry*)(queue->first->content);
+			int topicLen = (strlen(qe->topicName) == qe->topicLen) ? 0 : qe->topicLen;
+
+			offered = 1;
+			if (m->ma)
+				taken = MQTTAsync_deliverMessage(m, qe->topicName, topicLen, qe->msg) ? 1 : 0;
+			else
+			{	/* nobody to take it */
+				free(qe->topicName);
+				MQTTAsync_freeMessage(&qe->msg);
+				taken = 1;
+			}
+		}
+
+		if (taken == 0)
+		{
+			Log(TRACE_MIN, -1, "messageArrived did not take %d messages for client %s, they remain on queue",
+				offered, m->c->clientID);
+			break;
+		}
+		while (taken-- > 0)
+		{
+			qEntry* qe = ListDetachHeadElement(queue);
+#if !defined(NO_PERSISTENCE)
+			if (m->c->persistence)
+				MQTTPersistence_unpersistQueueEntry(m->c, (MQTTPersistence_qEntry*)qe);
+#endif
+			m->inbound_bytes -= qe->size;
+			free(qe);
+		}
+	}
+	if (m->c->net.readPaused && !MQTTAsync_inboundFull(m, 0))
+	{
+		Log(TRACE_MIN, -1, "Resuming reading for client %s, queue depth %d", m->c->clientID, queue->count);
+		Socket_resumeReading(m->c->net.socket);
+		m->c->net.readPaused = 0;
+	}
+	FUNC_EXIT_RC(queue->count);
+	return queue->count;
+}
+
+
+/**
+ * Pass the messages queued for all the clients to the application, for as long as it takes them.
+ * Called on the receive thread, with the mutex locked.
+ * @return boolean - are any messages left on the queues, because the application did not take them?
+ */
+static int MQTTAsync_drainMessageQueues(void)
+{
+	ListElement* current = NULL;
+	int left = 0;
+
+	while (ListNextElement(handles, &current))
+	{
+		MQTTAsyncs* m = (MQTTAsyncs*)(current->content);
+
+		if (m->c && m->c->messageQueue->count > 0 && MQTTAsync_drainMessageQueue(m) > 0)
+			left = 1;
+	}
+	return left;
+}
+
+
+/**
+ * Create the message passed to the application for a publication received, decompressing
+ * the payload if it was compressed for a topic filter of the client.
+ * @param m the client handle, or NULL if it was not found
+ * @param publish the publication
+ * @param payload the payload of the message, which is within that of the publication if it
+ * is a batch
+ * @param payloadlen the length of the payload of the message
+ * @param owned boolean - does the payload belong to the message, if it is not in an input buffer?
+ * @return the message
+ */
+static MQTTAsync_message* MQTTAsync_newMessage(MQTTAsyncs* m, Publish* publish, char* payload, int payloadlen, int owned)
+{
+	MQTTAsync_receivedMessage* received = malloc(sizeof(MQTTAsync_receivedMessage));
+	MQTTAsync_message* mm = &received->msg;
+	char* inflated = NULL;
+	int maxlen = MQTTCOMPRESSION_MAX_INFLATED;
+
+	if (m && m->c->net.maxInboundPacket > 0 && m->c->net.maxInboundPacket < maxlen)
+		maxlen = m->c->net.maxInboundPacket;
+	if (m && m->inbound_max_bytes > 0 && m->inbound_max_bytes < maxlen)
+		maxlen = m->inbound_max_bytes;
+	if (m && m->compression &&
+		MQTTCompression_inflate(m->compression, publish->topic, payload, payloadlen, maxlen, &inflated, &payloadlen))
+	{
+		if (owned && publish->buffer == NULL)
+			free(payload);
+		mm->payload = inflated;
+		received->buffer = NULL;
+	}
+	else if (publish->buffer)
+	{
+		mm->payload = payload;
+		received->buffer = SocketBuffer_retainData(publish->buffer);
+	}
+	else if (owned)
+	{
+		mm->payload = payload;
+		received->buffer = NULL;
+	}
+	else
+	{
+		mm->payload = malloc(payloadlen);
+		memcpy(mm->payload, payload, payloadlen);
+		received->buffer = NULL;
+	}
+
+	mm->payloadlen = payloadlen;
 	mm->qos = publish->header.bits.qos;
 	mm->retained = publish->header.bits.retain;
 	if (publish->header.bits.qos == 2)
@@ -1878,33 +3055,149 @@ void Protocol_processPublication(Publish* publish, Clients* client)
 	else
 		mm->dup = publish->header.bits.dup;
 	mm->msgid = publish->msgId;
-	
-	if (client->messageQueue->count == 0 && client->connected)
+	return mm;
+}
+
+
+/**
+ * Pass a message to the messageArrived callback, after any messages queued before it, or
+ * queue it if it is not taken or earlier messages are still queued.
+ * @param client the client the message arrived for
+ * @param m the client handle, or NULL if it was not found
+ * @param topic the topic, which passes to the application or the queue
+ * @param topiclen the length of the topic
+ * @param mm the message
+ */
+static void MQTTAsync_arrived(Clients* client, MQTTAsyncs* m, char* topic, int topiclen, MQTTAsync_message* mm)
+{
+	int rc = 0;
+
+	/* the messages queued before this one go first, as many as the application will take now */
+	if (m && client->messageQueue->count > 0)
+		MQTTAsync_drainMessageQueue(m);
+
+	if (m && client->messageQueue->count == 0 && client->connected)
 	{
-		ListElement* found = NULL;
-		
-		if ((found = ListFindItem(handles, client, clientStructCompare)) == NULL)
-			Log(LOG_ERROR, -1, "processPublication: did not find client structure in handles list");
-		else
+		if (m->mab)
 		{
-			MQTTAsyncs* m = (MQTTAsyncs*)(found->content);
+			MQTTAsync_arrivedMessage arrived;
 
-			if (m->ma)
-				rc = MQTTAsync_deliverMessage(m, publish->topic, publish->topiclen, mm);
-		} 
+			arrived.topicName = topic;
+			arrived.topicLen = topiclen;
+			arrived.message = mm;
+			rc = ((*(m->mab))(m->mab_context, &arrived, 1) > 0);
+		}
+		else if (m->ma)
+			rc = MQTTAsync_deliverMessage(m, topic, topiclen, mm);
 	}
 
 	if (rc == 0) /* if message was not delivered, queue it up */
 	{
 		qEntry* qe = malloc(sizeof(qEntry));	
 		qe->msg = mm;
-		qe->topicName = publish->topic;
-		qe->topicLen = publish->topiclen;
-		ListAppend(client->messageQueue, qe, sizeof(qe) + sizeof(mm) + mm->payloadlen + strlen(qe->topicName)+1);
+		qe->topicName = topic;
+		qe->topicLen = topiclen;
+		qe->size = MQTTAsync_qEntrySize(qe);
+		if (m && m->inbound_policy != MQTTASYNC_INBOUND_PAUSE && MQTTAsync_inboundFull(m, qe->size))
+		{
+			if (m->inbound_policy == MQTTASYNC_INBOUND_DROP_NEWEST ||
+				(!MQTTAsync_dropOldest(m, qe->size) && mm->qos == 0))
+			{
+				MQTTAsync_dropMessage(m, topic, mm, qe->size);
+				free(qe);
+				goto exit;
+			}
+		}
+		ListAppendNoMalloc(client->messageQueue, qe, &qe->link, sizeof(qe) + sizeof(mm) + mm->payloadlen + strlen(qe->topicName)+1);
+		if (m)
+			m->inbound_bytes += qe->size;
 #if !defined(NO_PERSISTENCE)
 		if (client->persistence)
 			MQTTPersistence_persistQueueEntry(client, (MQTTPersistence_qEntry*)qe);
 #endif
+		if (m && m->inbound_policy == MQTTASYNC_INBOUND_PAUSE && !client->net.readPaused && MQTTAsync_inboundFull(m, 0))
+		{
+			Log(TRACE_MIN, -1, "Inbound queue full for client %s, pausing reading", client->clientID);
+			Socket_pauseReading(client->net.socket);
+			client->net.readPaused = 1;
+			client->ping_outstanding = 0; /* its PINGRESP cannot be read until reading resumes */
+			++(m->inbound_pauses);
+		}
+	}
+exit:
+	return;
+}
+
+
+/**
+ * Count the messages in a batch of publications, checking that they fill it exactly.
+ * @param payload the payload of a publication
+ * @param payloadlen the length of the payload
+ * @return the number of messages, or 0 if the payload is not a batch
+ */
+static int MQTTAsync_batchCount(char* payload, int payloadlen)
+{
+	char* ptr = payload + MQTTASYNC_BATCH_MARKER_LEN;
+	char* enddata = payload + payloadlen;
+	int count = 0;
+
+	if (payloadlen <= MQTTASYNC_BATCH_MARKER_LEN ||
+		memcmp(payload, MQTTAsync_batchMarker, MQTTASYNC_BATCH_MARKER_LEN) != 0)
+		return 0;
+	while (ptr < enddata)
+	{
+		int len = 0;
+
+		if (MQTTPacket_decodeBuf(&ptr, enddata, &len) == 0 || len > enddata - ptr)
+			return 0;
+		ptr += len;
+		++count;
+	}
+	return count;
+}
+
+
+void Protocol_processPublication(Publish* publish, Clients* client)
+{
+	MQTTAsyncs* m = NULL;
+	ListElement* found = NULL;
+	int count = 0;
+
+	FUNC_ENTRY;
+	if ((found = ListFindItem(handles, client, clientStructCompare)) == NULL)
+		Log(LOG_ERROR, -1, "processPublication: did not find client structure in handles list");
+	else
+		m = (MQTTAsyncs*)(found->content);
+
+	if (m && m->batch_unpack && (count = MQTTAsync_batchCount(publish->payload, publish->payloadlen)) > 0)
+	{	/* each message of a batch is passed on as if it had been published on its own */
+		char* ptr = publish->payload + MQTTASYNC_BATCH_MARKER_LEN;
+		char* enddata = publish->payload + publish->payloadlen;
+		int i;
+
+		for (i = 0; i < count; ++i)
+		{
+			int len = 0;
+			/* copy the topic before the original is passed on with the last message */
+			char* topic = (i < count - 1) ? MQTTStrdup(publish->topic) : publish->topic;
+
+			MQTTPacket_decodeBuf(&ptr, enddata, &len);
+			MQTTAsync_arrived(client, m, topic, publish->topiclen, MQTTAsync_newMessage(m, publish, ptr, len, 0));
+			ptr += len;
+		}
+		if (publish->buffer == NULL && publish->header.bits.qos == 2)
+			free(publish->payload); /* it was passed to us, and the messages have their own copies */
+	}
+	else
+	{
+		/* The payload is normally left in the input buffer it was read into, which the message keeps
+		 * a reference to.  If the message is QoS 2 and restored from persistence, then we have already
+		 * stored the incoming payload in an allocated buffer, so we don't need to copy again.
+		 */
+		MQTTAsync_message* mm = MQTTAsync_newMessage(m, publish, publish->payload, publish->payloadlen,
+			publish->header.bits.qos == 2);
+
+		MQTTAsync_arrived(client, m, publish->topic, publish->topiclen, mm);
 	}
 	publish->topic = NULL;	
 	FUNC_EXIT;
@@ -1926,7 +3219,8 @@ int MQTTAsync_connect(MQTTAsync handle, const MQTTAsync_connectOptions* options)
 
 	if (strncmp(options->struct_id, "MQTC", 4) != 0 || 
 		(options->struct_version != 0 && options->struct_version != 1 && options->struct_version != 2 && 
-         options->struct_version != 3))
+         options->struct_version != 3 && options->struct_version != 4 && options->struct_version != 5 &&
+         options->struct_version != 6 && options->struct_version != 7))
 	{
 		rc = MQTTASYNC_BAD_STRUCTURE;
 		goto exit;
@@ -1952,6 +3246,23 @@ int MQTTAsync_connect(MQTTAsync handle, const MQTTAsync_connectOptions* options)
 			goto exit;
 		}
 	}
+	if (options->struct_version >= 6 && options->batch) /* check validity of batch options structure */
+	{
+		if (strncmp(options->batch->struct_id, "MQTB", 4) != 0 || options->batch->struct_version != 0)
+		{
+			rc = MQTTASYNC_BAD_STRUCTURE;
+			goto exit;
+		}
+	}
+	if (options->struct_version >= 7 && options->inbound) /* check validity of inbound options structure */
+	{
+		if (strncmp(options->inbound->struct_id, "MQTI", 4) != 0 || options->inbound->struct_version != 0 ||
+			options->inbound->policy < MQTTASYNC_INBOUND_DROP_OLDEST_QOS0 || options->inbound->policy > MQTTASYNC_INBOUND_PAUSE)
+		{
+			rc = MQTTASYNC_BAD_STRUCTURE;
+			goto exit;
+		}
+	}
 	if ((options->username && !UTF8_validateString(options->username)) ||
 		(options->password && !UTF8_validateString(options->password)))
 	{
@@ -1982,10 +3293,41 @@ int MQTTAsync_connect(MQTTAsync handle, const MQTTAsync_connectOptions* options)
 	m->c->keepAliveInterval = options->keepAliveInterval;
 	m->c->cleansession = options->cleansession;
 	m->c->maxInflightMessages = options->maxInflight;
-	if (options->struct_version == 3)
+	if (options->struct_version >= 3)
 		m->c->MQTTVersion = options->MQTTVersion;
 	else
 		m->c->MQTTVersion = 0;
+	if (options->struct_version >= 4)
+	{
+		m->max_queued_bytes = options->maxQueuedBytes;
+		m->low_water_bytes = (options->lowWatermarkBytes > 0) ? options->lowWatermarkBytes : options->maxQueuedBytes / 2;
+	}
+	else
+		m->max_queued_bytes = m->low_water_bytes = 0;
+	m->c->topicAliasMaximum = 0;
+	if (options->struct_version >= 5 && options->topicAliasMaximum > 0)
+		m->c->topicAliasMaximum = (options->topicAliasMaximum > 65535) ? 65535 : options->topicAliasMaximum;
+	m->batch_messages = m->batch_bytes = m->batch_unpack = 0;
+	if (options->struct_version >= 6 && options->batch)
+	{
+		if (options->batch->maxMessages > 1 && options->batch->maxBytes > MQTTASYNC_BATCH_MARKER_LEN)
+		{
+			m->batch_messages = options->batch->maxMessages;
+			m->batch_bytes = options->batch->maxBytes;
+			m->batch_linger = (options->batch->lingerMicros > 0) ? options->batch->lingerMicros : 0;
+		}
+		m->batch_unpack = options->batch->unpack;
+	}
+	m->inbound_max_messages = m->inbound_max_bytes = m->c->net.maxInboundPacket = 0;
+	m->inbound_policy = MQTTASYNC_INBOUND_DROP_OLDEST_QOS0;
+	if (options->struct_version >= 7 && options->inbound)
+	{
+		m->inbound_max_messages = (options->inbound->maxMessages > 0) ? options->inbound->maxMessages : 0;
+		m->inbound_max_bytes = (options->inbound->maxBytes > 0) ? options->inbound->maxBytes : 0;
+		m->c->net.maxInboundPacket = (options->inbound->maxPacketSize > 0) ? options->inbound->maxPacketSize : 0;
+		m->inbound_policy = options->inbound->policy;
+	}
+	MQTTAsync_countInbound(m);
 
 	if (m->c->will)
 	{
@@ -2044,8 +3386,7 @@ int MQTTAsync_connect(MQTTAsync handle, const MQTTAsync_connectOptions* options)
 	m->c->retryInterval = options->retryInterval;
 	
 	/* Add connect request to operation queue */
-	conn = malloc(sizeof(MQTTAsync_queuedCommand));
-	memset(conn, '\0', sizeof(MQTTAsync_queuedCommand));
+	conn = MQTTAsync_newCommand();
 	conn->client = m;
 	if (options)
 	{
@@ -2091,10 +3432,25 @@ int MQTTAsync_disconnect1(MQTTAsync handle, const MQTTAsync_disconnectOptions* o
 		rc = MQTTASYNC_DISCONNECTED;
 		goto exit;
 	}
+	if (!internal && m->batch_messages > 0)
+	{	/* send the publications waiting in batches before disconnecting */
+		thread_id_type thread_id = Thread_getid();
+		int locked = 0;
+
+		if (thread_id != sendThread_id && thread_id != receiveThread_id)
+		{
+			MQTTAsync_lock_mutex(mqttasync_mutex);
+			locked = 1;
+		}
+		MQTTAsync_lock_mutex(mqttcommand_mutex);
+		MQTTAsync_flushBatches(m);
+		MQTTAsync_unlock_mutex(mqttcommand_mutex);
+		if (locked)
+			MQTTAsync_unlock_mutex(mqttasync_mutex);
+	}
 	
 	/* Add disconnect request to operation queue */
-	dis = malloc(sizeof(MQTTAsync_queuedCommand));
-	memset(dis, '\0', sizeof(MQTTAsync_queuedCommand));
+	dis = MQTTAsync_newCommand();
 	dis->client = m;
 	if (options)
 	{
@@ -2157,31 +3513,21 @@ int cmdMessageIDCompare(void* a, void* b)
 
 
 /**
- * Assign a new message id for a client.  Make sure it isn't already being used and does
- * not exceed the maximum.
+ * Find a message id for a client which isn't already being used.  mqttasync_mutex must be locked.
  * @param m a client structure
  * @return the next message id to use, or 0 if none available
  */
-int MQTTAsync_assignMsgId(MQTTAsyncs* m)
+static int MQTTAsync_nextMsgId(MQTTAsyncs* m)
 {
 	int start_msgid = m->c->msgID;
 	int msgid = start_msgid;
-	thread_id_type thread_id = 0;
-	int locked = 0;
-
-	/* need to check: commands list and response list for a client */
-	FUNC_ENTRY;
-	/* We might be called in a callback. In which case, this mutex will be already locked. */
-	thread_id = Thread_getid();
-	if (thread_id != sendThread_id && thread_id != receiveThread_id)
-	{
-		MQTTAsync_lock_mutex(mqttasync_mutex);
-		locked = 1;
-	}
 
+	/* need to check: commands list, batches and response list for a client */
 	msgid = (msgid == MAX_MSG_ID) ? 1 : msgid + 1;
 	while (ListFindItem(commands, &msgid, cmdMessageIDCompare) ||
-			ListFindItem(m->responses, &msgid, cmdMessageIDCompare))
+			ListFindItem(batches, &msgid, cmdMessageIDCompare) ||
+			ListFindItem(m->responses, &msgid, cmdMessageIDCompare) ||
+			ListFindItem(m->c->outboundMsgs, &msgid, messageIDCompare)) /* a timed out publish may still be in flight */
 	{
 		msgid = (msgid == MAX_MSG_ID) ? 1 : msgid + 1;
 		if (msgid == start_msgid)
@@ -2192,6 +3538,31 @@ int MQTTAsync_assignMsgId(MQTTAsyncs* m)
 	}
 	if (msgid != 0)
 		m->c->msgID = msgid;
+	return msgid;
+}
+
+
+/**
+ * Assign a new message id for a client.  Make sure it isn't already being used and does
+ * not exceed the maximum.
+ * @param m a client structure
+ * @return the next message id to use, or 0 if none available
+ */
+int MQTTAsync_assignMsgId(MQTTAsyncs* m)
+{
+	int msgid = 0;
+	thread_id_type thread_id = 0;
+	int locked = 0;
+
+	FUNC_ENTRY;
+	/* We might be called in a callback. In which case, this mutex will be already locked. */
+	thread_id = Thread_getid();
+	if (thread_id != sendThread_id && thread_id != receiveThread_id)
+	{
+		MQTTAsync_lock_mutex(mqttasync_mutex);
+		locked = 1;
+	}
+	msgid = MQTTAsync_nextMsgId(m);
 	if (locked)
 		MQTTAsync_unlock_mutex(mqttasync_mutex);
 	FUNC_EXIT_RC(msgid);
@@ -2199,6 +3570,49 @@ int MQTTAsync_assignMsgId(MQTTAsyncs* m)
 }
 
 
+/**
+ * Find a token for a QoS 0 publication, which has no message id but can still be cancelled.
+ * mqttasync_mutex must be locked.
+ * @param m a client structure
+ * @return the next token to use
+ */
+static int MQTTAsync_nextToken(MQTTAsyncs* m)
+{
+	if (m->qos0_token <= MAX_MSG_ID || m->qos0_token == INT_MAX)
+		m->qos0_token = MAX_MSG_ID + 1;
+	else
+		++(m->qos0_token);
+	return m->qos0_token;
+}
+
+
+/**
+ * Assign a new token for a QoS 0 publication of a client.
+ * @param m a client structure
+ * @return the next token to use
+ */
+static int MQTTAsync_assignToken(MQTTAsyncs* m)
+{
+	int token = 0;
+	thread_id_type thread_id = 0;
+	int locked = 0;
+
+	FUNC_ENTRY;
+	/* We might be called in a callback. In which case, this mutex will be already locked. */
+	thread_id = Thread_getid();
+	if (thread_id != sendThread_id && thread_id != receiveThread_id)
+	{
+		MQTTAsync_lock_mutex(mqttasync_mutex);
+		locked = 1;
+	}
+	token = MQTTAsync_nextToken(m);
+	if (locked)
+		MQTTAsync_unlock_mutex(mqttasync_mutex);
+	FUNC_EXIT_RC(token);
+	return token;
+}
+
+
 int MQTTAsync_subscribeMany(MQTTAsync handle, int count, char* const* topic, int* qos, MQTTAsync_responseOptions* response)
 {
 	MQTTAsyncs* m = handle;
@@ -2238,8 +3652,7 @@ int MQTTAsync_subscribeMany(MQTTAsync handle, int count, char* const* topic, int
 	}
 
 	/* Add subscribe request to operation queue */
-	sub = malloc(sizeof(MQTTAsync_queuedCommand));
-	memset(sub, '\0', sizeof(MQTTAsync_queuedCommand));
+	sub = MQTTAsync_newCommand();
 	sub->client = m;
 	sub->command.token = msgid;
 	if (response)
@@ -2247,6 +3660,10 @@ int MQTTAsync_subscribeMany(MQTTAsync handle, int count, char* const* topic, int
 		sub->command.onSuccess = response->onSuccess;
 		sub->command.onFailure = response->onFailure;
 		sub->command.context = response->context;
+		if (response->struct_version >= 1)
+			sub->command.timeout = response->timeout;
+		if (response->struct_version >= 2)
+			sub->command.priority = response->priority;
 		response->token = sub->command.token;
 	}
 	sub->command.type = SUBSCRIBE;
@@ -2277,101 +3694,360 @@ int MQTTAsync_subscribe(MQTTAsync handle, const char* topic, int qos, MQTTAsync_
 }
 
 
-int MQTTAsync_unsubscribeMany(MQTTAsync handle, int count, char* const* topic, MQTTAsync_responseOptions* response)
+int MQTTAsync_unsubscribeMany(MQTTAsync handle, int count, char* const* topic, MQTTAsync_responseOptions* response)
+{
+	MQTTAsyncs* m = handle;
+	int i = 0;
+	int rc = SOCKET_ERROR;
+	MQTTAsync_queuedCommand* unsub;
+	int msgid = 0;
+
+	FUNC_ENTRY;
+	if (m == NULL || m->c == NULL)
+	{
+		rc = MQTTASYNC_FAILURE;
+		goto exit;
+	}
+	if (m->c->connected == 0)
+	{
+		rc = MQTTASYNC_DISCONNECTED;
+		goto exit;
+	}
+	for (i = 0; i < count; i++)
+	{
+		if (!UTF8_validateString(topic[i]))
+		{
+			rc = MQTTASYNC_BAD_UTF8_STRING;
+			goto exit;
+		}
+	}
+	if ((msgid = MQTTAsync_assignMsgId(m)) == 0)
+	{
+		rc = MQTTASYNC_NO_MORE_MSGIDS;
+		goto exit;
+	}
+	
+	/* Add unsubscribe request to operation queue */
+	unsub = MQTTAsync_newCommand();
+	unsub->client = m;
+	unsub->command.type = UNSUBSCRIBE;
+	unsub->command.token = msgid;
+	if (response)
+	{
+		unsub->command.onSuccess = response->onSuccess;
+		unsub->command.onFailure = response->onFailure;
+		unsub->command.context = response->context;
+		if (response->struct_version >= 1)
+			unsub->command.timeout = response->timeout;
+		if (response->struct_version >= 2)
+			unsub->command.priority = response->priority;
+		response->token = unsub->command.token;
+	}
+	unsub->command.details.unsub.count = count;
+	unsub->command.details.unsub.topics = malloc(sizeof(char*) * count);
+	for (i = 0; i < count; ++i)
+		unsub->command.details.unsub.topics[i] = MQTTStrdup(topic[i]);
+	rc = MQTTAsync_addCommand(unsub, sizeof(unsub));
+
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+int MQTTAsync_unsubscribe(MQTTAsync handle, const char* topic, MQTTAsync_responseOptions* response)
+{
+	int rc = 0;
+	char *const topics[] = {(char*)topic};
+	FUNC_ENTRY;
+	rc = MQTTAsync_unsubscribeMany(handle, 1, topics, response);
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+ * Check whether a publication of the given size would take the client over its queued bytes limit.
+ * If so, the client is marked as blocked so that the writable callback is called when the queue drains.
+ * @param m the client
+ * @param bytes the topic plus payload length of the publication
+ * @return boolean - would the limit be exceeded?
+ */
+static int MQTTAsync_queueFull(MQTTAsyncs* m, int bytes)
+{
+	int rc = 0;
+
+	MQTTAsync_lock_mutex(mqttcommand_mutex);
+	/* an empty queue always accepts one publication, however large, so it can't block forever */
+	if (m->queued_bytes > 0 && m->queued_bytes + bytes > m->max_queued_bytes)
+	{
+		m->write_blocked = 1;
+		rc = 1;
+	}
+	MQTTAsync_unlock_mutex(mqttcommand_mutex);
+	return rc;
+}
+
+
+/**
+ * Check whether a publication can be buffered while the client is not connected, to be sent
+ * when it reconnects.
+ * @param m the client
+ * @param bytes the topic plus payload length of the publication
+ * @return ::MQTTASYNC_SUCCESS if it can, ::MQTTASYNC_DISCONNECTED if the client has no offline
+ * buffer, or ::MQTTASYNC_MAX_BUFFERED_MESSAGES if the buffer is full
+ */
+static int MQTTAsync_offlineAccepts(MQTTAsyncs* m, int bytes)
+{
+	int rc = MQTTASYNC_SUCCESS;
+
+	MQTTAsync_lock_mutex(mqttcommand_mutex);
+	if (!m->offline_buffer)
+		rc = MQTTASYNC_DISCONNECTED;
+	else if ((m->offline_max_messages > 0 && m->queued_publishes + 1 > m->offline_max_messages) ||
+		(m->offline_max_bytes > 0 && m->queued_bytes + bytes > m->offline_max_bytes))
+		rc = MQTTASYNC_MAX_BUFFERED_MESSAGES;
+	MQTTAsync_unlock_mutex(mqttcommand_mutex);
+	return rc;
+}
+
+
+/**
+ * Whether a publication can be packed into a batch: it must be published in the same way.
+ * @param batch the publish command of the batch, for the same client and topic
+ * @return boolean
+ */
+static int MQTTAsync_batchMatches(MQTTAsync_queuedCommand* batch, int qos, int retained,
+	MQTTAsync_responseOptions* response)
+{
+	MQTTAsync_command* command = &batch->command;
+
+	if (command->details.pub.qos != qos || command->details.pub.retained != retained)
+		return 0;
+	if (response == NULL)
+		return command->onSuccess == NULL && command->onFailure == NULL && command->context == NULL &&
+			command->timeout == 0 && command->priority == MQTTASYNC_PRIORITY_NORMAL;
+	return command->onSuccess == response->onSuccess && command->onFailure == response->onFailure &&
+		command->context == response->context &&
+		command->timeout == ((response->struct_version >= 1) ? response->timeout : 0) &&
+		command->priority == ((response->struct_version >= 2) ? response->priority : MQTTASYNC_PRIORITY_NORMAL);
+}
+
+
+/**
+ * Take a batch off the list of those being filled.  Its bytes, which count towards its
+ * client's queued bytes from the time each publication is packed, stop being counted, until
+ * it is added to the command queue.  mqttcommand_mutex must be locked.
+ * @param batch the publish command of the batch
+ */
+static void MQTTAsync_detachBatch(MQTTAsync_queuedCommand* batch)
+{
+	ListDetachElement(batches, &batch->link);
+	batch->client->queued_bytes -= MQTTAsync_commandBytes(&batch->command);
+}
+
+
+/**
+ * Queue the batches of publications which have waited for their linger time, or all the
+ * batches of one client.  mqttasync_mutex and mqttcommand_mutex must be locked.
+ * @param m the client whose batches are all to be queued, or NULL to queue those of any
+ * client which have waited long enough
+ * @return the number of milliseconds until the next batch is due, at most 1000
+ */
+static int MQTTAsync_flushBatches(MQTTAsyncs* m)
+{
+	ListElement* current = NULL;
+	ListElement* next = NULL;
+	long wait = 1000000L;
+
+	current = ListNextElement(batches, &next);
+	ListNextElement(batches, &next);
+	while (current)
+	{
+		MQTTAsync_queuedCommand* batch = (MQTTAsync_queuedCommand*)(current->content);
+		long remaining = 0L;
+
+		if (m == NULL)
+			remaining = batch->client->batch_linger - MQTTAsync_elapsedMicros(batch->command.start_time);
+		if ((m == NULL) ? remaining <= 0 : batch->client == m)
+		{
+			MQTTAsync_detachBatch(batch);
+			MQTTAsync_enqueueCommand(batch, sizeof(batch));
+		}
+		else if (remaining < wait)
+			wait = remaining;
+		current = next;
+		ListNextElement(batches, &next);
+	}
+	return (int)((wait + 999) / 1000);
+}
+
+
+/**
+ * Pack a publication into the batch for its topic, opening a new batch if there is none it
+ * can join.  A batch which is full, has waited its linger time, or which the publication
+ * cannot join, is queued as a command.
+ * @param m the client
+ * @param destinationName the topic, already checked to be valid UTF-8
+ * @param registered the registered topic, or NULL
+ * @return ::MQTTASYNC_SUCCESS if the publication was packed, ::MQTTASYNC_FAILURE if it is too
+ * large to be packed, or ::MQTTASYNC_NO_MORE_MSGIDS
+ */
+static int MQTTAsync_batchPublish(MQTTAsyncs* m, const char* destinationName, RegisteredTopics* registered,
+	int payloadlen, void* payload, int qos, int retained, MQTTAsync_responseOptions* response)
 {
-	MQTTAsyncs* m = handle;
-	int i = 0;
-	int rc = SOCKET_ERROR;
-	MQTTAsync_queuedCommand* unsub;
-	int msgid = 0;
+	MQTTAsync_queuedCommand* batch = NULL;
+	ListElement* current = NULL;
+	thread_id_type thread_id = Thread_getid();
+	int entrylen = MQTTPacket_VBIlen(payloadlen) + payloadlen;
+	int locked = 0, signal = 0, msgid = 0;
+	int rc = MQTTASYNC_SUCCESS;
+	char* ptr = NULL;
 
 	FUNC_ENTRY;
-	if (m == NULL || m->c == NULL)
+	/* We might be called in a callback. In which case, this mutex will be already locked. */
+	if (thread_id != sendThread_id && thread_id != receiveThread_id)
 	{
-		rc = MQTTASYNC_FAILURE;
-		goto exit;
+		MQTTAsync_lock_mutex(mqttasync_mutex);
+		locked = 1;
 	}
-	if (m->c->connected == 0)
+	MQTTAsync_lock_mutex(mqttcommand_mutex);
+	while (ListNextElement(batches, &current))
 	{
-		rc = MQTTASYNC_DISCONNECTED;
+		MQTTAsync_queuedCommand* cmd = (MQTTAsync_queuedCommand*)(current->content);
+
+		if (cmd->client == m && ((registered && cmd->command.details.pub.registered == registered) ||
+			strcmp(cmd->command.details.pub.destinationName, destinationName) == 0))
+		{
+			batch = cmd;
+			break;
+		}
+	}
+	if (batch && (!MQTTAsync_batchMatches(batch, qos, retained, response) ||
+		batch->command.details.pub.payloadlen + entrylen > m->batch_bytes))
+	{	/* send the batch first, to keep the order of publications to the topic */
+		MQTTAsync_detachBatch(batch);
+		MQTTAsync_enqueueCommand(batch, sizeof(batch));
+		batch = NULL;
+		signal = 1;
+	}
+	if (MQTTASYNC_BATCH_MARKER_LEN + entrylen > m->batch_bytes)
+	{
+		rc = MQTTASYNC_FAILURE;
 		goto exit;
 	}
-	for (i = 0; i < count; i++)
+	if (batch == NULL)
 	{
-		if (!UTF8_validateString(topic[i]))
+		if (qos == 0)
+			msgid = MQTTAsync_nextToken(m);
+		else if ((msgid = MQTTAsync_nextMsgId(m)) == 0)
 		{
-			rc = MQTTASYNC_BAD_UTF8_STRING;
+			rc = MQTTASYNC_NO_MORE_MSGIDS;
 			goto exit;
 		}
+		batch = MQTTAsync_newCommand();
+		batch->client = m;
+		batch->command.type = PUBLISH;
+		batch->command.token = msgid;
+		batch->command.start_time = MQTTAsync_start_clock(); /* when the batch was opened, until it is queued */
+		if (response)
+		{
+			batch->command.onSuccess = response->onSuccess;
+			batch->command.onFailure = response->onFailure;
+			batch->command.context = response->context;
+			if (response->struct_version >= 1)
+				batch->command.timeout = response->timeout;
+			if (response->struct_version >= 2)
+				batch->command.priority = response->priority;
+		}
+		if (registered)
+		{
+			MQTTProtocol_retainTopic(registered);
+			batch->command.details.pub.registered = registered;
+			batch->command.details.pub.destinationName = registered->topic;
+		}
+		else
+			batch->command.details.pub.destinationName = MQTTStrdup(destinationName);
+		batch->command.details.pub.payload = malloc(m->batch_bytes);
+		memcpy(batch->command.details.pub.payload, MQTTAsync_batchMarker, MQTTASYNC_BATCH_MARKER_LEN);
+		batch->command.details.pub.payloadlen = MQTTASYNC_BATCH_MARKER_LEN;
+		batch->command.details.pub.qos = qos;
+		batch->command.details.pub.retained = retained;
+		ListAppendNoMalloc(batches, batch, &batch->link, sizeof(batch));
+		m->queued_bytes += MQTTAsync_commandBytes(&batch->command);
+		signal = 1; /* so that the send thread waits no longer than the linger time */
 	}
-	if ((msgid = MQTTAsync_assignMsgId(m)) == 0)
-	{
-		rc = MQTTASYNC_NO_MORE_MSGIDS;
-		goto exit;
-	}
-	
-	/* Add unsubscribe request to operation queue */
-	unsub = malloc(sizeof(MQTTAsync_queuedCommand));
-	memset(unsub, '\0', sizeof(MQTTAsync_queuedCommand));
-	unsub->client = m;
-	unsub->command.type = UNSUBSCRIBE;
-	unsub->command.token = msgid;
+	ptr = (char*)batch->command.details.pub.payload + batch->command.details.pub.payloadlen;
+	ptr += MQTTPacket_encode(ptr, payloadlen);
+	memcpy(ptr, payload, payloadlen);
+	batch->command.details.pub.payloadlen += entrylen;
+	m->queued_bytes += entrylen; /* so that publications waiting in batches count towards maxQueuedBytes */
 	if (response)
+		response->token = batch->command.token;
+	if (++(batch->command.details.pub.count) >= m->batch_messages ||
+		MQTTAsync_elapsedMicros(batch->command.start_time) >= m->batch_linger)
 	{
-		unsub->command.onSuccess = response->onSuccess;
-		unsub->command.onFailure = response->onFailure;
-		unsub->command.context = response->context;
-		response->token = unsub->command.token;
+		MQTTAsync_detachBatch(batch);
+		MQTTAsync_enqueueCommand(batch, sizeof(batch));
+		signal = 1;
 	}
-	unsub->command.details.unsub.count = count;
-	unsub->command.details.unsub.topics = malloc(sizeof(char*) * count);
-	for (i = 0; i < count; ++i)
-		unsub->command.details.unsub.topics[i] = MQTTStrdup(topic[i]);
-	rc = MQTTAsync_addCommand(unsub, sizeof(unsub));
-
 exit:
+	MQTTAsync_unlock_mutex(mqttcommand_mutex);
+	if (locked)
+		MQTTAsync_unlock_mutex(mqttasync_mutex);
+	if (signal)
+		MQTTAsync_signalSendThread();
 	FUNC_EXIT_RC(rc);
 	return rc;
 }
 
 
-int MQTTAsync_unsubscribe(MQTTAsync handle, const char* topic, MQTTAsync_responseOptions* response)
-{
-	int rc = 0;
-	char *const topics[] = {(char*)topic};
-	FUNC_ENTRY;
-	rc = MQTTAsync_unsubscribeMany(handle, 1, topics, response);
-	FUNC_EXIT_RC(rc);
-	return rc;
-}
-
-
-int MQTTAsync_send(MQTTAsync handle, const char* destinationName, int payloadlen, void* payload,
-							 int qos, int retained, MQTTAsync_responseOptions* response)
+/**
+ * Queue a publication, from MQTTAsync_send() or MQTTAsync_sendTo()
+ * @param m the client
+ * @param destinationName the topic, already checked to be valid UTF-8
+ * @param registered the registered topic, which gains a reference, or NULL to copy destinationName
+ * @return ::MQTTASYNC_SUCCESS if the message is accepted for publication, or an error code
+ */
+static int MQTTAsync_sendCommon(MQTTAsyncs* m, const char* destinationName, RegisteredTopics* registered,
+	int payloadlen, void* payload, int qos, int retained, MQTTAsync_responseOptions* response)
 {
 	int rc = MQTTASYNC_SUCCESS;
-	MQTTAsyncs* m = handle;
 	MQTTAsync_queuedCommand* pub;
+	int topiclen = (registered) ? registered->topiclen : (int)strlen(destinationName);
 	int msgid = 0;
+	char* compressed = NULL;
 
 	FUNC_ENTRY;
-	if (m == NULL || m->c == NULL)
-		rc = MQTTASYNC_FAILURE;
-	else if (m->c->connected == 0)
-		rc = MQTTASYNC_DISCONNECTED;
-	else if (!UTF8_validateString(destinationName))
-		rc = MQTTASYNC_BAD_UTF8_STRING;
-	else if (qos < 0 || qos > 2)
+	if (qos < 0 || qos > 2)
+	{
 		rc = MQTTASYNC_BAD_QOS;
+		goto exit;
+	}
+	/* compress before taking any lock, so that other threads can publish and receive meanwhile */
+	if (m->compression && MQTTCompression_deflate(m->compression, (registered) ? registered->topic : destinationName,
+			payload, payloadlen, &compressed, &payloadlen))
+		payload = compressed;
+
+	if (m->max_queued_bytes > 0 && MQTTAsync_queueFull(m, payloadlen + topiclen))
+		rc = MQTTASYNC_WOULD_BLOCK;
+	else if (m->batch_messages > 0 &&
+		(rc = MQTTAsync_batchPublish(m, destinationName, registered, payloadlen, payload, qos, retained, response)) != MQTTASYNC_FAILURE)
+		goto exit; /* packed into a batch, or no message id was free for a new one */
 	else if (qos > 0 && (msgid = MQTTAsync_assignMsgId(m)) == 0)
 		rc = MQTTASYNC_NO_MORE_MSGIDS;
+	else
+	{
+		if (qos == 0)
+			msgid = MQTTAsync_assignToken(m); /* so that the publication can be cancelled */
+		rc = MQTTASYNC_SUCCESS;
+	}
 
 	if (rc != MQTTASYNC_SUCCESS)
 		goto exit;
 	
 	/* Add publish request to operation queue */
-	pub = malloc(sizeof(MQTTAsync_queuedCommand));
-	memset(pub, '\0', sizeof(MQTTAsync_queuedCommand));
+	pub = MQTTAsync_newCommand();
 	pub->client = m;
 	pub->command.type = PUBLISH;
 	pub->command.token = msgid;
@@ -2380,16 +4056,115 @@ int MQTTAsync_send(MQTTAsync handle, const char* destinationName, int payloadlen
 		pub->command.onSuccess = response->onSuccess;
 		pub->command.onFailure = response->onFailure;
 		pub->command.context = response->context;
+		if (response->struct_version >= 1)
+			pub->command.timeout = response->timeout;
+		if (response->struct_version >= 2)
+			pub->command.priority = response->priority;
 		response->token = pub->command.token;
 	}
-	pub->command.details.pub.destinationName = MQTTStrdup(destinationName);
+	if (registered)
+	{
+		MQTTProtocol_retainTopic(registered);
+		pub->command.details.pub.registered = registered;
+		pub->command.details.pub.destinationName = registered->topic;
+	}
+	else
+		pub->command.details.pub.destinationName = MQTTStrdup(destinationName);
 	pub->command.details.pub.payloadlen = payloadlen;
-	pub->command.details.pub.payload = malloc(payloadlen);
-	memcpy(pub->command.details.pub.payload, payload, payloadlen);
+	if (compressed)
+	{
+		pub->command.details.pub.payload = compressed;
+		compressed = NULL;
+	}
+	else
+	{
+		pub->command.details.pub.payload = malloc(payloadlen);
+		memcpy(pub->command.details.pub.payload, payload, payloadlen);
+	}
 	pub->command.details.pub.qos = qos;
 	pub->command.details.pub.retained = retained;
 	rc = MQTTAsync_addCommand(pub, sizeof(pub));
 
+exit:
+	if (compressed)
+		free(compressed); /* copied into a batch, or not sent */
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+int MQTTAsync_send(MQTTAsync handle, const char* destinationName, int payloadlen, void* payload,
+							 int qos, int retained, MQTTAsync_responseOptions* response)
+{
+	int rc = MQTTASYNC_SUCCESS;
+	MQTTAsyncs* m = handle;
+
+	FUNC_ENTRY;
+	if (m == NULL || m->c == NULL)
+		rc = MQTTASYNC_FAILURE;
+	else if (m->c->connected == 0 && (rc = MQTTAsync_offlineAccepts(m, payloadlen + (int)strlen(destinationName))) != MQTTASYNC_SUCCESS)
+		;
+	else if (!UTF8_validateString(destinationName))
+		rc = MQTTASYNC_BAD_UTF8_STRING;
+	else
+		rc = MQTTAsync_sendCommon(m, destinationName, NULL, payloadlen, payload, qos, retained, response);
+
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+int MQTTAsync_registerTopic(MQTTAsync handle, const char* topicName, MQTTAsync_topicHandle* topicHandle)
+{
+	int rc = MQTTASYNC_SUCCESS;
+	MQTTAsyncs* m = handle;
+
+	FUNC_ENTRY;
+	if (topicHandle == NULL || topicName == NULL)
+		rc = MQTTASYNC_NULL_PARAMETER;
+	else if (m == NULL || m->c == NULL)
+		rc = MQTTASYNC_FAILURE;
+	else if (!UTF8_validateString(topicName))
+		rc = MQTTASYNC_BAD_UTF8_STRING;
+	else if ((*topicHandle = MQTTProtocol_registerTopic(topicName, m)) == NULL)
+		rc = MQTTASYNC_BAD_UTF8_STRING;
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+void MQTTAsync_unregisterTopic(MQTTAsync_topicHandle* topicHandle)
+{
+	FUNC_ENTRY;
+	if (topicHandle != NULL && *topicHandle != NULL)
+	{
+		MQTTProtocol_releaseTopic(*topicHandle);
+		*topicHandle = NULL;
+	}
+	FUNC_EXIT;
+}
+
+
+int MQTTAsync_sendTo(MQTTAsync_topicHandle topicHandle, int payloadlen, void* payload, int qos, int retained,
+							 MQTTAsync_responseOptions* response)
+{
+	int rc = MQTTASYNC_SUCCESS;
+	RegisteredTopics* registered = topicHandle;
+	MQTTAsyncs* m = NULL;
+
+	FUNC_ENTRY;
+	if (registered == NULL)
+	{
+		rc = MQTTASYNC_NULL_PARAMETER;
+		goto exit;
+	}
+	m = registered->owner;
+	if (m->c == NULL)
+		rc = MQTTASYNC_FAILURE;
+	else if (m->c->connected == 0 && (rc = MQTTAsync_offlineAccepts(m, payloadlen + registered->topiclen)) != MQTTASYNC_SUCCESS)
+		;
+	else
+		rc = MQTTAsync_sendCommon(m, registered->topic, registered, payloadlen, payload, qos, retained, response);
 exit:
 	FUNC_EXIT_RC(rc);
 	return rc;
@@ -2422,21 +4197,13 @@ exit:
 }
 
 
+/**
+ * Keepalive, retry and timeout processing: run the callbacks of any timers which have expired.
+ */
 void MQTTAsync_retry(void)
 {
-	static time_t last = 0L;
-	time_t now;
-
 	FUNC_ENTRY;
-	time(&(now));
-	if (difftime(now, last) > 5)
-	{
-		time(&(last));
-		MQTTProtocol_keepalive(now);
-		MQTTProtocol_retry(now, 1, 0);
-	}
-	else
-		MQTTProtocol_retry(now, 0, 0);
+	TimerWheel_run(&state.timers, Timer_now());
 	FUNC_EXIT;
 }
 
@@ -2530,8 +4297,7 @@ exit:
 				
 			MQTTAsync_closeOnly(m->c);
 			/* put the connect command back to the head of the command queue, using the next serverURI */
-			conn = malloc(sizeof(MQTTAsync_queuedCommand));
-			memset(conn, '\0', sizeof(MQTTAsync_queuedCommand));
+			conn = MQTTAsync_newCommand();
 			conn->client = m;
 			conn->command = m->connect; 
 			Log(TRACE_MIN, -1, "Connect failed, more to try");
@@ -2575,7 +4341,7 @@ MQTTPacket* MQTTAsync_cycle(int* sock, unsigned long timeout, int* rc)
 		*sock = Socket_getReadySocket(0, &tp);
 		if (!tostop && *sock == 0 && (tp.tv_sec > 0L || tp.tv_usec > 0L))
 		{
-			MQTTAsync_sleep(100L);
+			MQTTAsync_sleep((timeout < 100L) ? timeout : 100L);
 #if 0
 			if (s.clientsds->count == 0)
 			{
@@ -2610,8 +4376,7 @@ MQTTPacket* MQTTAsync_cycle(int* sock, unsigned long timeout, int* rc)
 
 					MQTTAsync_closeOnly(m->c);
 					/* put the connect command back to the head of the command queue, using the next serverURI */
-					conn = malloc(sizeof(MQTTAsync_queuedCommand));
-					memset(conn, '\0', sizeof(MQTTAsync_queuedCommand));
+					conn = MQTTAsync_newCommand();
 					conn->client = m;
 					conn->command = m->connect;
 					Log(TRACE_MIN, -1, "Connect failed, more to try");
@@ -2636,21 +4401,26 @@ MQTTPacket* MQTTAsync_cycle(int* sock, unsigned long timeout, int* rc)
 			/* Note that these handle... functions free the packet structure that they are dealing with */
 			if (pack->header.bits.type == PUBLISH)
 				*rc = MQTTProtocol_handlePublishes(pack, *sock);
-			else if (pack->header.bits.type == PUBACK || pack->header.bits.type == PUBCOMP)
-			{
+			else if (pack->header.bits.type == PUBACK || pack->header.bits.type == PUBCOMP ||
+				(pack->header.bits.type == PUBREC && ((Pubrec*)pack)->rc >= 0x80))
+			{	/* a PUBREC with a failure reason code ends the flow as a PUBCOMP does */
 				int msgid;
 
-				ack = (pack->header.bits.type == PUBCOMP) ? *(Pubcomp*)pack : *(Puback*)pack;
+				ack = *(Ack*)pack;
 				msgid = ack.msgId;
-				*rc = (pack->header.bits.type == PUBCOMP) ?
-						MQTTProtocol_handlePubcomps(pack, *sock) : MQTTProtocol_handlePubacks(pack, *sock);
+				if (pack->header.bits.type == PUBCOMP)
+					*rc = MQTTProtocol_handlePubcomps(pack, *sock);
+				else if (pack->header.bits.type == PUBREC)
+					*rc = MQTTProtocol_handlePubrecs(pack, *sock);
+				else
+					*rc = MQTTProtocol_handlePubacks(pack, *sock);
 				if (!m)
 					Log(LOG_ERROR, -1, "PUBCOMP or PUBACK received for no client, msgid %d", msgid);
 				if (m)
 				{
 					ListElement* current = NULL;
 					
-					if (m->dc)
+					if (m->dc && ack.rc < 0x80)
 					{
 						Log(TRACE_MIN, -1, "Calling deliveryComplete for client %s, msgid %d", m->c->clientID, msgid);
 						(*(m->dc))(m->context, msgid);
@@ -2661,9 +4431,21 @@ MQTTPacket* MQTTAsync_cycle(int* sock, unsigned long timeout, int* rc)
 						MQTTAsync_queuedCommand* command = (MQTTAsync_queuedCommand*)(current->content);
 						if (command->command.token == msgid)
 						{		
-							if (!ListDetach(m->responses, command)) /* then remove the response from the list */
-								Log(LOG_ERROR, -1, "Publish command not removed from command list");
-							if (command->command.onSuccess)
+							ListDetachElement(m->responses, &command->link); /* then remove the response from the list */
+							if (ack.rc >= 0x80)
+							{
+								if (command->command.onFailure)
+								{
+									MQTTAsync_failureData data;
+
+									data.token = command->command.token;
+									data.code = ack.rc;
+									data.message = (ack.header.bits.type == PUBREC) ? "PUBREC reason code" : "PUBACK reason code";
+									Log(TRACE_MIN, -1, "Calling publish failure for client %s", m->c->clientID);
+									(*(command->command.onFailure))(command->command.context, &data);
+								}
+							}
+							else if (command->command.onSuccess)
 							{
 								MQTTAsync_successData data;
 								
@@ -2680,6 +4462,10 @@ MQTTPacket* MQTTAsync_cycle(int* sock, unsigned long timeout, int* rc)
 							break;
 						}
 					}
+					if (commands->count > 0) /* an in-flight slot is free, so a waiting publish can be sent */
+						MQTTAsync_signalSendThread();
+					if (m->c->connect_state == -2) /* a disconnect may be waiting for this flow to finish */
+						MQTTAsync_checkDisconnect(m, &m->disconnect);
 				}
 			}
 			else if (pack->header.bits.type == PUBREC)
@@ -2708,6 +4494,92 @@ int pubCompare(void* a, void* b)
 }
 
 
+int MQTTAsync_cancel(MQTTAsync handle, MQTTAsync_token token)
+{
+	MQTTAsyncs* m = handle;
+	MQTTAsync_queuedCommand* command = NULL;
+	MQTTAsyncs* writable = NULL;
+	ListElement* current = NULL;
+	thread_id_type thread_id = 0;
+	int locked = 0;
+	int rc = MQTTASYNC_FAILURE;
+
+	FUNC_ENTRY;
+	if (m == NULL || token == 0)
+		goto exit;
+
+	/* We might be called in a callback. In which case, this mutex will be already locked. */
+	thread_id = Thread_getid();
+	if (thread_id != sendThread_id && thread_id != receiveThread_id)
+	{
+		MQTTAsync_lock_mutex(mqttasync_mutex);
+		locked = 1;
+	}
+	MQTTAsync_lock_mutex(mqttcommand_mutex);
+	while (ListNextElement(commands, &current))
+	{
+		MQTTAsync_queuedCommand* cmd = (MQTTAsync_queuedCommand*)(current->content);
+
+		if (cmd->client == m && cmd->command.token == token && (cmd->command.type == PUBLISH ||
+			cmd->command.type == SUBSCRIBE || cmd->command.type == UNSUBSCRIBE))
+		{
+			command = cmd;
+			break;
+		}
+	}
+	if (command)
+	{
+		ListDetachElement(commands, &command->link);
+		writable = MQTTAsync_dequeued(command);
+		rc = MQTTASYNC_SUCCESS;
+	}
+	else
+	{
+		current = NULL;
+		while (ListNextElement(batches, &current))
+		{
+			MQTTAsync_queuedCommand* cmd = (MQTTAsync_queuedCommand*)(current->content);
+
+			if (cmd->client == m && cmd->command.token == token)
+			{
+				command = cmd;
+				MQTTAsync_detachBatch(command);
+				if (m->write_blocked && m->queued_bytes <= m->low_water_bytes)
+				{
+					m->write_blocked = 0;
+					writable = m;
+				}
+				rc = MQTTASYNC_SUCCESS;
+				break;
+			}
+		}
+	}
+	MQTTAsync_unlock_mutex(mqttcommand_mutex);
+	if (command)
+	{
+		Log(TRACE_MIN, -1, "Command with token %d cancelled for client %s", token, m->c->clientID);
+		if (command->command.onFailure)
+		{	/* so that every request accepted has exactly one of its callbacks called */
+			MQTTAsync_failureData data;
+
+			data.token = command->command.token;
+			data.code = MQTTASYNC_OPERATION_CANCELLED;
+			data.message = NULL;
+			Log(TRACE_MIN, -1, "Calling command failure for client %s", m->c->clientID);
+			(*(command->command.onFailure))(command->command.context, &data);
+		}
+		MQTTAsync_freeCommand(command);
+	}
+	if (locked)
+		MQTTAsync_unlock_mutex(mqttasync_mutex);
+	MQTTAsync_callWritable(writable);
+
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
 int MQTTAsync_getPendingTokens(MQTTAsync handle, MQTTAsync_token **tokens)
 {
 	int rc = MQTTASYNC_SUCCESS;
@@ -2725,7 +4597,7 @@ int MQTTAsync_getPendingTokens(MQTTAsync handle, MQTTAsync_token **tokens)
 		goto exit;
 	}
 
-	/* calculate the number of pending tokens - commands plus inflight */
+	/* calculate the number of pending tokens - commands and batches plus inflight */
 	while (ListNextElement(commands, &current))
 	{
 		MQTTAsync_queuedCommand* cmd = (MQTTAsync_queuedCommand*)(current->content);
@@ -2733,6 +4605,14 @@ int MQTTAsync_getPendingTokens(MQTTAsync handle, MQTTAsync_token **tokens)
 		if (cmd->client == m)
 			count++;
 	}
+	current = NULL;
+	while (ListNextElement(batches, &current))
+	{
+		MQTTAsync_queuedCommand* cmd = (MQTTAsync_queuedCommand*)(current->content);
+
+		if (cmd->client == m)
+			count++;
+	}
 	if (m->c)
 		count += m->c->outboundMsgs->count;
 	if (count == 0)
@@ -2749,6 +4629,14 @@ int MQTTAsync_getPendingTokens(MQTTAsync handle, MQTTAsync_token **tokens)
 		if (cmd->client == m)
 			(*tokens)[count++] = cmd->command.token;
 	}
+	current = NULL;
+	while (ListNextElement(batches, &current))
+	{
+		MQTTAsync_queuedCommand* cmd = (MQTTAsync_queuedCommand*)(current->content);
+
+		if (cmd->client == m)
+			(*tokens)[count++] = cmd->command.token;
+	}
 
 	/* Now add the inflight messages */
 	if (m->c && m->c->outboundMsgs->count > 0)
@@ -2793,6 +4681,14 @@ int MQTTAsync_isComplete(MQTTAsync handle, MQTTAsync_token dt)
 		if (cmd->client == m && cmd->command.token == dt)
 			goto exit;
 	}
+	current = NULL;
+	while (ListNextElement(batches, &current))
+	{
+		MQTTAsync_queuedCommand* cmd = (MQTTAsync_queuedCommand*)(current->content);
+
+		if (cmd->client == m && cmd->command.token == dt)
+			goto exit;
+	}
 
 	/* Now check the inflight messages */
 	if (m->c && m->c->outboundMsgs->count > 0)
@@ -2872,6 +4768,12 @@ void MQTTAsync_setTraceCallback(MQTTAsync_traceCallback* callback)
 }
 
 
+int MQTTAsync_dumpTrace(char* dest)
+{
+	return Log_dumpTrace(dest);
+}
+
+
 MQTTAsync_nameValue* MQTTAsync_getVersionInfo()
 {
 	#define MAX_INFO_STRINGS 8
@@ -149,6 +149,33 @@
  * Return code: All 65535 MQTT msgids are being used
  */
 #define MQTTASYNC_NO_MORE_MSGIDS -10
+/**
+ * Return code: The publication was not queued because the client's command
+ * queue already holds MQTTAsync_connectOptions.maxQueuedBytes of publication
+ * data. Try again when the MQTTAsync_writable() callback is called.
+ */
+#define MQTTASYNC_WOULD_BLOCK -11
+/**
+ * Return code: The operation did not complete within the timeout set in its
+ * MQTTAsync_responseOptions. Passed to the onFailure callback.
+ */
+#define MQTTASYNC_OPERATION_TIMEOUT -12
+/**
+ * Return code: The publication is larger than the maximum packet size the
+ * MQTT 5.0 server accepts, so it was not sent. Passed to the onFailure callback.
+ */
+#define MQTTASYNC_PACKET_TOO_LARGE -13
+/**
+ * Return code: The client is not connected, and the publication was not
+ * buffered because the offline buffer set with MQTTAsync_setOfflineBuffer()
+ * is full.
+ */
+#define MQTTASYNC_MAX_BUFFERED_MESSAGES -14
+/**
+ * Return code: The request was removed from the command queue by
+ * MQTTAsync_cancel() before it was sent. Passed to the onFailure callback.
+ */
+#define MQTTASYNC_OPERATION_CANCELLED -15
 
 /**
  * Default MQTT version to connect with.  Use 3.1.1 then fall back to 3.1
@@ -162,16 +189,58 @@
  * MQTT version to connect with: 3.1.1
  */
 #define MQTTVERSION_3_1_1 4
+/**
+ * MQTT version to connect with: 5.0
+ */
+#define MQTTVERSION_5 5
 /**
  * Bad return code from subscribe, as defined in the 3.1.1 specification
  */
 #define MQTT_BAD_SUBSCRIBE 0x80
+/**
+ * Inbound policy: when the queue of messages waiting for the application is
+ * full, drop the oldest QoS 0 messages on it to make room. If there are none,
+ * an arriving QoS 0 message is dropped, and a QoS 1 or 2 message is queued anyway.
+ */
+#define MQTTASYNC_INBOUND_DROP_OLDEST_QOS0 0
+/**
+ * Inbound policy: when the queue of messages waiting for the application is
+ * full, drop each message that arrives, whatever its QoS.
+ */
+#define MQTTASYNC_INBOUND_DROP_NEWEST 1
+/**
+ * Inbound policy: when the queue of messages waiting for the application is
+ * full, stop reading from the network until the application has taken enough
+ * of them, so that TCP flow control holds the server back.
+ */
+#define MQTTASYNC_INBOUND_PAUSE 2
+/**
+ * Priority of an operation: in the normal lane of the command queue.
+ */
+#define MQTTASYNC_PRIORITY_NORMAL 0
+/**
+ * Priority of an operation: in the high priority lane of the command queue,
+ * which is served 16 times for every 4 times of the normal lane and once of
+ * the bulk lane, while they all have operations ready to send.
+ */
+#define MQTTASYNC_PRIORITY_HIGH 1
+/**
+ * Priority of an operation: in the bulk lane of the command queue, for
+ * publications that can wait behind the others.
+ */
+#define MQTTASYNC_PRIORITY_BULK 2
 
 /**
  * A handle representing an MQTT client. A valid client handle is available
  * following a successful call to MQTTAsync_create().
  */
 typedef void* MQTTAsync;
+/**
+ * A handle representing a topic registered for repeated publishing with
+ * MQTTAsync_sendTo(). A valid topic handle is available following a successful
+ * call to MQTTAsync_registerTopic().
+ */
+typedef void* MQTTAsync_topicHandle;
 /**
  * A value representing an MQTT message. A token is returned to the
  * client application when a message is published. The token can then be used to
@@ -275,6 +344,41 @@ typedef struct
  */
 typedef int MQTTAsync_messageArrived(void* context, char* topicName, int topicLen, MQTTAsync_message* message);
 
+/**
+ * A message passed to MQTTAsync_messageArrivedBatch(), with its topic as
+ * MQTTAsync_messageArrived() would be passed them.
+ */
+typedef struct
+{
+	/** The topic associated with the received message. */
+	char* topicName;
+	/** The length of the topic if it has embedded NULL characters, otherwise 0. */
+	int topicLen;
+	/** The received message. */
+	MQTTAsync_message* message;
+} MQTTAsync_arrivedMessage;
+
+/**
+ * This is a callback function. The client application can provide an
+ * implementation of this function to receive messages several at a time,
+ * instead of MQTTAsync_messageArrived(). The function is registered with the
+ * client library by passing it as an argument to MQTTAsync_setMessageArrivedBatch().
+ * It is called with the messages waiting for the application, oldest first,
+ * as soon as they arrive, and for as long as it takes all it is passed.
+ * This function is executed on a separate thread to the one on which the
+ * client application is running.
+ * @param context A pointer to the <i>context</i> value originally passed to
+ * MQTTAsync_setMessageArrivedBatch(), which contains any application-specific context.
+ * @param messages The messages, each of which the application takes in the
+ * same way as one passed to MQTTAsync_messageArrived().
+ * @param count The number of messages, at least 1.
+ * @return The number of messages, from the first, that have been safely
+ * received by the client application. The client library offers the rest
+ * again straight away, or if none were taken, a little later, with any that
+ * arrive in the meantime queued behind them.
+ */
+typedef int MQTTAsync_messageArrivedBatch(void* context, MQTTAsync_arrivedMessage* messages, int count);
+
 /**
  * This is a callback function. The client application
  * must provide an implementation of this function to enable asynchronous 
@@ -312,12 +416,28 @@ typedef void MQTTAsync_deliveryComplete(void* context, MQTTAsync_token token);
  */
 typedef void MQTTAsync_connectionLost(void* context, char* cause);
 
+/**
+ * This is a callback function. The client application
+ * must provide an implementation of this function to be notified when
+ * publications can be queued again after MQTTAsync_send() or 
+ * MQTTAsync_sendMessage() has returned ::MQTTASYNC_WOULD_BLOCK. The function
+ * is registered with the client library by passing it as an argument to
+ * MQTTAsync_setWritable(). It is called once the publication data waiting in
+ * the client's command queue has drained to 
+ * MQTTAsync_connectOptions.lowWatermarkBytes. This function is executed on a
+ * separate thread to the one on which the client application is running.
+ * @param context A pointer to the <i>context</i> value originally passed to 
+ * MQTTAsync_setWritable(), which contains any application-specific context.
+ */
+typedef void MQTTAsync_writable(void* context);
+
 /** The data returned on completion of an unsuccessful API call in the response callback onFailure. */
 typedef struct
 {
 	/** A token identifying the failed request. */
 	MQTTAsync_token token;
-	/** A numeric code identifying the error. */
+	/** A numeric code identifying the error. For an MQTT 5.0 publication
+	  * which the server refused, the reason code of its PUBACK or PUBREC. */
 	int code;
 	/** Optional text explaining the error. Can be NULL. */
 	char* message;
@@ -379,7 +499,8 @@ typedef struct
 {
 	/** The eyecatcher for this structure.  Must be MQTR */
 	char struct_id[4];
-	/** The version number of this structure.  Must be 0 */
+	/** The version number of this structure.  Must be 0, 1 or 2.
+	  * 0 signifies no timeout field, 1 no priority field */
 	int struct_version;	
 	/** 
     * A pointer to a callback function to be called if the API call successfully
@@ -400,9 +521,24 @@ typedef struct
     */
 	void* context; 
 	MQTTAsync_token token;   /* output */
+	/**
+	* The number of milliseconds to wait for the operation to complete. If it has
+	* not completed by then, it is abandoned and the onFailure callback is called
+	* with the code ::MQTTASYNC_OPERATION_TIMEOUT.  A publication which has already
+	* been sent with QoS 1 or 2 may still be delivered.  0 means wait forever.
+	*/
+	int timeout;
+	/**
+	* The lane of the command queue the operation waits in:
+	* ::MQTTASYNC_PRIORITY_NORMAL, ::MQTTASYNC_PRIORITY_HIGH or ::MQTTASYNC_PRIORITY_BULK.
+	* Operations are sent in order within a lane, and the lanes take turns,
+	* high priority ones most often, so that a backlog of bulk publications does
+	* not hold back an urgent publication or a subscription.
+	*/
+	int priority;
 } MQTTAsync_responseOptions;
 
-#define MQTTAsync_responseOptions_initializer { {'M', 'Q', 'T', 'R'}, 0, NULL, NULL, 0, 0 }
+#define MQTTAsync_responseOptions_initializer { {'M', 'Q', 'T', 'R'}, 2, NULL, NULL, 0, 0, 0, MQTTASYNC_PRIORITY_NORMAL }
 
 
 /**
@@ -435,6 +571,262 @@ typedef struct
  */
 DLLExport int MQTTAsync_setCallbacks(MQTTAsync handle, void* context, MQTTAsync_connectionLost* cl,
 									MQTTAsync_messageArrived* ma, MQTTAsync_deliveryComplete* dc);
+
+/**
+ * This function sets the callback function used to signal that a client which
+ * has been refused a publication with ::MQTTASYNC_WOULD_BLOCK can publish 
+ * again. 
+ * @param handle A valid client handle from a successful call to
+ * MQTTAsync_create(). 
+ * @param context A pointer to any application-specific context. The
+ * the <i>context</i> pointer is passed to the callback function.
+ * @param ow A pointer to an MQTTAsync_writable() callback function. Set
+ * to NULL to remove a previously set callback.
+ * @return ::MQTTASYNC_SUCCESS if the callback was correctly set,
+ * ::MQTTASYNC_FAILURE if an error occurred.
+ */
+DLLExport int MQTTAsync_setWritable(MQTTAsync handle, void* context, MQTTAsync_writable* ow);
+
+/**
+ * This function sets the callback function used to pass received messages to
+ * the application several at a time. When it is set, it is called instead of
+ * the MQTTAsync_messageArrived() callback set by MQTTAsync_setCallbacks().
+ * This function must be called while the client is not connected.
+ * @param handle A valid client handle from a successful call to
+ * MQTTAsync_create().
+ * @param context A pointer to any application-specific context. The
+ * the <i>context</i> pointer is passed to the callback function.
+ * @param mab A pointer to an MQTTAsync_messageArrivedBatch() callback function.
+ * Set to NULL to pass messages to MQTTAsync_messageArrived() again.
+ * @param maxCount The most messages passed to one call of the callback.
+ * @return ::MQTTASYNC_SUCCESS if the callback was correctly set,
+ * ::MQTTASYNC_FAILURE if an error occurred.
+ */
+DLLExport int MQTTAsync_setMessageArrivedBatch(MQTTAsync handle, void* context, MQTTAsync_messageArrivedBatch* mab,
+									int maxCount);
+
+/**
+ * MQTTAsync_compressionOptions defines the compression of the payloads
+ * published to the topics matching one topic filter. Payloads are compressed
+ * with zlib, which can start from a preset dictionary: a sample of the
+ * strings that typical payloads contain, such as the keys of JSON telemetry,
+ * which lets even short payloads compress well. The compressed payload starts
+ * with the marker 0x00 'M' 'Q' 'Z' and the length of the original payload.
+ * A receiving client with a matching topic filter, and the same dictionary,
+ * decompresses it before messageArrived; other payloads are passed on as they are.
+ * A payload whose original length is more than the maxPacketSize or maxBytes of
+ * MQTTAsync_inboundOptions, or 16 MB if those are not set, is passed on compressed.
+ */
+typedef struct
+{
+	/** The eyecatcher for this structure.  must be MQTZ. */
+	char struct_id[4];
+	/** The version number of this structure.  Must be 0 */
+	int struct_version;
+	/** The topic filter, which may include wildcards (see @ref wildcard). */
+	const char* topicFilter;
+	/**
+	  * Payloads shorter than this are published as they are. Payloads are also
+	  * published as they are if compression does not make them shorter.
+	  */
+	int minBytes;
+	/** The zlib compression level, from 1 (fastest) to 9 (smallest), or -1 for zlib's default. */
+	int level;
+	/** The preset dictionary, or NULL. Publisher and subscriber must use the same one. */
+	const void* dictionary;
+	/** The length of the dictionary in bytes. */
+	int dictionaryLen;
+} MQTTAsync_compressionOptions;
+
+#define MQTTAsync_compressionOptions_initializer { {'M', 'Q', 'T', 'Z'}, 0, NULL, 256, -1, NULL, 0 }
+
+/**
+ * This function sets the topic filters for which payloads are compressed when
+ * they are published, and decompressed when they are received. Compression
+ * is done by the thread that calls MQTTAsync_send(), before the message is
+ * queued, using the settings of the first filter that matches the topic. The
+ * filters, and their dictionaries, are copied.
+ * This function must be called while the client is not connected.
+ * @param handle A valid client handle from a successful call to
+ * MQTTAsync_create().
+ * @param count The number of topic filters. Set to 0 to stop compressing.
+ * @param options An array of <i>count</i> ::MQTTAsync_compressionOptions.
+ * @return ::MQTTASYNC_SUCCESS if the filters were set,
+ * ::MQTTASYNC_BAD_UTF8_STRING if a filter is not valid UTF-8,
+ * ::MQTTASYNC_BAD_STRUCTURE if an options structure or compression level is
+ * not valid, or ::MQTTASYNC_FAILURE if the client is connected.
+ */
+DLLExport int MQTTAsync_setCompression(MQTTAsync handle, int count, MQTTAsync_compressionOptions* options);
+
+/**
+ * MQTTAsync_offlineOptions defines the buffer that holds publications while
+ * the client is not connected, and how fast they are sent when it reconnects.
+ */
+typedef struct
+{
+	/** The eyecatcher for this structure.  must be MQTO. */
+	char struct_id[4];
+	/** The version number of this structure.  Must be 0 */
+	int struct_version;
+	/** The most publications waiting to be sent while disconnected. 0 means no limit. */
+	int maxMessages;
+	/** The most bytes of topics and payloads waiting to be sent while disconnected. 0 means no limit. */
+	int maxBytes;
+	/**
+	  * The most publications sent per second after reconnecting, until those
+	  * waiting when the connection was made have been sent, so that a full
+	  * buffer does not flood the network and the server. 0 means no pacing.
+	  */
+	int replayRate;
+} MQTTAsync_offlineOptions;
+
+#define MQTTAsync_offlineOptions_initializer { {'M', 'Q', 'T', 'O'}, 0, 100, 0, 0 }
+
+/**
+ * This function lets MQTTAsync_send(), MQTTAsync_sendMessage() and
+ * MQTTAsync_sendTo() accept publications while the client is not connected,
+ * rather than returning ::MQTTASYNC_DISCONNECTED. They wait on the command
+ * queue, and are sent in order once the client has reconnected. They are
+ * kept when the connection is lost, even with a clean session. If the client
+ * was created with persistence, they are persisted too, and are restored by
+ * MQTTAsync_create() if the application restarts.
+ * This function can be called at any time.
+ * @param handle A valid client handle from a successful call to
+ * MQTTAsync_create().
+ * @param options A pointer to an ::MQTTAsync_offlineOptions structure, which
+ * is copied, or NULL to stop buffering publications while disconnected.
+ * @return ::MQTTASYNC_SUCCESS if the options were set,
+ * ::MQTTASYNC_BAD_STRUCTURE if they are not valid.
+ */
+DLLExport int MQTTAsync_setOfflineBuffer(MQTTAsync handle, const MQTTAsync_offlineOptions* options);
+
+/**
+ * MQTTAsync_replayOptions sets how fast the QoS 1 and 2 messages that were
+ * in flight when the connection was lost are resent after reconnecting.
+ * They are resent a few at a time, when nothing is waiting to be written to
+ * the socket, so that new publications are sent between them.
+ */
+typedef struct
+{
+	/** The eyecatcher for this structure.  must be MQTP. */
+	char struct_id[4];
+	/** The version number of this structure.  Must be 0 */
+	int struct_version;
+	/**
+	  * The most bytes of packets resent in each cycle of the replay, which
+	  * runs every 10 to 20 milliseconds. 0 means as many as the socket takes.
+	  */
+	int maxBytes;
+	/** The most messages resent per second. 0 means no limit. */
+	int maxRate;
+} MQTTAsync_replayOptions;
+
+#define MQTTAsync_replayOptions_initializer { {'M', 'Q', 'T', 'P'}, 0, 0, 0 }
+
+/**
+ * This function sets the pacing of the messages resent after reconnecting.
+ * It takes effect from the next cycle of the replay.
+ * This function can be called at any time.
+ * @param handle A valid client handle from a successful call to
+ * MQTTAsync_create().
+ * @param options A pointer to an ::MQTTAsync_replayOptions structure, which
+ * is copied, or NULL for no pacing.
+ * @return ::MQTTASYNC_SUCCESS if the options were set,
+ * ::MQTTASYNC_BAD_STRUCTURE if they are not valid.
+ */
+DLLExport int MQTTAsync_setReplayOptions(MQTTAsync handle, const MQTTAsync_replayOptions* options);
+
+/**
+ * MQTTAsync_replayProgress reports how far the resending of the messages in
+ * flight when the client last reconnected has got.
+ */
+typedef struct
+{
+	/** The messages in flight when the client last reconnected. */
+	int total;
+	/** Of those, the messages resent, or acknowledged before their turn came. */
+	int sent;
+	/** The messages still to be resent. 0 when the replay has finished, or the connection was lost. */
+	int remaining;
+} MQTTAsync_replayProgress;
+
+/**
+ * This function gets the progress of the resending of messages after
+ * reconnecting. It can be called from the callbacks.
+ * @param handle A valid client handle from a successful call to
+ * MQTTAsync_create().
+ * @param progress A pointer to an ::MQTTAsync_replayProgress structure, which is filled in.
+ * @return ::MQTTASYNC_SUCCESS if the progress was returned,
+ * ::MQTTASYNC_FAILURE if an error occurred.
+ */
+DLLExport int MQTTAsync_getReplayProgress(MQTTAsync handle, MQTTAsync_replayProgress* progress);
+
+/**
+ * Durability: persisted messages are written to the store, and left to the
+ * operating system to write to the disk. They survive the process ending,
+ * but not the machine failing.
+ */
+#define MQTTASYNC_DURABILITY_NONE 0
+/**
+ * Durability: what has been written to the store is synced to the disk
+ * every interval milliseconds, so that at most that much is lost if the
+ * machine fails.
+ */
+#define MQTTASYNC_DURABILITY_INTERVAL 1
+/**
+ * Durability: the messages persisted while the client's packets are read
+ * or its commands sent, until there is nothing more to do or 64 packets
+ * have been read, are synced to the disk together. The PUBREC for a QoS 2
+ * message received is sent after the sync, so that the server does not
+ * give up the message before the client holds it safely.
+ */
+#define MQTTASYNC_DURABILITY_BATCH 2
+
+/**
+ * MQTTAsync_durabilityOptions sets when the messages persisted by a client
+ * are synced to the disk. They can only be synced with
+ * ::MQTTCLIENT_PERSISTENCE_LOG, which syncs all of its records with one
+ * fdatasync.
+ */
+typedef struct
+{
+	/** The eyecatcher for this structure.  must be MQTD. */
+	char struct_id[4];
+	/** The version number of this structure.  Must be 0 */
+	int struct_version;
+	/** ::MQTTASYNC_DURABILITY_NONE, ::MQTTASYNC_DURABILITY_INTERVAL or ::MQTTASYNC_DURABILITY_BATCH */
+	int mode;
+	/** The milliseconds between syncs with ::MQTTASYNC_DURABILITY_INTERVAL. */
+	int interval;
+} MQTTAsync_durabilityOptions;
+
+#define MQTTAsync_durabilityOptions_initializer { {'M', 'Q', 'T', 'D'}, 0, MQTTASYNC_DURABILITY_NONE, 1000 }
+
+/**
+ * This function sets when the messages persisted by a client are synced to
+ * the disk. This function can be called at any time.
+ * @param handle A valid client handle from a successful call to
+ * MQTTAsync_create().
+ * @param options A pointer to an ::MQTTAsync_durabilityOptions structure,
+ * which is copied, or NULL for ::MQTTASYNC_DURABILITY_NONE.
+ * @return ::MQTTASYNC_SUCCESS if the options were set,
+ * ::MQTTASYNC_BAD_STRUCTURE if they are not valid,
+ * ::MQTTASYNC_PERSISTENCE_ERROR if the client's persistence cannot be synced.
+ */
+DLLExport int MQTTAsync_setDurability(MQTTAsync handle, const MQTTAsync_durabilityOptions* options);
+
+/**
+ * This function writes the messages held by ::MQTTCLIENT_PERSISTENCE_MEMORY
+ * persistence to its snapshot file now, rather than only when the client is
+ * destroyed. An application which stops on a signal can call it once the
+ * signal has been handled, outside the signal handler.
+ * @param handle A valid client handle from a successful call to
+ * MQTTAsync_create().
+ * @return ::MQTTASYNC_SUCCESS if the snapshot was written,
+ * ::MQTTASYNC_PERSISTENCE_ERROR if it could not be, or the client has no
+ * snapshot file.
+ */
+DLLExport int MQTTAsync_snapshot(MQTTAsync handle);
 		
 
 /**
@@ -466,6 +858,15 @@ DLLExport int MQTTAsync_setCallbacks(MQTTAsync handle, void* context, MQTTAsync_
  * storage and provides some protection against message loss in the case of 
  * unexpected failure.
  * <br>
+ * ::MQTTCLIENT_PERSISTENCE_LOG: Like the default persistence, but messages
+ * are appended to a few segment files rather than written to a file each, so
+ * that files are not created and deleted at the rate messages are sent.
+ * <br>
+ * ::MQTTCLIENT_PERSISTENCE_MEMORY: Keep in-flight messages in memory, and
+ * write them to a snapshot file when the client is destroyed, to be restored
+ * when it is next created. The snapshot is kept until a new one replaces it.
+ * Messages persisted since the last snapshot are lost if the process fails.
+ * <br>
  * ::MQTTCLIENT_PERSISTENCE_USER: Use an application-specific persistence
  * implementation. Using this type of persistence gives control of the 
  * persistence mechanism to the application. The application has to implement
@@ -475,6 +876,9 @@ DLLExport int MQTTAsync_setCallbacks(MQTTAsync handle, void* context, MQTTAsync_
  * be set to NULL. For ::MQTTCLIENT_PERSISTENCE_DEFAULT persistence, it
  * should be set to the location of the persistence directory (if set 
  * to NULL, the persistence directory used is the working directory).
+ * The same applies to ::MQTTCLIENT_PERSISTENCE_LOG persistence.
+ * For ::MQTTCLIENT_PERSISTENCE_MEMORY persistence, it is the directory of the
+ * snapshot file, or NULL for no snapshot.
  * Applications that use ::MQTTCLIENT_PERSISTENCE_USER persistence set this
  * argument to point to a valid MQTTClient_persistence structure.
  * @return ::MQTTASYNC_SUCCESS if the client is successfully created, otherwise
@@ -569,6 +973,119 @@ typedef struct
 
 #define MQTTAsync_SSLOptions_initializer { {'M', 'Q', 'T', 'S'}, 0, NULL, NULL, NULL, NULL, NULL, 1 }
 
+/**
+ * MQTTAsync_batchOptions defines how small publications are packed together.
+ * Publications made with MQTTAsync_send() to the same topic, with the same QoS,
+ * retained flag and response options, are held for up to lingerMicros and sent
+ * as one PUBLISH, whose payload is an envelope of the messages: the four bytes
+ * 0x00 'M' 'Q' 'B', then for each message its length as an MQTT variable byte
+ * integer followed by its bytes. Each message accepted into a batch is given
+ * the token of the batch, and the callbacks are called once for the batch.
+ * Publications waiting in a batch count towards maxQueuedBytes.
+ * A client receiving batches with unpack set passes each message to the
+ * messageArrived callback as if it had been published on its own.
+ */
+typedef struct
+{
+	/** The eyecatcher for this structure.  Must be MQTB. */
+	const char struct_id[4];
+	/** The version number of this structure.  Must be 0. */
+	int struct_version;
+	/**
+	  * The most messages packed into one publication. A batch is sent as soon
+	  * as it holds this many. Set to 0 or 1 not to pack publications.
+	  */
+	int maxMessages;
+	/**
+	  * The longest time in microseconds that the first message of a batch waits
+	  * for others before the batch is sent. The send thread checks batches to a
+	  * resolution of a millisecond, and MQTTAsync_send() checks the batch for
+	  * its own topic.
+	  */
+	int lingerMicros;
+	/**
+	  * The most bytes of envelope in one publication. Messages too large to fit
+	  * in a batch on their own are sent unpacked.
+	  */
+	int maxBytes;
+	/**
+	  * Boolean: unpack batches received, so that messageArrived is called for each message.
+	  * Any message received whose payload starts with the four bytes 0x00 'M' 'Q' 'B' and
+	  * then holds whole length-prefixed messages is taken to be a batch, so only set this
+	  * for topics whose publishers do not send such payloads of their own.
+	  */
+	int unpack;
+} MQTTAsync_batchOptions;
+
+#define MQTTAsync_batchOptions_initializer { {'M', 'Q', 'T', 'B'}, 0, 64, 1000, 4096, 1 }
+
+/**
+ * MQTTAsync_inboundOptions limits the memory used by received messages: the
+ * messages waiting on the queue for the application to take them, and the
+ * size of each packet read from the server.
+ */
+typedef struct
+{
+	/** The eyecatcher for this structure.  must be MQTI. */
+	char struct_id[4];
+	/** The version number of this structure.  Must be 0 */
+	int struct_version;
+	/** The most messages waiting for the application. 0 means no limit. */
+	int maxMessages;
+	/** The most bytes of messages, with their topics, waiting for the application. 0 means no limit. */
+	int maxBytes;
+	/**
+	  * The largest packet read from the server. The connection is closed if
+	  * the server sends a larger one, before any memory is allocated for it.
+	  * With MQTT 5.0 the server is told the limit when the client connects.
+	  * 0 means no limit.
+	  */
+	int maxPacketSize;
+	/**
+	  * What happens when maxMessages or maxBytes is reached:
+	  * ::MQTTASYNC_INBOUND_DROP_OLDEST_QOS0, ::MQTTASYNC_INBOUND_DROP_NEWEST or
+	  * ::MQTTASYNC_INBOUND_PAUSE. While reading is paused, PINGREQs are still
+	  * sent so that the server keeps the connection, but no PINGRESP can be read,
+	  * so the connection is not checked by keepalive.
+	  */
+	int policy;
+} MQTTAsync_inboundOptions;
+
+#define MQTTAsync_inboundOptions_initializer { {'M', 'Q', 'T', 'I'}, 0, 0, 0, 0, MQTTASYNC_INBOUND_DROP_OLDEST_QOS0 }
+
+/**
+ * MQTTAsync_inboundStats reports the received messages waiting for the
+ * application, and those dropped by the limits of MQTTAsync_inboundOptions.
+ * The counts are from when the client was created.
+ */
+typedef struct
+{
+	/** The messages waiting for the application. */
+	int queuedMessages;
+	/** The bytes of messages, with their topics, waiting for the application. */
+	int queuedBytes;
+	/** The messages dropped because the queue was full. */
+	int droppedMessages;
+	/** The bytes of the messages dropped because the queue was full. */
+	int droppedBytes;
+	/** The packets larger than maxPacketSize, each of which closed the connection. */
+	int oversizedPackets;
+	/** The times reading from the network was paused because the queue was full. */
+	int pauses;
+} MQTTAsync_inboundStats;
+
+/**
+ * This function gets the number of received messages waiting for the
+ * application, and of those dropped by the limits set in
+ * MQTTAsync_connectOptions.inbound.
+ * @param handle A valid client handle from a successful call to
+ * MQTTAsync_create().
+ * @param stats A pointer to an ::MQTTAsync_inboundStats structure, which is filled in.
+ * @return ::MQTTASYNC_SUCCESS if the statistics were returned,
+ * ::MQTTASYNC_FAILURE if an error occurred.
+ */
+DLLExport int MQTTAsync_getInboundStats(MQTTAsync handle, MQTTAsync_inboundStats* stats);
+
 /**
  * MQTTAsync_connectOptions defines several settings that control the way the
  * client connects to an MQTT server.  Default values are set in 
@@ -578,10 +1095,14 @@ typedef struct
 {
 	/** The eyecatcher for this structure.  must be MQTC. */
 	const char struct_id[4];
-	/** The version number of this structure.  Must be 0, 1 or 2.  
+	/** The version number of this structure.  Must be 0, 1, 2, 3, 4, 5, 6 or 7.  
 	  * 0 signifies no SSL options and no serverURIs
 	  * 1 signifies no serverURIs 
       * 2 signifies no MQTTVersion
+      * 3 signifies no maxQueuedBytes and lowWatermarkBytes
+      * 4 signifies no topicAliasMaximum
+      * 5 signifies no batch
+      * 6 signifies no inbound
 	  */
 	int struct_version;
 	/** The "keep alive" interval, measured in seconds, defines the maximum time
@@ -614,11 +1135,15 @@ typedef struct
       * session still exists, and cleansession=true, then the previous session 
       * information at the client and server is cleared. If cleansession=false,
       * the previous session is resumed. If no previous session exists, a new
-      * session is started.
+      * session is started. With MQTT 5.0, cleansession=false asks the server
+      * to keep the session for ever after the connection closes.
 	  */
 	int cleansession;
 	/** 
-      * This controls how many messages can be in-flight simultaneously. 
+      * This controls how many QoS 1 and 2 messages can be in-flight 
+      * simultaneously. Further publications wait in the command queue until
+      * an acknowledgement from the server frees a slot. 
+      * Set to 0, as the initializer does, for no limit.
 	  */
 	int maxInflight;		
 	/** 
@@ -688,12 +1213,44 @@ typedef struct
       * MQTTVERSION_DEFAULT (0) = default: start with 3.1.1, and if that fails, fall back to 3.1
       * MQTTVERSION_3_1 (3) = only try version 3.1
       * MQTTVERSION_3_1_1 (4) = only try version 3.1.1
+      * MQTTVERSION_5 (5) = only try version 5.0.  Publications use topic aliases
+      * when the server allows them, and no more QoS 1 and 2 publications are sent
+      * at once than the server's Receive Maximum.
 	  */
 	int MQTTVersion;
+	/**
+      * The maximum number of bytes of publication data (topic and payload)
+      * allowed to wait in the command queue. Once reached, MQTTAsync_send()
+      * returns ::MQTTASYNC_WOULD_BLOCK. Set to 0 for no limit.
+	  */
+	int maxQueuedBytes;
+	/**
+      * When a publication has been refused with ::MQTTASYNC_WOULD_BLOCK, the
+      * MQTTAsync_writable() callback is called once the queued publication 
+      * data has drained to this number of bytes. 0 means half of maxQueuedBytes.
+	  */
+	int lowWatermarkBytes;
+	/**
+      * MQTT 5.0 only: the number of topic aliases the server may use when
+      * publishing to this client. 0 means the server must always send the topic.
+	  */
+	int topicAliasMaximum;
+	/**
+      * This is a pointer to an MQTTAsync_batchOptions structure. If your
+      * application does not pack small publications together, set this
+      * pointer to NULL.
+	  */
+	MQTTAsync_batchOptions* batch;
+	/**
+      * This is a pointer to an MQTTAsync_inboundOptions structure. If your
+      * application does not limit the messages waiting for it, set this
+      * pointer to NULL.
+	  */
+	MQTTAsync_inboundOptions* inbound;
 } MQTTAsync_connectOptions;
 
 
-#define MQTTAsync_connectOptions_initializer { {'M', 'Q', 'T', 'C'}, 3, 60, 1, 10, NULL, NULL, NULL, 30, 0, NULL, NULL, NULL, NULL, 0, NULL, 0}
+#define MQTTAsync_connectOptions_initializer { {'M', 'Q', 'T', 'C'}, 7, 60, 1, 0, NULL, NULL, NULL, 30, 0, NULL, NULL, NULL, NULL, 0, NULL, 0, 0, 0, 0, NULL, NULL}
 
 /**
   * This function attempts to connect a previously-created client (see
@@ -869,6 +1426,48 @@ DLLExport int MQTTAsync_unsubscribeMany(MQTTAsync handle, int count, char* const
 DLLExport int MQTTAsync_send(MQTTAsync handle, const char* destinationName, int payloadlen, void* payload, int qos, int retained,
 																 MQTTAsync_responseOptions* response);
 
+/**
+  * This function registers a topic to be published to many times with
+  * MQTTAsync_sendTo(). The topic is checked to be valid UTF-8 and encoded
+  * once, here, and each publication holds a reference to it rather than a copy.
+  * The topic handle is valid until it is passed to MQTTAsync_unregisterTopic(),
+  * which must be done before the client is destroyed.
+  * @param handle A valid client handle from a successful call to
+  * MQTTAsync_create().
+  * @param topicName The topic to register.
+  * @param topicHandle A pointer to an ::MQTTAsync_topicHandle, which is set to
+  * the registered topic if this function returns successfully.
+  * @return ::MQTTASYNC_SUCCESS if the topic is registered, or
+  * ::MQTTASYNC_BAD_UTF8_STRING if it is not valid UTF-8 or is longer than 65535 bytes.
+  */
+DLLExport int MQTTAsync_registerTopic(MQTTAsync handle, const char* topicName, MQTTAsync_topicHandle* topicHandle);
+
+/**
+  * This function releases a topic registered by MQTTAsync_registerTopic().
+  * Publications already accepted by MQTTAsync_sendTo() keep the topic until they
+  * are complete.
+  * @param topicHandle A pointer to the topic handle, which is set to NULL.
+  */
+DLLExport void MQTTAsync_unregisterTopic(MQTTAsync_topicHandle* topicHandle);
+
+/**
+  * This function attempts to publish a message to a registered topic, in the
+  * same way as MQTTAsync_send(), without checking or copying the topic again.
+  * @param topicHandle A valid topic handle from a successful call to
+  * MQTTAsync_registerTopic(). The message is published by the client the topic
+  * was registered with.
+  * @param payloadlen The length of the payload in bytes.
+  * @param payload A pointer to the byte array payload of the message.
+  * @param qos The @ref qos of the message.
+  * @param retained The retained flag for the message.
+  * @param response A pointer to an ::MQTTAsync_responseOptions structure. Used to set callback functions.
+  * This is optional and can be set to NULL.
+  * @return ::MQTTASYNC_SUCCESS if the message is accepted for publication.
+  * An error code is returned if there was a problem accepting the message.
+  */
+DLLExport int MQTTAsync_sendTo(MQTTAsync_topicHandle topicHandle, int payloadlen, void* payload, int qos, int retained,
+																 MQTTAsync_responseOptions* response);
+
 
 /** 
   * This function attempts to publish a message to a given topic (see also
@@ -888,6 +1487,21 @@ DLLExport int MQTTAsync_send(MQTTAsync handle, const char* destinationName, int
 DLLExport int MQTTAsync_sendMessage(MQTTAsync handle, const char* destinationName, const MQTTAsync_message* msg, MQTTAsync_responseOptions* response);
 
 
+/**
+  * This function removes a subscribe, unsubscribe or publish request from the
+  * client's command queue before it is sent to the server.  The onFailure
+  * callback of the request is called once, with ::MQTTASYNC_OPERATION_CANCELLED,
+  * before this function returns, and the onSuccess callback is not called.  A
+  * request which has already been sent cannot be cancelled.
+  * @param handle A valid client handle from a successful call to 
+  * MQTTAsync_create(). 
+  * @param token The ::MQTTAsync_token returned for the request.
+  * @return ::MQTTASYNC_SUCCESS if the request was removed, ::MQTTASYNC_FAILURE
+  * if it has already been sent or the token is not known.
+  */
+DLLExport int MQTTAsync_cancel(MQTTAsync handle, MQTTAsync_token token);
+
+
 /**
   * This function sets a pointer to an array of tokens for 
   * messages that are currently in-flight (pending completion). 
@@ -921,6 +1535,10 @@ DLLExport int MQTTAsync_waitForCompletion(MQTTAsync handle, MQTTAsync_token dt,
   * note:</b> This function does not free the memory allocated to a message 
   * topic string. It is the responsibility of the client application to free 
   * this memory using the MQTTAsync_free() library function.
+  * <p>The payload of a message received from the server is not copied: it
+  * refers to the buffer the packet was read into, which is kept until this
+  * function is called.  Only messages passed to the application by the
+  * library can be freed with this function.
   * @param msg The address of a pointer to the ::MQTTAsync_message structure 
   * to be freed.
   */
@@ -985,6 +1603,15 @@ typedef void MQTTAsync_traceCallback(enum MQTTASYNC_TRACE_LEVELS level, char* me
   */
 DLLExport void MQTTAsync_setTraceCallback(MQTTAsync_traceCallback* callback);
 
+/** 
+  * This function writes the trace entries held in memory to a file.  Each thread keeps its
+  * most recent entries, at or above the trace level, in a ring buffer without formatting them,
+  * so the history leading up to a problem can be recovered even when no trace is output.
+  * @param dest the name of the file to write, or "stdout" or "stderr"
+  * @return 0 if successful, -1 if the file could not be opened
+  */
+DLLExport int MQTTAsync_dumpTrace(char* dest);
+
 
 typedef struct
 {
@@ -1436,6 +2063,10 @@ exit:
   * Choosing ::MQTTASYNC_TRACE_ERROR will cause ERROR, SEVERE and FATAL trace entries to be returned
   * to the callback function.
   *
+  * Trace entries at or above the trace level are also kept in memory, in a ring buffer for each
+  * thread, whether or not they are output.  They are only formatted when they are output or when
+  * MQTTAsync_dumpTrace() writes them out, so this history is cheap enough to leave on.
+  *
   * ### MQTT Packet Tracing
   * 
   * A feature that can be very useful is printing the MQTT packets that are sent and received.  To 
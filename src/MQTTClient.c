@@ -52,6 +52,7 @@
 #include "SocketBuffer.h"
 #include "StackTrace.h"
 #include "Heap.h"
+#include "Pool.h"
 
 #if defined(OPENSSL)
 #include <openssl/ssl.h>
@@ -81,6 +82,7 @@ static mutex_type socket_mutex = NULL;
 extern mutex_type stack_mutex;
 extern mutex_type heap_mutex;
 extern mutex_type log_mutex;
+extern mutex_type pool_mutex;
 BOOL APIENTRY DllMain(HANDLE hModule,
 					  DWORD  ul_reason_for_call,
 					  LPVOID lpReserved)
@@ -95,12 +97,15 @@ BOOL APIENTRY DllMain(HANDLE hModule,
 				stack_mutex = CreateMutex(NULL, 0, NULL);
 				heap_mutex = CreateMutex(NULL, 0, NULL);
 				log_mutex = CreateMutex(NULL, 0, NULL);
+				pool_mutex = CreateMutex(NULL, 0, NULL);
 				socket_mutex = CreateMutex(NULL, 0, NULL);
 			}
 		case DLL_THREAD_ATTACH:
 			Log(TRACE_MAX, -1, "DLL thread attach");
 		case DLL_THREAD_DETACH:
 			Log(TRACE_MAX, -1, "DLL thread detach");
+			Pool_threadEnd(); /* return the thread's cached objects to the pools */
+			Log_threadEnd(); /* let a new thread reuse the thread's trace ring */
 		case DLL_PROCESS_DETACH:
 			Log(TRACE_MAX, -1, "DLL process detach");
 	}
@@ -130,7 +135,6 @@ void MQTTClient_init()
 
 static volatile int initialized = 0;
 static List* handles = NULL;
-static time_t last;
 static int running = 0;
 static int tostop = 0;
 static thread_id_type run_id = 0;
@@ -149,6 +153,7 @@ typedef struct
 	char* topicName;
 	int topicLen;
 	unsigned int seqno; /* only used on restore */
+	ListElement link; /* links the entry into the message queue */
 } qEntry;
 
 
@@ -347,15 +352,15 @@ void MQTTClient_emptyMessageQueue(Clients* client)
 	/* empty message queue */
 	if (client->messageQueue->count > 0)
 	{
-		ListElement* current = NULL;
-		while (ListNextElement(client->messageQueue, &current))
+		qEntry* qe = NULL;
+
+		while ((qe = ListDetachHeadElement(client->messageQueue)) != NULL)
 		{
-			qEntry* qe = (qEntry*)(current->content);
 			free(qe->topicName);
 			free(qe->msg->payload);
 			free(qe->msg);
+			free(qe);
 		}
-		ListEmpty(client->messageQueue);
 	}
 	FUNC_EXIT;
 }
@@ -436,7 +441,8 @@ int MQTTClient_deliverMessage(int rc, MQTTClients* m, char** topicName, int* top
 	if (m->c->persistence)
 		MQTTPersistence_unpersistQueueEntry(m->c, (MQTTPersistence_qEntry*)qe);
 #endif
-	ListRemove(m->c->messageQueue, m->c->messageQueue->first->content);
+	ListDetachElement(m->c->messageQueue, &qe->link);
+	free(qe);
 	FUNC_EXIT_RC(rc);
 	return rc;
 }
@@ -548,7 +554,10 @@ thread_return_type WINAPI MQTTClient_run(void* n)
 				 * so we must be careful how we use it.
 				 */
 				if (rc)
-					ListRemove(m->c->messageQueue, qe);
+				{
+					ListDetachElement(m->c->messageQueue, &qe->link);
+					free(qe);
+				}
 				else
 					Log(TRACE_MIN, -1, "False returned from messageArrived for client %s, message remains on queue",
 						m->c->clientID);
@@ -698,6 +707,7 @@ void MQTTClient_closeSession(Clients* client)
 	}
 	client->connected = 0;
 	client->connect_state = 0;
+	MQTTProtocol_stopReplay(client);
 
 	if (client->cleansession)
 		MQTTClient_cleanSession(client);
@@ -713,6 +723,7 @@ int MQTTClient_cleanSession(Clients* client)
 #if !defined(NO_PERSISTENCE)
 	rc = MQTTPersistence_clear(client);
 #endif
+	MQTTProtocol_stopReplay(client);
 	MQTTProtocol_emptyMessageList(client->inboundMsgs);
 	MQTTProtocol_emptyMessageList(client->outboundMsgs);
 	MQTTClient_emptyMessageQueue(client);
@@ -738,9 +749,9 @@ void Protocol_processPublication(Publish* publish, Clients* client)
 	publish->topic = NULL;
 
 	/* If the message is QoS 2, then we have already stored the incoming payload
-	 * in an allocated buffer, so we don't need to copy again.
+	 * in an allocated buffer, so we don't need to copy again, unless it is in an input buffer.
 	 */
-	if (publish->header.bits.qos == 2)
+	if (publish->header.bits.qos == 2 && publish->buffer == NULL)
 		mm->payload = publish->payload;
 	else
 	{
@@ -757,7 +768,7 @@ void Protocol_processPublication(Publish* publish, Clients* client)
 		mm->dup = publish->header.bits.dup;
 	mm->msgid = publish->msgId;
 
-	ListAppend(client->messageQueue, qe, sizeof(qe) + sizeof(mm) + mm->payloadlen + strlen(qe->topicName)+1);
+	ListAppendNoMalloc(client->messageQueue, qe, &qe->link, sizeof(qe) + sizeof(mm) + mm->payloadlen + strlen(qe->topicName)+1);
 #if !defined(NO_PERSISTENCE)
 	if (client->persistence)
 		MQTTPersistence_persistQueueEntry(client, (MQTTPersistence_qEntry*)qe);
@@ -900,24 +911,19 @@ int MQTTClient_connectURIVersion(MQTTClient handle, MQTTClient_connectOptions* o
 				m->c->connected = 1;
 				m->c->good = 1;
 				m->c->connect_state = 0;
+				MQTTProtocol_startKeepalive(m->c);
 				if (MQTTVersion == 4)
 					sessionPresent = connack->flags.bits.sessionPresent;
 				if (m->c->cleansession)
 					rc = MQTTClient_cleanSession(m->c);
 				if (m->c->outboundMsgs->count > 0)
 				{
-					ListElement* outcurrent = NULL;
-
-					while (ListNextElement(m->c->outboundMsgs, &outcurrent))
-					{
-						Messages* m = (Messages*)(outcurrent->content);
-						m->lastTouch = 0;
-					}
-					MQTTProtocol_retry((time_t)0, 1, 1);
+					MQTTProtocol_retries(m->c);
 					if (m->c->connected != 1)
 						rc = MQTTCLIENT_DISCONNECTED;
 				}
 			}
+			MQTTProperties_free(&connack->properties);
 			free(connack);
 			m->pack = NULL;
 		}
@@ -1450,7 +1456,10 @@ int MQTTClient_publish(MQTTClient handle, const char* topicName, int payloadlen,
 	p->payload = payload;
 	p->payloadlen = payloadlen;
 	p->topic = (char*)topicName;
+	p->topiclen = strlen(topicName);
+	p->topicEncoded = 0;
 	p->msgId = msgid;
+	p->buffer = NULL;
 
 	rc = MQTTProtocol_startPublish(m->c, p, qos, retained, &msg);
 
@@ -1518,20 +1527,13 @@ exit:
 }
 
 
+/**
+ * Keepalive and retry processing: run the callbacks of any timers which have expired.
+ */
 void MQTTClient_retry(void)
 {
-	time_t now;
-
 	FUNC_ENTRY;
-	time(&(now));
-	if (difftime(now, last) > 5)
-	{
-		time(&(last));
-		MQTTProtocol_keepalive(now);
-		MQTTProtocol_retry(now, 1, 0);
-	}
-	else
-		MQTTProtocol_retry(now, 0, 0);
+	TimerWheel_run(&state.timers, Timer_now());
 	FUNC_EXIT;
 }
 
@@ -1940,15 +1942,15 @@ void MQTTProtocol_checkPendingWrites()
 		ListElement* le = state.pending_writes.first;
 		while (le)
 		{
-			if (Socket_noPendingWrites(((pending_write*)(le->content))->socket))
+			pending_write* pw = (pending_write*)(le->content);
+
+			le = le->next;
+			if (Socket_noPendingWrites(pw->socket))
 			{
-				MQTTProtocol_removePublication(((pending_write*)(le->content))->p);
-				state.pending_writes.current = le;
-				ListRemove(&(state.pending_writes), le->content); /* does NextElement itself */
-				le = state.pending_writes.current;
+				MQTTProtocol_removePublication(pw->p);
+				ListDetachElement(&(state.pending_writes), &pw->link);
+				free(pw);
 			}
-			else
-				ListNextElement(&(state.pending_writes), &le);
 		}
 	}
 	FUNC_EXIT;
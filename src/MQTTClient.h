@@ -391,6 +391,15 @@ DLLExport int MQTTClient_setCallbacks(MQTTClient handle, void* context, MQTTClie
  * storage and provides some protection against message loss in the case of 
  * unexpected failure.
  * <br>
+ * ::MQTTCLIENT_PERSISTENCE_LOG: Like the default persistence, but messages
+ * are appended to a few segment files rather than written to a file each, so
+ * that files are not created and deleted at the rate messages are sent.
+ * <br>
+ * ::MQTTCLIENT_PERSISTENCE_MEMORY: Keep in-flight messages in memory, and
+ * write them to a snapshot file when the client is destroyed, to be restored
+ * when it is next created. The snapshot is kept until a new one replaces it.
+ * Messages persisted since the last snapshot are lost if the process fails.
+ * <br>
  * ::MQTTCLIENT_PERSISTENCE_USER: Use an application-specific persistence
  * implementation. Using this type of persistence gives control of the 
  * persistence mechanism to the application. The application has to implement
@@ -400,6 +409,9 @@ DLLExport int MQTTClient_setCallbacks(MQTTClient handle, void* context, MQTTClie
  * be set to NULL. For ::MQTTCLIENT_PERSISTENCE_DEFAULT persistence, it
  * should be set to the location of the persistence directory (if set 
  * to NULL, the persistence directory used is the working directory).
+ * The same applies to ::MQTTCLIENT_PERSISTENCE_LOG persistence.
+ * For ::MQTTCLIENT_PERSISTENCE_MEMORY persistence, it is the directory of the
+ * snapshot file, or NULL for no snapshot.
  * Applications that use ::MQTTCLIENT_PERSISTENCE_USER persistence set this
  * argument to point to a valid MQTTClient_persistence structure.
  * @return ::MQTTCLIENT_SUCCESS if the client is successfully created, otherwise
@@ -30,6 +30,17 @@
  * representing the location of the persistence directory. If the context 
  * argument is NULL, the working directory will be used. 
  *
+ * ::MQTTCLIENT_PERSISTENCE_LOG also keeps messages in the persistence
+ * directory, but appends them to a few large segment files rather than
+ * writing each to its own file, which suits high message rates. It is not
+ * available on Windows.
+ *
+ * ::MQTTCLIENT_PERSISTENCE_MEMORY keeps messages in memory, and if a
+ * directory is given as the context, writes them to a snapshot file there
+ * when the client is destroyed. They are restored from it when the client is
+ * next created, so that they survive a clean restart without a file being
+ * written for each message.
+ *
  * To use memory-based persistence, an application passes 
  * ::MQTTCLIENT_PERSISTENCE_NONE as the <i>persistence_type</i> to 
  * MQTTClient_create(). This can lead to message loss in certain situations, 
@@ -73,6 +84,18 @@
   * persistence mechanism (see MQTTClient_create()).
   */
 #define MQTTCLIENT_PERSISTENCE_USER 2
+/**
+  * This <i>persistence_type</i> value specifies a file system-based
+  * persistence mechanism which appends to segment files
+  * (see MQTTClient_create()).
+  */
+#define MQTTCLIENT_PERSISTENCE_LOG 3
+/**
+  * This <i>persistence_type</i> value specifies a memory-based persistence
+  * mechanism which writes a snapshot file when the client is destroyed
+  * (see MQTTClient_create()).
+  */
+#define MQTTCLIENT_PERSISTENCE_MEMORY 4
 
 /** 
   * Application-specific persistence functions must return this error code if 
@@ -0,0 +1,328 @@
+/*******************************************************************************
+ * Copyright (c) 2026 the mruby-mqtt contributors
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *******************************************************************************/
+
+/**
+ * @file
+ * \brief Compression of publication payloads by topic filter.
+ *
+ * Payloads published to a topic matching a filter are compressed with zlib, using the
+ * filter's preset dictionary if it has one, when they are at least the filter's minimum
+ * length and compression makes them shorter.  A compressed payload is the marker
+ * 0x00 'M' 'Q' 'Z', the length of the original payload as a variable byte integer, and
+ * the zlib stream.  The zlib header identifies the dictionary, so a receiver can find it
+ * among its own filters.
+ *
+ * Each filter keeps a deflate stream, which is locked by the filter's own mutex while a
+ * payload is compressed, so that the threads publishing to different filters do not wait
+ * for each other or for the client's mutex.
+ */
+
+#include "MQTTCompression.h"
+#include "MQTTPacket.h"
+#include "MQTTProtocolClient.h"
+#include "Log.h"
+#include "StackTrace.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "Heap.h"
+
+static const char MQTTCompression_marker[MQTTCOMPRESSION_MARKER_LEN] = {'\0', 'M', 'Q', 'Z'};
+
+
+/**
+ * Does a topic match a topic filter, as a subscription would?
+ * @param topicFilter the topic filter, which may include the wildcards + and #
+ * @param topic the topic name
+ * @return boolean
+ */
+int MQTTCompression_topicMatches(const char* topicFilter, const char* topic)
+{
+	if (topic[0] == '$' && (topicFilter[0] == '+' || topicFilter[0] == '#'))
+		return 0; /* wildcards at the first level don't match system topics */
+	while (*topicFilter && *topic)
+	{
+		if (*topicFilter == '#')
+			return 1;
+		if (*topicFilter == '+')
+		{
+			while (*topic && *topic != '/')
+				++topic;
+			++topicFilter;
+		}
+		else if (*topicFilter++ != *topic++)
+			return 0;
+	}
+	if (*topic == '\0')
+	{	/* "a/#" and "a/+" match "a/", and "a/#" matches "a" too */
+		if (*topicFilter == '\0' || strcmp(topicFilter, "#") == 0 || strcmp(topicFilter, "/#") == 0)
+			return 1;
+		return (*topicFilter == '+' && topicFilter[1] == '\0' && topic[-1] == '/');
+	}
+	return 0;
+}
+
+
+/**
+ * Create a compression table
+ * @param count the number of topic filters, each of which must be set with MQTTCompression_setFilter()
+ * @return the table
+ */
+MQTTCompression* MQTTCompression_create(int count)
+{
+	MQTTCompression* compression = malloc(sizeof(MQTTCompression));
+
+	FUNC_ENTRY;
+	compression->count = count;
+	compression->filters = malloc(count * sizeof(MQTTCompression_filter));
+	memset(compression->filters, '\0', count * sizeof(MQTTCompression_filter));
+	compression->inflater = NULL;
+	FUNC_EXIT;
+	return compression;
+}
+
+
+/**
+ * Set one of the topic filters of a compression table
+ * @param compression the table
+ * @param i the index of the filter
+ * @param topicFilter the topic filter, which is copied
+ * @param minBytes the length of the shortest payload to compress
+ * @param level the zlib compression level, from 1 to 9, or -1 for the default
+ * @param dictionary the preset dictionary, which is copied, or NULL
+ * @param dictionaryLen the length of the dictionary
+ * @return 0 on success, -1 if the level is not valid
+ */
+int MQTTCompression_setFilter(MQTTCompression* compression, int i, const char* topicFilter, int minBytes,
+	int level, const void* dictionary, int dictionaryLen)
+{
+	MQTTCompression_filter* filter = &compression->filters[i];
+	int rc = 0;
+
+	FUNC_ENTRY;
+	if (level != Z_DEFAULT_COMPRESSION && (level < Z_BEST_SPEED || level > Z_BEST_COMPRESSION))
+	{
+		rc = -1;
+		goto exit;
+	}
+	filter->topicFilter = MQTTStrdup(topicFilter);
+	filter->minBytes = minBytes;
+	filter->level = level;
+	if (dictionary && dictionaryLen > 0)
+	{
+		filter->dictionary = malloc(dictionaryLen);
+		memcpy(filter->dictionary, dictionary, dictionaryLen);
+		filter->dictionaryLen = dictionaryLen;
+		filter->dictionaryId = adler32(adler32(0L, Z_NULL, 0), filter->dictionary, dictionaryLen);
+	}
+	filter->mutex = Thread_create_mutex();
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+ * Compress a payload, if its topic matches a filter and compression makes it shorter.
+ * @param compression the table
+ * @param topic the topic the payload is published to
+ * @param payload the payload
+ * @param payloadlen the length of the payload
+ * @param compressed set to the compressed payload, which the caller frees
+ * @param compressedlen set to the length of the compressed payload
+ * @return boolean - was the payload compressed?
+ */
+int MQTTCompression_deflate(MQTTCompression* compression, const char* topic, const char* payload,
+	int payloadlen, char** compressed, int* compressedlen)
+{
+	MQTTCompression_filter* filter = NULL;
+	z_stream* strm = NULL;
+	char* buf = NULL;
+	int headerlen, i, rc = 0;
+
+	FUNC_ENTRY;
+	for (i = 0; i < compression->count; ++i)
+	{
+		if (MQTTCompression_topicMatches(compression->filters[i].topicFilter, topic))
+		{
+			filter = &compression->filters[i];
+			break;
+		}
+	}
+	if (filter == NULL || payloadlen < filter->minBytes || payloadlen <= MQTTCOMPRESSION_MARKER_LEN + 1)
+		goto exit;
+
+	Thread_lock_mutex(filter->mutex);
+	if ((strm = filter->deflater) == NULL)
+	{
+		strm = malloc(sizeof(z_stream));
+		memset(strm, '\0', sizeof(z_stream));
+		if (deflateInit(strm, filter->level) != Z_OK)
+		{
+			free(strm);
+			goto unlock;
+		}
+		filter->deflater = strm;
+	}
+	else
+		deflateReset(strm);
+	if (filter->dictionary)
+		deflateSetDictionary(strm, filter->dictionary, filter->dictionaryLen);
+
+	/* only worth sending if it is shorter, so the output never needs to be longer than the input */
+	buf = malloc(payloadlen);
+	memcpy(buf, MQTTCompression_marker, MQTTCOMPRESSION_MARKER_LEN);
+	headerlen = MQTTCOMPRESSION_MARKER_LEN + MQTTPacket_encode(buf + MQTTCOMPRESSION_MARKER_LEN, payloadlen);
+	strm->next_in = (Bytef*)payload;
+	strm->avail_in = payloadlen;
+	strm->next_out = (Bytef*)buf + headerlen;
+	strm->avail_out = (payloadlen > headerlen) ? payloadlen - headerlen : 0;
+	if (deflate(strm, Z_FINISH) == Z_STREAM_END)
+	{
+		*compressed = buf;
+		*compressedlen = headerlen + (int)strm->total_out;
+		rc = 1;
+	}
+	else
+		free(buf);
+unlock:
+	Thread_unlock_mutex(filter->mutex);
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+ * Decompress a payload, if its topic matches a filter and it starts with the marker.
+ * Called on the receive thread only.
+ * @param compression the table
+ * @param topic the topic the payload was published to
+ * @param payload the payload
+ * @param payloadlen the length of the payload
+ * @param maxlen the longest original payload accepted.  The length is declared by the sender,
+ * so a longer one is passed on compressed rather than allocated.
+ * @param inflated set to the original payload, which the caller frees
+ * @param inflatedlen set to the length of the original payload
+ * @return boolean - was the payload decompressed?  If it could not be, it is passed on as it is.
+ */
+int MQTTCompression_inflate(MQTTCompression* compression, const char* topic, const char* payload,
+	int payloadlen, int maxlen, char** inflated, int* inflatedlen)
+{
+	z_stream* strm = compression->inflater;
+	char* ptr = (char*)payload + MQTTCOMPRESSION_MARKER_LEN;
+	char* buf = NULL;
+	int i, len = 0, zrc, rc = 0;
+
+	FUNC_ENTRY;
+	if (payloadlen <= MQTTCOMPRESSION_MARKER_LEN ||
+		memcmp(payload, MQTTCompression_marker, MQTTCOMPRESSION_MARKER_LEN) != 0 ||
+		MQTTPacket_decodeBuf(&ptr, (char*)payload + payloadlen, &len) == 0)
+		goto exit;
+	for (i = 0; i < compression->count; ++i)
+		if (MQTTCompression_topicMatches(compression->filters[i].topicFilter, topic))
+			break;
+	if (i == compression->count)
+		goto exit;
+	if (len > maxlen)
+	{
+		Log(LOG_ERROR, -1, "Compressed payload on topic %s declares %d bytes, more than the limit of %d, not decompressed",
+			topic, len, maxlen);
+		goto exit;
+	}
+
+	if (strm == NULL)
+	{
+		strm = malloc(sizeof(z_stream));
+		memset(strm, '\0', sizeof(z_stream));
+		if (inflateInit(strm) != Z_OK)
+		{
+			free(strm);
+			goto exit;
+		}
+		compression->inflater = strm;
+	}
+	else
+		inflateReset(strm);
+
+	buf = malloc((len > 0) ? len : 1);
+	strm->next_in = (Bytef*)ptr;
+	strm->avail_in = (uInt)(payload + payloadlen - ptr);
+	strm->next_out = (Bytef*)buf;
+	strm->avail_out = len;
+	while ((zrc = inflate(strm, Z_FINISH)) == Z_NEED_DICT)
+	{
+		for (i = 0; i < compression->count; ++i)
+		{
+			MQTTCompression_filter* filter = &compression->filters[i];
+
+			if (filter->dictionary && filter->dictionaryId == strm->adler)
+				break;
+		}
+		if (i == compression->count ||
+			inflateSetDictionary(strm, compression->filters[i].dictionary, compression->filters[i].dictionaryLen) != Z_OK)
+			break;
+	}
+	if (zrc == Z_STREAM_END && strm->total_out == (uLong)len)
+	{
+		*inflated = buf;
+		*inflatedlen = len;
+		rc = 1;
+	}
+	else
+	{
+		Log(LOG_ERROR, -1, "Compressed payload on topic %s could not be decompressed, zlib rc %d", topic, zrc);
+		free(buf);
+	}
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+ * Free a compression table, and the streams of its filters
+ * @param compression the table
+ */
+void MQTTCompression_free(MQTTCompression* compression)
+{
+	int i;
+
+	FUNC_ENTRY;
+	for (i = 0; i < compression->count; ++i)
+	{
+		MQTTCompression_filter* filter = &compression->filters[i];
+
+		if (filter->topicFilter == NULL)
+			continue; /* not set */
+		free(filter->topicFilter);
+		if (filter->dictionary)
+			free(filter->dictionary);
+		if (filter->deflater)
+		{
+			deflateEnd(filter->deflater);
+			free(filter->deflater);
+		}
+		Thread_destroy_mutex(filter->mutex);
+	}
+	free(compression->filters);
+	if (compression->inflater)
+	{
+		inflateEnd(compression->inflater);
+		free(compression->inflater);
+	}
+	free(compression);
+	FUNC_EXIT;
+}
@@ -0,0 +1,60 @@
+/*******************************************************************************
+ * Copyright (c) 2026 the mruby-mqtt contributors
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *******************************************************************************/
+
+#if !defined(MQTTCOMPRESSION_H)
+#define MQTTCOMPRESSION_H
+
+#include "Thread.h"
+
+/** the length of the marker at the start of a compressed payload */
+#define MQTTCOMPRESSION_MARKER_LEN 4
+
+/** the longest payload decompressed when the client sets no smaller inbound limit */
+#define MQTTCOMPRESSION_MAX_INFLATED (16 * 1024 * 1024)
+
+/**
+ * The compression of the payloads published to the topics matching one topic filter
+ */
+typedef struct
+{
+	char* topicFilter;			/**< the topic filter, which may include wildcards */
+	int minBytes;				/**< payloads shorter than this are not compressed */
+	int level;					/**< the zlib compression level */
+	unsigned char* dictionary;	/**< the preset dictionary, or NULL */
+	int dictionaryLen;			/**< the length of the dictionary */
+	unsigned long dictionaryId;	/**< the Adler-32 checksum of the dictionary, which identifies it */
+	mutex_type mutex;			/**< serializes the use of the deflate stream */
+	void* deflater;				/**< the deflate stream, reset for each payload */
+} MQTTCompression_filter;
+
+/**
+ * The topic filters a client compresses payloads for, in the order they were given
+ */
+typedef struct
+{
+	int count;							/**< the number of filters */
+	MQTTCompression_filter* filters;	/**< the filters */
+	void* inflater;						/**< the inflate stream, used on the receive thread only */
+} MQTTCompression;
+
+int MQTTCompression_topicMatches(const char* topicFilter, const char* topic);
+MQTTCompression* MQTTCompression_create(int count);
+int MQTTCompression_setFilter(MQTTCompression* compression, int i, const char* topicFilter, int minBytes,
+	int level, const void* dictionary, int dictionaryLen);
+int MQTTCompression_deflate(MQTTCompression* compression, const char* topic, const char* payload,
+	int payloadlen, char** compressed, int* compressedlen);
+int MQTTCompression_inflate(MQTTCompression* compression, const char* topic, const char* payload,
+	int payloadlen, int maxlen, char** inflated, int* inflatedlen);
+void MQTTCompression_free(MQTTCompression* compression);
+
+#endif
@@ -29,6 +29,7 @@
 	#include "MQTTPersistence.h"
 #endif
 #include "Messages.h"
+#include "SocketBuffer.h"
 #include "StackTrace.h"
 
 #include <stdlib.h>
@@ -40,6 +41,8 @@
 #define min(A,B) ( (A) < (B) ? (A):(B))
 #endif
 
+#define MAX_NO_OF_REMAINING_LENGTH_BYTES 4
+
 /**
  * List of the predefined MQTT v3 packet names.
  */
@@ -86,6 +89,58 @@ pf new_packets[] =
 };
 
 
+/**
+ * Replaces the topic alias of a received MQTT 5.0 PUBLISH with its topic.  A PUBLISH with
+ * both a topic and an alias sets the alias for the following ones.
+ * @param net the network connection the PUBLISH was received on
+ * @param pack the PUBLISH
+ * @return 1 on success, 0 if the alias is not valid
+ */
+static int MQTTPacket_resolveTopicAlias(networkHandles* net, Publish* pack)
+{
+	const char* topic = NULL;
+
+	if (pack->topiclen > 0)
+		return MQTTTopicAliases_setInbound(&net->aliases, pack->topicAlias, pack->topic);
+	if ((topic = MQTTTopicAliases_inbound(&net->aliases, pack->topicAlias)) == NULL)
+		return 0;
+	free(pack->topic);
+	pack->topiclen = strlen(topic);
+	pack->topic = malloc(pack->topiclen + 1);
+	memcpy(pack->topic, topic, pack->topiclen + 1);
+	return 1;
+}
+
+
+#if !defined(NO_PERSISTENCE)
+/**
+ * Persists a QoS 1 or 2 PUBLISH.  Whichever MQTT version it is sent or received with, it
+ * is stored in the MQTT 3.1.1 layout, with its full topic and without properties, so that
+ * it can be restored and sent again whatever the version of the next connection.
+ * @param net the network connection
+ * @param header the MQTT header byte
+ * @param pack the PUBLISH
+ * @param scr 0 for a PUBLISH being sent, 1 for one received
+ * @return 0 on success, #MQTTCLIENT_PERSISTENCE_ERROR otherwise
+ */
+static int MQTTPacket_persistPublish(networkHandles* net, Header header, Publish* pack, int scr)
+{
+	char buf[MQTTPACKET_HEADER_LEN], topiclen[2], msgid[2];
+	char* ptr = topiclen;
+	char* bufs[4] = {topiclen, pack->topic, msgid, pack->payload};
+	size_t lens[4] = {2, pack->topiclen, 2, pack->payloadlen};
+	int buf0len;
+
+	writeInt(&ptr, lens[1]);
+	ptr = msgid;
+	writeInt(&ptr, pack->msgId);
+	buf[0] = header.byte;
+	buf0len = 1 + MQTTPacket_encode(&buf[1], lens[0] + lens[1] + lens[2] + lens[3]);
+	return MQTTPersistence_put(net->socket, buf, buf0len, 4, bufs, lens, PUBLISH, pack->msgId, scr);
+}
+#endif
+
+
 /**
  * Reads one MQTT packet from a socket.
  * @param socket a socket from which to read an MQTT packet
@@ -97,7 +152,6 @@ void* MQTTPacket_Factory(networkHandles* net, int* error)
 	char* data = NULL;
 	static Header header;
 	int remaining_length, ptype;
-	size_t remaining_length_new;
 	void* pack = NULL;
 	int actual_len = 0;
 
@@ -117,6 +171,15 @@ void* MQTTPacket_Factory(networkHandles* net, int* error)
 	if ((*error = MQTTPacket_decode(net, &remaining_length)) != TCPSOCKET_COMPLETE)
 		goto exit; /* packet not read, *error indicates whether SOCKET_ERROR occurred */
 
+	if (net->maxInboundPacket > 0 && 1 + MQTTPacket_VBIlen(remaining_length) + remaining_length > net->maxInboundPacket)
+	{	/* refuse it before allocating anything for it: the rest of the connection can't be read past it */
+		Log(LOG_ERROR, -1, "Packet of %d bytes on socket %d is larger than the maximum of %d, closing",
+			1 + MQTTPacket_VBIlen(remaining_length) + remaining_length, net->socket, net->maxInboundPacket);
+		++(net->oversizedPackets);
+		*error = SOCKET_ERROR;
+		goto exit;
+	}
+
 	/* now read the rest, the variable header and payload */
 #if defined(OPENSSL)
 	data = (net->ssl) ? SSLSocket_getdata(net->ssl, net->socket, remaining_length, &actual_len) : 
@@ -139,21 +202,22 @@ void* MQTTPacket_Factory(networkHandles* net, int* error)
 			Log(TRACE_MIN, 2, NULL, ptype);
 		else
 		{
-			if ((pack = (*new_packets[ptype])(header.byte, data, remaining_length)) == NULL)
+			if ((pack = (*new_packets[ptype])(net->MQTTVersion, header.byte, data, remaining_length)) == NULL)
 				*error = BAD_MQTT_PACKET;
-#if !defined(NO_PERSISTENCE)
-			else if (header.bits.type == PUBLISH && header.bits.qos == 2)
+			else if (header.bits.type == PUBLISH && ((Publish*)pack)->topicAlias &&
+				MQTTPacket_resolveTopicAlias(net, (Publish*)pack) == 0)
 			{
-				int buf0len;
-				char *buf = malloc(10);
-				buf[0] = header.byte;
-				buf0len = 1 + MQTTPacket_encode(&buf[1], remaining_length);
-				remaining_length_new = remaining_length;
-				*error = MQTTPersistence_put(net->socket, buf, buf0len, 1,
-					&data, &remaining_length_new, header.bits.type, ((Publish *)pack)->msgId, 1);
-				free(buf);
+				Log(LOG_ERROR, -1, "Bad topic alias %d received on socket %d", ((Publish*)pack)->topicAlias, net->socket);
+				MQTTPacket_freePublish((Publish*)pack);
+				pack = NULL;
+				*error = BAD_MQTT_PACKET;
 			}
+#if !defined(NO_PERSISTENCE)
+			else if (header.bits.type == PUBLISH && header.bits.qos == 2)
+				*error = MQTTPacket_persistPublish(net, header, (Publish*)pack, 1);
 #endif
+			if (pack && header.bits.type == PUBLISH) /* keep the payload where it was read, rather than copying it */
+				((Publish*)pack)->buffer = SocketBuffer_retainData(data);
 		}
 	}
 	if (pack)
@@ -165,20 +229,21 @@ exit:
 
 
 /**
- * Sends an MQTT packet in one system call write
+ * Sends an MQTT packet in one system call write.  The fixed header is encoded on the stack, and
+ * only copied if the write is interrupted.
  * @param socket the socket to which to write the data
  * @param header the one-byte MQTT header
  * @param buffer the rest of the buffer to write (not including remaining length)
  * @param buflen the length of the data in buffer to be written
+ * @param free 1 to free buffer once written, or SOCKETBUFFER_COPY if buffer is on the caller's stack
  * @return the completion code (TCPSOCKET_COMPLETE etc)
  */
 int MQTTPacket_send(networkHandles* net, Header header, char* buffer, size_t buflen, int free)
 {
 	int rc, buf0len;
-	char *buf;
+	char buf[MQTTPACKET_HEADER_LEN];
 
 	FUNC_ENTRY;
-	buf = malloc(10);
 	buf[0] = header.byte;
 	buf0len = 1 + MQTTPacket_encode(&buf[1], buflen);
 #if !defined(NO_PERSISTENCE)
@@ -200,9 +265,6 @@ int MQTTPacket_send(networkHandles* net, Header header, char* buffer, size_t buf
 		
 	if (rc == TCPSOCKET_COMPLETE)
 		time(&(net->lastSent));
-	
-	if (rc != TCPSOCKET_INTERRUPTED)
-	  free(buf);
 
 	FUNC_EXIT_RC(rc);
 	return rc;
@@ -221,23 +283,13 @@ int MQTTPacket_send(networkHandles* net, Header header, char* buffer, size_t buf
 int MQTTPacket_sends(networkHandles* net, Header header, int count, char** buffers, size_t* buflens, int* frees)
 {
 	int i, rc, buf0len, total = 0;
-	char *buf;
+	char buf[MQTTPACKET_HEADER_LEN];
 
 	FUNC_ENTRY;
-	buf = malloc(10);
 	buf[0] = header.byte;
 	for (i = 0; i < count; i++)
 		total += buflens[i];
 	buf0len = 1 + MQTTPacket_encode(&buf[1], total);
-#if !defined(NO_PERSISTENCE)
-	if (header.bits.type == PUBLISH && header.bits.qos != 0)
-	{   /* persist PUBLISH QoS1 and Qo2 */
-		char *ptraux = buffers[2];
-		int msgId = readInt(&ptraux);
-		rc = MQTTPersistence_put(net->socket, buf, buf0len, count, buffers, buflens,
-			header.bits.type, msgId, 0);
-	}
-#endif
 #if defined(OPENSSL)
 	if (net->ssl)
 		rc = SSLSocket_putdatas(net->ssl, net->socket, buf, buf0len, count, buffers, buflens, frees);
@@ -247,9 +299,6 @@ int MQTTPacket_sends(networkHandles* net, Header header, int count, char** buffe
 		
 	if (rc == TCPSOCKET_COMPLETE)
 		time(&(net->lastSent));
-	
-	if (rc != TCPSOCKET_INTERRUPTED)
-	  free(buf);
 	FUNC_EXIT_RC(rc);
 	return rc;
 }
@@ -280,6 +329,43 @@ int MQTTPacket_encode(char* buf, int length)
 }
 
 
+/**
+ * Gets the number of bytes needed to encode a length according to the MQTT algorithm
+ * @param length the length to be encoded
+ * @return the number of bytes
+ */
+int MQTTPacket_VBIlen(int length)
+{
+	return (length < 128) ? 1 : (length < 16384) ? 2 : (length < 2097152) ? 3 : 4;
+}
+
+
+/**
+ * Decodes a length encoded according to the MQTT algorithm from a buffer
+ * @param pptr pointer to the input buffer - incremented by the number of bytes used & returned
+ * @param enddata pointer to the end of the buffer not to be read beyond
+ * @param value the decoded length returned
+ * @return the number of bytes read, or 0 if the encoding is malformed
+ */
+int MQTTPacket_decodeBuf(char** pptr, char* enddata, int* value)
+{
+	int multiplier = 1;
+	int len = 0;
+	char c;
+
+	*value = 0;
+	do
+	{
+		if (*pptr >= enddata || ++len > MAX_NO_OF_REMAINING_LENGTH_BYTES)
+			return 0;
+		c = readChar(pptr);
+		*value += (c & 127) * multiplier;
+		multiplier *= 128;
+	} while ((c & 128) != 0);
+	return len;
+}
+
+
 /**
  * Decodes the message length according to the MQTT algorithm
  * @param socket the socket from which to read the bytes
@@ -292,7 +378,6 @@ int MQTTPacket_decode(networkHandles* net, int* value)
 	char c;
 	int multiplier = 1;
 	int len = 0;
-#define MAX_NO_OF_REMAINING_LENGTH_BYTES 4
 
 	FUNC_ENTRY;
 	*value = 0;
@@ -438,12 +523,13 @@ void writeUTF(char** pptr, const char* string)
 
 /**
  * Function used in the new packets table to create packets which have only a header.
+ * @param MQTTVersion the MQTT version of the connection
  * @param aHeader the MQTT header byte
  * @param data the rest of the packet
  * @param datalen the length of the rest of the packet
  * @return pointer to the packet structure
  */
-void* MQTTPacket_header_only(unsigned char aHeader, char* data, size_t datalen)
+void* MQTTPacket_header_only(int MQTTVersion, unsigned char aHeader, char* data, size_t datalen)
 {
 	static unsigned char header = 0;
 	header = aHeader;
@@ -472,13 +558,15 @@ int MQTTPacket_send_disconnect(networkHandles *net, const char* clientID)
 
 
 /**
- * Function used in the new packets table to create publish packets.
+ * Function used in the new packets table to create publish packets.  Of the MQTT 5.0
+ * properties, only the topic alias is kept.
+ * @param MQTTVersion the MQTT version of the connection
  * @param aHeader the MQTT header byte
  * @param data the rest of the packet
  * @param datalen the length of the rest of the packet
  * @return pointer to the packet structure
  */
-void* MQTTPacket_publish(unsigned char aHeader, char* data, size_t datalen)
+void* MQTTPacket_publish(int MQTTVersion, unsigned char aHeader, char* data, size_t datalen)
 {
 	Publish* pack = malloc(sizeof(Publish));
 	char* curdata = data;
@@ -486,6 +574,7 @@ void* MQTTPacket_publish(unsigned char aHeader, char* data, size_t datalen)
 
 	FUNC_ENTRY;
 	pack->header.byte = aHeader;
+	pack->topicEncoded = 0;
 	if ((pack->topic = readUTFlen(&curdata, enddata, &pack->topiclen)) == NULL) /* Topic name on which to publish */
 	{
 		free(pack);
@@ -496,8 +585,35 @@ void* MQTTPacket_publish(unsigned char aHeader, char* data, size_t datalen)
 		pack->msgId = readInt(&curdata);
 	else
 		pack->msgId = 0;
+	pack->topicAlias = 0;
+	if (MQTTVersion >= MQTTVERSION_5)
+	{
+		int proplen = 0;
+		char* endprops = NULL;
+
+		if (MQTTPacket_decodeBuf(&curdata, enddata, &proplen) == 0 || enddata - curdata < proplen)
+			goto bad;
+		endprops = curdata + proplen;
+		while (curdata < endprops)
+		{
+			MQTTProperty prop;
+
+			if (!MQTTProperty_read(&prop, &curdata, endprops))
+				goto bad;
+			if (prop.identifier == MQTTPROPERTY_CODE_TOPIC_ALIAS)
+				pack->topicAlias = prop.value.integer2;
+		}
+		if (pack->topiclen == 0 && pack->topicAlias == 0)
+			goto bad;
+	}
 	pack->payload = curdata;
 	pack->payloadlen = datalen-(curdata-data);
+	pack->buffer = NULL;
+	goto exit;
+bad:
+	free(pack->topic);
+	free(pack);
+	pack = NULL;
 exit:
 	FUNC_EXIT;
 	return pack;
@@ -513,6 +629,8 @@ void MQTTPacket_freePublish(Publish* pack)
 	FUNC_ENTRY;
 	if (pack->topic != NULL)
 		free(pack->topic);
+	if (pack->buffer != NULL)
+		SocketBuffer_releaseData(pack->buffer);
 	free(pack);
 	FUNC_EXIT;
 }
@@ -530,7 +648,7 @@ int MQTTPacket_send_ack(int type, int msgid, int dup, networkHandles *net)
 {
 	Header header;
 	int rc;
-	char *buf = malloc(2);
+	char buf[2];
 	char *ptr = buf;
 
 	FUNC_ENTRY;
@@ -540,8 +658,7 @@ int MQTTPacket_send_ack(int type, int msgid, int dup, networkHandles *net)
 	if (type == PUBREL)
 	    header.bits.qos = 1;
 	writeInt(&ptr, msgid);
-	if ((rc = MQTTPacket_send(net, header, buf, 2, 1)) != TCPSOCKET_INTERRUPTED)
-		free(buf);
+	rc = MQTTPacket_send(net, header, buf, 2, SOCKETBUFFER_COPY);
 	FUNC_EXIT_RC(rc);
 	return rc;
 }
@@ -639,13 +756,15 @@ int MQTTPacket_send_pubcomp(int msgid, networkHandles* net, const char* clientID
 
 
 /**
- * Function used in the new packets table to create acknowledgement packets.
+ * Function used in the new packets table to create acknowledgement packets.  The MQTT 5.0
+ * reason code which may follow the message id is kept, and the properties are ignored.
+ * @param MQTTVersion the MQTT version of the connection
  * @param aHeader the MQTT header byte
  * @param data the rest of the packet
  * @param datalen the length of the rest of the packet
  * @return pointer to the packet structure
  */
-void* MQTTPacket_ack(unsigned char aHeader, char* data, size_t datalen)
+void* MQTTPacket_ack(int MQTTVersion, unsigned char aHeader, char* data, size_t datalen)
 {
 	Ack* pack = malloc(sizeof(Ack));
 	char* curdata = data;
@@ -653,13 +772,38 @@ void* MQTTPacket_ack(unsigned char aHeader, char* data, size_t datalen)
 	FUNC_ENTRY;
 	pack->header.byte = aHeader;
 	pack->msgId = readInt(&curdata);
+	pack->rc = 0;
+	if (MQTTVersion >= MQTTVERSION_5 && pack->header.bits.type != UNSUBACK && datalen > 2)
+		pack->rc = readChar(&curdata); /* an UNSUBACK has its properties first, then a reason code per topic */
 	FUNC_EXIT;
 	return pack;
 }
 
 
 /**
- * Send an MQTT PUBLISH packet down a socket.
+ * Calculate the length of a PUBLISH packet, as limited by the MQTT 5.0 maximum packet size.
+ * The length is the largest the packet can be, sent with its full topic and a topic alias.
+ * @param MQTTVersion the MQTT version of the connection
+ * @param topic the topic
+ * @param qos the QoS
+ * @param payloadlen the length of the payload
+ * @return the length in bytes, including the fixed header
+ */
+int MQTTPacket_publishLength(int MQTTVersion, const char* topic, int qos, int payloadlen)
+{
+	int remaining_length = 2 + strlen(topic) + payloadlen;
+
+	if (qos > 0)
+		remaining_length += 2;
+	if (MQTTVersion >= MQTTVERSION_5)
+		remaining_length += 4; /* property length and topic alias */
+	return 1 + MQTTPacket_VBIlen(remaining_length) + remaining_length;
+}
+
+
+/**
+ * Send an MQTT PUBLISH packet down a socket.  In MQTT 5.0 the topic is replaced by a topic
+ * alias, once the alias has been sent with the topic on the same connection.
  * @param pack a structure from which to get some values to use, e.g topic, payload
  * @param dup boolean - whether to set the MQTT DUP flag
  * @param qos the value to use for the MQTT QoS setting
@@ -671,43 +815,88 @@ void* MQTTPacket_ack(unsigned char aHeader, char* data, size_t datalen)
 int MQTTPacket_send_publish(Publish* pack, int dup, int qos, int retained, networkHandles* net, const char* clientID)
 {
 	Header header;
-	char *topiclen;
+	char topiclen[2];
 	int rc = -1;
 
 	FUNC_ENTRY;
-	topiclen = malloc(2);
-
 	header.bits.type = PUBLISH;
 	header.bits.dup = dup;
 	header.bits.qos = qos;
 	header.bits.retain = retained;
+#if !defined(NO_PERSISTENCE)
 	if (qos > 0)
+		MQTTPacket_persistPublish(net, header, pack, 0);
+#endif
+	if (net->MQTTVersion >= MQTTVERSION_5)
 	{
-		char *buf = malloc(2);
+		char buf[6]; /* the message id and properties, which hold only the topic alias */
+		char* ptr = buf;
+		char* bufs[4] = {topiclen, pack->topic, buf, pack->payload};
+		size_t lens[4] = {2, 0, 0, pack->payloadlen};
+		int frees[4] = {SOCKETBUFFER_COPY, 0, SOCKETBUFFER_COPY, 0};
+		int known = 0, alias = MQTTTopicAliases_outbound(&net->aliases, pack->topic, &known);
+
+		if (qos > 0)
+			writeInt(&ptr, pack->msgId);
+		if (alias > 0)
+		{
+			writeChar(&ptr, 3);
+			writeChar(&ptr, MQTTPROPERTY_CODE_TOPIC_ALIAS);
+			writeInt(&ptr, alias);
+		}
+		else
+			writeChar(&ptr, 0);
+		lens[1] = (known) ? 0 : pack->topiclen;
+		lens[2] = ptr - buf;
+		if (pack->topicEncoded && !known)
+		{
+			bufs[0] = pack->topic - 2;
+			frees[0] = 0;
+		}
+		else
+		{
+			ptr = topiclen;
+			writeInt(&ptr, lens[1]);
+		}
+		rc = MQTTPacket_sends(net, header, 4, bufs, lens, frees);
+	}
+	else if (qos > 0)
+	{
+		char buf[2];
 		char *ptr = buf;
 		char* bufs[4] = {topiclen, pack->topic, buf, pack->payload};
-		size_t lens[4] = {2, strlen(pack->topic), 2, pack->payloadlen};
-		int frees[4] = {1, 0, 1, 0};
+		size_t lens[4] = {2, pack->topiclen, 2, pack->payloadlen};
+		int frees[4] = {SOCKETBUFFER_COPY, 0, SOCKETBUFFER_COPY, 0};
 
 		writeInt(&ptr, pack->msgId);
-		ptr = topiclen;
-		writeInt(&ptr, lens[1]);
+		if (pack->topicEncoded)
+		{
+			bufs[0] = pack->topic - 2;
+			frees[0] = 0;
+		}
+		else
+		{
+			ptr = topiclen;
+			writeInt(&ptr, lens[1]);
+		}
 		rc = MQTTPacket_sends(net, header, 4, bufs, lens, frees);
-		if (rc != TCPSOCKET_INTERRUPTED)
-			free(buf);
 	}
 	else
 	{
 		char* ptr = topiclen;
 		char* bufs[3] = {topiclen, pack->topic, pack->payload};
-		size_t lens[3] = {2, strlen(pack->topic), pack->payloadlen};
-		int frees[3] = {1, 0, 0};
+		size_t lens[3] = {2, pack->topiclen, pack->payloadlen};
+		int frees[3] = {SOCKETBUFFER_COPY, 0, 0};
 
-		writeInt(&ptr, lens[1]);
+		if (pack->topicEncoded)
+		{
+			bufs[0] = pack->topic - 2;
+			frees[0] = 0;
+		}
+		else
+			writeInt(&ptr, lens[1]);
 		rc = MQTTPacket_sends(net, header, 3, bufs, lens, frees);
 	}
-	if (rc != TCPSOCKET_INTERRUPTED)
-		free(topiclen);
 	if (qos == 0)
 		Log(LOG_PROTOCOL, 27, NULL, net->socket, clientID, retained, rc);
 	else
@@ -727,6 +916,11 @@ void MQTTPacket_free_packet(MQTTPacket* pack)
 	FUNC_ENTRY;
 	if (pack->header.bits.type == PUBLISH)
 		MQTTPacket_freePublish((Publish*)pack);
+	else if (pack->header.bits.type == CONNACK)
+	{
+		MQTTProperties_free(&((Connack*)pack)->properties);
+		free(pack);
+	}
 	/*else if (pack->header.type == SUBSCRIBE)
 		MQTTPacket_freeSubscribe((Subscribe*)pack, 1);
 	else if (pack->header.type == UNSUBSCRIBE)
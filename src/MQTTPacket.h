@@ -25,6 +25,7 @@
 #endif
 #include "LinkedList.h"
 #include "Clients.h"
+#include "MQTTProperties.h"
 
 /*BE
 include "Socket"
@@ -33,9 +34,11 @@ include "Clients"
 BE*/
 
 typedef unsigned int bool;
-typedef void* (*pf)(unsigned char, char*, size_t);
+typedef void* (*pf)(int, unsigned char, char*, size_t);
 
 #define BAD_MQTT_PACKET -4
+/** the longest fixed header: the header byte and up to 4 bytes of remaining length */
+#define MQTTPACKET_HEADER_LEN 5
 
 enum msgTypes
 {
@@ -139,6 +142,7 @@ typedef struct
 #endif
 	} flags;	 /**< connack flags byte */
 	char rc; /**< connack return code */
+	MQTTProperties properties; /**< MQTT 5.0 properties */
 } Connack;
 
 
@@ -195,9 +199,12 @@ typedef struct
 	Header header;	/**< MQTT header byte */
 	char* topic;	/**< topic string */
 	int topiclen;
+	int topicEncoded;	/**< 1 if the topic is preceded by its two byte encoded length */
 	int msgId;		/**< MQTT message id */
 	char* payload;	/**< binary payload, length delimited */
 	int payloadlen;	/**< payload length */
+	char* buffer;	/**< reference to the input buffer holding the payload, or NULL */
+	int topicAlias;	/**< MQTT 5.0 topic alias received, or 0 */
 } Publish;
 
 
@@ -208,6 +215,7 @@ typedef struct
 {
 	Header header;	/**< MQTT header byte */
 	int msgId;		/**< MQTT message id */
+	int rc;			/**< MQTT 5.0 reason code of a PUBACK, PUBREC, PUBREL or PUBCOMP, 0 for success */
 } Ack;
 
 typedef Ack Puback;
@@ -218,6 +226,8 @@ typedef Ack Unsuback;
 
 int MQTTPacket_encode(char* buf, int length);
 int MQTTPacket_decode(networkHandles* net, int* value);
+int MQTTPacket_VBIlen(int length);
+int MQTTPacket_decodeBuf(char** pptr, char* enddata, int* value);
 int readInt(char** pptr);
 char* readUTF(char** pptr, char* enddata);
 unsigned char readChar(char** pptr);
@@ -231,14 +241,15 @@ void* MQTTPacket_Factory(networkHandles* net, int* error);
 int MQTTPacket_send(networkHandles* net, Header header, char* buffer, size_t buflen, int free);
 int MQTTPacket_sends(networkHandles* net, Header header, int count, char** buffers, size_t* buflens, int* frees);
 
-void* MQTTPacket_header_only(unsigned char aHeader, char* data, size_t datalen);
+void* MQTTPacket_header_only(int MQTTVersion, unsigned char aHeader, char* data, size_t datalen);
 int MQTTPacket_send_disconnect(networkHandles* net, const char* clientID);
 
-void* MQTTPacket_publish(unsigned char aHeader, char* data, size_t datalen);
+void* MQTTPacket_publish(int MQTTVersion, unsigned char aHeader, char* data, size_t datalen);
 void MQTTPacket_freePublish(Publish* pack);
+int MQTTPacket_publishLength(int MQTTVersion, const char* topic, int qos, int payloadlen);
 int MQTTPacket_send_publish(Publish* pack, int dup, int qos, int retained, networkHandles* net, const char* clientID);
 int MQTTPacket_send_puback(int msgid, networkHandles* net, const char* clientID);
-void* MQTTPacket_ack(unsigned char aHeader, char* data, size_t datalen);
+void* MQTTPacket_ack(int MQTTVersion, unsigned char aHeader, char* data, size_t datalen);
 
 void MQTTPacket_freeSuback(Suback* pack);
 int MQTTPacket_send_pubrec(int msgid, networkHandles* net, const char* clientID);
@@ -36,7 +36,8 @@
 
 
 /**
- * Send an MQTT CONNECT packet down a socket.
+ * Send an MQTT CONNECT packet down a socket.  This starts a new network connection, so the
+ * MQTT version and topic aliases of the client's network handles are reset here.
  * @param client a structure from which to get all the required values
  * @param MQTTVersion the MQTT version to connect with
  * @return the completion code (e.g. TCPSOCKET_COMPLETE)
@@ -45,13 +46,46 @@ int MQTTPacket_send_connect(Clients* client, int MQTTVersion)
 {
 	char *buf, *ptr;
 	Connect packet;
+	MQTTProperties props = MQTTProperties_initializer;
 	int rc = -1, len;
 
 	FUNC_ENTRY;
 	packet.header.byte = 0;
 	packet.header.bits.type = CONNECT;
 
+	client->net.MQTTVersion = MQTTVersion;
+	MQTTTopicAliases_reset(&client->net.aliases, (MQTTVersion >= MQTTVERSION_5) ? client->topicAliasMaximum : 0);
+	if (MQTTVersion >= MQTTVERSION_5 && client->cleansession == 0)
+	{	/* with no expiry interval an MQTT 5.0 server ends the session when the connection closes */
+		MQTTProperty prop;
+
+		memset(&prop, '\0', sizeof(prop));
+		prop.identifier = MQTTPROPERTY_CODE_SESSION_EXPIRY_INTERVAL;
+		prop.value.integer4 = 0xFFFFFFFF; /* never expires, as a session did before MQTT 5.0 */
+		MQTTProperties_add(&props, &prop);
+	}
+	if (MQTTVersion >= MQTTVERSION_5 && client->topicAliasMaximum > 0)
+	{
+		MQTTProperty prop;
+
+		memset(&prop, '\0', sizeof(prop));
+		prop.identifier = MQTTPROPERTY_CODE_TOPIC_ALIAS_MAXIMUM;
+		prop.value.integer2 = client->topicAliasMaximum;
+		MQTTProperties_add(&props, &prop);
+	}
+	if (MQTTVersion >= MQTTVERSION_5 && client->net.maxInboundPacket > 0)
+	{	/* so that the server doesn't send packets we would close the connection for */
+		MQTTProperty prop;
+
+		memset(&prop, '\0', sizeof(prop));
+		prop.identifier = MQTTPROPERTY_CODE_MAXIMUM_PACKET_SIZE;
+		prop.value.integer4 = client->net.maxInboundPacket;
+		MQTTProperties_add(&props, &prop);
+	}
+
 	len = ((MQTTVersion == 3) ? 12 : 10) + strlen(client->clientID)+2;
+	if (MQTTVersion >= MQTTVERSION_5)
+		len += MQTTProperties_len(&props) + ((client->will) ? MQTTProperties_len(NULL) : 0);
 	if (client->will)
 		len += strlen(client->will->topic)+2 + strlen(client->will->msg)+2;
 	if (client->username)
@@ -65,10 +99,10 @@ int MQTTPacket_send_connect(Clients* client, int MQTTVersion)
 		writeUTF(&ptr, "MQIsdp");
 		writeChar(&ptr, (char)3);
 	}
-	else if (MQTTVersion == 4)
+	else if (MQTTVersion == 4 || MQTTVersion == MQTTVERSION_5)
 	{
 		writeUTF(&ptr, "MQTT");
-		writeChar(&ptr, (char)4);
+		writeChar(&ptr, (char)MQTTVersion);
 	}
 	else
 		goto exit;
@@ -89,9 +123,13 @@ int MQTTPacket_send_connect(Clients* client, int MQTTVersion)
 
 	writeChar(&ptr, packet.flags.all);
 	writeInt(&ptr, client->keepAliveInterval);
+	if (MQTTVersion >= MQTTVERSION_5)
+		MQTTProperties_write(&ptr, &props);
 	writeUTF(&ptr, client->clientID);
 	if (client->will)
 	{
+		if (MQTTVersion >= MQTTVERSION_5)
+			MQTTProperties_write(&ptr, NULL); /* no will properties */
 		writeUTF(&ptr, client->will->topic);
 		writeUTF(&ptr, client->will->msg);
 	}
@@ -105,6 +143,7 @@ int MQTTPacket_send_connect(Clients* client, int MQTTVersion)
 exit:
 	if (rc != TCPSOCKET_INTERRUPTED)
 		free(buf);
+	MQTTProperties_free(&props);
 	FUNC_EXIT_RC(rc);
 	return rc;
 }
@@ -112,20 +151,28 @@ exit:
 
 /**
  * Function used in the new packets table to create connack packets.
+ * @param MQTTVersion the MQTT version of the connection
  * @param aHeader the MQTT header byte
  * @param data the rest of the packet
  * @param datalen the length of the rest of the packet
  * @return pointer to the packet structure
  */
-void* MQTTPacket_connack(unsigned char aHeader, char* data, size_t datalen)
+void* MQTTPacket_connack(int MQTTVersion, unsigned char aHeader, char* data, size_t datalen)
 {
 	Connack* pack = malloc(sizeof(Connack));
 	char* curdata = data;
+	char* enddata = &data[datalen];
 
 	FUNC_ENTRY;
 	pack->header.byte = aHeader;
 	pack->flags.all = readChar(&curdata);
 	pack->rc = readChar(&curdata);
+	memset(&pack->properties, '\0', sizeof(MQTTProperties));
+	if (MQTTVersion >= MQTTVERSION_5 && datalen > 2 && !MQTTProperties_read(&pack->properties, &curdata, enddata))
+	{
+		free(pack);
+		pack = NULL;
+	}
 	FUNC_EXIT;
 	return pack;
 }
@@ -178,11 +225,15 @@ int MQTTPacket_send_subscribe(List* topics, List* qoss, int msgid, int dup, netw
 	header.bits.retain = 0;
 
 	datalen = 2 + topics->count * 3; // utf length + char qos == 3
+	if (net->MQTTVersion >= MQTTVERSION_5)
+		datalen += MQTTProperties_len(NULL);
 	while (ListNextElement(topics, &elem))
 		datalen += strlen((char*)(elem->content));
 	ptr = data = malloc(datalen);
 
 	writeInt(&ptr, msgid);
+	if (net->MQTTVersion >= MQTTVERSION_5)
+		MQTTProperties_write(&ptr, NULL);
 	elem = NULL;
 	while (ListNextElement(topics, &elem))
 	{
@@ -200,13 +251,15 @@ int MQTTPacket_send_subscribe(List* topics, List* qoss, int msgid, int dup, netw
 
 
 /**
- * Function used in the new packets table to create suback packets.
+ * Function used in the new packets table to create suback packets.  MQTT 5.0 properties are
+ * skipped, and failure reason codes are all reported as 0x80, the MQTT 3.1.1 failure code.
+ * @param MQTTVersion the MQTT version of the connection
  * @param aHeader the MQTT header byte
  * @param data the rest of the packet
  * @param datalen the length of the rest of the packet
  * @return pointer to the packet structure
  */
-void* MQTTPacket_suback(unsigned char aHeader, char* data, size_t datalen)
+void* MQTTPacket_suback(int MQTTVersion, unsigned char aHeader, char* data, size_t datalen)
 {
 	Suback* pack = malloc(sizeof(Suback));
 	char* curdata = data;
@@ -214,14 +267,29 @@ void* MQTTPacket_suback(unsigned char aHeader, char* data, size_t datalen)
 	FUNC_ENTRY;
 	pack->header.byte = aHeader;
 	pack->msgId = readInt(&curdata);
+	if (MQTTVersion >= MQTTVERSION_5)
+	{
+		int proplen = 0;
+
+		if (MQTTPacket_decodeBuf(&curdata, &data[datalen], &proplen) == 0 || (size_t)(curdata - data) + proplen > datalen)
+		{
+			free(pack);
+			pack = NULL;
+			goto exit;
+		}
+		curdata += proplen;
+	}
 	pack->qoss = ListInitialize();
 	while ((size_t)(curdata - data) < datalen)
 	{
 		int* newint;
 		newint = malloc(sizeof(int));
 		*newint = (int)readChar(&curdata);
+		if (*newint >= 0x80)
+			*newint = 0x80;
 		ListAppend(pack->qoss, newint, sizeof(int));
 	}
+exit:
 	FUNC_EXIT;
 	return pack;
 }
@@ -251,11 +319,15 @@ int MQTTPacket_send_unsubscribe(List* topics, int msgid, int dup, networkHandles
 	header.bits.retain = 0;
 
 	datalen = 2 + topics->count * 2; // utf length == 2
+	if (net->MQTTVersion >= MQTTVERSION_5)
+		datalen += MQTTProperties_len(NULL);
 	while (ListNextElement(topics, &elem))
 		datalen += strlen((char*)(elem->content));
 	ptr = data = malloc(datalen);
 
 	writeInt(&ptr, msgid);
+	if (net->MQTTVersion >= MQTTVERSION_5)
+		MQTTProperties_write(&ptr, NULL);
 	elem = NULL;
 	while (ListNextElement(topics, &elem))
 		writeUTF(&ptr, (char*)(elem->content));
@@ -22,12 +22,12 @@
 #include "MQTTPacket.h"
 
 int MQTTPacket_send_connect(Clients* client, int MQTTVersion);
-void* MQTTPacket_connack(unsigned char aHeader, char* data, size_t datalen);
+void* MQTTPacket_connack(int MQTTVersion, unsigned char aHeader, char* data, size_t datalen);
 
 int MQTTPacket_send_pingreq(networkHandles* net, const char* clientID);
 
 int MQTTPacket_send_subscribe(List* topics, List* qoss, int msgid, int dup, networkHandles* net, const char* clientID);
-void* MQTTPacket_suback(unsigned char aHeader, char* data, size_t datalen);
+void* MQTTPacket_suback(int MQTTVersion, unsigned char aHeader, char* data, size_t datalen);
 
 int MQTTPacket_send_unsubscribe(List* topics, int msgid, int dup, networkHandles* net, const char* clientID);
 
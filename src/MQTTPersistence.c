@@ -23,10 +23,13 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "MQTTPersistence.h"
 #include "MQTTPersistenceDefault.h"
+#include "MQTTPersistenceLog.h"
+#include "MQTTPersistenceMemory.h"
 #include "MQTTProtocolClient.h"
 #include "Heap.h"
 
@@ -76,6 +79,52 @@ int MQTTPersistence_create(MQTTClient_persistence** persistence, int type, void*
 			else
 				rc = MQTTCLIENT_PERSISTENCE_ERROR;
 			break;
+#if !defined(WIN32) && !defined(WIN64)
+		case MQTTCLIENT_PERSISTENCE_LOG :
+			per = malloc(sizeof(MQTTClient_persistence));
+			if ( per != NULL )
+			{
+				if ( pcontext == NULL )
+					pcontext = ".";  /* working directory */
+				per->context = malloc(strlen(pcontext) + 1);
+				strcpy(per->context, pcontext);
+				/* segment file functions */
+				per->popen        = MQTTPersistenceLog_open;
+				per->pclose       = MQTTPersistenceLog_close;
+				per->pput         = MQTTPersistenceLog_put;
+				per->pget         = MQTTPersistenceLog_get;
+				per->premove      = MQTTPersistenceLog_remove;
+				per->pkeys        = MQTTPersistenceLog_keys;
+				per->pclear       = MQTTPersistenceLog_clear;
+				per->pcontainskey = MQTTPersistenceLog_containskey;
+			}
+			else
+				rc = MQTTCLIENT_PERSISTENCE_ERROR;
+			break;
+#endif
+		case MQTTCLIENT_PERSISTENCE_MEMORY :
+			per = malloc(sizeof(MQTTClient_persistence));
+			if ( per != NULL )
+			{
+				per->context = NULL;  /* no snapshot */
+				if ( pcontext != NULL )
+				{
+					per->context = malloc(strlen(pcontext) + 1);
+					strcpy(per->context, pcontext);
+				}
+				/* in-memory functions */
+				per->popen        = MQTTPersistenceMemory_open;
+				per->pclose       = MQTTPersistenceMemory_close;
+				per->pput         = MQTTPersistenceMemory_put;
+				per->pget         = MQTTPersistenceMemory_get;
+				per->premove      = MQTTPersistenceMemory_remove;
+				per->pkeys        = MQTTPersistenceMemory_keys;
+				per->pclear       = MQTTPersistenceMemory_clear;
+				per->pcontainskey = MQTTPersistenceMemory_containskey;
+			}
+			else
+				rc = MQTTCLIENT_PERSISTENCE_ERROR;
+			break;
 		case MQTTCLIENT_PERSISTENCE_USER :
 			per = (MQTTClient_persistence *)pcontext;
 			if ( per == NULL || (per != NULL && (per->context == NULL || per->pclear == NULL ||
@@ -136,6 +185,19 @@ int MQTTPersistence_close(Clients *c)
 #if !defined(NO_PERSISTENCE)
 		if ( c->persistence->popen == pstopen )
 			free(c->persistence);
+#if !defined(WIN32) && !defined(WIN64)
+		else if ( c->persistence->popen == MQTTPersistenceLog_open )
+		{
+			free(c->persistence->context);
+			free(c->persistence);
+		}
+#endif
+		else if ( c->persistence->popen == MQTTPersistenceMemory_open )
+		{
+			if (c->persistence->context)
+				free(c->persistence->context);
+			free(c->persistence);
+		}
 #endif
 		c->persistence = NULL;
 	}
@@ -162,9 +224,29 @@ int MQTTPersistence_clear(Clients *c)
 }
 
 
+/**
+ * qsort callback ordering restored messages by message ID
+ */
+static int MQTTPersistence_msgIdCompare(const void* a, const void* b)
+{
+	return (*(Messages**)a)->msgid - (*(Messages**)b)->msgid;
+}
+
+
+/**
+ * bsearch callback finding a restored message by message ID
+ */
+static int MQTTPersistence_msgIdFind(const void* key, const void* member)
+{
+	return *(int*)key - (*(Messages**)member)->msgid;
+}
+
+
 /**
  * Restores the persisted records to the outbound and inbound message queues of the
- * client.
+ * client.  The keys are listed once.  The sent messages are sorted by message ID once they
+ * have all been read, and then the PUBRELs are matched with them, rather than the store being
+ * searched for each message.
  * @param client the client as ::Clients.
  * @return 0 if success, #MQTTCLIENT_PERSISTENCE_ERROR otherwise.
  */
@@ -177,10 +259,18 @@ int MQTTPersistence_restore(Clients *c)
 	int i = 0;
 	int msgs_sent = 0;
 	int msgs_rcvd = 0;
+	Messages** sent = NULL;	/* the sent messages, to be sorted by message ID */
+	int* pubrels = NULL;	/* the message ID and key index of each PUBREL */
+	int npubrels = 0;
 
 	FUNC_ENTRY;
 	if (c->persistence && (rc = c->persistence->pkeys(c->phandle, &msgkeys, &nkeys)) == 0)
 	{
+		if (nkeys > 0)
+		{
+			sent = malloc(nkeys * sizeof(Messages*));
+			pubrels = malloc(2 * nkeys * sizeof(int));
+		}
 		while (rc == 0 && i < nkeys)
 		{
 			if (strncmp(msgkeys[i], PERSISTENCE_COMMAND_KEY, strlen(PERSISTENCE_COMMAND_KEY)) == 0)
@@ -199,7 +289,7 @@ int MQTTPersistence_restore(Clients *c)
 						msg = MQTTProtocol_createMessage(publish, &msg, publish->header.bits.qos, publish->header.bits.retain);
 						msg->nextMessageType = PUBREL;
 						/* order does not matter for persisted received messages */
-						ListAppend(c->inboundMsgs, msg, msg->len);
+						ListAppendNoMalloc(c->inboundMsgs, msg, &msg->link, msg->len);
 						publish->topic = NULL;
 						MQTTPacket_freePublish(publish);
 						msgs_rcvd++;
@@ -208,31 +298,20 @@ int MQTTPersistence_restore(Clients *c)
 					{
 						Publish* publish = (Publish*)pack;
 						Messages* msg = NULL;
-						char *key = malloc(MESSAGE_FILENAME_LENGTH + 1);
-						sprintf(key, "%s%d", PERSISTENCE_PUBREL, publish->msgId);
 						msg = MQTTProtocol_createMessage(publish, &msg, publish->header.bits.qos, publish->header.bits.retain);
-						if ( c->persistence->pcontainskey(c->phandle, key) == 0 )
-							/* PUBLISH Qo2 and PUBREL sent */
-							msg->nextMessageType = PUBCOMP;
-						/* else: PUBLISH QoS1, or PUBLISH QoS2 and PUBREL not sent */
+						/* PUBLISH QoS1, or PUBLISH QoS2 and PUBREL not sent, unless a PUBREL is found below */
 						/* retry at the first opportunity */
 						msg->lastTouch = 0;
-						MQTTPersistence_insertInOrder(c->outboundMsgs, msg, msg->len);
+						sent[msgs_sent++] = msg;
 						publish->topic = NULL;
 						MQTTPacket_freePublish(publish);
-						free(key);
-						msgs_sent++;
 					}
 					else if ( strstr(msgkeys[i],PERSISTENCE_PUBREL) != NULL )
 					{
-						/* orphaned PUBRELs ? */
 						Pubrel* pubrel = (Pubrel*)pack;
-						char *key = malloc(MESSAGE_FILENAME_LENGTH + 1);
-						sprintf(key, "%s%d", PERSISTENCE_PUBLISH_SENT, pubrel->msgId);
-						if ( c->persistence->pcontainskey(c->phandle, key) != 0 )
-							rc = c->persistence->premove(c->phandle, msgkeys[i]);
+						pubrels[2 * npubrels] = pubrel->msgId;
+						pubrels[2 * npubrels++ + 1] = i;
 						free(pubrel);
-						free(key);
 					}
 				}
 				else  /* pack == NULL -> bad persisted record */
@@ -243,12 +322,28 @@ int MQTTPersistence_restore(Clients *c)
 				free(buffer);
 				buffer = NULL;
 			}
-			if (msgkeys[i])
-				free(msgkeys[i]);
 			i++;
 		}
+		qsort(sent, msgs_sent, sizeof(Messages*), MQTTPersistence_msgIdCompare);
+		for (i = 0; i < npubrels; ++i)
+		{
+			Messages** msg = bsearch(&pubrels[2 * i], sent, msgs_sent, sizeof(Messages*), MQTTPersistence_msgIdFind);
+
+			if (msg)  /* PUBLISH Qo2 and PUBREL sent */
+				(*msg)->nextMessageType = PUBCOMP;
+			else if (rc == 0)  /* orphaned PUBREL */
+				rc = c->persistence->premove(c->phandle, msgkeys[pubrels[2 * i + 1]]);
+		}
+		for (i = 0; i < msgs_sent; ++i)
+			ListAppendNoMalloc(c->outboundMsgs, sent[i], &sent[i]->link, sent[i]->len);
+		for (i = 0; i < nkeys; ++i)
+			free(msgkeys[i]);
 		if (msgkeys)
 			free(msgkeys);
+		if (sent)
+			free(sent);
+		if (pubrels)
+			free(pubrels);
 	}
 	Log(TRACE_MINIMUM, -1, "%d sent messages and %d received messages restored for client %s\n", 
 		msgs_sent, msgs_rcvd, c->clientID);
@@ -288,7 +383,7 @@ void* MQTTPersistence_restorePacket(char* buffer, size_t buflen)
 	{
 		ptype = header.bits.type;
 		if (ptype >= CONNECT && ptype <= DISCONNECT && new_packets[ptype] != NULL)
-			pack = (*new_packets[ptype])(header.byte, ++buffer, remaining_length);
+			pack = (*new_packets[ptype])(MQTTVERSION_3_1_1, header.byte, ++buffer, remaining_length); /* stored in the 3.1.1 layout */
 	}
 
 	FUNC_EXIT;
@@ -296,29 +391,6 @@ void* MQTTPersistence_restorePacket(char* buffer, size_t buflen)
 }
 
 
-/**
- * Inserts the specified message into the list, maintaining message ID order.
- * @param list the list to insert the message into.
- * @param content the message to add.
- * @param size size of the message.
- */
-void MQTTPersistence_insertInOrder(List* list, void* content, size_t size)
-{
-	ListElement* index = NULL;
-	ListElement* current = NULL;
-
-	FUNC_ENTRY;
-	while(ListNextElement(list, &current) != NULL && index == NULL)
-	{
-		if ( ((Messages*)content)->msgid < ((Messages*)current->content)->msgid )
-			index = current;
-	}
-
-	ListInsert(list, content, size, index);
-	FUNC_EXIT;
-}
-
-
 /**
  * Adds a record to the persistent store. This function must not be called for QoS0
  * messages.
@@ -420,6 +492,63 @@ int MQTTPersistence_remove(Clients* c, char *type, int qos, int msgId)
 }
 
 
+/**
+ * Can the records of the client be made durable with MQTTPersistence_sync?  Only the
+ * log-structured store can sync many records at once.  The default store writes a file for
+ * each record, and user stores are left to decide for themselves.
+ * @param c the client as ::Clients.
+ * @return boolean
+ */
+int MQTTPersistence_syncable(Clients* c)
+{
+#if !defined(NO_PERSISTENCE) && !defined(WIN32) && !defined(WIN64)
+	return c->persistence != NULL && c->persistence->popen == MQTTPersistenceLog_open;
+#else
+	return 0;
+#endif
+}
+
+
+/**
+ * Makes the records put to and removed from the persistent store of the client since the
+ * last sync durable.
+ * @param c the client as ::Clients.
+ * @return 0 if success, #MQTTCLIENT_PERSISTENCE_ERROR otherwise.
+ */
+int MQTTPersistence_sync(Clients* c)
+{
+	int rc = 0;
+
+	FUNC_ENTRY;
+#if !defined(NO_PERSISTENCE) && !defined(WIN32) && !defined(WIN64)
+	if (MQTTPersistence_syncable(c) && c->phandle != NULL)
+		rc = MQTTPersistenceLog_sync(c->phandle);
+#endif
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+ * Writes the records of the client's in-memory persistent store to its snapshot file.
+ * @param c the client as ::Clients.
+ * @return 0 if success, #MQTTCLIENT_PERSISTENCE_ERROR otherwise, or if the client's
+ * persistence has no snapshot.
+ */
+int MQTTPersistence_snapshot(Clients* c)
+{
+	int rc = MQTTCLIENT_PERSISTENCE_ERROR;
+
+	FUNC_ENTRY;
+#if !defined(NO_PERSISTENCE)
+	if (c->persistence != NULL && c->persistence->popen == MQTTPersistenceMemory_open && c->phandle != NULL)
+		rc = MQTTPersistenceMemory_snapshot(c->phandle);
+#endif
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
 /**
  * Checks whether the message IDs wrapped by looking for the largest gap between two consecutive
  * message IDs in the outboundMsgs queue.
@@ -577,24 +706,18 @@ MQTTPersistence_qEntry* MQTTPersistence_restoreQueueEntry(char* buffer, size_t b
 }
 
 
-void MQTTPersistence_insertInSeqOrder(List* list, MQTTPersistence_qEntry* qEntry, size_t size)
+/**
+ * qsort callback ordering restored queue entries by sequence number
+ */
+static int MQTTPersistence_seqnoCompare(const void* a, const void* b)
 {
-	ListElement* index = NULL;
-	ListElement* current = NULL;
-
-	FUNC_ENTRY;
-	while (ListNextElement(list, &current) != NULL && index == NULL)
-	{
-		if (qEntry->seqno < ((MQTTPersistence_qEntry*)current->content)->seqno)
-			index = current;
-	}
-	ListInsert(list, qEntry, size, index);
-	FUNC_EXIT;
+	return (*(MQTTPersistence_qEntry**)a)->seqno - (*(MQTTPersistence_qEntry**)b)->seqno;
 }
 
 
 /**
- * Restores a queue of messages from persistence to memory
+ * Restores a queue of messages from persistence to memory.  The entries are sorted by
+ * sequence number once they have all been read.
  * @param c the client as ::Clients - the client object to restore the messages to
  * @return return code, 0 if successful
  */
@@ -605,10 +728,13 @@ int MQTTPersistence_restoreMessageQueue(Clients* c)
 	int nkeys;
 	int i = 0;
 	int entries_restored = 0;
+	MQTTPersistence_qEntry** entries = NULL;
 
 	FUNC_ENTRY;
 	if (c->persistence && (rc = c->persistence->pkeys(c->phandle, &msgkeys, &nkeys)) == 0)
 	{
+		if (nkeys > 0)
+			entries = malloc(nkeys * sizeof(MQTTPersistence_qEntry*));
 		while (rc == 0 && i < nkeys)
 		{
 			char *buffer = NULL;
@@ -623,18 +749,22 @@ int MQTTPersistence_restoreMessageQueue(Clients* c)
 				if (qe)
 				{	
 					qe->seqno = atoi(msgkeys[i]+2);
-					MQTTPersistence_insertInSeqOrder(c->messageQueue, qe, sizeof(MQTTPersistence_qEntry));
+					entries[entries_restored++] = qe;
 					free(buffer);
 					c->qentry_seqno = max(c->qentry_seqno, qe->seqno);
-					entries_restored++;
 				}
 			}
-			if (msgkeys[i])
-				free(msgkeys[i]);
 			i++;
 		}
+		qsort(entries, entries_restored, sizeof(MQTTPersistence_qEntry*), MQTTPersistence_seqnoCompare);
+		for (i = 0; i < entries_restored; ++i)
+			ListAppendNoMalloc(c->messageQueue, entries[i], &entries[i]->link, sizeof(MQTTPersistence_qEntry));
+		for (i = 0; i < nkeys; ++i)
+			free(msgkeys[i]);
 		if (msgkeys != NULL)
 			free(msgkeys);
+		if (entries)
+			free(entries);
 	}
 	Log(TRACE_MINIMUM, -1, "%d queued messages restored for client %s", entries_restored, c->clientID);
 	FUNC_EXIT_RC(rc);
@@ -40,10 +40,12 @@ int MQTTPersistence_close(Clients* c);
 int MQTTPersistence_clear(Clients* c);
 int MQTTPersistence_restore(Clients* c);
 void* MQTTPersistence_restorePacket(char* buffer, size_t buflen);
-void MQTTPersistence_insertInOrder(List* list, void* content, size_t size);
 int MQTTPersistence_put(int socket, char* buf0, size_t buf0len, int count, 
 								 char** buffers, size_t* buflens, int htype, int msgId, int scr);
 int MQTTPersistence_remove(Clients* c, char* type, int qos, int msgId);
+int MQTTPersistence_syncable(Clients* c);
+int MQTTPersistence_sync(Clients* c);
+int MQTTPersistence_snapshot(Clients* c);
 void MQTTPersistence_wrapMsgID(Clients *c);
 
 typedef struct
@@ -56,6 +58,7 @@ typedef struct
 	int retained;
 	int dup;
 	int msgid;
+	char* buffer; /* must match the input buffer reference in MQTTAsync messages; NULL when restored */
 } MQTTPersistence_message;
 
 typedef struct
@@ -64,6 +67,8 @@ typedef struct
 	char* topicName;
 	int topicLen;
 	unsigned int seqno; /* only used on restore */
+	ListElement link; /* links the entry into the message queue */
+	int size; /* bytes counted against the client's inbound limit */
 } MQTTPersistence_qEntry;
 
 int MQTTPersistence_unpersistQueueEntry(Clients* client, MQTTPersistence_qEntry* qe);
@@ -630,29 +630,57 @@ exit:
 	return rc;
 }
 #else
+/**
+ * Returns whether a directory entry is a regular file.  The type is taken from the entry
+ * where the file system provides it, so that only the directory is read.
+ */
+static int isRegularFile(char *dirname, struct dirent *dir_entry)
+{
+	int rc = 0;
+	struct stat stat_info;
+	char* temp = NULL;
+
+#if defined(DT_REG)
+	if (dir_entry->d_type != DT_UNKNOWN)
+		return dir_entry->d_type == DT_REG;
+#endif
+	temp = malloc(strlen(dirname)+strlen(dir_entry->d_name)+2);
+	sprintf(temp, "%s/%s", dirname, dir_entry->d_name);
+	rc = (lstat(temp, &stat_info) == 0 && S_ISREG(stat_info.st_mode));
+	free(temp);
+	return rc;
+}
+
+
 int keysUnix(char *dirname, char ***keys, int *nkeys)
 {
 	int rc = 0;
 	char **fkeys = NULL;
 	int nfkeys = 0;
+	int maxkeys = 0;
 	char *ptraux;
-	int i;
 	DIR *dp;
 	struct dirent *dir_entry;
-	struct stat stat_info;
 
 	FUNC_ENTRY;
-	/* get number of keys */
+	/* copy the keys in one pass over the directory */
 	if((dp = opendir(dirname)) != NULL)
 	{
 		while((dir_entry = readdir(dp)) != NULL)
 		{
-			char* temp = malloc(strlen(dirname)+strlen(dir_entry->d_name)+2);
-
-			sprintf(temp, "%s/%s", dirname, dir_entry->d_name);
-			if (lstat(temp, &stat_info) == 0 && S_ISREG(stat_info.st_mode))
-				nfkeys++;
-			free(temp);
+			if (!isRegularFile(dirname, dir_entry))
+				continue;
+			if (nfkeys == maxkeys)
+			{
+				maxkeys = (maxkeys == 0) ? 16 : maxkeys * 2;
+				fkeys = (fkeys) ? realloc(fkeys, maxkeys * sizeof(char *)) : malloc(maxkeys * sizeof(char *));
+			}
+			fkeys[nfkeys] = malloc(strlen(dir_entry->d_name) + 1);
+			strcpy(fkeys[nfkeys], dir_entry->d_name);
+			ptraux = strstr(fkeys[nfkeys], MESSAGE_FILENAME_EXTENSION);
+			if ( ptraux != NULL )
+				*ptraux = '\0' ;
+			nfkeys++;
 		}
 		closedir(dp);
 	} else
@@ -661,38 +689,6 @@ int keysUnix(char *dirname, char ***keys, int *nkeys)
 		goto exit;
 	}
 
-	if (nfkeys != 0)
-	{
-		fkeys = (char **)malloc(nfkeys * sizeof(char *));
-
-		/* copy the keys */
-		if((dp = opendir(dirname)) != NULL)
-		{
-			i = 0;
-			while((dir_entry = readdir(dp)) != NULL)
-			{
-				char* temp = malloc(strlen(dirname)+strlen(dir_entry->d_name)+2);
-	
-				sprintf(temp, "%s/%s", dirname, dir_entry->d_name);
-				if (lstat(temp, &stat_info) == 0 && S_ISREG(stat_info.st_mode))
-				{
-					fkeys[i] = malloc(strlen(dir_entry->d_name) + 1);
-					strcpy(fkeys[i], dir_entry->d_name);
-					ptraux = strstr(fkeys[i], MESSAGE_FILENAME_EXTENSION);
-					if ( ptraux != NULL )
-						*ptraux = '\0' ;
-					i++;
-				}
-				free(temp);
-			}
-			closedir(dp);
-		} else
-		{
-			rc = MQTTCLIENT_PERSISTENCE_ERROR;
-			goto exit;
-		}
-	}
-
 	*nkeys = nfkeys;
 	*keys = fkeys;
 	/* the caller must free keys */
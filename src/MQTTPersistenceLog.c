@@ -0,0 +1,1031 @@
+/*******************************************************************************
+ * Copyright (c) 2026 the mruby-mqtt contributors
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *******************************************************************************/
+
+/**
+ * @file
+ * \brief A log-structured file persistence implementation.
+ *
+ * Records are appended to segment files in a directory for the client ID and server URI,
+ * beneath the directory given when the client is created.  Putting a key appends its data,
+ * and removing one appends a tombstone, so that no file is created or deleted per message.
+ * An index in memory maps each key to its latest record.  When a segment reaches
+ * MQTTPERSISTENCELOG_SEGMENT_SIZE the next one is started, and a background thread compacts
+ * the oldest segment once most of it is dead, or once there are more than
+ * MQTTPERSISTENCELOG_MAX_SEGMENTS: its live records are appended to the newest segment, and it
+ * is deleted.  Its tombstones are dropped, since no older segment holds the keys they remove.
+ *
+ * When the store is opened, the segments are read once, in order, to build the index.  The
+ * data read is kept for the first get of each key, which is how the client restores its
+ * messages.  A record whose checksum is wrong, left at the end of a segment by a write which
+ * did not finish, is cut off along with anything after it.
+ *
+ * Records are left to the operating system to write to the disk until
+ * MQTTPersistenceLog_sync is called, which covers everything written since the last call.
+ */
+
+#if !defined(NO_PERSISTENCE) && !defined(WIN32) && !defined(WIN64)
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <zlib.h>
+
+#include "MQTTClientPersistence.h"
+#include "MQTTPersistenceDefault.h"
+#include "MQTTPersistenceLog.h"
+#include "LinkedList.h"
+#include "Thread.h"
+#include "Tree.h"
+#include "Log.h"
+#include "StackTrace.h"
+#include "Heap.h"
+
+/** the data length of a record which removes its key */
+#define TOMBSTONE 0xFFFFFFFFU
+
+/** the buffers written with one record without allocating an iovec array */
+#define MAX_IOV 16
+
+#if !defined(IOV_MAX)
+#define IOV_MAX 1024
+#endif
+
+#if defined(__APPLE__)
+#define fdatasync fsync
+#endif
+
+/**
+ * The header of a record.  It is followed by the key, and by the data unless the record is a
+ * tombstone.  The integers are in the byte order of the host.
+ */
+typedef struct
+{
+	unsigned int crc;		/**< CRC-32 of the lengths, the key and the data */
+	unsigned int keylen;	/**< length of the key */
+	unsigned int datalen;	/**< length of the data, or TOMBSTONE */
+} LogHeader;
+
+/**
+ * A segment file
+ */
+typedef struct
+{
+	int number;			/**< the number in the file name, higher for later segments */
+	int fd;
+	long size;			/**< bytes of records in the file */
+	long live;			/**< bytes of the records which the index points to */
+	long synced;		/**< bytes of records known to be on the disk */
+	ListElement link;	/**< links the segment into the list of the store, oldest first */
+} LogSegment;
+
+/**
+ * Where the latest data of a key is
+ */
+typedef struct
+{
+	char* key;
+	int keylen;
+	LogSegment* segment;
+	long offset;		/**< of the record in the segment */
+	int datalen;
+	char* restored;		/**< the data read when the store was opened, until it is first got */
+} LogEntry;
+
+/**
+ * An open store
+ */
+typedef struct
+{
+	char* dir;				/**< the directory of the segment files */
+	Tree index;				/**< a LogEntry for each key */
+	List segments;			/**< the segments, oldest first; the last is the one being written */
+	int nextNumber;			/**< the number of the next segment */
+	mutex_type mutex;		/**< protects the store from the compaction thread */
+	cond_type wake;			/**< signalled when the oldest segment may need compacting */
+	cond_type stopped;		/**< signalled by the compaction thread when it ends */
+	int stopping;			/**< tells the compaction thread to end */
+	int created;			/**< has a segment file been created since the directory was last synced? */
+} LogStore;
+
+
+static int MQTTPersistenceLog_compare(void* a, void* b, int content)
+{
+	char* key = (content) ? ((LogEntry*)b)->key : (char*)b;
+
+	return strcmp(((LogEntry*)a)->key, key);
+}
+
+
+static long MQTTPersistenceLog_recordSize(LogEntry* e)
+{
+	return sizeof(LogHeader) + e->keylen + e->datalen;
+}
+
+
+static char* MQTTPersistenceLog_fileName(LogStore* s, int number)
+{
+	char* file = malloc(strlen(s->dir) + 12 + strlen(MQTTPERSISTENCELOG_EXTENSION));
+
+	sprintf(file, "%s/%08d%s", s->dir, number, MQTTPERSISTENCELOG_EXTENSION);
+	return file;
+}
+
+
+/**
+ * Open a segment file and add it to the end of the list of segments
+ * @param s the store
+ * @param number the number of the segment
+ * @param create boolean - create a new, empty segment, rather than opening an existing one?
+ * @return the segment, or NULL if the file could not be opened
+ */
+static LogSegment* MQTTPersistenceLog_openSegment(LogStore* s, int number, int create)
+{
+	char* file = MQTTPersistenceLog_fileName(s, number);
+	LogSegment* seg = NULL;
+	int fd;
+
+	if ((fd = open(file, O_RDWR | O_APPEND | ((create) ? O_CREAT | O_TRUNC : 0), S_IRUSR | S_IWUSR)) >= 0)
+	{
+		seg = malloc(sizeof(LogSegment));
+		memset(seg, '\0', sizeof(LogSegment));
+		seg->number = number;
+		seg->fd = fd;
+		ListAppendNoMalloc(&s->segments, seg, &seg->link, sizeof(LogSegment));
+		s->created |= create;
+		if (number >= s->nextNumber)
+			s->nextNumber = number + 1;
+	}
+	free(file);
+	return seg;
+}
+
+
+/**
+ * Close a segment, delete its file and remove it from the list of segments
+ */
+static void MQTTPersistenceLog_dropSegment(LogStore* s, LogSegment* seg)
+{
+	char* file = MQTTPersistenceLog_fileName(s, seg->number);
+
+	close(seg->fd);
+	unlink(file);
+	free(file);
+	ListDetachElement(&s->segments, &seg->link);
+	free(seg);
+}
+
+
+/**
+ * Take the bytes of a record away from the live bytes of its segment, because the key has been
+ * written again or removed.  The compaction thread is woken if that leaves the oldest segment
+ * mostly dead.
+ */
+static void MQTTPersistenceLog_release(LogStore* s, LogEntry* e)
+{
+	LogSegment* seg = e->segment;
+
+	seg->live -= MQTTPersistenceLog_recordSize(e);
+	if (&seg->link == s->segments.first && &seg->link != s->segments.last && seg->live * 2 <= seg->size)
+		Thread_signal_cond(s->wake);
+}
+
+
+static int MQTTPersistenceLog_readAll(int fd, char* buf, long len, long offset)
+{
+	while (len > 0)
+	{
+		ssize_t n = pread(fd, buf, len, offset);
+
+		if (n <= 0)
+		{
+			if (n < 0 && errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += n;
+		len -= n;
+		offset += n;
+	}
+	return 0;
+}
+
+
+/**
+ * Append a record to the segment being written, starting the next segment if it is full.
+ * The record is written with one writev where the system allows.
+ * @param s the store
+ * @param iov the buffers of the record
+ * @param count the number of buffers, which are changed as they are written
+ * @param size the total length of the buffers
+ * @param segp set to the segment written to
+ * @param offset set to the offset of the record in that segment
+ * @return 0 if success, #MQTTCLIENT_PERSISTENCE_ERROR otherwise
+ */
+static int MQTTPersistenceLog_write(LogStore* s, struct iovec* iov, int count, long size, LogSegment** segp, long* offset)
+{
+	LogSegment* seg = (s->segments.last) ? s->segments.last->content : NULL;
+	int rc = 0;
+
+	if (seg == NULL || (seg->size > 0 && seg->size + size > MQTTPERSISTENCELOG_SEGMENT_SIZE))
+	{
+		if ((seg = MQTTPersistenceLog_openSegment(s, s->nextNumber, 1)) == NULL)
+		{
+			rc = MQTTCLIENT_PERSISTENCE_ERROR;
+			goto exit;
+		}
+		Thread_signal_cond(s->wake);
+	}
+	while (count > 0)
+	{
+		ssize_t n = writev(seg->fd, iov, (count > IOV_MAX) ? IOV_MAX : count);
+
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			rc = MQTTCLIENT_PERSISTENCE_ERROR;
+			if (ftruncate(seg->fd, seg->size) != 0) /* otherwise it is cut off when the segment is next read */
+				Log(LOG_ERROR, -1, "Could not cut a partial record off persistence segment %d", seg->number);
+			goto exit;
+		}
+		while (count > 0 && (size_t)n >= iov->iov_len)
+		{
+			n -= iov->iov_len;
+			++iov;
+			--count;
+		}
+		if (count > 0)
+		{
+			iov->iov_base = (char*)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+	*segp = seg;
+	*offset = seg->size;
+	seg->size += size;
+exit:
+	return rc;
+}
+
+
+/**
+ * Append a record for a key
+ * @param s the store
+ * @param key the key
+ * @param keylen the length of the key
+ * @param bufcount the number of data buffers, 0 for a tombstone
+ * @param buffers the data buffers
+ * @param buflens the lengths of the data buffers
+ * @param segp set to the segment written to
+ * @param offset set to the offset of the record in that segment
+ * @return 0 if success, #MQTTCLIENT_PERSISTENCE_ERROR otherwise
+ */
+static int MQTTPersistenceLog_append(LogStore* s, char* key, int keylen, int bufcount, char* buffers[],
+	int buflens[], LogSegment** segp, long* offset)
+{
+	struct iovec iovs[MAX_IOV];
+	struct iovec* iov = iovs;
+	LogHeader header;
+	long size = sizeof(LogHeader) + keylen;
+	int i, rc;
+
+	if (bufcount + 2 > MAX_IOV)
+		iov = malloc((bufcount + 2) * sizeof(struct iovec));
+	header.keylen = keylen;
+	header.datalen = (bufcount > 0) ? 0 : TOMBSTONE;
+	for (i = 0; i < bufcount; ++i)
+		header.datalen += buflens[i];
+	header.crc = crc32(0L, (Bytef*)&header.keylen, 2 * sizeof(unsigned int));
+	header.crc = crc32(header.crc, (Bytef*)key, keylen);
+	iov[0].iov_base = &header;
+	iov[0].iov_len = sizeof(LogHeader);
+	iov[1].iov_base = key;
+	iov[1].iov_len = keylen;
+	for (i = 0; i < bufcount; ++i)
+	{
+		header.crc = crc32(header.crc, (Bytef*)buffers[i], buflens[i]);
+		iov[i + 2].iov_base = buffers[i];
+		iov[i + 2].iov_len = buflens[i];
+		size += buflens[i];
+	}
+	rc = MQTTPersistenceLog_write(s, iov, bufcount + 2, size, segp, offset);
+	if (iov != iovs)
+		free(iov);
+	return rc;
+}
+
+
+/**
+ * Write the records appended since the last flush to the disk, with one fdatasync of each
+ * segment they are in, which is usually only the segment being written.  The directory is
+ * synced too if a segment has been created, so that the new file is found after a crash.
+ * Called with the store locked.
+ * @param s the store
+ * @return 0 if success, #MQTTCLIENT_PERSISTENCE_ERROR otherwise
+ */
+static int MQTTPersistenceLog_flush(LogStore* s)
+{
+	ListElement* current = NULL;
+	int rc = 0;
+
+	while (ListNextElement(&s->segments, &current))
+	{
+		LogSegment* seg = current->content;
+
+		if (seg->synced < seg->size)
+		{
+			if (fdatasync(seg->fd) != 0)
+				rc = MQTTCLIENT_PERSISTENCE_ERROR;
+			else
+				seg->synced = seg->size;
+		}
+	}
+	if (s->created)
+	{
+		int fd = open(s->dir, O_RDONLY);
+
+		if (fd < 0 || fsync(fd) != 0)
+			rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		else
+			s->created = 0;
+		if (fd >= 0)
+			close(fd);
+	}
+	if (rc != 0)
+		Log(LOG_ERROR, -1, "Could not sync the persistence segments in %s", s->dir);
+	return rc;
+}
+
+
+/**
+ * Record in the index that a key has been written
+ * @param s the store
+ * @param key the key, which is copied if it is new
+ * @param keylen the length of the key
+ * @param seg the segment the record is in
+ * @param offset the offset of the record
+ * @param datalen the length of the data
+ * @return the entry for the key
+ */
+static LogEntry* MQTTPersistenceLog_index(LogStore* s, char* key, int keylen, LogSegment* seg, long offset, int datalen)
+{
+	Node* node = TreeFind(&s->index, key);
+	LogEntry* e = NULL;
+
+	if (node)
+	{
+		e = node->content;
+		MQTTPersistenceLog_release(s, e);
+		if (e->restored)
+		{
+			free(e->restored);
+			e->restored = NULL;
+		}
+	}
+	else
+	{
+		e = malloc(sizeof(LogEntry));
+		memset(e, '\0', sizeof(LogEntry));
+		e->key = malloc(keylen + 1);
+		memcpy(e->key, key, keylen + 1);
+		e->keylen = keylen;
+		TreeAdd(&s->index, e, sizeof(LogEntry));
+	}
+	e->segment = seg;
+	e->offset = offset;
+	e->datalen = datalen;
+	seg->live += MQTTPersistenceLog_recordSize(e);
+	return e;
+}
+
+
+static void MQTTPersistenceLog_unindex(LogStore* s, LogEntry* e)
+{
+	TreeRemove(&s->index, e);
+	free(e->key);
+	if (e->restored)
+		free(e->restored);
+	free(e);
+}
+
+
+/**
+ * Get a key out of a record as a string, in a buffer which is reused
+ */
+static char* MQTTPersistenceLog_key(char** buf, int* buflen, char* key, int keylen)
+{
+	if (keylen + 1 > *buflen)
+	{
+		*buflen = keylen + 1;
+		*buf = (*buf) ? realloc(*buf, *buflen) : malloc(*buflen);
+	}
+	memcpy(*buf, key, keylen);
+	(*buf)[keylen] = '\0';
+	return *buf;
+}
+
+
+/**
+ * Check the record at an offset of a segment which has been read into memory
+ * @param data the contents of the segment
+ * @param size the length of the contents
+ * @param pos the offset of the record
+ * @param header set to the header of the record
+ * @return the length of the record, or 0 if it is incomplete or damaged
+ */
+static long MQTTPersistenceLog_check(char* data, long size, long pos, LogHeader* header)
+{
+	long len = sizeof(LogHeader);
+	unsigned int crc;
+
+	if (size - pos < len)
+		return 0;
+	memcpy(header, &data[pos], sizeof(LogHeader));
+	if (header->keylen > size - pos - len)
+		return 0;
+	len += header->keylen;
+	if (header->datalen != TOMBSTONE)
+	{
+		if (header->datalen > size - pos - len)
+			return 0;
+		len += header->datalen;
+	}
+	crc = crc32(0L, (Bytef*)&data[pos + sizeof(header->crc)], 2 * sizeof(unsigned int));
+	crc = crc32(crc, (Bytef*)&data[pos + sizeof(LogHeader)], len - sizeof(LogHeader));
+	return (crc == header->crc) ? len : 0;
+}
+
+
+static int MQTTPersistenceLog_numberCompare(const void* a, const void* b)
+{
+	return *(const int*)a - *(const int*)b;
+}
+
+
+/**
+ * Read all the segments of the store, in order, and build the index from them
+ * @param s the store
+ * @return 0 if success, #MQTTCLIENT_PERSISTENCE_ERROR otherwise
+ */
+static int MQTTPersistenceLog_scan(LogStore* s)
+{
+	DIR* dp = NULL;
+	struct dirent* dir_entry = NULL;
+	int* numbers = NULL;
+	int count = 0, max = 0, i;
+	char* key = NULL;
+	int keylen = 0;
+	int rc = 0;
+
+	FUNC_ENTRY;
+	if ((dp = opendir(s->dir)) == NULL)
+	{
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto exit;
+	}
+	while ((dir_entry = readdir(dp)) != NULL)
+	{
+		int number, len = 0;
+
+		if (sscanf(dir_entry->d_name, "%8d%n", &number, &len) == 1 && len == 8 &&
+			strcmp(&dir_entry->d_name[len], MQTTPERSISTENCELOG_EXTENSION) == 0)
+		{
+			if (count == max)
+			{
+				max = (max == 0) ? 16 : max * 2;
+				numbers = (numbers) ? realloc(numbers, max * sizeof(int)) : malloc(max * sizeof(int));
+			}
+			numbers[count++] = number;
+		}
+	}
+	closedir(dp);
+	qsort(numbers, count, sizeof(int), MQTTPersistenceLog_numberCompare);
+
+	for (i = 0; i < count && rc == 0; ++i)
+	{
+		LogSegment* seg = MQTTPersistenceLog_openSegment(s, numbers[i], 0);
+		struct stat st;
+		char* data = NULL;
+		long pos = 0, len;
+		LogHeader header;
+
+		if (seg == NULL || fstat(seg->fd, &st) != 0)
+		{
+			rc = MQTTCLIENT_PERSISTENCE_ERROR;
+			break;
+		}
+		data = malloc(st.st_size + 1);
+		if (MQTTPersistenceLog_readAll(seg->fd, data, st.st_size, 0) != 0)
+			rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		while (rc == 0 && (len = MQTTPersistenceLog_check(data, st.st_size, pos, &header)) > 0)
+		{
+			char* k = MQTTPersistenceLog_key(&key, &keylen, &data[pos + sizeof(LogHeader)], header.keylen);
+
+			if (header.datalen == TOMBSTONE)
+			{
+				Node* node = TreeFind(&s->index, k);
+
+				if (node)
+				{
+					MQTTPersistenceLog_release(s, node->content);
+					MQTTPersistenceLog_unindex(s, node->content);
+				}
+			}
+			else
+			{
+				LogEntry* e = MQTTPersistenceLog_index(s, k, header.keylen, seg, pos, header.datalen);
+
+				e->restored = malloc(header.datalen + 1);
+				memcpy(e->restored, &data[pos + sizeof(LogHeader) + header.keylen], header.datalen);
+			}
+			pos += len;
+		}
+		seg->size = pos;
+		if (rc == 0 && pos < st.st_size && ftruncate(seg->fd, pos) != 0)
+			rc = MQTTCLIENT_PERSISTENCE_ERROR; /* a record which was not completely written */
+		free(data);
+	}
+	if (rc == 0 && (s->segments.count == 0 ||
+		((LogSegment*)s->segments.last->content)->size >= MQTTPERSISTENCELOG_SEGMENT_SIZE))
+	{
+		if (MQTTPersistenceLog_openSegment(s, s->nextNumber, 1) == NULL)
+			rc = MQTTCLIENT_PERSISTENCE_ERROR;
+	}
+exit:
+	if (numbers)
+		free(numbers);
+	if (key)
+		free(key);
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+ * Should the oldest segment be compacted?  It should if most of it is dead, or if there are
+ * more than MQTTPERSISTENCELOG_MAX_SEGMENTS closed segments and most of them all is dead.
+ * Live records are moved out of the way, to the segment being written, so that in time every
+ * closed segment becomes the oldest.
+ */
+static int MQTTPersistenceLog_compactable(LogStore* s)
+{
+	LogSegment* oldest = NULL;
+	ListElement* current = NULL;
+	long live = 0, size = 0;
+
+	if (s->segments.first == s->segments.last)
+		return 0;
+	oldest = s->segments.first->content;
+	if (oldest->live * 2 <= oldest->size)
+		return 1;
+	if (s->segments.count <= MQTTPERSISTENCELOG_MAX_SEGMENTS + 1)
+		return 0;
+	while (ListNextElement(&s->segments, &current) && current != s->segments.last)
+	{
+		live += ((LogSegment*)current->content)->live;
+		size += ((LogSegment*)current->content)->size;
+	}
+	return live * 2 <= size;
+}
+
+
+/**
+ * Compact the oldest segment, if it should be, by appending its live records to the segment
+ * being written and deleting it.  Called with the store locked.
+ * @param s the store
+ * @return 1 if a segment was compacted, 0 if not
+ */
+static int MQTTPersistenceLog_compact(LogStore* s)
+{
+	LogSegment* oldest = NULL;
+	char* data = NULL;
+	char* key = NULL;
+	int keylen = 0;
+	long pos = 0, len;
+	LogHeader header;
+	int rc = 0;
+
+	FUNC_ENTRY;
+	if (!MQTTPersistenceLog_compactable(s))
+		goto exit;
+	oldest = s->segments.first->content;
+	if (oldest->live > 0)
+	{
+		long copied = 0;
+
+		data = malloc(oldest->size + 1);
+		if (MQTTPersistenceLog_readAll(oldest->fd, data, oldest->size, 0) != 0)
+			goto exit;
+		while ((len = MQTTPersistenceLog_check(data, oldest->size, pos, &header)) > 0)
+		{
+			if (header.datalen != TOMBSTONE)
+			{
+				char* k = MQTTPersistenceLog_key(&key, &keylen, &data[pos + sizeof(LogHeader)], header.keylen);
+				Node* node = TreeFind(&s->index, k);
+				LogEntry* e = (node) ? node->content : NULL;
+
+				if (e && e->segment == oldest && e->offset == pos)
+				{	/* the record is still live, and is copied as it is */
+					struct iovec iov;
+					LogSegment* seg = NULL;
+					long offset = 0;
+
+					iov.iov_base = &data[pos];
+					iov.iov_len = len;
+					if (MQTTPersistenceLog_write(s, &iov, 1, len, &seg, &offset) != 0)
+						goto exit;
+					oldest->live -= len;
+					e->segment = seg;
+					e->offset = offset;
+					seg->live += len;
+					copied += len;
+				}
+			}
+			pos += len;
+		}
+		/* the copies must be on the disk before the only other copy is deleted */
+		if (copied > 0 && MQTTPersistenceLog_flush(s) != 0)
+			goto exit;
+	}
+	MQTTPersistenceLog_dropSegment(s, oldest);
+	rc = 1;
+exit:
+	if (data)
+		free(data);
+	if (key)
+		free(key);
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+static thread_return_type MQTTPersistenceLog_compactor(void* n)
+{
+	LogStore* s = n;
+
+	FUNC_ENTRY;
+	while (!s->stopping)
+	{
+		int compacted = 0;
+
+		Thread_lock_mutex(s->mutex); /* unlocked between segments, so that puts are not held up for long */
+		if (!s->stopping)
+			compacted = MQTTPersistenceLog_compact(s);
+		Thread_unlock_mutex(s->mutex);
+		if (!compacted)
+			Thread_wait_cond(s->wake, 1000);
+	}
+	Thread_signal_cond(s->stopped);
+	FUNC_EXIT;
+	return 0;
+}
+
+
+static void MQTTPersistenceLog_free(LogStore* s)
+{
+	LogSegment* seg = NULL;
+
+	while (s->index.count > 0)
+		MQTTPersistenceLog_unindex(s, TreeNextElement(&s->index, NULL)->content);
+	while ((seg = ListDetachHeadElement(&s->segments)) != NULL)
+	{
+		close(seg->fd);
+		free(seg);
+	}
+	Thread_destroy_cond(s->wake);
+	Thread_destroy_cond(s->stopped);
+	Thread_destroy_mutex(s->mutex);
+	free(s->dir);
+	free(s);
+}
+
+
+/** Open the store for the client: context/clientID-serverURI, with the characters of the URI
+ *  which are not allowed in file names replaced, and read its segments.
+ *  See ::Persistence_open
+ */
+int MQTTPersistenceLog_open(void** handle, const char* clientID, const char* serverURI, void* context)
+{
+	int rc = 0;
+	char* dataDir = context;
+	LogStore* s = NULL;
+	char* p = NULL;
+
+	FUNC_ENTRY;
+	s = malloc(sizeof(LogStore));
+	memset(s, '\0', sizeof(LogStore));
+	s->dir = malloc(strlen(dataDir) + strlen(clientID) + strlen(serverURI) + 3);
+	sprintf(s->dir, "%s/%s-%s", dataDir, clientID, serverURI);
+	for (p = &s->dir[strlen(dataDir) + 1]; *p; ++p)
+	{
+		if (*p == '/' || *p == '\\' || *p == ':')
+			*p = '-';
+	}
+	TreeInitializeNoMalloc(&s->index, MQTTPersistenceLog_compare);
+	s->mutex = Thread_create_mutex();
+	s->wake = Thread_create_cond();
+	s->stopped = Thread_create_cond();
+
+	/* create the directory and any above it */
+	for (p = strchr(&s->dir[1], '/'); p && rc == 0; p = strchr(p + 1, '/'))
+	{
+		*p = '\0';
+		rc = pstmkdir(s->dir);
+		*p = '/';
+	}
+	if (rc == 0)
+		rc = pstmkdir(s->dir);
+	if (rc == 0)
+		rc = MQTTPersistenceLog_scan(s);
+	if (rc == 0 && Thread_start(MQTTPersistenceLog_compactor, s) == 0)
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+	if (rc != 0)
+	{
+		MQTTPersistenceLog_free(s);
+		s = NULL;
+	}
+	*handle = s;
+
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/** Stop the compaction thread and close the segments.
+ *  See ::Persistence_close
+ */
+int MQTTPersistenceLog_close(void* handle)
+{
+	int rc = 0;
+	LogStore* s = handle;
+
+	FUNC_ENTRY;
+	if (s == NULL)
+	{
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto exit;
+	}
+	Thread_lock_mutex(s->mutex);
+	s->stopping = 1;
+	Thread_unlock_mutex(s->mutex);
+	Thread_signal_cond(s->wake);
+	while (Thread_wait_cond(s->stopped, 1000) != 0)
+		;
+	MQTTPersistenceLog_free(s);
+
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/** Append a wire message to the store.
+ *  See ::Persistence_put
+ */
+int MQTTPersistenceLog_put(void* handle, char* key, int bufcount, char* buffers[], int buflens[])
+{
+	int rc = 0;
+	LogStore* s = handle;
+	LogSegment* seg = NULL;
+	long offset = 0;
+	int keylen, datalen = 0, i;
+
+	FUNC_ENTRY;
+	if (s == NULL || bufcount <= 0)
+	{
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto exit;
+	}
+	keylen = strlen(key);
+	for (i = 0; i < bufcount; ++i)
+		datalen += buflens[i];
+	Thread_lock_mutex(s->mutex);
+	if ((rc = MQTTPersistenceLog_append(s, key, keylen, bufcount, buffers, buflens, &seg, &offset)) == 0)
+		MQTTPersistenceLog_index(s, key, keylen, seg, offset, datalen);
+	Thread_unlock_mutex(s->mutex);
+
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/** Retrieve a wire message from the store.
+ *  See ::Persistence_get
+ */
+int MQTTPersistenceLog_get(void* handle, char* key, char** buffer, int* buflen)
+{
+	int rc = 0;
+	LogStore* s = handle;
+	LogEntry* e = NULL;
+	Node* node = NULL;
+
+	FUNC_ENTRY;
+	if (s == NULL)
+	{
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto exit;
+	}
+	Thread_lock_mutex(s->mutex);
+	if ((node = TreeFind(&s->index, key)) == NULL)
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+	else if ((e = node->content)->restored)
+	{	/* read when the store was opened, so hand it over */
+		*buffer = e->restored;
+		*buflen = e->datalen;
+		e->restored = NULL;
+	}
+	else
+	{
+		char* buf = malloc(e->datalen + 1);
+
+		if (MQTTPersistenceLog_readAll(e->segment->fd, buf, e->datalen, e->offset + sizeof(LogHeader) + e->keylen) != 0)
+		{
+			free(buf);
+			rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		}
+		else
+		{
+			*buffer = buf;
+			*buflen = e->datalen;
+		}
+	}
+	Thread_unlock_mutex(s->mutex);
+
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/** Append a tombstone for a key to the store.
+ *  See ::Persistence_remove
+ */
+int MQTTPersistenceLog_remove(void* handle, char* key)
+{
+	int rc = 0;
+	LogStore* s = handle;
+	LogSegment* seg = NULL;
+	long offset = 0;
+	Node* node = NULL;
+
+	FUNC_ENTRY;
+	if (s == NULL)
+	{
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto exit;
+	}
+	Thread_lock_mutex(s->mutex);
+	if ((node = TreeFind(&s->index, key)) == NULL)
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+	else if ((rc = MQTTPersistenceLog_append(s, key, strlen(key), 0, NULL, NULL, &seg, &offset)) == 0)
+	{
+		MQTTPersistenceLog_release(s, node->content);
+		MQTTPersistenceLog_unindex(s, node->content);
+	}
+	Thread_unlock_mutex(s->mutex);
+
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/** Return the keys in the store, from the index.
+ *  See ::Persistence_keys
+ */
+int MQTTPersistenceLog_keys(void* handle, char*** keys, int* nkeys)
+{
+	int rc = 0;
+	LogStore* s = handle;
+	char** fkeys = NULL;
+	Node* node = NULL;
+	int i = 0;
+
+	FUNC_ENTRY;
+	if (s == NULL)
+	{
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto exit;
+	}
+	Thread_lock_mutex(s->mutex);
+	if (s->index.count > 0)
+	{
+		fkeys = malloc(s->index.count * sizeof(char*));
+		while ((node = TreeNextElement(&s->index, node)) != NULL)
+		{
+			LogEntry* e = node->content;
+
+			fkeys[i] = malloc(e->keylen + 1);
+			memcpy(fkeys[i++], e->key, e->keylen + 1);
+		}
+	}
+	Thread_unlock_mutex(s->mutex);
+	*nkeys = i;
+	*keys = fkeys;
+	/* the caller must free keys */
+
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/** Delete all the segments, and start an empty one.
+ *  See ::Persistence_clear
+ */
+int MQTTPersistenceLog_clear(void* handle)
+{
+	int rc = 0;
+	LogStore* s = handle;
+
+	FUNC_ENTRY;
+	if (s == NULL)
+	{
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto exit;
+	}
+	Thread_lock_mutex(s->mutex);
+	while (s->index.count > 0)
+		MQTTPersistenceLog_unindex(s, TreeNextElement(&s->index, NULL)->content);
+	while (s->segments.count > 0)
+		MQTTPersistenceLog_dropSegment(s, s->segments.first->content);
+	if (MQTTPersistenceLog_openSegment(s, s->nextNumber, 1) == NULL)
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+	Thread_unlock_mutex(s->mutex);
+
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+ * Make the records written to the store so far durable.  The records written by any number
+ * of puts and removes since the last call are covered by one fdatasync.
+ * @param handle the store
+ * @return 0 if success, #MQTTCLIENT_PERSISTENCE_ERROR otherwise
+ */
+int MQTTPersistenceLog_sync(void* handle)
+{
+	int rc = 0;
+	LogStore* s = handle;
+
+	FUNC_ENTRY;
+	if (s == NULL)
+	{
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto exit;
+	}
+	Thread_lock_mutex(s->mutex);
+	rc = MQTTPersistenceLog_flush(s);
+	Thread_unlock_mutex(s->mutex);
+
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/** Returns whether a key is in the store.
+ *  See ::Persistence_containskey
+ */
+int MQTTPersistenceLog_containskey(void* handle, char* key)
+{
+	int rc = 0;
+	LogStore* s = handle;
+
+	FUNC_ENTRY;
+	if (s == NULL)
+	{
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto exit;
+	}
+	Thread_lock_mutex(s->mutex);
+	if (TreeFind(&s->index, key) == NULL)
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+	Thread_unlock_mutex(s->mutex);
+
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+#endif
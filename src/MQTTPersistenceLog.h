@@ -0,0 +1,41 @@
+/*******************************************************************************
+ * Copyright (c) 2026 the mruby-mqtt contributors
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *******************************************************************************/
+
+#if !defined(MQTTPERSISTENCELOG_H)
+#define MQTTPERSISTENCELOG_H
+
+/** Extension of the segment file names */
+#define MQTTPERSISTENCELOG_EXTENSION ".log"
+
+/** the size at which a segment is closed and the next one started */
+#if !defined(MQTTPERSISTENCELOG_SEGMENT_SIZE)
+#define MQTTPERSISTENCELOG_SEGMENT_SIZE (4 * 1024 * 1024)
+#endif
+
+/** the closed segments kept before the oldest is compacted, however much of it is still live */
+#if !defined(MQTTPERSISTENCELOG_MAX_SEGMENTS)
+#define MQTTPERSISTENCELOG_MAX_SEGMENTS 4
+#endif
+
+/* prototypes of the functions for the log-structured file persistence */
+int MQTTPersistenceLog_open(void** handle, const char* clientID, const char* serverURI, void* context);
+int MQTTPersistenceLog_close(void* handle);
+int MQTTPersistenceLog_put(void* handle, char* key, int bufcount, char* buffers[], int buflens[]);
+int MQTTPersistenceLog_get(void* handle, char* key, char** buffer, int* buflen);
+int MQTTPersistenceLog_remove(void* handle, char* key);
+int MQTTPersistenceLog_keys(void* handle, char*** keys, int* nkeys);
+int MQTTPersistenceLog_clear(void* handle);
+int MQTTPersistenceLog_containskey(void* handle, char* key);
+int MQTTPersistenceLog_sync(void* handle);
+
+#endif
@@ -0,0 +1,550 @@
+/*******************************************************************************
+ * Copyright (c) 2026 the mruby-mqtt contributors
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *******************************************************************************/
+
+/**
+ * @file
+ * \brief An in-memory persistence implementation, with an optional snapshot file.
+ *
+ * Each record is held in one allocation with its key, in a tree indexed by key, so that a
+ * put is one allocation and copy and a remove is one free, with no file system calls.
+ *
+ * If a directory is given when the client is created, the records are written to a snapshot
+ * file there, context/clientID-serverURI.snapshot, when the store is closed by destroying the
+ * client, and when MQTTPersistenceMemory_snapshot is called.  The snapshot is read back when
+ * the store is next opened, and kept until a new snapshot replaces it or the store is cleared,
+ * so that messages restored after a restart are restored again if the process then fails, and
+ * are resent as duplicates.  Messages persisted after the last snapshot are lost if the
+ * process fails.
+ */
+
+#if !defined(NO_PERSISTENCE)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if !defined(WIN32) && !defined(WIN64)
+#include <unistd.h>
+#endif
+#include <zlib.h>
+
+#include "MQTTClientPersistence.h"
+#include "MQTTPersistenceDefault.h"
+#include "MQTTPersistenceMemory.h"
+#include "Thread.h"
+#include "Tree.h"
+#include "Log.h"
+#include "StackTrace.h"
+#include "Heap.h"
+
+/** The start of a snapshot file, followed by the number of records */
+static const char MQTTPersistenceMemory_magic[] = {'M', 'Q', 'M', 'S'};
+
+/**
+ * A record, followed by its key and data
+ */
+typedef struct
+{
+	char* key;			/**< the null terminated key */
+	char* data;
+	unsigned int keylen;
+	unsigned int datalen;
+} MemoryRecord;
+
+/**
+ * An open store
+ */
+typedef struct
+{
+	char* file;				/**< the snapshot file, or NULL if there is none */
+	Tree index;				/**< a MemoryRecord for each key */
+	mutex_type mutex;		/**< protects the store from the threads which persist messages */
+} MemoryStore;
+
+
+static int MQTTPersistenceMemory_compare(void* a, void* b, int content)
+{
+	char* key = (content) ? ((MemoryRecord*)b)->key : (char*)b;
+
+	return strcmp(((MemoryRecord*)a)->key, key);
+}
+
+
+/**
+ * Allocate a record with room for its key and data, and copy the key into it
+ */
+static MemoryRecord* MQTTPersistenceMemory_newRecord(char* key, unsigned int keylen, unsigned int datalen)
+{
+	MemoryRecord* r = malloc(sizeof(MemoryRecord) + keylen + 1 + datalen);
+
+	r->key = (char*)(r + 1);
+	memcpy(r->key, key, keylen);
+	r->key[keylen] = '\0';
+	r->keylen = keylen;
+	r->data = r->key + keylen + 1;
+	r->datalen = datalen;
+	return r;
+}
+
+
+/**
+ * Add a record to the index, replacing any with the same key
+ */
+static void MQTTPersistenceMemory_add(MemoryStore* s, MemoryRecord* r)
+{
+	Node* node = TreeFind(&s->index, r->key);
+
+	if (node)
+	{
+		free(node->content);
+		node->content = r;
+	}
+	else
+		TreeAdd(&s->index, r, sizeof(MemoryRecord) + r->keylen + 1 + r->datalen);
+}
+
+
+static void MQTTPersistenceMemory_empty(MemoryStore* s)
+{
+	while (s->index.count > 0)
+		free(TreeRemove(&s->index, TreeNextElement(&s->index, NULL)->content));
+}
+
+
+/**
+ * Read the snapshot file, if there is one, into the index.  The file is kept until the next
+ * snapshot replaces it.  A snapshot which is incomplete or damaged is logged and ignored.
+ * @param s the store
+ */
+static void MQTTPersistenceMemory_load(MemoryStore* s)
+{
+	FILE* fp = NULL;
+	char* data = NULL;
+	long size = 0, pos = 0;
+	unsigned int count = 0, crc = 0;
+
+	FUNC_ENTRY;
+	if ((fp = fopen(s->file, "rb")) == NULL)
+		goto exit;
+	if (fseek(fp, 0, SEEK_END) == 0 && (size = ftell(fp)) > 0 && fseek(fp, 0, SEEK_SET) == 0)
+	{
+		data = malloc(size);
+		if (fread(data, 1, size, fp) != (size_t)size)
+			size = 0;
+	}
+	fclose(fp);
+	pos = sizeof(MQTTPersistenceMemory_magic) + sizeof(count);
+	if (size < pos + (long)sizeof(crc) || memcmp(data, MQTTPersistenceMemory_magic, sizeof(MQTTPersistenceMemory_magic)) != 0)
+		goto damaged;
+	size -= sizeof(crc);
+	memcpy(&crc, &data[size], sizeof(crc));
+	if (crc != crc32(0L, (Bytef*)data, size))
+		goto damaged;
+	memcpy(&count, &data[sizeof(MQTTPersistenceMemory_magic)], sizeof(count));
+	while (count-- > 0)
+	{
+		unsigned int lens[2];
+		MemoryRecord* r = NULL;
+
+		if (size - pos < (long)sizeof(lens))
+			goto damaged;
+		memcpy(lens, &data[pos], sizeof(lens));
+		pos += sizeof(lens);
+		if (lens[0] > size - pos || lens[1] > size - pos - lens[0])
+			goto damaged;
+		r = MQTTPersistenceMemory_newRecord(&data[pos], lens[0], lens[1]);
+		memcpy(r->data, &data[pos + lens[0]], lens[1]);
+		MQTTPersistenceMemory_add(s, r);
+		pos += lens[0] + lens[1];
+	}
+	goto exit;
+
+damaged:
+	Log(LOG_ERROR, -1, "Persistence snapshot %s is damaged and has been ignored", s->file);
+	MQTTPersistenceMemory_empty(s);
+exit:
+	if (data)
+		free(data);
+	FUNC_EXIT;
+}
+
+
+/**
+ * Write the records to a temporary file, and rename it to the snapshot file once it is complete
+ * and on the disk, so that a failure while writing leaves the previous snapshot.  If there are
+ * no records, any previous snapshot is deleted.  Called with the store locked.
+ * @param s the store
+ * @return 0 if success, #MQTTCLIENT_PERSISTENCE_ERROR otherwise
+ */
+static int MQTTPersistenceMemory_write(MemoryStore* s)
+{
+	FILE* fp = NULL;
+	char* temp = NULL;
+	Node* node = NULL;
+	unsigned int count = s->index.count, crc = 0;
+	int rc = 0;
+
+	FUNC_ENTRY;
+	if (count == 0)
+	{
+		remove(s->file);
+		goto exit;
+	}
+	temp = malloc(strlen(s->file) + 5);
+	sprintf(temp, "%s.tmp", s->file);
+	if ((fp = fopen(temp, "wb")) == NULL)
+	{
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto exit;
+	}
+	crc = crc32(0L, (Bytef*)MQTTPersistenceMemory_magic, sizeof(MQTTPersistenceMemory_magic));
+	crc = crc32(crc, (Bytef*)&count, sizeof(count));
+	if (fwrite(MQTTPersistenceMemory_magic, sizeof(MQTTPersistenceMemory_magic), 1, fp) != 1 ||
+		fwrite(&count, sizeof(count), 1, fp) != 1)
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+	while (rc == 0 && (node = TreeNextElement(&s->index, node)) != NULL)
+	{
+		MemoryRecord* r = node->content;
+		unsigned int lens[2] = {r->keylen, r->datalen};
+
+		crc = crc32(crc, (Bytef*)lens, sizeof(lens));
+		crc = crc32(crc, (Bytef*)r->key, r->keylen);
+		crc = crc32(crc, (Bytef*)r->data, r->datalen);
+		if (fwrite(lens, sizeof(lens), 1, fp) != 1 || fwrite(r->key, 1, r->keylen, fp) != r->keylen ||
+			fwrite(r->data, 1, r->datalen, fp) != r->datalen)
+			rc = MQTTCLIENT_PERSISTENCE_ERROR;
+	}
+	if (rc == 0 && (fwrite(&crc, sizeof(crc), 1, fp) != 1 || fflush(fp) != 0))
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+#if !defined(WIN32) && !defined(WIN64)
+	if (rc == 0 && fsync(fileno(fp)) != 0)
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+#endif
+	if (fclose(fp) != 0)
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+#if defined(WIN32) || defined(WIN64)
+	if (rc == 0)
+		remove(s->file); /* rename does not replace a file on Windows */
+#endif
+	if (rc == 0 && rename(temp, s->file) != 0)
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+	if (rc != 0)
+	{
+		Log(LOG_ERROR, -1, "Could not write persistence snapshot %s", s->file);
+		remove(temp);
+	}
+
+exit:
+	if (temp)
+		free(temp);
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+static void MQTTPersistenceMemory_free(MemoryStore* s)
+{
+	MQTTPersistenceMemory_empty(s);
+	Thread_destroy_mutex(s->mutex);
+	if (s->file)
+		free(s->file);
+	free(s);
+}
+
+
+/** Create the store for the client, and read its snapshot from context/clientID-serverURI,
+ *  with the characters of the URI which are not allowed in file names replaced, if context
+ *  is not NULL.
+ *  See ::Persistence_open
+ */
+int MQTTPersistenceMemory_open(void** handle, const char* clientID, const char* serverURI, void* context)
+{
+	int rc = 0;
+	char* dataDir = context;
+	MemoryStore* s = NULL;
+	char* p = NULL;
+
+	FUNC_ENTRY;
+	s = malloc(sizeof(MemoryStore));
+	memset(s, '\0', sizeof(MemoryStore));
+	TreeInitializeNoMalloc(&s->index, MQTTPersistenceMemory_compare);
+	s->mutex = Thread_create_mutex();
+	if (dataDir)
+	{
+		s->file = malloc(strlen(dataDir) + strlen(clientID) + strlen(serverURI) + 3 +
+			strlen(MQTTPERSISTENCEMEMORY_EXTENSION));
+		sprintf(s->file, "%s/%s-%s", dataDir, clientID, serverURI);
+		for (p = &s->file[strlen(dataDir) + 1]; *p; ++p)
+		{
+			if (*p == '/' || *p == '\\' || *p == ':')
+				*p = '-';
+		}
+		strcat(s->file, MQTTPERSISTENCEMEMORY_EXTENSION);
+
+		/* create the directory and any above it */
+		for (p = strchr(&s->file[1], '/'); p && rc == 0; p = strchr(p + 1, '/'))
+		{
+			*p = '\0';
+			rc = pstmkdir(s->file);
+			*p = '/';
+		}
+		if (rc == 0)
+			MQTTPersistenceMemory_load(s);
+	}
+	if (rc != 0)
+	{
+		MQTTPersistenceMemory_free(s);
+		s = NULL;
+	}
+	*handle = s;
+
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/** Write the snapshot, if there is a snapshot file, and free the store.
+ *  See ::Persistence_close
+ */
+int MQTTPersistenceMemory_close(void* handle)
+{
+	int rc = 0;
+	MemoryStore* s = handle;
+
+	FUNC_ENTRY;
+	if (s == NULL)
+	{
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto exit;
+	}
+	if (s->file)
+		rc = MQTTPersistenceMemory_write(s);
+	MQTTPersistenceMemory_free(s);
+
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/** Copy a wire message into a record in the store.
+ *  See ::Persistence_put
+ */
+int MQTTPersistenceMemory_put(void* handle, char* key, int bufcount, char* buffers[], int buflens[])
+{
+	int rc = 0;
+	MemoryStore* s = handle;
+	MemoryRecord* r = NULL;
+	char* ptr = NULL;
+	int datalen = 0, i;
+
+	FUNC_ENTRY;
+	if (s == NULL || bufcount <= 0)
+	{
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto exit;
+	}
+	for (i = 0; i < bufcount; ++i)
+		datalen += buflens[i];
+	r = MQTTPersistenceMemory_newRecord(key, strlen(key), datalen);
+	for (ptr = r->data, i = 0; i < bufcount; ptr += buflens[i++])
+		memcpy(ptr, buffers[i], buflens[i]);
+	Thread_lock_mutex(s->mutex);
+	MQTTPersistenceMemory_add(s, r);
+	Thread_unlock_mutex(s->mutex);
+
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/** Retrieve a copy of a wire message from the store.
+ *  See ::Persistence_get
+ */
+int MQTTPersistenceMemory_get(void* handle, char* key, char** buffer, int* buflen)
+{
+	int rc = 0;
+	MemoryStore* s = handle;
+	Node* node = NULL;
+
+	FUNC_ENTRY;
+	if (s == NULL)
+	{
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto exit;
+	}
+	Thread_lock_mutex(s->mutex);
+	if ((node = TreeFind(&s->index, key)) == NULL)
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+	else
+	{
+		MemoryRecord* r = node->content;
+
+		*buffer = malloc(r->datalen + 1);
+		memcpy(*buffer, r->data, r->datalen);
+		*buflen = r->datalen;
+	}
+	Thread_unlock_mutex(s->mutex);
+
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/** Delete a wire message from the store.
+ *  See ::Persistence_remove
+ */
+int MQTTPersistenceMemory_remove(void* handle, char* key)
+{
+	int rc = 0;
+	MemoryStore* s = handle;
+	MemoryRecord* r = NULL;
+
+	FUNC_ENTRY;
+	if (s == NULL)
+	{
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto exit;
+	}
+	Thread_lock_mutex(s->mutex);
+	if ((r = TreeRemoveKey(&s->index, key)) == NULL)
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+	else
+		free(r);
+	Thread_unlock_mutex(s->mutex);
+
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/** Return the keys in the store.
+ *  See ::Persistence_keys
+ */
+int MQTTPersistenceMemory_keys(void* handle, char*** keys, int* nkeys)
+{
+	int rc = 0;
+	MemoryStore* s = handle;
+	char** fkeys = NULL;
+	Node* node = NULL;
+	int i = 0;
+
+	FUNC_ENTRY;
+	if (s == NULL)
+	{
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto exit;
+	}
+	Thread_lock_mutex(s->mutex);
+	if (s->index.count > 0)
+	{
+		fkeys = malloc(s->index.count * sizeof(char*));
+		while ((node = TreeNextElement(&s->index, node)) != NULL)
+		{
+			MemoryRecord* r = node->content;
+
+			fkeys[i] = malloc(r->keylen + 1);
+			memcpy(fkeys[i++], r->key, r->keylen + 1);
+		}
+	}
+	Thread_unlock_mutex(s->mutex);
+	*nkeys = i;
+	*keys = fkeys;
+	/* the caller must free keys */
+
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/** Delete all the records, and the snapshot.
+ *  See ::Persistence_clear
+ */
+int MQTTPersistenceMemory_clear(void* handle)
+{
+	int rc = 0;
+	MemoryStore* s = handle;
+
+	FUNC_ENTRY;
+	if (s == NULL)
+	{
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto exit;
+	}
+	Thread_lock_mutex(s->mutex);
+	MQTTPersistenceMemory_empty(s);
+	if (s->file)
+		remove(s->file);
+	Thread_unlock_mutex(s->mutex);
+
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/** Returns whether a key is in the store.
+ *  See ::Persistence_containskey
+ */
+int MQTTPersistenceMemory_containskey(void* handle, char* key)
+{
+	int rc = 0;
+	MemoryStore* s = handle;
+
+	FUNC_ENTRY;
+	if (s == NULL)
+	{
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto exit;
+	}
+	Thread_lock_mutex(s->mutex);
+	if (TreeFind(&s->index, key) == NULL)
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+	Thread_unlock_mutex(s->mutex);
+
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+ * Write the records in the store to its snapshot file now, rather than only when it is closed.
+ * @param handle the store
+ * @return 0 if success, #MQTTCLIENT_PERSISTENCE_ERROR otherwise, or if the store has no
+ * snapshot file
+ */
+int MQTTPersistenceMemory_snapshot(void* handle)
+{
+	int rc = 0;
+	MemoryStore* s = handle;
+
+	FUNC_ENTRY;
+	if (s == NULL || s->file == NULL)
+	{
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto exit;
+	}
+	Thread_lock_mutex(s->mutex);
+	rc = MQTTPersistenceMemory_write(s);
+	Thread_unlock_mutex(s->mutex);
+
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+#endif
@@ -0,0 +1,31 @@
+/*******************************************************************************
+ * Copyright (c) 2026 the mruby-mqtt contributors
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *******************************************************************************/
+
+#if !defined(MQTTPERSISTENCEMEMORY_H)
+#define MQTTPERSISTENCEMEMORY_H
+
+/** Extension of the snapshot file names */
+#define MQTTPERSISTENCEMEMORY_EXTENSION ".snapshot"
+
+/* prototypes of the functions for the in-memory persistence */
+int MQTTPersistenceMemory_open(void** handle, const char* clientID, const char* serverURI, void* context);
+int MQTTPersistenceMemory_close(void* handle);
+int MQTTPersistenceMemory_put(void* handle, char* key, int bufcount, char* buffers[], int buflens[]);
+int MQTTPersistenceMemory_get(void* handle, char* key, char** buffer, int* buflen);
+int MQTTPersistenceMemory_remove(void* handle, char* key);
+int MQTTPersistenceMemory_keys(void* handle, char*** keys, int* nkeys);
+int MQTTPersistenceMemory_clear(void* handle);
+int MQTTPersistenceMemory_containskey(void* handle, char* key);
+int MQTTPersistenceMemory_snapshot(void* handle);
+
+#endif
@@ -0,0 +1,400 @@
+/*******************************************************************************
+ * Copyright (c) 2026 the mruby-mqtt contributors
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *******************************************************************************/
+
+/**
+ * @file
+ * \brief Encoding and decoding of MQTT 5.0 properties.
+ *
+ * Properties are a variable byte integer length followed by a sequence of identifier and
+ * value pairs, where the type of each value is fixed by its identifier.  An MQTTProperties
+ * structure owns copies of its string and binary values.  MQTTProperty_read does not copy,
+ * so that the packet decoders can pick out the few properties they use without allocating.
+ */
+
+#include "MQTTProperties.h"
+#include "MQTTPacket.h"
+#include "StackTrace.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "Heap.h"
+
+
+/**
+ * The type of the value of each property
+ */
+static struct
+{
+	int identifier;
+	int type;
+} property_types[] =
+{
+	{ MQTTPROPERTY_CODE_PAYLOAD_FORMAT_INDICATOR, MQTTPROPERTY_TYPE_BYTE },
+	{ MQTTPROPERTY_CODE_MESSAGE_EXPIRY_INTERVAL, MQTTPROPERTY_TYPE_FOUR_BYTE_INTEGER },
+	{ MQTTPROPERTY_CODE_CONTENT_TYPE, MQTTPROPERTY_TYPE_UTF_8_ENCODED_STRING },
+	{ MQTTPROPERTY_CODE_RESPONSE_TOPIC, MQTTPROPERTY_TYPE_UTF_8_ENCODED_STRING },
+	{ MQTTPROPERTY_CODE_CORRELATION_DATA, MQTTPROPERTY_TYPE_BINARY_DATA },
+	{ MQTTPROPERTY_CODE_SUBSCRIPTION_IDENTIFIER, MQTTPROPERTY_TYPE_VARIABLE_BYTE_INTEGER },
+	{ MQTTPROPERTY_CODE_SESSION_EXPIRY_INTERVAL, MQTTPROPERTY_TYPE_FOUR_BYTE_INTEGER },
+	{ MQTTPROPERTY_CODE_ASSIGNED_CLIENT_IDENTIFIER, MQTTPROPERTY_TYPE_UTF_8_ENCODED_STRING },
+	{ MQTTPROPERTY_CODE_SERVER_KEEP_ALIVE, MQTTPROPERTY_TYPE_TWO_BYTE_INTEGER },
+	{ MQTTPROPERTY_CODE_AUTHENTICATION_METHOD, MQTTPROPERTY_TYPE_UTF_8_ENCODED_STRING },
+	{ MQTTPROPERTY_CODE_AUTHENTICATION_DATA, MQTTPROPERTY_TYPE_BINARY_DATA },
+	{ MQTTPROPERTY_CODE_REQUEST_PROBLEM_INFORMATION, MQTTPROPERTY_TYPE_BYTE },
+	{ MQTTPROPERTY_CODE_WILL_DELAY_INTERVAL, MQTTPROPERTY_TYPE_FOUR_BYTE_INTEGER },
+	{ MQTTPROPERTY_CODE_REQUEST_RESPONSE_INFORMATION, MQTTPROPERTY_TYPE_BYTE },
+	{ MQTTPROPERTY_CODE_RESPONSE_INFORMATION, MQTTPROPERTY_TYPE_UTF_8_ENCODED_STRING },
+	{ MQTTPROPERTY_CODE_SERVER_REFERENCE, MQTTPROPERTY_TYPE_UTF_8_ENCODED_STRING },
+	{ MQTTPROPERTY_CODE_REASON_STRING, MQTTPROPERTY_TYPE_UTF_8_ENCODED_STRING },
+	{ MQTTPROPERTY_CODE_RECEIVE_MAXIMUM, MQTTPROPERTY_TYPE_TWO_BYTE_INTEGER },
+	{ MQTTPROPERTY_CODE_TOPIC_ALIAS_MAXIMUM, MQTTPROPERTY_TYPE_TWO_BYTE_INTEGER },
+	{ MQTTPROPERTY_CODE_TOPIC_ALIAS, MQTTPROPERTY_TYPE_TWO_BYTE_INTEGER },
+	{ MQTTPROPERTY_CODE_MAXIMUM_QOS, MQTTPROPERTY_TYPE_BYTE },
+	{ MQTTPROPERTY_CODE_RETAIN_AVAILABLE, MQTTPROPERTY_TYPE_BYTE },
+	{ MQTTPROPERTY_CODE_USER_PROPERTY, MQTTPROPERTY_TYPE_UTF_8_STRING_PAIR },
+	{ MQTTPROPERTY_CODE_MAXIMUM_PACKET_SIZE, MQTTPROPERTY_TYPE_FOUR_BYTE_INTEGER },
+	{ MQTTPROPERTY_CODE_WILDCARD_SUBSCRIPTION_AVAILABLE, MQTTPROPERTY_TYPE_BYTE },
+	{ MQTTPROPERTY_CODE_SUBSCRIPTION_IDENTIFIERS_AVAILABLE, MQTTPROPERTY_TYPE_BYTE },
+	{ MQTTPROPERTY_CODE_SHARED_SUBSCRIPTION_AVAILABLE, MQTTPROPERTY_TYPE_BYTE }
+};
+
+
+/**
+ * Get the type of the value of a property
+ * @param identifier the property identifier
+ * @return one of MQTTPropertyTypes, or -1 if the identifier is not known
+ */
+int MQTTProperty_getType(int identifier)
+{
+	int i;
+
+	for (i = 0; i < (int)(sizeof(property_types) / sizeof(property_types[0])); ++i)
+	{
+		if (property_types[i].identifier == identifier)
+			return property_types[i].type;
+	}
+	return -1;
+}
+
+
+/**
+ * Get the encoded length of one property, including its identifier
+ * @param prop the property
+ * @return the length in bytes
+ */
+static int MQTTProperty_len(const MQTTProperty* prop)
+{
+	int len = 1;
+
+	switch (MQTTProperty_getType(prop->identifier))
+	{
+		case MQTTPROPERTY_TYPE_BYTE:
+			len += 1;
+			break;
+		case MQTTPROPERTY_TYPE_TWO_BYTE_INTEGER:
+			len += 2;
+			break;
+		case MQTTPROPERTY_TYPE_FOUR_BYTE_INTEGER:
+			len += 4;
+			break;
+		case MQTTPROPERTY_TYPE_VARIABLE_BYTE_INTEGER:
+			len += MQTTPacket_VBIlen(prop->value.integer4);
+			break;
+		case MQTTPROPERTY_TYPE_BINARY_DATA:
+		case MQTTPROPERTY_TYPE_UTF_8_ENCODED_STRING:
+			len += 2 + prop->data.len;
+			break;
+		case MQTTPROPERTY_TYPE_UTF_8_STRING_PAIR:
+			len += 2 + prop->data.len + 2 + prop->userValue.len;
+			break;
+	}
+	return len;
+}
+
+
+/**
+ * Get the encoded length of a set of properties, including the length field which precedes them
+ * @param props the properties, or NULL for none
+ * @return the length in bytes
+ */
+int MQTTProperties_len(MQTTProperties* props)
+{
+	int length = (props) ? props->length : 0;
+
+	return MQTTPacket_VBIlen(length) + length;
+}
+
+
+static char* MQTTProperties_copyData(const char* data, int len)
+{
+	char* copy = malloc(len + 1);
+
+	memcpy(copy, data, len);
+	copy[len] = '\0'; /* so that strings can be used directly */
+	return copy;
+}
+
+
+/**
+ * Add a property to a set of properties.  String and binary values are copied.
+ * @param props the properties
+ * @param prop the property to add
+ * @return 0 on success, -1 if the identifier is not known
+ */
+int MQTTProperties_add(MQTTProperties* props, const MQTTProperty* prop)
+{
+	MQTTProperty* copy = NULL;
+	int rc = 0;
+
+	FUNC_ENTRY;
+	if (MQTTProperty_getType(prop->identifier) < 0)
+	{
+		rc = -1;
+		goto exit;
+	}
+	if (props->count == props->max_count)
+	{
+		if (props->max_count == 0)
+		{
+			props->max_count = 4;
+			props->array = malloc(props->max_count * sizeof(MQTTProperty));
+		}
+		else
+		{
+			props->max_count *= 2;
+			props->array = realloc(props->array, props->max_count * sizeof(MQTTProperty));
+		}
+	}
+	copy = &props->array[props->count++];
+	*copy = *prop;
+	if (prop->data.data)
+		copy->data.data = MQTTProperties_copyData(prop->data.data, prop->data.len);
+	if (prop->userValue.data)
+		copy->userValue.data = MQTTProperties_copyData(prop->userValue.data, prop->userValue.len);
+	props->length += MQTTProperty_len(copy);
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+static void writeLenString(char** pptr, const MQTTLenString* string)
+{
+	writeInt(pptr, string->len);
+	memcpy(*pptr, string->data, string->len);
+	*pptr += string->len;
+}
+
+
+/**
+ * Write a set of properties, preceded by their length, to an output buffer
+ * @param pptr pointer to the output buffer - incremented by the number of bytes used & returned
+ * @param props the properties, or NULL for none
+ * @return the number of bytes written
+ */
+int MQTTProperties_write(char** pptr, const MQTTProperties* props)
+{
+	char* start = *pptr;
+	int i;
+
+	FUNC_ENTRY;
+	*pptr += MQTTPacket_encode(*pptr, (props) ? props->length : 0);
+	for (i = 0; props && i < props->count; ++i)
+	{
+		const MQTTProperty* prop = &props->array[i];
+
+		writeChar(pptr, (char)prop->identifier);
+		switch (MQTTProperty_getType(prop->identifier))
+		{
+			case MQTTPROPERTY_TYPE_BYTE:
+				writeChar(pptr, prop->value.byte);
+				break;
+			case MQTTPROPERTY_TYPE_TWO_BYTE_INTEGER:
+				writeInt(pptr, prop->value.integer2);
+				break;
+			case MQTTPROPERTY_TYPE_FOUR_BYTE_INTEGER:
+				writeInt(pptr, prop->value.integer4 >> 16);
+				writeInt(pptr, prop->value.integer4 & 0xFFFF);
+				break;
+			case MQTTPROPERTY_TYPE_VARIABLE_BYTE_INTEGER:
+				*pptr += MQTTPacket_encode(*pptr, prop->value.integer4);
+				break;
+			case MQTTPROPERTY_TYPE_BINARY_DATA:
+			case MQTTPROPERTY_TYPE_UTF_8_ENCODED_STRING:
+				writeLenString(pptr, &prop->data);
+				break;
+			case MQTTPROPERTY_TYPE_UTF_8_STRING_PAIR:
+				writeLenString(pptr, &prop->data);
+				writeLenString(pptr, &prop->userValue);
+				break;
+		}
+	}
+	FUNC_EXIT;
+	return (int)(*pptr - start);
+}
+
+
+static int readLenString(MQTTLenString* string, char** pptr, char* enddata)
+{
+	if (enddata - *pptr < 2)
+		return 0;
+	string->len = readInt(pptr);
+	if (enddata - *pptr < string->len)
+		return 0;
+	string->data = *pptr;
+	*pptr += string->len;
+	return 1;
+}
+
+
+/**
+ * Read one property from an input buffer.  String and binary values are not copied, but
+ * point into the input buffer.
+ * @param prop the property read
+ * @param pptr pointer to the input buffer - incremented by the number of bytes used & returned
+ * @param enddata pointer to the end of the properties not to be read beyond
+ * @return 1 if the property was read, 0 if it is malformed or not known
+ */
+int MQTTProperty_read(MQTTProperty* prop, char** pptr, char* enddata)
+{
+	int rc = 0;
+
+	memset(prop, '\0', sizeof(MQTTProperty));
+	if (*pptr >= enddata)
+		goto exit;
+	prop->identifier = readChar(pptr);
+	switch (MQTTProperty_getType(prop->identifier))
+	{
+		case MQTTPROPERTY_TYPE_BYTE:
+			if ((rc = (enddata - *pptr >= 1)))
+				prop->value.byte = readChar(pptr);
+			break;
+		case MQTTPROPERTY_TYPE_TWO_BYTE_INTEGER:
+			if ((rc = (enddata - *pptr >= 2)))
+				prop->value.integer2 = readInt(pptr);
+			break;
+		case MQTTPROPERTY_TYPE_FOUR_BYTE_INTEGER:
+			if ((rc = (enddata - *pptr >= 4)))
+			{
+				prop->value.integer4 = (unsigned int)readInt(pptr) << 16;
+				prop->value.integer4 += readInt(pptr);
+			}
+			break;
+		case MQTTPROPERTY_TYPE_VARIABLE_BYTE_INTEGER:
+		{
+			int value = 0;
+
+			if ((rc = (MQTTPacket_decodeBuf(pptr, enddata, &value) > 0)))
+				prop->value.integer4 = value;
+			break;
+		}
+		case MQTTPROPERTY_TYPE_BINARY_DATA:
+		case MQTTPROPERTY_TYPE_UTF_8_ENCODED_STRING:
+			rc = readLenString(&prop->data, pptr, enddata);
+			break;
+		case MQTTPROPERTY_TYPE_UTF_8_STRING_PAIR:
+			rc = readLenString(&prop->data, pptr, enddata) && readLenString(&prop->userValue, pptr, enddata);
+			break;
+	}
+exit:
+	return rc;
+}
+
+
+/**
+ * Read a set of properties, preceded by their length, from an input buffer.  String and binary
+ * values are copied, so the properties remain valid when the input buffer is reused.
+ * @param props the properties read, which must be freed with MQTTProperties_free
+ * @param pptr pointer to the input buffer - incremented by the number of bytes used & returned
+ * @param enddata pointer to the end of the buffer not to be read beyond
+ * @return 1 if the properties were read, 0 if they are malformed
+ */
+int MQTTProperties_read(MQTTProperties* props, char** pptr, char* enddata)
+{
+	int rc = 0, length = 0;
+	char* end = NULL;
+
+	FUNC_ENTRY;
+	memset(props, '\0', sizeof(MQTTProperties));
+	if (MQTTPacket_decodeBuf(pptr, enddata, &length) <= 0 || enddata - *pptr < length)
+		goto exit;
+	end = *pptr + length;
+	while (*pptr < end)
+	{
+		MQTTProperty prop;
+
+		if (!MQTTProperty_read(&prop, pptr, end))
+			goto exit;
+		MQTTProperties_add(props, &prop);
+	}
+	rc = 1;
+exit:
+	if (rc == 0)
+		MQTTProperties_free(props);
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+ * Free the storage held by a set of properties, leaving the set empty
+ * @param props the properties
+ */
+void MQTTProperties_free(MQTTProperties* props)
+{
+	int i;
+
+	FUNC_ENTRY;
+	for (i = 0; i < props->count; ++i)
+	{
+		if (props->array[i].data.data)
+			free(props->array[i].data.data);
+		if (props->array[i].userValue.data)
+			free(props->array[i].userValue.data);
+	}
+	if (props->array)
+		free(props->array);
+	memset(props, '\0', sizeof(MQTTProperties));
+	FUNC_EXIT;
+}
+
+
+/**
+ * Get the value of a numeric property
+ * @param props the properties
+ * @param identifier the property identifier
+ * @param defaultValue the value to return if the property is not present
+ * @return the value of the first property with the identifier, or defaultValue
+ */
+int MQTTProperties_getNumericValue(MQTTProperties* props, int identifier, int defaultValue)
+{
+	int i;
+
+	for (i = 0; i < props->count; ++i)
+	{
+		if (props->array[i].identifier != identifier)
+			continue;
+		switch (MQTTProperty_getType(identifier))
+		{
+			case MQTTPROPERTY_TYPE_BYTE:
+				return props->array[i].value.byte;
+			case MQTTPROPERTY_TYPE_TWO_BYTE_INTEGER:
+				return props->array[i].value.integer2;
+			case MQTTPROPERTY_TYPE_FOUR_BYTE_INTEGER:
+			case MQTTPROPERTY_TYPE_VARIABLE_BYTE_INTEGER:
+				return (int)props->array[i].value.integer4;
+		}
+	}
+	return defaultValue;
+}
@@ -0,0 +1,117 @@
+/*******************************************************************************
+ * Copyright (c) 2026 the mruby-mqtt contributors
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *******************************************************************************/
+
+#if !defined(MQTTPROPERTIES_H)
+#define MQTTPROPERTIES_H
+
+#if !defined(MQTTVERSION_5)
+/** MQTT version 5.0, the first version whose packets carry properties */
+#define MQTTVERSION_5 5
+#endif
+
+/**
+ * The MQTT 5.0 property identifiers
+ */
+enum MQTTPropertyCodes
+{
+	MQTTPROPERTY_CODE_PAYLOAD_FORMAT_INDICATOR = 1,
+	MQTTPROPERTY_CODE_MESSAGE_EXPIRY_INTERVAL = 2,
+	MQTTPROPERTY_CODE_CONTENT_TYPE = 3,
+	MQTTPROPERTY_CODE_RESPONSE_TOPIC = 8,
+	MQTTPROPERTY_CODE_CORRELATION_DATA = 9,
+	MQTTPROPERTY_CODE_SUBSCRIPTION_IDENTIFIER = 11,
+	MQTTPROPERTY_CODE_SESSION_EXPIRY_INTERVAL = 17,
+	MQTTPROPERTY_CODE_ASSIGNED_CLIENT_IDENTIFIER = 18,
+	MQTTPROPERTY_CODE_SERVER_KEEP_ALIVE = 19,
+	MQTTPROPERTY_CODE_AUTHENTICATION_METHOD = 21,
+	MQTTPROPERTY_CODE_AUTHENTICATION_DATA = 22,
+	MQTTPROPERTY_CODE_REQUEST_PROBLEM_INFORMATION = 23,
+	MQTTPROPERTY_CODE_WILL_DELAY_INTERVAL = 24,
+	MQTTPROPERTY_CODE_REQUEST_RESPONSE_INFORMATION = 25,
+	MQTTPROPERTY_CODE_RESPONSE_INFORMATION = 26,
+	MQTTPROPERTY_CODE_SERVER_REFERENCE = 28,
+	MQTTPROPERTY_CODE_REASON_STRING = 31,
+	MQTTPROPERTY_CODE_RECEIVE_MAXIMUM = 33,
+	MQTTPROPERTY_CODE_TOPIC_ALIAS_MAXIMUM = 34,
+	MQTTPROPERTY_CODE_TOPIC_ALIAS = 35,
+	MQTTPROPERTY_CODE_MAXIMUM_QOS = 36,
+	MQTTPROPERTY_CODE_RETAIN_AVAILABLE = 37,
+	MQTTPROPERTY_CODE_USER_PROPERTY = 38,
+	MQTTPROPERTY_CODE_MAXIMUM_PACKET_SIZE = 39,
+	MQTTPROPERTY_CODE_WILDCARD_SUBSCRIPTION_AVAILABLE = 40,
+	MQTTPROPERTY_CODE_SUBSCRIPTION_IDENTIFIERS_AVAILABLE = 41,
+	MQTTPROPERTY_CODE_SHARED_SUBSCRIPTION_AVAILABLE = 42
+};
+
+/**
+ * The encodings of property values
+ */
+enum MQTTPropertyTypes
+{
+	MQTTPROPERTY_TYPE_BYTE,
+	MQTTPROPERTY_TYPE_TWO_BYTE_INTEGER,
+	MQTTPROPERTY_TYPE_FOUR_BYTE_INTEGER,
+	MQTTPROPERTY_TYPE_VARIABLE_BYTE_INTEGER,
+	MQTTPROPERTY_TYPE_BINARY_DATA,
+	MQTTPROPERTY_TYPE_UTF_8_ENCODED_STRING,
+	MQTTPROPERTY_TYPE_UTF_8_STRING_PAIR
+};
+
+/**
+ * A length delimited string or binary value
+ */
+typedef struct
+{
+	int len;	/**< the length of the data */
+	char* data;	/**< the data, not null terminated */
+} MQTTLenString;
+
+/**
+ * One property
+ */
+typedef struct
+{
+	int identifier;	/**< one of MQTTPropertyCodes */
+	union
+	{
+		unsigned char byte;
+		unsigned short integer2;
+		unsigned int integer4;	/**< also holds variable byte integers */
+	} value;		/**< numeric values */
+	MQTTLenString data;		/**< string and binary values, and the name of a user property */
+	MQTTLenString userValue;	/**< the value of a user property */
+} MQTTProperty;
+
+/**
+ * The properties of one packet
+ */
+typedef struct
+{
+	int count;				/**< the number of properties */
+	int max_count;			/**< the number of properties the array has room for */
+	int length;				/**< the encoded length of the properties, not including the length field */
+	MQTTProperty* array;	/**< the properties */
+} MQTTProperties;
+
+#define MQTTProperties_initializer { 0, 0, 0, NULL }
+
+int MQTTProperty_getType(int identifier);
+int MQTTProperties_len(MQTTProperties* props);
+int MQTTProperties_add(MQTTProperties* props, const MQTTProperty* prop);
+int MQTTProperties_write(char** pptr, const MQTTProperties* props);
+int MQTTProperty_read(MQTTProperty* prop, char** pptr, char* enddata);
+int MQTTProperties_read(MQTTProperties* props, char** pptr, char* enddata);
+void MQTTProperties_free(MQTTProperties* props);
+int MQTTProperties_getNumericValue(MQTTProperties* props, int identifier, int defaultValue);
+
+#endif
@@ -21,6 +21,7 @@
 #include "LinkedList.h"
 #include "MQTTPacket.h"
 #include "Clients.h"
+#include "Timer.h"
 
 #define MAX_MSG_ID 65535
 #define MAX_CLIENTID_LEN 65535
@@ -29,15 +30,16 @@ typedef struct
 {
 	int socket;
 	Publications* p;
+	ListElement link; /* links the write into state.pending_writes */
 } pending_write;
 
 
 typedef struct
 {
-	List publications;
 	unsigned int msgs_received;
 	unsigned int msgs_sent;
 	List pending_writes; /* for qos 0 writes not complete */
+	TimerWheel timers; /* keepalive, retry and timeout deadlines */
 } MQTTProtocol;
 
 
@@ -36,16 +36,32 @@
 #include "SocketBuffer.h"
 #include "StackTrace.h"
 #include "Heap.h"
+#include "Pool.h"
 
 #if !defined(min)
 #define min(A,B) ( (A) < (B) ? (A):(B))
 #endif
 
+#if defined(WIN32) || defined(WIN64)
+#define MQTTProtocol_addRef(count, n) (InterlockedExchangeAdd((volatile LONG*)(count), n) + (n))
+#else
+#define MQTTProtocol_addRef(count, n) __sync_add_and_fetch(count, n)
+#endif
+
 void Protocol_processPublication(Publish* publish, Clients* client);
 void MQTTProtocol_closeSession(Clients* client, int sendwill);
+static void MQTTProtocol_touch(Clients* client, Messages* m);
+static void MQTTProtocol_retryTimeout(void* context, void* content);
+static Messages* MQTTProtocol_newMessage(Publications* p, int msgid, int qos, int retained);
+static void MQTTProtocol_removeMessage(List* msgList, Messages* m);
+static void MQTTProtocol_replayed(Clients* client, Messages* m);
 
 extern MQTTProtocol state;
+
+static Pool message_pool = POOL_INITIALIZER(POOL_MESSAGES, "messages", Messages);
+static Pool publication_pool = POOL_INITIALIZER(POOL_PUBLICATIONS, "publications", Publications);
 extern ClientStates* bstate;
+static int replaying = 0; /* clients resending their in-flight messages after reconnecting */
 
 /**
  * List callback function for comparing Message structures by message id
@@ -100,7 +116,7 @@ void MQTTProtocol_storeQoS0(Clients* pubclient, Publish* publish)
 	Log(TRACE_MIN, 12, NULL);
 	pw->p = MQTTProtocol_storePublication(publish, &len);
 	pw->socket = pubclient->net.socket;
-	ListAppend(&(state.pending_writes), pw, sizeof(pending_write)+len);
+	ListAppendNoMalloc(&(state.pending_writes), pw, &pw->link, sizeof(pending_write)+len);
 	/* we don't copy QoS 0 messages unless we have to, so now we have to tell the socket buffer where
 	the saved copy is */
 	if (SocketBuffer_updateWrite(pw->socket, pw->p->topic, pw->p->payload) == NULL)
@@ -148,7 +164,8 @@ int MQTTProtocol_startPublish(Clients* pubclient, Publish* publish, int qos, int
 	if (qos > 0)
 	{
 		*mm = MQTTProtocol_createMessage(publish, mm, qos, retained);
-		ListAppend(pubclient->outboundMsgs, *mm, (*mm)->len);
+		ListAppendNoMalloc(pubclient->outboundMsgs, *mm, &(*mm)->link, (*mm)->len);
+		MQTTProtocol_touch(pubclient, *mm);
 		/* we change these pointers to the saved message location just in case the packet could not be written
 		entirely; the socket buffer will use these locations to finish writing the packet */
 		p.payload = (*mm)->publish->payload;
@@ -160,6 +177,78 @@ int MQTTProtocol_startPublish(Clients* pubclient, Publish* publish, int qos, int
 }
 
 
+/**
+ * Start a new publish exchange for publication data which is already stored, so that it is
+ * shared with the message flow rather than copied.  Store any state necessary and try to send the packet
+ * @param pubclient the client to send the publication to
+ * @param stored the stored publication data, which gains a reference for each use made of it
+ * @param msgid the message id, if qos is greater than 0
+ * @param qos the MQTT QoS to use
+ * @param retained boolean - whether to set the MQTT retained flag
+ * @param mm - pointer to the message to send
+ * @return the completion code
+ */
+int MQTTProtocol_startStoredPublish(Clients* pubclient, Publications* stored, int msgid, int qos, int retained, Messages** mm)
+{
+	Publish p;
+	int rc = 0;
+
+	FUNC_ENTRY;
+	p.topic = stored->topic;
+	p.topiclen = stored->topiclen;
+	p.topicEncoded = (stored->registered != NULL);
+	p.payload = stored->payload;
+	p.payloadlen = stored->payloadlen;
+	p.msgId = msgid;
+	if (qos > 0)
+	{
+		++(stored->refcount);
+		*mm = MQTTProtocol_newMessage(stored, msgid, qos, retained);
+		ListAppendNoMalloc(pubclient->outboundMsgs, *mm, &(*mm)->link, (*mm)->len);
+		MQTTProtocol_touch(pubclient, *mm);
+	}
+	rc = MQTTPacket_send_publish(&p, 0, qos, retained, &pubclient->net, pubclient->clientID);
+	if (qos == 0 && rc == TCPSOCKET_INTERRUPTED)
+	{	/* the socket buffer already points at the stored data, so just keep it until the write is finished */
+		pending_write* pw = malloc(sizeof(pending_write));
+
+		++(stored->refcount);
+		pw->p = stored;
+		pw->socket = pubclient->net.socket;
+		ListAppendNoMalloc(&(state.pending_writes), pw, &pw->link, sizeof(pending_write));
+	}
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+ * Create the message data for a publish exchange
+ * @param p the stored publication data, whose reference passes to the message
+ * @param msgid the message id
+ * @param qos the MQTT QoS to use
+ * @param retained boolean - whether to set the MQTT retained flag
+ * @return pointer to the message data
+ */
+static Messages* MQTTProtocol_newMessage(Publications* p, int msgid, int qos, int retained)
+{
+	Messages* m = Pool_alloc(&message_pool);
+
+	m->len = sizeof(Messages);
+	m->publish = p;
+	m->msgid = msgid;
+	m->qos = qos;
+	m->retain = retained;
+	time(&(m->lastTouch));
+	Timer_init(&m->retryTimer, MQTTProtocol_retryTimeout, NULL, m);
+	m->replay = 0;
+	m->ackHeld = 0;
+	if (qos == 2)
+		m->nextMessageType = PUBREC;
+	return m;
+}
+
+
 /**
  * Copy and store message data for retries
  * @param publish the publication data
@@ -170,28 +259,22 @@ int MQTTProtocol_startPublish(Clients* pubclient, Publish* publish, int qos, int
  */
 Messages* MQTTProtocol_createMessage(Publish* publish, Messages **mm, int qos, int retained)
 {
-	Messages* m = malloc(sizeof(Messages));
+	Messages* m = NULL;
 
 	FUNC_ENTRY;
-	m->len = sizeof(Messages);
 	if (*mm == NULL || (*mm)->publish == NULL)
 	{
 		int len1;
-		*mm = m;
-		m->publish = MQTTProtocol_storePublication(publish, &len1);
+
+		m = MQTTProtocol_newMessage(MQTTProtocol_storePublication(publish, &len1), publish->msgId, qos, retained);
 		m->len += len1;
+		*mm = m;
 	}
 	else
 	{
 		++(((*mm)->publish)->refcount);
-		m->publish = (*mm)->publish;
+		m = MQTTProtocol_newMessage((*mm)->publish, publish->msgId, qos, retained);
 	}
-	m->msgid = publish->msgId;
-	m->qos = qos;
-	m->retain = retained;
-	time(&(m->lastTouch));
-	if (qos == 2)
-		m->nextMessageType = PUBREC;
 	FUNC_EXIT;
 	return m;
 }
@@ -205,7 +288,7 @@ Messages* MQTTProtocol_createMessage(Publish* publish, Messages **mm, int qos, i
  */
 Publications* MQTTProtocol_storePublication(Publish* publish, int* len)
 {
-	Publications* p = malloc(sizeof(Publications));
+	Publications* p = Pool_alloc(&publication_pool);
 
 	FUNC_ENTRY;
 	p->refcount = 1;
@@ -221,12 +304,54 @@ Publications* MQTTProtocol_storePublication(Publish* publish, int* len)
 	*len += sizeof(Publications);
 
 	p->topiclen = publish->topiclen;
+	p->registered = NULL;
 	p->payloadlen = publish->payloadlen;
-	p->payload = malloc(publish->payloadlen);
-	memcpy(p->payload, publish->payload, p->payloadlen);
+	if (publish->buffer)
+	{	/* share the input buffer the payload was read into */
+		p->payload = publish->payload;
+		p->buffer = SocketBuffer_retainData(publish->buffer);
+	}
+	else
+	{
+		p->payload = malloc(publish->payloadlen);
+		memcpy(p->payload, publish->payload, p->payloadlen);
+		p->buffer = NULL;
+	}
 	*len += publish->payloadlen;
+	FUNC_EXIT;
+	return p;
+}
+
 
-	ListAppend(&(state.publications), p, *len);
+/**
+ * Store message data for possible retry, taking ownership of the topic and payload
+ * rather than copying them.
+ * @param topic the topic name, allocated by malloc, if registered is NULL
+ * @param registered the registered topic, whose reference passes to the publication, or NULL
+ * @param payload the payload, allocated by malloc
+ * @param payloadlen the length of the payload
+ * @return the publication stored, with one reference
+ */
+Publications* MQTTProtocol_adoptPublication(char* topic, RegisteredTopics* registered, char* payload, int payloadlen)
+{
+	Publications* p = Pool_alloc(&publication_pool);
+
+	FUNC_ENTRY;
+	p->refcount = 1;
+	p->registered = registered;
+	if (registered)
+	{
+		p->topic = registered->topic;
+		p->topiclen = registered->topiclen;
+	}
+	else
+	{
+		p->topic = topic;
+		p->topiclen = strlen(topic);
+	}
+	p->payload = payload;
+	p->payloadlen = payloadlen;
+	p->buffer = NULL;
 	FUNC_EXIT;
 	return p;
 }
@@ -240,13 +365,70 @@ void MQTTProtocol_removePublication(Publications* p)
 	FUNC_ENTRY;
 	if (--(p->refcount) == 0)
 	{
-		free(p->payload);
-		free(p->topic);
-		ListRemove(&(state.publications), p);
+		if (p->buffer)
+			SocketBuffer_releaseData(p->buffer);
+		else
+			free(p->payload);
+		if (p->registered)
+			MQTTProtocol_releaseTopic(p->registered);
+		else
+			free(p->topic);
+		Pool_free(&publication_pool, p);
 	}
 	FUNC_EXIT;
 }
 
+
+/**
+ * Register a topic for repeated publishing, with its encoded length in front of it
+ * @param topic the topic, already checked to be valid UTF-8
+ * @param owner the client the topic is registered with
+ * @return the registered topic, with one reference, or NULL if the topic is too long
+ */
+RegisteredTopics* MQTTProtocol_registerTopic(const char* topic, void* owner)
+{
+	RegisteredTopics* t = NULL;
+	size_t len = strlen(topic);
+	char* ptr = NULL;
+
+	FUNC_ENTRY;
+	if (len > 65535)
+		goto exit;
+	t = malloc(sizeof(RegisteredTopics) + len + 3);
+	t->refcount = 1;
+	t->topiclen = (int)len;
+	t->owner = owner;
+	ptr = (char*)(t + 1);
+	writeInt(&ptr, t->topiclen);
+	t->topic = ptr;
+	memcpy(t->topic, topic, len + 1);
+exit:
+	FUNC_EXIT;
+	return t;
+}
+
+
+/**
+ * Add a reference to a registered topic.  This may be done from any thread.
+ * @param t the registered topic
+ */
+void MQTTProtocol_retainTopic(RegisteredTopics* t)
+{
+	MQTTProtocol_addRef(&t->refcount, 1);
+}
+
+
+/**
+ * Remove a reference to a registered topic, freeing it when none are left.  This may be
+ * done from any thread.
+ * @param t the registered topic
+ */
+void MQTTProtocol_releaseTopic(RegisteredTopics* t)
+{
+	if (MQTTProtocol_addRef(&t->refcount, -1) == 0)
+		free(t);
+}
+
 /**
  * Process an incoming publish packet for a socket
  * @param pack pointer to the publish packet
@@ -280,22 +462,27 @@ int MQTTProtocol_handlePublishes(void* pack, int sock)
 		/* store publication in inbound list */
 		int len;
 		ListElement* listElem = NULL;
-		Messages* m = malloc(sizeof(Messages));
 		Publications* p = MQTTProtocol_storePublication(publish, &len);
-		m->publish = p;
-		m->msgid = publish->msgId;
-		m->qos = publish->header.bits.qos;
-		m->retain = publish->header.bits.retain;
+		Messages* m = MQTTProtocol_newMessage(p, publish->msgId, 2, publish->header.bits.retain);
+
+		m->len += len;
 		m->nextMessageType = PUBREL;
+		m->ackHeld = client->syncAcks;
+		m->retryTimer.context = client;
 		if ( ( listElem = ListFindItem(client->inboundMsgs, &(m->msgid), messageIDCompare) ) != NULL )
 		{   /* discard queued publication with same msgID that the current incoming message */
 			Messages* msg = (Messages*)(listElem->content);
+			if (msg->ackHeld)
+				--(client->heldAcks);
 			MQTTProtocol_removePublication(msg->publish);
-			ListInsert(client->inboundMsgs, m, sizeof(Messages) + len, listElem);
-			ListRemove(client->inboundMsgs, msg);
+			ListInsertNoMalloc(client->inboundMsgs, m, &m->link, m->len, listElem);
+			MQTTProtocol_removeMessage(client->inboundMsgs, msg);
 		} else
-			ListAppend(client->inboundMsgs, m, sizeof(Messages) + len);
-		rc = MQTTPacket_send_pubrec(publish->msgId, &client->net, client->clientID);
+			ListAppendNoMalloc(client->inboundMsgs, m, &m->link, m->len);
+		if (m->ackHeld)
+			++(client->heldAcks); /* sent by MQTTProtocol_releaseAcks once the message is durable */
+		else
+			rc = MQTTPacket_send_pubrec(publish->msgId, &client->net, client->clientID);
 		publish->topic = NULL;
 	}
 	MQTTPacket_freePublish(publish);
@@ -334,7 +521,8 @@ int MQTTProtocol_handlePubacks(void* pack, int sock)
 				rc = MQTTPersistence_remove(client, PERSISTENCE_PUBLISH_SENT, m->qos, puback->msgId);
 			#endif
 			MQTTProtocol_removePublication(m->publish);
-			ListRemove(client->outboundMsgs, m);
+			MQTTProtocol_replayed(client, m);
+			MQTTProtocol_removeMessage(client->outboundMsgs, m);
 		}
 	}
 	free(pack);
@@ -379,11 +567,22 @@ int MQTTProtocol_handlePubrecs(void* pack, int sock)
 			if (pubrec->header.bits.dup == 0)
 				Log(TRACE_MIN, 5, NULL, "PUBREC", client->clientID, pubrec->msgId);
 		}
+		else if (pubrec->rc >= 0x80)
+		{	/* the server has refused the message, which ends the flow without a PUBREL */
+			Log(TRACE_MIN, -1, "PUBREC with reason code %d received from client %s for msgid %d",
+				pubrec->rc, client->clientID, pubrec->msgId);
+			#if !defined(NO_PERSISTENCE)
+				rc = MQTTPersistence_remove(client, PERSISTENCE_PUBLISH_SENT, m->qos, pubrec->msgId);
+			#endif
+			MQTTProtocol_removePublication(m->publish);
+			MQTTProtocol_replayed(client, m);
+			MQTTProtocol_removeMessage(client->outboundMsgs, m);
+		}
 		else
 		{
 			rc = MQTTPacket_send_pubrel(pubrec->msgId, 0, &client->net, client->clientID);
 			m->nextMessageType = PUBCOMP;
-			time(&(m->lastTouch));
+			MQTTProtocol_touch(client, m);
 		}
 	}
 	free(pack);
@@ -437,12 +636,15 @@ int MQTTProtocol_handlePubrels(void* pack, int sock)
 			publish.topiclen = m->publish->topiclen;
 			publish.payload = m->publish->payload;
 			publish.payloadlen = m->publish->payloadlen;
+			publish.buffer = m->publish->buffer;
 			Protocol_processPublication(&publish, client);
 			#if !defined(NO_PERSISTENCE)
 				rc += MQTTPersistence_remove(client, PERSISTENCE_PUBLISH_RECEIVED, m->qos, pubrel->msgId);
 			#endif
-			ListRemove(&(state.publications), m->publish);
-			ListRemove(client->inboundMsgs, m);
+			if (m->publish->buffer)
+				SocketBuffer_releaseData(m->publish->buffer); /* the application has its own reference */
+			Pool_free(&publication_pool, m->publish); /* the topic, and any payload not in an input buffer, now belong to the application */
+			MQTTProtocol_removeMessage(client->inboundMsgs, m);
 			++(state.msgs_received);
 		}
 	}
@@ -490,7 +692,8 @@ int MQTTProtocol_handlePubcomps(void* pack, int sock)
 					rc = MQTTPersistence_remove(client, PERSISTENCE_PUBLISH_SENT, m->qos, pubcomp->msgId);
 				#endif
 				MQTTProtocol_removePublication(m->publish);
-				ListRemove(client->outboundMsgs, m);
+				MQTTProtocol_replayed(client, m);
+				MQTTProtocol_removeMessage(client->outboundMsgs, m);
 				(++state.msgs_sent);
 			}
 		}
@@ -502,153 +705,378 @@ int MQTTProtocol_handlePubcomps(void* pack, int sock)
 
 
 /**
- * MQTT protocol keepAlive processing.  Sends PINGREQ packets as required.
+ * Schedule the next keepalive check for a client.
+ * @param client the client
  * @param now current time
  */
-void MQTTProtocol_keepalive(time_t now)
+static void MQTTProtocol_scheduleKeepalive(Clients* client, time_t now)
 {
-	ListElement* current = NULL;
+	long interval = client->keepAliveInterval;
+
+	if (client->ping_outstanding == 0)
+	{	/* a PINGREQ is due when either direction has been quiet for the keepalive interval,
+		   but nothing is received while reading is paused */
+		time_t last = (client->net.readPaused) ? client->net.lastSent :
+			min(client->net.lastSent, client->net.lastReceived);
+		interval = (long)difftime(last + client->keepAliveInterval, now);
+	}
+	Timer_setIn(&state.timers, &client->keepAliveTimer, max(interval, 1) * 1000L);
+}
+
+
+/**
+ * MQTT protocol keepAlive processing.  Sends PINGREQ packets as required.
+ * Called when the keepalive timer of a client expires.
+ * @param context the client
+ * @param content unused
+ */
+static void MQTTProtocol_keepaliveTimeout(void* context, void* content)
+{
+	Clients* client = (Clients*)context;
+	time_t now;
 
 	FUNC_ENTRY;
-	ListNextElement(bstate->clients, &current);
-	while (current)
+	time(&(now));
+	if (client->connected && client->keepAliveInterval > 0 &&
+		(difftime(now, client->net.lastSent) >= client->keepAliveInterval ||
+				(!client->net.readPaused && difftime(now, client->net.lastReceived) >= client->keepAliveInterval)))
 	{
-		Clients* client =	(Clients*)(current->content);
-		ListNextElement(bstate->clients, &current); 
-		if (client->connected && client->keepAliveInterval > 0 &&
-			(difftime(now, client->net.lastSent) >= client->keepAliveInterval ||
-					difftime(now, client->net.lastReceived) >= client->keepAliveInterval))
+		if (client->ping_outstanding == 0)
 		{
-			if (client->ping_outstanding == 0)
+			if (Socket_noPendingWrites(client->net.socket))
 			{
-				if (Socket_noPendingWrites(client->net.socket))
+				if (MQTTPacket_send_pingreq(&client->net, client->clientID) != TCPSOCKET_COMPLETE)
+				{
+					Log(TRACE_PROTOCOL, -1, "Error sending PINGREQ for client %s on socket %d, disconnecting", client->clientID, client->net.socket);
+					MQTTProtocol_closeSession(client, 1);
+				}
+				else
 				{
-					if (MQTTPacket_send_pingreq(&client->net, client->clientID) != TCPSOCKET_COMPLETE)
-					{
-						Log(TRACE_PROTOCOL, -1, "Error sending PINGREQ for client %s on socket %d, disconnecting", client->clientID, client->net.socket);
-						MQTTProtocol_closeSession(client, 1);
-					}
-					else
-					{
-						client->net.lastSent = now;
+					client->net.lastSent = now;
+					/* while reading is paused the PINGRESP cannot be read, so it is not waited for:
+					   the PINGREQ only keeps the server from closing the connection */
+					if (!client->net.readPaused)
 						client->ping_outstanding = 1;
-					}
 				}
 			}
-			else
-			{
-				Log(TRACE_PROTOCOL, -1, "PINGRESP not received in keepalive interval for client %s on socket %d, disconnecting", client->clientID, client->net.socket);
-				MQTTProtocol_closeSession(client, 1);
-			}
+		}
+		else
+		{
+			Log(TRACE_PROTOCOL, -1, "PINGRESP not received in keepalive interval for client %s on socket %d, disconnecting", client->clientID, client->net.socket);
+			MQTTProtocol_closeSession(client, 1);
 		}
 	}
+	if (client->connected && client->keepAliveInterval > 0)
+		MQTTProtocol_scheduleKeepalive(client, now);
 	FUNC_EXIT;
 }
 
 
 /**
- * MQTT retry processing per client
- * @param now current time
- * @param client - the client to which to apply the retry processing
- * @param regardless boolean - retry packets regardless of retry interval (used on reconnect)
+ * Start keepalive processing for a client which has just connected.
+ * @param client the client
  */
-void MQTTProtocol_retries(time_t now, Clients* client, int regardless)
+void MQTTProtocol_startKeepalive(Clients* client)
 {
-	ListElement* outcurrent = NULL;
-
 	FUNC_ENTRY;
+	client->keepAliveTimer.callback = MQTTProtocol_keepaliveTimeout;
+	client->keepAliveTimer.context = client;
+	if (client->keepAliveInterval > 0)
+		MQTTProtocol_scheduleKeepalive(client, time(NULL));
+	else
+		Timer_cancel(&state.timers, &client->keepAliveTimer);
+	FUNC_EXIT;
+}
 
-	if (!regardless && client->retryInterval <= 0) /* 0 or -ive retryInterval turns off retry except on reconnect */
-		goto exit;
 
-	while (client && ListNextElement(client->outboundMsgs, &outcurrent) &&
-		   client->connected && client->good &&        /* client is connected and has no errors */
-		   Socket_noPendingWrites(client->net.socket)) /* there aren't any previous packets still stacked up on the socket */
+/**
+ * Record that a message flow has progressed, and schedule its next retry.
+ * @param client the client the message belongs to
+ * @param m the message
+ */
+static void MQTTProtocol_touch(Clients* client, Messages* m)
+{
+	time(&(m->lastTouch));
+	m->retryTimer.context = client;
+	if (client->retryInterval > 0) /* 0 or -ive retryInterval turns off retry except on reconnect */
+		Timer_setIn(&state.timers, &m->retryTimer, max(client->retryInterval, 10) * 1000L);
+	else
+		Timer_cancel(&state.timers, &m->retryTimer);
+}
+
+
+/**
+ * Resend the packet of a message flow which is waiting to be acknowledged.
+ * @param client the client the message belongs to
+ * @param m the message
+ * @return boolean - is the client still usable?
+ */
+static int MQTTProtocol_resend(Clients* client, Messages* m)
+{
+	int good = 1;
+
+	FUNC_ENTRY;
+	if (m->qos == 1 || (m->qos == 2 && m->nextMessageType == PUBREC))
 	{
-		Messages* m = (Messages*)(outcurrent->content);
-		if (regardless || difftime(now, m->lastTouch) > max(client->retryInterval, 10))
+		Publish publish;
+		int rc;
+
+		Log(TRACE_MIN, 7, NULL, "PUBLISH", client->clientID, client->net.socket, m->msgid);
+		publish.msgId = m->msgid;
+		publish.topic = m->publish->topic;
+		publish.topiclen = m->publish->topiclen;
+		publish.topicEncoded = (m->publish->registered != NULL);
+		publish.payload = m->publish->payload;
+		publish.payloadlen = m->publish->payloadlen;
+		rc = MQTTPacket_send_publish(&publish, 1, m->qos, m->retain, &client->net, client->clientID);
+		if (rc == SOCKET_ERROR)
 		{
-			if (m->qos == 1 || (m->qos == 2 && m->nextMessageType == PUBREC))
-			{
-				Publish publish;
-				int rc;
-
-				Log(TRACE_MIN, 7, NULL, "PUBLISH", client->clientID, client->net.socket, m->msgid);
-				publish.msgId = m->msgid;
-				publish.topic = m->publish->topic;
-				publish.payload = m->publish->payload;
-				publish.payloadlen = m->publish->payloadlen;
-				rc = MQTTPacket_send_publish(&publish, 1, m->qos, m->retain, &client->net, client->clientID);
-				if (rc == SOCKET_ERROR)
-				{
-					client->good = 0;
-					Log(TRACE_PROTOCOL, 29, NULL, client->clientID, client->net.socket,
-												Socket_getpeer(client->net.socket));
-					MQTTProtocol_closeSession(client, 1);
-					client = NULL;
-				}
-				else
-				{
-					if (m->qos == 0 && rc == TCPSOCKET_INTERRUPTED)
-						MQTTProtocol_storeQoS0(client, &publish);
-					time(&(m->lastTouch));
-				}
-			}
-			else if (m->qos && m->nextMessageType == PUBCOMP)
-			{
-				Log(TRACE_MIN, 7, NULL, "PUBREL", client->clientID, client->net.socket, m->msgid);
-				if (MQTTPacket_send_pubrel(m->msgid, 0, &client->net, client->clientID) != TCPSOCKET_COMPLETE)
-				{
-					client->good = 0;
-					Log(TRACE_PROTOCOL, 29, NULL, client->clientID, client->net.socket,
-							Socket_getpeer(client->net.socket));
-					MQTTProtocol_closeSession(client, 1);
-					client = NULL;
-				}
-				else
-					time(&(m->lastTouch));
-			}
-			/* break; why not do all retries at once? */
+			client->good = 0;
+			Log(TRACE_PROTOCOL, 29, NULL, client->clientID, client->net.socket,
+										Socket_getpeer(client->net.socket));
+			MQTTProtocol_closeSession(client, 1);
+			good = 0;
+		}
+		else
+		{
+			if (m->qos == 0 && rc == TCPSOCKET_INTERRUPTED)
+				MQTTProtocol_storeQoS0(client, &publish);
+			MQTTProtocol_touch(client, m);
 		}
 	}
-exit:
+	else if (m->qos && m->nextMessageType == PUBCOMP)
+	{
+		Log(TRACE_MIN, 7, NULL, "PUBREL", client->clientID, client->net.socket, m->msgid);
+		if (MQTTPacket_send_pubrel(m->msgid, 0, &client->net, client->clientID) != TCPSOCKET_COMPLETE)
+		{
+			client->good = 0;
+			Log(TRACE_PROTOCOL, 29, NULL, client->clientID, client->net.socket,
+					Socket_getpeer(client->net.socket));
+			MQTTProtocol_closeSession(client, 1);
+			good = 0;
+		}
+		else
+			MQTTProtocol_touch(client, m);
+	}
+	FUNC_EXIT_RC(good);
+	return good;
+}
+
+
+/**
+ * MQTT retry processing for one message.  Called when the retry timer of the message expires.
+ * @param context the client the message belongs to
+ * @param content the message
+ */
+static void MQTTProtocol_retryTimeout(void* context, void* content)
+{
+	Clients* client = (Clients*)context;
+	Messages* m = (Messages*)content;
+
+	FUNC_ENTRY;
+	if (client->connected == 0 || m->replay)
+		; /* all flows are resent on reconnect */
+	else if (client->good == 0)
+		MQTTProtocol_closeSession(client, 1);
+	else if (Socket_noPendingWrites(client->net.socket) == 0)
+		Timer_setIn(&state.timers, &m->retryTimer, 1000L); /* previous packets are still stacked up on the socket */
+	else
+		MQTTProtocol_resend(client, m);
 	FUNC_EXIT;
 }
 
 
 /**
- * MQTT retry protocol and socket pending writes processing.
- * @param now current time
- * @param doRetry boolean - retries as well as pending writes?
- * @param regardless boolean - retry packets regardless of retry interval (used on reconnect)
+ * Record that a message no longer needs to be resent after reconnecting, because it has been
+ * resent or is about to be removed, and move the replay on to the next message if it was that one.
+ * @param client the client the message belongs to
+ * @param m the message
+ */
+static void MQTTProtocol_replayed(Clients* client, Messages* m)
+{
+	if (m->replay == 0)
+		return;
+	m->replay = 0;
+	++(client->replaySent);
+	if (client->replayNext == m)
+	{	/* messages sent since the reconnect follow those to be replayed, and are not flagged */
+		ListElement* next = m->link.next;
+
+		client->replayNext = (next && ((Messages*)next->content)->replay) ? (Messages*)next->content : NULL;
+		if (client->replayNext == NULL)
+		{
+			Timer_cancel(&state.timers, &client->replayTimer);
+			--replaying;
+		}
+	}
+}
+
+
+/**
+ * The size of the packet that resends a message, as counted against the replay byte limit.
+ * @param m the message
+ * @return the number of bytes
+ */
+static int MQTTProtocol_replaySize(Messages* m)
+{
+	if (m->qos == 2 && m->nextMessageType == PUBCOMP)
+		return 4; /* PUBREL */
+	return 2 + 4 + 2 + m->publish->topiclen + m->publish->payloadlen;
+}
+
+
+/**
+ * Resend the next in-flight messages of a client after reconnecting, as many as the pacing
+ * allows and while nothing is waiting to be written to the socket, so that new publications
+ * are sent between them.  The replay timer is set to continue with the rest.
+ * @param client the client
+ */
+static void MQTTProtocol_replay(Clients* client)
+{
+	unsigned long now = Timer_now();
+	long interval = 1L; /* the next tick of the timer wheel */
+	int bytes = 0;
+
+	FUNC_ENTRY;
+	while (client->replayNext && client->connected && client->good)
+	{
+		Messages* m = client->replayNext;
+		int size = MQTTProtocol_replaySize(m);
+
+		if (!Socket_noPendingWrites(client->net.socket))
+			break; /* continue once the socket has taken the previous packets */
+		if (client->replayRate > 0 &&
+			client->replaySent >= (int)((now - client->replayStart) * client->replayRate / 1000L) + 1)
+		{	/* wait until the next message is due */
+			interval = (long)((double)client->replaySent * 1000L / client->replayRate) - (long)(now - client->replayStart);
+			break;
+		}
+		if (client->replayBytes > 0 && bytes > 0 && bytes + size > client->replayBytes)
+			break;
+		bytes += size;
+		MQTTProtocol_replayed(client, m);
+		if (!MQTTProtocol_resend(client, m))
+			break;
+	}
+	if (client->replayNext && client->connected && client->good)
+		Timer_setIn(&state.timers, &client->replayTimer, max(interval, 1L));
+	FUNC_EXIT;
+}
+
+
+/**
+ * Continue the replay of the in-flight messages of a client.  Called when its replay timer expires.
+ * @param context the client
+ * @param content unused
  */
-void MQTTProtocol_retry(time_t now, int doRetry, int regardless)
+static void MQTTProtocol_replayTimeout(void* context, void* content)
+{
+	Clients* client = (Clients*)context;
+
+	FUNC_ENTRY;
+	if (client->connected == 0 || client->good == 0)
+		MQTTProtocol_stopReplay(client);
+	else
+		MQTTProtocol_replay(client);
+	FUNC_EXIT;
+}
+
+
+/**
+ * Resend the current packet of every outbound message flow of a client, regardless of
+ * retry interval (used on reconnect).  The packets are not all written at once: they are
+ * resent a few at a time, paced by the client's replayBytes and replayRate, while the
+ * socket keeps up.
+ * @param client the client
+ */
+void MQTTProtocol_retries(Clients* client)
 {
 	ListElement* current = NULL;
 
 	FUNC_ENTRY;
-	ListNextElement(bstate->clients, &current);
-	/* look through the outbound message list of each client, checking to see if a retry is necessary */
-	while (current)
+	MQTTProtocol_stopReplay(client);
+	while (ListNextElement(client->outboundMsgs, &current))
+	{
+		Messages* m = (Messages*)(current->content);
+
+		m->replay = 1;
+		Timer_cancel(&state.timers, &m->retryTimer);
+	}
+	client->replayTotal = client->outboundMsgs->count;
+	client->replaySent = 0;
+	client->replayStart = Timer_now();
+	if (client->outboundMsgs->first)
 	{
-		Clients* client = (Clients*)(current->content);
-		ListNextElement(bstate->clients, &current);
-		if (client->connected == 0)
-			continue;
-		if (client->good == 0)
+		client->replayNext = (Messages*)(client->outboundMsgs->first->content);
+		++replaying;
+	}
+	client->replayTimer.callback = MQTTProtocol_replayTimeout;
+	client->replayTimer.context = client;
+	MQTTProtocol_replay(client);
+	FUNC_EXIT;
+}
+
+
+/**
+ * Send the PUBRECs which were held until the messages they acknowledge were durable.  If the
+ * client is no longer connected they are dropped, and sent when the server sends the messages
+ * again.
+ * @param client the client
+ * @return completion code
+ */
+int MQTTProtocol_releaseAcks(Clients* client)
+{
+	ListElement* current = NULL;
+	int rc = TCPSOCKET_COMPLETE;
+
+	FUNC_ENTRY;
+	while (client->heldAcks > 0 && ListNextElement(client->inboundMsgs, &current))
+	{
+		Messages* m = (Messages*)(current->content);
+
+		if (m->ackHeld)
 		{
-			MQTTProtocol_closeSession(client, 1);
-			continue;
+			m->ackHeld = 0;
+			--(client->heldAcks);
+			if (client->connected && rc != SOCKET_ERROR)
+				rc = MQTTPacket_send_pubrec(m->msgid, &client->net, client->clientID);
 		}
-		if (Socket_noPendingWrites(client->net.socket) == 0)
-			continue;
-		if (doRetry)
-			MQTTProtocol_retries(now, client, regardless);
+	}
+	client->heldAcks = 0;
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+ * Stop resending the in-flight messages of a client, because its connection has closed.  They
+ * are all resent when it reconnects.
+ * @param client the client
+ */
+void MQTTProtocol_stopReplay(Clients* client)
+{
+	FUNC_ENTRY;
+	Timer_cancel(&state.timers, &client->replayTimer);
+	if (client->replayNext)
+	{
+		client->replayNext = NULL;
+		--replaying;
 	}
 	FUNC_EXIT;
 }
 
 
+/**
+ * Are any clients resending their in-flight messages after reconnecting?  If so, the replay timers
+ * must be run every TIMER_TICK_MS.
+ * @return the number of clients
+ */
+int MQTTProtocol_replaying(void)
+{
+	return replaying;
+}
+
+
 /**
  * Free a client structure
  * @param client the client data to free
@@ -657,9 +1085,12 @@ void MQTTProtocol_freeClient(Clients* client)
 {
 	FUNC_ENTRY;
 	/* free up pending message lists here, and any other allocated data */
+	Timer_cancel(&state.timers, &client->keepAliveTimer);
+	MQTTProtocol_stopReplay(client);
 	MQTTProtocol_freeMessageList(client->outboundMsgs);
 	MQTTProtocol_freeMessageList(client->inboundMsgs);
 	ListFree(client->messageQueue);
+	MQTTTopicAliases_free(&client->net.aliases);
 	free(client->clientID);
 	if (client->will)
 	{
@@ -688,21 +1119,35 @@ void MQTTProtocol_freeClient(Clients* client)
 }
 
 
+/**
+ * Remove a message from a message list, cancel its retry timer and free it.  Its publication
+ * must already have been released.
+ * @param msgList the message list
+ * @param m the message
+ */
+static void MQTTProtocol_removeMessage(List* msgList, Messages* m)
+{
+	ListDetachElement(msgList, &m->link);
+	Timer_cancel(&state.timers, &m->retryTimer);
+	Pool_free(&message_pool, m);
+}
+
+
 /**
  * Empty a message list, leaving it able to accept new messages
  * @param msgList the message list to empty
  */
 void MQTTProtocol_emptyMessageList(List* msgList)
 {
-	ListElement* current = NULL;
+	Messages* m = NULL;
 
 	FUNC_ENTRY;
-	while (ListNextElement(msgList, &current))
+	while ((m = ListDetachHeadElement(msgList)) != NULL)
 	{
-		Messages* m = (Messages*)(current->content);
+		Timer_cancel(&state.timers, &m->retryTimer);
 		MQTTProtocol_removePublication(m->publish);
+		Pool_free(&message_pool, m);
 	}
-	ListEmpty(msgList);
 	FUNC_EXIT;
 }
 
@@ -30,8 +30,13 @@
 #define MAX_CLIENTID_LEN 65535
 
 int MQTTProtocol_startPublish(Clients* pubclient, Publish* publish, int qos, int retained, Messages** m);
+int MQTTProtocol_startStoredPublish(Clients* pubclient, Publications* stored, int msgid, int qos, int retained, Messages** mm);
 Messages* MQTTProtocol_createMessage(Publish* publish, Messages** mm, int qos, int retained);
 Publications* MQTTProtocol_storePublication(Publish* publish, int* len);
+Publications* MQTTProtocol_adoptPublication(char* topic, RegisteredTopics* registered, char* payload, int payloadlen);
+RegisteredTopics* MQTTProtocol_registerTopic(const char* topic, void* owner);
+void MQTTProtocol_retainTopic(RegisteredTopics* t);
+void MQTTProtocol_releaseTopic(RegisteredTopics* t);
 int messageIDCompare(void* a, void* b);
 int MQTTProtocol_assignMsgId(Clients* client);
 void MQTTProtocol_removePublication(Publications* p);
@@ -42,8 +47,11 @@ int MQTTProtocol_handlePubrecs(void* pack, int sock);
 int MQTTProtocol_handlePubrels(void* pack, int sock);
 int MQTTProtocol_handlePubcomps(void* pack, int sock);
 
-void MQTTProtocol_keepalive(time_t);
-void MQTTProtocol_retry(time_t, int, int);
+void MQTTProtocol_startKeepalive(Clients* client);
+void MQTTProtocol_retries(Clients* client);
+void MQTTProtocol_stopReplay(Clients* client);
+int MQTTProtocol_releaseAcks(Clients* client);
+int MQTTProtocol_replaying(void);
 void MQTTProtocol_freeClient(Clients* client);
 void MQTTProtocol_emptyMessageList(List* msgList);
 void MQTTProtocol_freeMessageList(List* msgList);
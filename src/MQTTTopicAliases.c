@@ -0,0 +1,207 @@
+/*******************************************************************************
+ * Copyright (c) 2026 the mruby-mqtt contributors
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *******************************************************************************/
+
+/**
+ * @file
+ * \brief MQTT 5.0 topic aliases.
+ *
+ * An alias replaces the topic of a PUBLISH once the topic has been sent with that alias on the
+ * same connection.  Outbound aliases are assigned to topics as they are published, and once
+ * the number the server accepts is used up, the least recently used alias is given to the new
+ * topic.  Inbound aliases are chosen by the server, and resolved through a table indexed by alias.
+ *
+ * None of these functions lock: the aliases belong to a connection, and are protected by the
+ * caller's mutex.
+ */
+
+#include "MQTTTopicAliases.h"
+#include "StackTrace.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "Heap.h"
+
+
+/**
+ * Compare an outbound alias with another, or with a topic
+ */
+static int MQTTTopicAliases_compare(void* a, void* b, int content)
+{
+	char* topic = (content) ? ((MQTTTopicAlias*)b)->topic : (char*)b;
+
+	return strcmp(((MQTTTopicAlias*)a)->topic, topic);
+}
+
+
+static char* MQTTTopicAliases_copy(const char* topic)
+{
+	size_t len = strlen(topic) + 1;
+	char* copy = malloc(len);
+
+	memcpy(copy, topic, len);
+	return copy;
+}
+
+
+/**
+ * Forget all the outbound aliases
+ * @param aliases the topic aliases of a connection
+ */
+static void MQTTTopicAliases_clearOutbound(MQTTTopicAliases* aliases)
+{
+	MQTTTopicAlias* entry = NULL;
+
+	if (aliases->topics.index[0].compare == NULL)
+		TreeInitializeNoMalloc(&aliases->topics, MQTTTopicAliases_compare);
+	while ((entry = ListDetachHeadElement(&aliases->lru)) != NULL)
+	{
+		TreeRemove(&aliases->topics, entry);
+		free(entry->topic);
+	}
+	if (aliases->outbound)
+	{
+		free(aliases->outbound);
+		aliases->outbound = NULL;
+	}
+	aliases->outboundCount = aliases->outboundMax = 0;
+}
+
+
+/**
+ * Forget all the aliases in both directions, ready for a new connection.  No outbound
+ * aliases are used until the server says how many it accepts.
+ * @param aliases the topic aliases of a connection
+ * @param inboundMax the number of aliases the server is allowed to use
+ */
+void MQTTTopicAliases_reset(MQTTTopicAliases* aliases, int inboundMax)
+{
+	int i;
+
+	FUNC_ENTRY;
+	MQTTTopicAliases_clearOutbound(aliases);
+	for (i = 0; i < aliases->inboundMax; ++i)
+	{
+		if (aliases->inbound[i])
+			free(aliases->inbound[i]);
+	}
+	if (aliases->inbound)
+		free(aliases->inbound);
+	aliases->inbound = NULL;
+	if ((aliases->inboundMax = inboundMax) > 0)
+	{
+		aliases->inbound = malloc(inboundMax * sizeof(char*));
+		memset(aliases->inbound, '\0', inboundMax * sizeof(char*));
+	}
+	FUNC_EXIT;
+}
+
+
+/**
+ * Set the number of outbound aliases the server accepts, from its CONNACK
+ * @param aliases the topic aliases of a connection
+ * @param outboundMax the server's topic alias maximum
+ */
+void MQTTTopicAliases_setOutboundMax(MQTTTopicAliases* aliases, int outboundMax)
+{
+	FUNC_ENTRY;
+	MQTTTopicAliases_clearOutbound(aliases);
+	if (outboundMax > MQTTTOPICALIASES_OUTBOUND_MAX)
+		outboundMax = MQTTTOPICALIASES_OUTBOUND_MAX;
+	if ((aliases->outboundMax = outboundMax) > 0)
+		aliases->outbound = malloc(outboundMax * sizeof(MQTTTopicAlias));
+	FUNC_EXIT;
+}
+
+
+/**
+ * Get the alias to send a topic with, assigning one if the topic has none
+ * @param aliases the topic aliases of a connection
+ * @param topic the topic being published to
+ * @param known set to 1 if the alias has already been sent with this topic, so that the topic
+ * can be left out, or 0 if the topic must be sent as well
+ * @return the alias, or 0 if the server does not accept aliases
+ */
+int MQTTTopicAliases_outbound(MQTTTopicAliases* aliases, const char* topic, int* known)
+{
+	MQTTTopicAlias* entry = NULL;
+	Node* node = NULL;
+
+	*known = 0;
+	if (aliases->outboundMax == 0)
+		return 0;
+	if ((node = TreeFind(&aliases->topics, (void*)topic)) != NULL)
+	{
+		entry = node->content;
+		*known = 1;
+		ListDetachElement(&aliases->lru, &entry->link);
+	}
+	else
+	{
+		if (aliases->outboundCount < aliases->outboundMax)
+		{
+			entry = &aliases->outbound[aliases->outboundCount];
+			entry->alias = ++(aliases->outboundCount);
+		}
+		else
+		{	/* reassign the least recently used alias */
+			entry = ListDetachHeadElement(&aliases->lru);
+			TreeRemove(&aliases->topics, entry);
+			free(entry->topic);
+		}
+		entry->topic = MQTTTopicAliases_copy(topic);
+		TreeAdd(&aliases->topics, entry, sizeof(MQTTTopicAlias));
+	}
+	ListAppendNoMalloc(&aliases->lru, entry, &entry->link, sizeof(MQTTTopicAlias));
+	return entry->alias;
+}
+
+
+/**
+ * Record the topic the server has sent with an inbound alias
+ * @param aliases the topic aliases of a connection
+ * @param alias the alias
+ * @param topic the topic
+ * @return 1 if the alias was recorded, 0 if it is outside the range we allowed
+ */
+int MQTTTopicAliases_setInbound(MQTTTopicAliases* aliases, int alias, const char* topic)
+{
+	if (alias < 1 || alias > aliases->inboundMax)
+		return 0;
+	if (aliases->inbound[alias - 1])
+		free(aliases->inbound[alias - 1]);
+	aliases->inbound[alias - 1] = MQTTTopicAliases_copy(topic);
+	return 1;
+}
+
+
+/**
+ * Get the topic of an inbound alias
+ * @param aliases the topic aliases of a connection
+ * @param alias the alias
+ * @return the topic, or NULL if the alias has not been set
+ */
+const char* MQTTTopicAliases_inbound(MQTTTopicAliases* aliases, int alias)
+{
+	return (alias < 1 || alias > aliases->inboundMax) ? NULL : aliases->inbound[alias - 1];
+}
+
+
+/**
+ * Free all the storage used by the topic aliases of a connection
+ * @param aliases the topic aliases of a connection
+ */
+void MQTTTopicAliases_free(MQTTTopicAliases* aliases)
+{
+	MQTTTopicAliases_reset(aliases, 0);
+}
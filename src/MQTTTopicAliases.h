@@ -0,0 +1,58 @@
+/*******************************************************************************
+ * Copyright (c) 2026 the mruby-mqtt contributors
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *******************************************************************************/
+
+#if !defined(MQTTTOPICALIASES_H)
+#define MQTTTOPICALIASES_H
+
+#include "LinkedList.h"
+#include "Tree.h"
+
+/** the most outbound topic aliases used on one connection, whatever the server allows */
+#if !defined(MQTTTOPICALIASES_OUTBOUND_MAX)
+#define MQTTTOPICALIASES_OUTBOUND_MAX 1024
+#endif
+
+/**
+ * An outbound topic alias
+ */
+typedef struct
+{
+	char* topic;		/**< the topic the alias stands for */
+	int alias;			/**< the alias, from 1 */
+	ListElement link;	/**< links the alias into the least recently used list */
+} MQTTTopicAlias;
+
+/**
+ * The topic aliases of one MQTT 5.0 network connection, in both directions.  Aliases only
+ * last as long as the connection, so they are reset whenever a CONNECT is sent.
+ * A zeroed structure is valid, with no aliases allowed.
+ */
+typedef struct
+{
+	int outboundMax;			/**< the number of aliases the server accepts from us */
+	int outboundCount;			/**< the number of outbound aliases assigned */
+	MQTTTopicAlias* outbound;	/**< the outbound aliases, indexed by alias - 1 */
+	Tree topics;				/**< the outbound aliases, indexed by topic */
+	List lru;					/**< the outbound aliases, least recently used first */
+	int inboundMax;				/**< the number of aliases we accept from the server */
+	char** inbound;				/**< the topics of the inbound aliases, indexed by alias - 1 */
+} MQTTTopicAliases;
+
+void MQTTTopicAliases_reset(MQTTTopicAliases* aliases, int inboundMax);
+void MQTTTopicAliases_setOutboundMax(MQTTTopicAliases* aliases, int outboundMax);
+int MQTTTopicAliases_outbound(MQTTTopicAliases* aliases, const char* topic, int* known);
+int MQTTTopicAliases_setInbound(MQTTTopicAliases* aliases, int alias, const char* topic);
+const char* MQTTTopicAliases_inbound(MQTTTopicAliases* aliases, int alias);
+void MQTTTopicAliases_free(MQTTTopicAliases* aliases);
+
+#endif
@@ -0,0 +1,280 @@
+/*******************************************************************************
+ * Copyright (c) 2026 the mruby-mqtt contributors
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *******************************************************************************/
+
+/**
+ * @file
+ * \brief Pools of fixed size objects.
+ *
+ * The structures allocated for every message - list elements, commands, message flows and
+ * stored publications - come from pools rather than the heap.  Each thread keeps a small
+ * cache of free objects for every pool, so that allocating and freeing normally takes no lock.
+ * Only when a cache is empty, or holds too many objects, are objects moved to or from the
+ * pool's shared free list, in batches, under the pool mutex.
+ *
+ * Slabs are allocated directly from the C library, not through the heap tracking in Heap.c,
+ * and are never freed, so the memory used by a pool is its high water mark.
+ */
+
+#include "Pool.h"
+
+#include <stdlib.h>
+
+#include "Thread.h"
+#include "Log.h"
+
+#if defined(WIN32) || defined(WIN64)
+#define POOL_THREAD_LOCAL __declspec(thread)
+mutex_type pool_mutex;
+#else
+#define POOL_THREAD_LOCAL __thread
+static pthread_mutex_t pool_mutex_store = PTHREAD_MUTEX_INITIALIZER;
+static mutex_type pool_mutex = &pool_mutex_store;
+static pthread_key_t pool_thread_key;
+static pthread_once_t pool_key_once = PTHREAD_ONCE_INIT;
+#endif
+
+#define POOL_SLAB_BYTES 16384	/* target size of a slab */
+#define POOL_MIN_PER_SLAB 16	/* fewest objects in a slab, for large objects */
+#define POOL_ALIGN 16			/* alignment of each object */
+#define POOL_CACHE_MAX 64		/* most free objects a thread cache holds */
+#define POOL_BATCH 32			/* objects moved between a thread cache and the shared free list at once */
+
+/**
+ * The free objects a thread holds for one pool
+ */
+typedef struct
+{
+	void* free;
+	int count;
+} PoolCache;
+
+static POOL_THREAD_LOCAL PoolCache pool_caches[POOL_COUNT];
+static POOL_THREAD_LOCAL int pool_thread_registered = 0;
+static Pool* pools[POOL_COUNT]; /* the pools which have been used, for statistics and thread end */
+
+
+#if !defined(WIN32) && !defined(WIN64)
+/**
+ * Called by pthreads when a thread which used a pool ends.
+ * @param arg unused
+ */
+static void Pool_threadDestructor(void* arg)
+{
+	(void)arg;
+	Pool_threadEnd();
+}
+
+
+static void Pool_createKey(void)
+{
+	pthread_key_create(&pool_thread_key, Pool_threadDestructor);
+}
+#endif
+
+
+/**
+ * Arrange for a thread's caches to be returned to the pools when the thread ends.  On
+ * Windows, Pool_threadEnd is called from DllMain instead.
+ */
+static void Pool_registerThread(void)
+{
+#if !defined(WIN32) && !defined(WIN64)
+	pthread_once(&pool_key_once, Pool_createKey);
+	pthread_setspecific(pool_thread_key, &pool_thread_registered); /* any non-NULL value */
+#endif
+	pool_thread_registered = 1;
+}
+
+
+/**
+ * Add a new slab of objects to the shared free list of a pool.  Called with the pool mutex locked.
+ * @param pool the pool
+ * @return boolean - was the slab allocated?
+ */
+static int Pool_newSlab(Pool* pool)
+{
+	size_t header = (sizeof(void*) + POOL_ALIGN - 1) & ~(size_t)(POOL_ALIGN - 1);
+	char* slab = NULL;
+	int count = 0;
+	int i;
+
+	if (pool->info.slabs == 0)
+	{	/* make room for the free list link, and keep every object aligned */
+		if (pool->info.size < sizeof(void*))
+			pool->info.size = sizeof(void*);
+		pool->info.size = (pool->info.size + POOL_ALIGN - 1) & ~(size_t)(POOL_ALIGN - 1);
+	}
+	count = (int)((POOL_SLAB_BYTES - header) / pool->info.size);
+	if (count < POOL_MIN_PER_SLAB)
+		count = POOL_MIN_PER_SLAB;
+	if ((slab = malloc(header + count * pool->info.size)) == NULL)
+		return 0;
+	*(void**)slab = pool->slab;
+	pool->slab = slab;
+	for (i = count - 1; i >= 0; --i) /* so that objects are handed out in address order */
+	{
+		void* object = slab + header + i * pool->info.size;
+
+		*(void**)object = pool->free;
+		pool->free = object;
+	}
+	++(pool->info.slabs);
+	pool->info.capacity += count;
+	pool->info.available += count;
+	return 1;
+}
+
+
+/**
+ * Move a batch of objects from the shared free list of a pool to a thread cache
+ * @param pool the pool
+ * @param cache the calling thread's cache for the pool
+ */
+static void Pool_refill(Pool* pool, PoolCache* cache)
+{
+	if (!pool_thread_registered)
+		Pool_registerThread();
+	Thread_lock_mutex(pool_mutex);
+	pools[pool->index] = pool;
+	if (pool->info.available < POOL_BATCH)
+		Pool_newSlab(pool);
+	while (cache->count < POOL_BATCH && pool->free)
+	{
+		void* object = pool->free;
+
+		pool->free = *(void**)object;
+		*(void**)object = cache->free;
+		cache->free = object;
+		++(cache->count);
+		--(pool->info.available);
+	}
+	pool->info.in_use = pool->info.capacity - pool->info.available;
+	if (pool->info.in_use > pool->info.max_in_use)
+		pool->info.max_in_use = pool->info.in_use;
+	Thread_unlock_mutex(pool_mutex);
+}
+
+
+/**
+ * Move objects from a thread cache to the shared free list of a pool
+ * @param pool the pool
+ * @param cache the calling thread's cache for the pool
+ * @param count the number of objects to keep in the cache
+ */
+static void Pool_spill(Pool* pool, PoolCache* cache, int count)
+{
+	Thread_lock_mutex(pool_mutex);
+	while (cache->count > count)
+	{
+		void* object = cache->free;
+
+		cache->free = *(void**)object;
+		*(void**)object = pool->free;
+		pool->free = object;
+		--(cache->count);
+		++(pool->info.available);
+	}
+	pool->info.in_use = pool->info.capacity - pool->info.available;
+	Thread_unlock_mutex(pool_mutex);
+}
+
+
+/**
+ * Allocate an object from a pool.
+ * @param pool the pool
+ * @return the object, or NULL if no memory is available
+ */
+void* Pool_alloc(Pool* pool)
+{
+	PoolCache* cache = &pool_caches[pool->index];
+	void* object = NULL;
+
+	if (cache->count == 0)
+		Pool_refill(pool, cache);
+	if ((object = cache->free) != NULL)
+	{
+		cache->free = *(void**)object;
+		--(cache->count);
+	}
+	return object;
+}
+
+
+/**
+ * Return an object to a pool.  The object can be freed by a different thread from the one
+ * which allocated it.
+ * @param pool the pool the object was allocated from
+ * @param object the object, or NULL
+ */
+void Pool_free(Pool* pool, void* object)
+{
+	PoolCache* cache = &pool_caches[pool->index];
+
+	if (object == NULL)
+		return;
+	if (!pool_thread_registered)
+		Pool_registerThread();
+	*(void**)object = cache->free;
+	cache->free = object;
+	if (++(cache->count) > POOL_CACHE_MAX)
+		Pool_spill(pool, cache, POOL_CACHE_MAX - POOL_BATCH);
+}
+
+
+/**
+ * Return all the objects cached by the calling thread to their pools.  Must be called when a
+ * thread which has used the pools ends, or those objects are lost.
+ */
+void Pool_threadEnd(void)
+{
+	int i;
+
+	for (i = 0; i < POOL_COUNT; ++i)
+	{
+		if (pool_caches[i].count > 0 && pools[i])
+			Pool_spill(pools[i], &pool_caches[i], 0);
+	}
+}
+
+
+/**
+ * Get the statistics of a pool
+ * @param pool the pool
+ * @param info returned statistics
+ */
+void Pool_get_info(Pool* pool, pool_info* info)
+{
+	Thread_lock_mutex(pool_mutex);
+	*info = pool->info;
+	Thread_unlock_mutex(pool_mutex);
+}
+
+
+/**
+ * Write the statistics of all the pools which have been used to the trace log
+ */
+void Pool_logStats(void)
+{
+	int i;
+
+	for (i = 0; i < POOL_COUNT; ++i)
+	{
+		pool_info info;
+
+		if (pools[i] == NULL)
+			continue;
+		Pool_get_info(pools[i], &info);
+		Log(TRACE_MIN, -1, "Pool %s: %d objects of %d bytes in %d slabs, %d in use, maximum %d",
+			info.name, info.capacity, (int)info.size, info.slabs, info.in_use, info.max_in_use);
+	}
+}
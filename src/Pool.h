@@ -0,0 +1,62 @@
+/*******************************************************************************
+ * Copyright (c) 2026 the mruby-mqtt contributors
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *******************************************************************************/
+
+#if !defined(POOL_H)
+#define POOL_H
+
+#include <stddef.h>
+
+/**
+ * The pools of fixed size objects.  Each pool has a free object cache in every thread,
+ * indexed by these values.
+ */
+enum Pool_indexes
+{
+	POOL_LIST_ELEMENTS, POOL_COMMANDS, POOL_MESSAGES, POOL_PUBLICATIONS, POOL_COUNT
+};
+
+/**
+ * Statistics for a pool
+ */
+typedef struct
+{
+	const char* name;	/**< the name of the pool */
+	size_t size;		/**< the size of each object, after alignment */
+	int slabs;			/**< the number of slabs allocated */
+	int capacity;		/**< the number of objects the slabs hold */
+	int available;		/**< objects on the shared free list */
+	int in_use;			/**< objects held by callers or in thread caches */
+	int max_in_use;		/**< high water mark of in_use */
+} pool_info;
+
+/**
+ * A pool of fixed size objects, which are carved out of slabs that are never returned
+ * to the heap.  Define with POOL_INITIALIZER.
+ */
+typedef struct
+{
+	int index;			/**< one of Pool_indexes */
+	void* free;			/**< the shared free list, linked through the first word of each object */
+	void* slab;			/**< the most recent slab, linked through its first word to the previous one */
+	pool_info info;
+} Pool;
+
+#define POOL_INITIALIZER(index, name, type) { index, NULL, NULL, { name, sizeof(type), 0, 0, 0, 0, 0 } }
+
+void* Pool_alloc(Pool* pool);
+void Pool_free(Pool* pool, void* object);
+void Pool_get_info(Pool* pool, pool_info* info);
+void Pool_logStats(void);
+void Pool_threadEnd(void);
+
+#endif
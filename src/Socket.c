@@ -199,6 +199,33 @@ int isReady(int socket, fd_set* read_set, fd_set* write_set)
 }
 
 
+/**
+ *  Stop reporting a socket as ready to read, so that data waits in the kernel and TCP flow
+ *  control holds the sender back.  Writes continue.
+ *  @param socket the socket
+ */
+void Socket_pauseReading(int socket)
+{
+	FUNC_ENTRY;
+	FD_CLR(socket, &(s.rset_saved));
+	FD_CLR(socket, &(s.rset));
+	FUNC_EXIT;
+}
+
+
+/**
+ *  Report a socket as ready to read again, after Socket_pauseReading()
+ *  @param socket the socket, which is ignored if it has been closed meanwhile
+ */
+void Socket_resumeReading(int socket)
+{
+	FUNC_ENTRY;
+	if (ListFindItem(s.clientsds, &socket, intcompare) != NULL)
+		FD_SET(socket, &(s.rset_saved));
+	FUNC_EXIT;
+}
+
+
 /**
  *  Returns the next socket ready for communications as indicated by select
  *  @param more_work flag to indicate more work is waiting, and thus a timeout value of 0 should
@@ -426,11 +453,13 @@ int Socket_writev(int socket, iobuf* iovecs, int count, unsigned long* bytes)
  *  Attempts to write a series of buffers to a socket in *one* system call so that they are
  *  sent as one packet.
  *  @param socket the socket to write to
- *  @param buf0 the first buffer
+ *  @param buf0 the first buffer, the packet header, which is copied if the write is interrupted
  *  @param buf0len the length of data in the first buffer
  *  @param count number of buffers
  *  @param buffers an array of buffers to write
  *  @param buflens an array of corresponding buffer lengths
+ *  @param frees an array of flags: 1 to free the buffer once written, SOCKETBUFFER_COPY to copy it
+ *  if the write is interrupted, or 0 if it remains valid until the write is complete
  *  @return completion code, especially TCPSOCKET_INTERRUPTED
  */
 int Socket_putdatas(int socket, char* buf0, size_t buf0len, int count, char** buffers, size_t* buflens, int* frees)
@@ -453,7 +482,7 @@ int Socket_putdatas(int socket, char* buf0, size_t buf0len, int count, char** bu
 
 	iovecs[0].iov_base = buf0;
 	iovecs[0].iov_len = buf0len;
-	frees1[0] = 1;
+	frees1[0] = SOCKETBUFFER_COPY;
 	for (i = 0; i < count; i++)
 	{
 		iovecs[i+1].iov_base = buffers[i];
@@ -654,6 +683,7 @@ int Socket_new(char* addr, int port, int* sock)
 			rc = Socket_error("socket", *sock);
 		else
 		{
+			int nodelay = 1;
 #if defined(NOSIGPIPE)
 			int opt = 1;
 
@@ -661,6 +691,10 @@ int Socket_new(char* addr, int port, int* sock)
 				Log(LOG_ERROR, -1, "Could not set SO_NOSIGPIPE for socket %d", *sock);
 #endif
 
+			/* each packet is written in one call, so there is nothing to gain from Nagle's algorithm */
+			if (setsockopt(*sock, IPPROTO_TCP, TCP_NODELAY, (void*)&nodelay, sizeof(nodelay)) != 0)
+				Log(LOG_ERROR, -1, "Could not set TCP_NODELAY for socket %d", *sock);
+
 			Log(TRACE_MIN, -1, "New socket %d for %s, port %d",	*sock, addr, port);
 			if (Socket_addSocket(*sock) == SOCKET_ERROR)
 				rc = Socket_error("setnonblocking", *sock);
@@ -113,6 +113,8 @@ typedef struct
 void Socket_outInitialize(void);
 void Socket_outTerminate(void);
 int Socket_getReadySocket(int more_work, struct timeval *tp);
+void Socket_pauseReading(int socket);
+void Socket_resumeReading(int socket);
 int Socket_getch(int socket, char* c);
 char *Socket_getdata(int socket, int bytes, int* actual_len);
 int Socket_putdatas(int socket, char* buf0, size_t buf0len, int count, char** buffers, size_t* buflens, int* frees);
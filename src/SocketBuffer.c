@@ -36,8 +36,20 @@
 #if defined(WIN32) || defined(WIN64)
 #define iov_len len
 #define iov_base buf
+#define SocketBuffer_addRef(count, n) (InterlockedExchangeAdd((volatile LONG*)(count), n) + (n))
+#else
+#define SocketBuffer_addRef(count, n) __sync_add_and_fetch(count, n)
 #endif
 
+/**
+ * Input buffers are reference counted, so that a packet can keep the data it was read from,
+ * rather than copying it out, while further packets are read into a new buffer.  The count
+ * is held in a header before the data, padded to keep the data aligned.
+ */
+#define SOCKETBUFFER_DATA_OFFSET 16
+#define SOCKETBUFFER_DEFAULT_SIZE 1000	/* the size of a new input buffer, unless a packet needs more */
+#define SocketBuffer_refcount(data) ((volatile int*)((data) - SOCKETBUFFER_DATA_OFFSET))
+
 /**
  * Default input queue buffer
  */
@@ -65,15 +77,53 @@ int socketcompare(void* a, void* b)
 }
 
 
+/**
+ * Allocate an input buffer, with one reference held by the caller
+ * @param len the length of data the buffer is to hold
+ * @return the data area of the buffer
+ */
+static char* SocketBuffer_newData(int len)
+{
+	char* data = (char*)malloc(SOCKETBUFFER_DATA_OFFSET + len) + SOCKETBUFFER_DATA_OFFSET;
+
+	*SocketBuffer_refcount(data) = 1;
+	return data;
+}
+
+
+/**
+ * Take a reference to an input buffer, so that the data in it remains valid after the
+ * socket has read on.  Any thread can take or release references.
+ * @param data the data area of the buffer, as returned by SocketBuffer_getQueuedData
+ * @return the same data pointer
+ */
+char* SocketBuffer_retainData(char* data)
+{
+	SocketBuffer_addRef(SocketBuffer_refcount(data), 1);
+	return data;
+}
+
+
+/**
+ * Release a reference to an input buffer, freeing it when there are none left
+ * @param data the data area of the buffer
+ */
+void SocketBuffer_releaseData(char* data)
+{
+	if (SocketBuffer_addRef(SocketBuffer_refcount(data), -1) == 0)
+		free(data - SOCKETBUFFER_DATA_OFFSET);
+}
+
+
 /**
  * Create a new default queue when one has just been used.
  */
 void SocketBuffer_newDefQ(void)
 {
 	def_queue = malloc(sizeof(socket_queue));
-	def_queue->buflen = 1000;
-	def_queue->buf = malloc(def_queue->buflen);
-	def_queue->socket = def_queue->index = def_queue->buflen = def_queue->datalen = 0;
+	def_queue->buflen = SOCKETBUFFER_DEFAULT_SIZE;
+	def_queue->buf = SocketBuffer_newData(def_queue->buflen);
+	def_queue->socket = def_queue->index = def_queue->datalen = 0;
 }
 
 
@@ -95,7 +145,7 @@ void SocketBuffer_initialize(void)
  */
 void SocketBuffer_freeDefQ(void)
 {
-	free(def_queue->buf);
+	SocketBuffer_releaseData(def_queue->buf);
 	free(def_queue);
 }
 
@@ -110,7 +160,7 @@ void SocketBuffer_terminate(void)
 
 	FUNC_ENTRY;
 	while (ListNextElement(queues, &cur))
-		free(((socket_queue*)(cur->content))->buf);
+		SocketBuffer_releaseData(((socket_queue*)(cur->content))->buf);
 	ListFree(queues);
 	SocketBuffer_freeDefQ();
 	FUNC_EXIT;
@@ -126,7 +176,7 @@ void SocketBuffer_cleanup(int socket)
 	FUNC_ENTRY;
 	if (ListFindItem(queues, &socket, socketcompare))
 	{
-		free(((socket_queue*)(queues->current->content))->buf);
+		SocketBuffer_releaseData(((socket_queue*)(queues->current->content))->buf);
 		ListRemove(queues, queues->current->content);
 	}
 	if (def_queue->socket == socket)
@@ -157,18 +207,19 @@ char* SocketBuffer_getQueuedData(int socket, int bytes, int* actual_len)
 		*actual_len = 0;
 		queue = def_queue;
 	}
-	if (bytes > queue->buflen)
-	{
+	if (bytes > queue->buflen || *SocketBuffer_refcount(queue->buf) > 1)
+	{	/* too small, or still holding a packet which was kept after it was read */
+		char* newmem = NULL;
+
+		if (bytes > queue->buflen)
+			queue->buflen = bytes;
+		else /* a replacement for a kept buffer is sized for this packet, not the largest one seen, as it may be kept too */
+			queue->buflen = (bytes > SOCKETBUFFER_DEFAULT_SIZE) ? bytes : SOCKETBUFFER_DEFAULT_SIZE;
+		newmem = SocketBuffer_newData(queue->buflen);
 		if (queue->datalen > 0)
-		{
-			void* newmem = malloc(bytes);
 			memcpy(newmem, queue->buf, queue->datalen);
-			free(queue->buf);
-			queue->buf = newmem;
-		}
-		else
-			queue->buf = realloc(queue->buf, bytes);
-		queue->buflen = bytes;
+		SocketBuffer_releaseData(queue->buf);
+		queue->buf = newmem;
 	}
 
 	FUNC_EXIT;
@@ -308,6 +359,7 @@ void SocketBuffer_pendingWrite(int socket, int count, iobuf* iovecs, int* frees,
 #endif
 {
 	int i = 0;
+	int fixedlen = 0;
 	pending_writes* pw = NULL;
 
 	FUNC_ENTRY;
@@ -324,6 +376,24 @@ void SocketBuffer_pendingWrite(int socket, int count, iobuf* iovecs, int* frees,
 	{
 		pw->iovecs[i] = iovecs[i];
 		pw->frees[i] = frees[i];
+		if (frees[i] == SOCKETBUFFER_COPY)
+		{	/* the buffer is about to go out of scope, so keep a copy */
+			char* copy = NULL;
+
+			if (fixedlen + iovecs[i].iov_len <= SOCKETBUFFER_FIXED_LEN)
+			{
+				copy = &pw->fixed[fixedlen];
+				fixedlen += iovecs[i].iov_len;
+				pw->frees[i] = 0;
+			}
+			else
+			{
+				copy = malloc(iovecs[i].iov_len);
+				pw->frees[i] = 1;
+			}
+			memcpy(copy, iovecs[i].iov_base, iovecs[i].iov_len);
+			pw->iovecs[i].iov_base = copy;
+		}
 	}
 	ListAppend(&writes, pw, sizeof(pw) + total);
 	FUNC_EXIT;
@@ -381,10 +451,10 @@ pending_writes* SocketBuffer_updateWrite(int socket, char* topic, char* payload)
 	if ((le = ListFindItem(&writes, &socket, pending_socketcompare)) != NULL)
 	{
 		pw = (pending_writes*)(le->content);
-		if (pw->count == 4)
+		if (pw->count >= 4) /* header, topic length, topic, [message id and properties,] payload */
 		{
 			pw->iovecs[2].iov_base = topic;
-			pw->iovecs[3].iov_base = payload;
+			pw->iovecs[pw->count - 1].iov_base = payload;
 		}
 	}
 
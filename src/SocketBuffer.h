@@ -44,6 +44,16 @@ typedef struct
 	char* buf;
 } socket_queue;
 
+/**
+ * Value in the frees array of a write, for a small buffer such as an encoded header which is
+ * on the writer's stack.  It is copied into the pending write if the write is interrupted,
+ * so that no buffer need be allocated for it otherwise.
+ */
+#define SOCKETBUFFER_COPY 2
+/** the space in a pending write for SOCKETBUFFER_COPY buffers: enough for a PUBLISH header,
+    topic length and message id */
+#define SOCKETBUFFER_FIXED_LEN 16
+
 typedef struct
 {
 	int socket, total, count;
@@ -53,6 +63,7 @@ typedef struct
 	unsigned long bytes;
 	iobuf iovecs[5];
 	int frees[5];
+	char fixed[SOCKETBUFFER_FIXED_LEN];	/**< copies of the SOCKETBUFFER_COPY buffers */
 } pending_writes;
 
 #define SOCKETBUFFER_COMPLETE 0
@@ -69,6 +80,8 @@ int SocketBuffer_getQueuedChar(int socket, char* c);
 void SocketBuffer_interrupted(int socket, int actual_len);
 char* SocketBuffer_complete(int socket);
 void SocketBuffer_queueChar(int socket, char c);
+char* SocketBuffer_retainData(char* data);
+void SocketBuffer_releaseData(char* data);
 
 #if defined(OPENSSL)
 void SocketBuffer_pendingWrite(int socket, SSL* ssl, int count, iobuf* iovecs, int* frees, int total, int bytes);
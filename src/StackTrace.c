@@ -27,6 +27,9 @@
 
 #if defined(WIN32) || defined(WIN64)
 #define snprintf _snprintf
+#define STACKTRACE_THREAD_LOCAL __declspec(thread)
+#else
+#define STACKTRACE_THREAD_LOCAL __thread
 #endif
 
 /*BE
@@ -62,7 +65,7 @@ typedef struct
 
 static int thread_count = 0;
 static threadEntry threads[MAX_THREADS];
-static threadEntry *cur_thread = NULL;
+static STACKTRACE_THREAD_LOCAL threadEntry *cur_thread = NULL; /* the calling thread's entry, once found */
 
 #if defined(WIN32) || defined(WIN64)
 mutex_type stack_mutex;
@@ -72,12 +75,21 @@ static mutex_type stack_mutex = &stack_mutex_store;
 #endif
 
 
+/**
+ * Find the calling thread's stack.  Each thread only changes its own stack, so the mutex
+ * is only needed the first time, to look up or add the thread's entry.
+ * @param create add an entry for the thread if there is none
+ * @return boolean - was the stack found?
+ */
 int setStack(int create)
 {
 	int i = -1;
-	thread_id_type curid = Thread_getid();
+	thread_id_type curid;
 
-	cur_thread = NULL;
+	if (cur_thread)
+		return 1;
+	Thread_lock_mutex(stack_mutex);
+	curid = Thread_getid();
 	for (i = 0; i < MAX_THREADS && i < thread_count; ++i)
 	{
 		if (threads[i].id == curid)
@@ -95,14 +107,14 @@ int setStack(int create)
 		cur_thread->current_depth = 0;
 		++thread_count;
 	}
+	Thread_unlock_mutex(stack_mutex);
 	return cur_thread != NULL; /* good == 1 */
 }
 
 void StackTrace_entry(const char* name, int line, int trace_level)
 {
-	Thread_lock_mutex(stack_mutex);
 	if (!setStack(1))
-		goto exit;
+		return;
 	if (trace_level != -1)
 		Log_stackTrace(trace_level, 9, (int)cur_thread->id, cur_thread->current_depth, name, line, NULL);
 	strncpy(cur_thread->callstack[cur_thread->current_depth].name, name, sizeof(cur_thread->callstack[0].name)-1);
@@ -111,16 +123,13 @@ void StackTrace_entry(const char* name, int line, int trace_level)
 		cur_thread->maxdepth = cur_thread->current_depth;
 	if (cur_thread->current_depth >= MAX_STACK_DEPTH)
 		Log(LOG_FATAL, -1, "Max stack depth exceeded");
-exit:
-	Thread_unlock_mutex(stack_mutex);
 }
 
 
 void StackTrace_exit(const char* name, int line, void* rc, int trace_level)
 {
-	Thread_lock_mutex(stack_mutex);
 	if (!setStack(0))
-		goto exit;
+		return;
 	if (--(cur_thread->current_depth) < 0)
 		Log(LOG_FATAL, -1, "Minimum stack depth exceeded for thread %lu", cur_thread->id);
 	if (strncmp(cur_thread->callstack[cur_thread->current_depth].name, name, sizeof(cur_thread->callstack[0].name)-1) != 0)
@@ -132,8 +141,6 @@ void StackTrace_exit(const char* name, int line, void* rc, int trace_level)
 		else
 			Log_stackTrace(trace_level, 11, (int)cur_thread->id, cur_thread->current_depth, name, line, (int*)rc);
 	}
-exit:
-	Thread_unlock_mutex(stack_mutex);
 }
 
 
@@ -373,13 +373,15 @@ cond_type Thread_create_cond()
 	condvar = malloc(sizeof(cond_type_struct));
 	rc = pthread_cond_init(&condvar->cond, NULL);
 	rc = pthread_mutex_init(&condvar->mutex, NULL);
+	condvar->signalled = 0;
 
 	FUNC_EXIT_RC(rc);
 	return condvar;
 }
 
 /**
- * Signal a condition variable
+ * Signal a condition variable.  The signal is kept until it is waited for, so that it is not
+ * lost if the waiting thread is busy when it is sent.
  * @return completion code
  */
 int Thread_signal_cond(cond_type condvar)
@@ -387,6 +389,7 @@ int Thread_signal_cond(cond_type condvar)
 	int rc = 0;
 
 	pthread_mutex_lock(&condvar->mutex);
+	condvar->signalled = 1;
 	rc = pthread_cond_signal(&condvar->cond);
 	pthread_mutex_unlock(&condvar->mutex);
 
@@ -394,7 +397,10 @@ int Thread_signal_cond(cond_type condvar)
 }
 
 /**
- * Wait with a timeout (seconds) for condition variable
+ * Wait with a timeout for condition variable, returning at once if it has been
+ * signalled since the last wait
+ * @param condvar the condition variable
+ * @param timeout the maximum time to wait, in milliseconds
  * @return completion code
  */
 int Thread_wait_cond(cond_type condvar, int timeout)
@@ -403,14 +409,18 @@ int Thread_wait_cond(cond_type condvar, int timeout)
 	int rc = 0;
 	struct timespec cond_timeout;
 	struct timeval cur_time;
+	long usec;
 
 	gettimeofday(&cur_time, NULL);
 
-	cond_timeout.tv_sec = cur_time.tv_sec + timeout;
-	cond_timeout.tv_nsec = cur_time.tv_usec * 1000;
+	usec = cur_time.tv_usec + (timeout % 1000) * 1000L;
+	cond_timeout.tv_sec = cur_time.tv_sec + timeout / 1000 + usec / 1000000L;
+	cond_timeout.tv_nsec = (usec % 1000000L) * 1000L;
 
 	pthread_mutex_lock(&condvar->mutex);
-	rc = pthread_cond_timedwait(&condvar->cond, &condvar->mutex, &cond_timeout);
+	while (!condvar->signalled && rc == 0)
+		rc = pthread_cond_timedwait(&condvar->cond, &condvar->mutex, &cond_timeout);
+	condvar->signalled = 0;
 	pthread_mutex_unlock(&condvar->mutex);
 
 	FUNC_EXIT_RC(rc);
@@ -36,7 +36,7 @@
 	#define thread_return_type void*
 	typedef thread_return_type (*thread_fn)(void*);
 	#define mutex_type pthread_mutex_t*
-	typedef struct { pthread_cond_t cond; pthread_mutex_t mutex; } cond_type_struct;
+	typedef struct { pthread_cond_t cond; pthread_mutex_t mutex; int signalled; } cond_type_struct;
 	typedef cond_type_struct *cond_type;
 	typedef sem_t *sem_type;
 
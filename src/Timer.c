@@ -0,0 +1,248 @@
+/*******************************************************************************
+ * Copyright (c) 2026 the mruby-mqtt contributors
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *******************************************************************************/
+
+/**
+ * @file
+ * \brief Hierarchical timer wheel.
+ *
+ * Timers are kept in slots indexed by their deadline, rather than being found by
+ * walking every client and message, so that the cost of running the wheel depends on
+ * the number of timers which expire, not on the number which are scheduled.
+ * Level 0 has one slot per tick; each higher level has slots TIMER_WHEEL_SLOTS times as
+ * wide, whose timers are moved down a level when the wheel reaches them.
+ * Deadlines are measured by a monotonic clock, so changes to the wall clock time do not
+ * cause retries and keepalives to be missed or to be sent early.
+ *
+ * None of these functions lock: the wheel is protected by the caller's mutex.
+ */
+
+#include "Timer.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(WIN32) || defined(WIN64)
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+#include "StackTrace.h"
+
+#define TIMER_WHEEL_SHIFT 6 /* log2 of TIMER_WHEEL_SLOTS */
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+
+
+/**
+ * Get the current value of the monotonic clock.
+ * @return the time in milliseconds from an arbitrary starting point
+ */
+unsigned long Timer_now(void)
+{
+#if defined(WIN32) || defined(WIN64)
+	return GetTickCount();
+#else
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000UL + now.tv_nsec / 1000000L;
+#endif
+}
+
+
+/**
+ * Initialize a timer structure.  The timer is not scheduled.
+ * @param timer the timer to initialize
+ * @param callback the function to call when the timer expires
+ * @param context the first parameter to pass to the callback
+ * @param content the second parameter to pass to the callback
+ */
+void Timer_init(Timer* timer, Timer_callback* callback, void* context, void* content)
+{
+	memset(timer, '\0', sizeof(Timer));
+	timer->callback = callback;
+	timer->context = context;
+	timer->content = content;
+}
+
+
+static void TimerWheel_unlink(TimerWheel* wheel, Timer* timer)
+{
+	if (timer->prev)
+		timer->prev->next = timer->next;
+	else if (timer->level == TIMER_WHEEL_LEVELS)
+		wheel->expired = timer->next;
+	else
+		wheel->slots[timer->level][timer->slot] = timer->next;
+	if (timer->next)
+		timer->next->prev = timer->prev;
+	timer->prev = timer->next = NULL;
+}
+
+
+/**
+ * Put a timer into the slot matching its deadline.
+ * @param wheel the timer wheel
+ * @param timer the timer, with its expiry tick already set
+ */
+static void TimerWheel_insert(TimerWheel* wheel, Timer* timer)
+{
+	unsigned long expires = timer->expires;
+	long delta = (long)(expires - wheel->tick);
+	long span = TIMER_WHEEL_SLOTS;
+	int level = 0;
+	Timer** slot;
+
+	if (delta < 0)
+	{	/* already expired: run on the next tick */
+		expires = wheel->tick;
+		delta = 0;
+	}
+	while (level < TIMER_WHEEL_LEVELS - 1 && delta >= span)
+	{
+		++level;
+		span *= TIMER_WHEEL_SLOTS;
+	}
+	if (delta >= span) /* beyond the top level, so park in the furthest slot - it will be inserted again from there */
+		expires = wheel->tick + span - 1;
+
+	timer->level = level;
+	timer->slot = (expires >> (TIMER_WHEEL_SHIFT * level)) & TIMER_WHEEL_MASK;
+	slot = &wheel->slots[level][timer->slot];
+	timer->prev = NULL;
+	timer->next = *slot;
+	if (*slot)
+		(*slot)->prev = timer;
+	*slot = timer;
+}
+
+
+/**
+ * Move the timers in the current slot of a level down to the levels below.
+ * @param wheel the timer wheel
+ * @param level the level to cascade, greater than 0
+ */
+static void TimerWheel_cascade(TimerWheel* wheel, int level)
+{
+	int index = (wheel->tick >> (TIMER_WHEEL_SHIFT * level)) & TIMER_WHEEL_MASK;
+	Timer* timer = NULL;
+
+	if (index == 0 && level < TIMER_WHEEL_LEVELS - 1)
+		TimerWheel_cascade(wheel, level + 1);
+	while ((timer = wheel->slots[level][index]) != NULL)
+	{
+		TimerWheel_unlink(wheel, timer);
+		TimerWheel_insert(wheel, timer);
+	}
+}
+
+
+/**
+ * Schedule a timer, rescheduling it if it is already pending.
+ * @param wheel the timer wheel
+ * @param timer the timer
+ * @param deadline the time from Timer_now() at which the timer is to expire
+ */
+void Timer_set(TimerWheel* wheel, Timer* timer, unsigned long deadline)
+{
+	FUNC_ENTRY;
+	if (timer->pending)
+		Timer_cancel(wheel, timer);
+	if (wheel->count == 0)
+	{	/* an empty wheel may not have been run for some time */
+		unsigned long now = Timer_now() / TIMER_TICK_MS;
+
+		if ((long)(now - wheel->tick) > 0)
+			wheel->tick = now;
+	}
+	timer->expires = (deadline + TIMER_TICK_MS - 1) / TIMER_TICK_MS; /* never expire early */
+	TimerWheel_insert(wheel, timer);
+	timer->pending = 1;
+	++(wheel->count);
+	FUNC_EXIT;
+}
+
+
+/**
+ * Schedule a timer relative to the current time.
+ * @param wheel the timer wheel
+ * @param timer the timer
+ * @param interval the number of milliseconds from now at which the timer is to expire
+ */
+void Timer_setIn(TimerWheel* wheel, Timer* timer, long interval)
+{
+	Timer_set(wheel, timer, Timer_now() + interval);
+}
+
+
+/**
+ * Unschedule a timer.  It is not an error if the timer is not pending.
+ * @param wheel the timer wheel
+ * @param timer the timer
+ */
+void Timer_cancel(TimerWheel* wheel, Timer* timer)
+{
+	FUNC_ENTRY;
+	if (timer->pending)
+	{
+		TimerWheel_unlink(wheel, timer);
+		timer->pending = 0;
+		--(wheel->count);
+	}
+	FUNC_EXIT;
+}
+
+
+/**
+ * Advance the wheel to the given time, calling the callbacks of all the timers which have
+ * expired.  The callbacks may set and cancel any timers, including the one being called.
+ * @param wheel the timer wheel
+ * @param now the current time from Timer_now()
+ * @return the number of timers which expired
+ */
+int TimerWheel_run(TimerWheel* wheel, unsigned long now)
+{
+	unsigned long target = now / TIMER_TICK_MS;
+	int fired = 0;
+
+	FUNC_ENTRY;
+	while (wheel->count > 0 && (long)(target - wheel->tick) >= 0)
+	{
+		int index = wheel->tick & TIMER_WHEEL_MASK;
+		Timer* timer = NULL;
+
+		if (index == 0)
+			TimerWheel_cascade(wheel, 1);
+		++(wheel->tick);
+		/* move the slot's timers to the expired list, so that any timer set by a callback lands in
+		   the empty slot to be run on the next lap, and any timer cancelled is still found */
+		if ((timer = wheel->expired = wheel->slots[0][index]) != NULL)
+		{
+			wheel->slots[0][index] = NULL;
+			for (; timer; timer = timer->next)
+				timer->level = TIMER_WHEEL_LEVELS;
+		}
+		while ((timer = wheel->expired) != NULL)
+		{
+			TimerWheel_unlink(wheel, timer);
+			timer->pending = 0;
+			--(wheel->count);
+			++fired;
+			(*(timer->callback))(timer->context, timer->content);
+		}
+	}
+	if ((long)(target + 1 - wheel->tick) > 0)
+		wheel->tick = target + 1; /* nothing left to expire on the ticks skipped */
+	FUNC_EXIT_RC(fired);
+	return fired;
+}
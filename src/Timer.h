@@ -0,0 +1,65 @@
+/*******************************************************************************
+ * Copyright (c) 2026 the mruby-mqtt contributors
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *******************************************************************************/
+
+#if !defined(TIMER_H)
+#define TIMER_H
+
+/** number of levels in the timer wheel hierarchy */
+#define TIMER_WHEEL_LEVELS 4
+/** number of slots at each level: must be a power of two */
+#define TIMER_WHEEL_SLOTS 64
+/** resolution of the timer wheel in milliseconds */
+#define TIMER_TICK_MS 10
+
+/**
+ * Function called when a timer expires.
+ * @param context the context pointer the timer was initialized with
+ * @param content the content pointer the timer was initialized with
+ */
+typedef void Timer_callback(void* context, void* content);
+
+/**
+ * A timer, normally embedded in the structure it is the deadline for, so that no
+ * allocation is needed to schedule it.  Must be initialized with Timer_init.
+ */
+typedef struct TimerStruct
+{
+	struct TimerStruct *prev, *next; /**< links within a wheel slot */
+	unsigned long expires;           /**< deadline in wheel ticks */
+	Timer_callback* callback;        /**< called on expiry */
+	void* context;                   /**< first callback parameter */
+	void* content;                   /**< second callback parameter */
+	unsigned int pending : 1;        /**< is the timer scheduled? */
+	unsigned int level : 7;          /**< the wheel level holding the timer, TIMER_WHEEL_LEVELS when expired */
+	unsigned int slot : 8;           /**< the slot within that level */
+} Timer;
+
+/**
+ * A hierarchical timer wheel.  A zeroed structure is a valid empty wheel.
+ */
+typedef struct
+{
+	unsigned long tick;	/**< the next tick to be processed */
+	int count;			/**< number of scheduled timers */
+	Timer* slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+	Timer* expired;		/**< timers whose callbacks are being called */
+} TimerWheel;
+
+unsigned long Timer_now(void);
+void Timer_init(Timer* timer, Timer_callback* callback, void* context, void* content);
+void Timer_set(TimerWheel* wheel, Timer* timer, unsigned long deadline);
+void Timer_setIn(TimerWheel* wheel, Timer* timer, long interval);
+void Timer_cancel(TimerWheel* wheel, Timer* timer);
+int TimerWheel_run(TimerWheel* wheel, unsigned long now);
+
+#endif
@@ -21,8 +21,10 @@ THE SOFTWARE.
 */
 
 #include "mruby.h"
+#include "mruby/array.h"
 #include "mruby/class.h"
 #include "mruby/data.h"
+#include "mruby/hash.h"
 #include "mruby/numeric.h"
 #include "mruby/string.h"
 #include "mruby/variable.h"
@@ -37,6 +39,7 @@ THE SOFTWARE.
 #define E_MQTT_SUBSCRIBE_ERROR          (mrb_class_get(mrb, "MQTTSubscribeFailureError"))
 #define E_MQTT_PUBLISH_ERROR            (mrb_class_get(mrb, "MQTTPublishFailureError"))
 #define E_MQTT_DISCONNECT_ERROR         (mrb_class_get(mrb, "MQTTDisconnectFailureError"))
+#define E_MQTT_WOULD_BLOCK_ERROR        (mrb_class_get(mrb, "MQTTWouldBlockError"))
 
 typedef struct _mqtt_state {
   mrb_state *mrb;
@@ -113,6 +116,61 @@ clean_session_c(mrb_state* mrb, mrb_value self)
 		    mrb_funcall(mrb, self, "clean_session", 0));
 }
 
+mrb_int
+fixnum_option_c(mrb_state* mrb, mrb_value self, const char *name)
+{
+  return mrb_fixnum(mrb_funcall(mrb, self, name, 0));
+}
+
+// exp: inbound_policy  #=> :drop_oldest | :drop_newest | :pause
+int
+inbound_policy_c(mrb_state* mrb, mrb_value self)
+{
+  mrb_sym policy = mrb_symbol(mrb_funcall(mrb, self, "inbound_policy", 0));
+
+  if (policy == mrb_intern_lit(mrb, "drop_newest")) {
+    return MQTTASYNC_INBOUND_DROP_NEWEST;
+  } else if (policy == mrb_intern_lit(mrb, "pause")) {
+    return MQTTASYNC_INBOUND_PAUSE;
+  }
+  return MQTTASYNC_INBOUND_DROP_OLDEST_QOS0;
+}
+
+// exp: compressions  #=> [[filter, min_bytes, level, dictionary], ...]
+int
+set_compression_c(mrb_state* mrb, mrb_value self, MQTTAsync client)
+{
+  mrb_value list = mrb_funcall(mrb, self, "compressions", 0);
+  mrb_int count = RARRAY_LEN(list);
+  MQTTAsync_compressionOptions *opts;
+  mrb_int i;
+  int rc;
+
+  if (count == 0) {
+    return MQTTASYNC_SUCCESS;
+  }
+
+  opts = mrb_malloc(mrb, sizeof(MQTTAsync_compressionOptions) * count);
+  for (i = 0; i < count; i++) {
+    MQTTAsync_compressionOptions initializer = MQTTAsync_compressionOptions_initializer;
+    mrb_value entry = mrb_ary_ref(mrb, list, i);
+    mrb_value dictionary = mrb_ary_ref(mrb, entry, 3);
+
+    opts[i] = initializer;
+    opts[i].topicFilter = mrb_str_to_cstr(mrb, mrb_ary_ref(mrb, entry, 0));
+    opts[i].minBytes = mrb_fixnum(mrb_ary_ref(mrb, entry, 1));
+    opts[i].level = mrb_fixnum(mrb_ary_ref(mrb, entry, 2));
+    if (!mrb_nil_p(dictionary)) {
+      opts[i].dictionary = RSTRING_PTR(dictionary);
+      opts[i].dictionaryLen = RSTRING_LEN(dictionary);
+    }
+  }
+
+  rc = MQTTAsync_setCompression(client, count, opts);
+  mrb_free(mrb, opts);
+  return rc;
+}
+
 /*******************************************************************
   MQTT Call backs
  *******************************************************************/
@@ -124,18 +182,11 @@ mqtt_msgarrvd(void *context, char *topicName, int topicLen,
   mqtt_state *m = DATA_PTR(_self);
   if (m == NULL) return 0;
 
-  char *ptr;
-
-  ptr = topicName;
-  for(int i = 0; i < topicLen; i++) ptr++;
-  *ptr = '\0';
-
-  ptr = message->payload;
-  for(int i = 0; i < message->payloadlen; i++) ptr++;
-  *ptr = '\0';
-
-  mrb_value mrb_topic = mrb_str_new_cstr(m->mrb, topicName);
-  mrb_value mrb_payload = mrb_str_new_cstr(m->mrb, message->payload);
+  // exp: the payload may be followed by the next message of a batch,
+  //      so it is copied by length rather than terminated in place
+  if (topicLen == 0) topicLen = strlen(topicName);
+  mrb_value mrb_topic = mrb_str_new(m->mrb, topicName, topicLen);
+  mrb_value mrb_payload = mrb_str_new(m->mrb, message->payload, message->payloadlen);
   mrb_value mrb_message = mqtt_msg_new(m->mrb);
   mrb_funcall(m->mrb, mrb_message, "topic=", 1, mrb_topic);
   mrb_funcall(m->mrb, mrb_message, "payload=", 1, mrb_payload);
@@ -198,6 +249,25 @@ mqtt_on_publish(void* context, MQTTAsync_successData* response)
   mrb_funcall(m->mrb, m->self, "on_publish_callback", 0);
 }
 
+void
+mqtt_on_publish_failure(void* context, MQTTAsync_failureData* response)
+{
+  mqtt_state *m = DATA_PTR(_self);
+  if (m == NULL) return;
+
+  mrb_funcall(m->mrb, m->self, "on_publish_failure_callback", 1,
+	      mrb_fixnum_value(response ? response->code : MQTTASYNC_FAILURE));
+}
+
+void
+mqtt_on_writable(void* context)
+{
+  mqtt_state *m = DATA_PTR(_self);
+  if (m == NULL) return;
+
+  mrb_funcall(m->mrb, m->self, "on_writable_callback", 0);
+}
+
 void
 mqtt_on_connect_failure(void* context, MQTTAsync_failureData* response)
 {
@@ -232,7 +302,7 @@ mqtt_init(mrb_state *mrb, mrb_value self)
   mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "keep_alive"), 
 	     mrb_fixnum_value(20));
   mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "request_timeout"), 
-	     mrb_fixnum_value(1000));
+	     mrb_fixnum_value(10));
 
   DATA_PTR(self) = NULL;
   return self;
@@ -326,6 +396,8 @@ mqtt_connect(mrb_state *mrb, mrb_value self)
 
   MQTTAsync client;
   MQTTAsync_connectOptions conn_opts = MQTTAsync_connectOptions_initializer;
+  MQTTAsync_batchOptions batch_opts = MQTTAsync_batchOptions_initializer;
+  MQTTAsync_inboundOptions inbound_opts = MQTTAsync_inboundOptions_initializer;
   mrb_value m_address = mqtt_address(mrb, self);
   mrb_value m_client_id = mqtt_client_id(mrb, self);
   mrb_value m_keep_alive = mqtt_keep_alive(mrb, self);
@@ -338,9 +410,35 @@ mqtt_connect(mrb_state *mrb, mrb_value self)
 		   MQTTCLIENT_PERSISTENCE_NONE, NULL);
 
   MQTTAsync_setCallbacks(client, NULL, mqtt_connlost, mqtt_msgarrvd, NULL);
+  MQTTAsync_setWritable(client, NULL, mqtt_on_writable);
+  if (set_compression_c(mrb, self, client) != MQTTASYNC_SUCCESS) {
+    MQTTAsync_destroy(&client);
+    mrb_raise(mrb, E_MQTT_CONNECTION_FAILURE_ERROR, "invalid compression");
+  }
 
   conn_opts.keepAliveInterval = c_keep_alive;
   conn_opts.cleansession = clean_session_c(mrb, self);
+  conn_opts.maxInflight = fixnum_option_c(mrb, self, "max_inflight");
+  conn_opts.maxQueuedBytes = fixnum_option_c(mrb, self, "max_queued_bytes");
+  conn_opts.lowWatermarkBytes = fixnum_option_c(mrb, self, "low_watermark_bytes");
+  conn_opts.MQTTVersion = fixnum_option_c(mrb, self, "mqtt_version");
+  conn_opts.topicAliasMaximum = fixnum_option_c(mrb, self, "topic_alias_maximum");
+
+  batch_opts.maxMessages = fixnum_option_c(mrb, self, "batch_messages");
+  batch_opts.lingerMicros = fixnum_option_c(mrb, self, "batch_linger");
+  batch_opts.maxBytes = fixnum_option_c(mrb, self, "batch_bytes");
+  batch_opts.unpack = mrb_obj_eq(mrb, mrb_true_value(),
+				 mrb_funcall(mrb, self, "unpack_batches", 0));
+  if (batch_opts.maxMessages > 1 || batch_opts.unpack) {
+    conn_opts.batch = &batch_opts;
+  }
+
+  inbound_opts.maxMessages = fixnum_option_c(mrb, self, "max_inbound_messages");
+  inbound_opts.maxBytes = fixnum_option_c(mrb, self, "max_inbound_bytes");
+  inbound_opts.maxPacketSize = fixnum_option_c(mrb, self, "max_inbound_packet");
+  inbound_opts.policy = inbound_policy_c(mrb, self);
+  conn_opts.inbound = &inbound_opts;
+
   conn_opts.onSuccess = mqtt_on_connect;
   conn_opts.onFailure = mqtt_on_connect_failure;
   conn_opts.context = client;
@@ -378,6 +476,27 @@ mqtt_disconnect(mrb_state *mrb, mrb_value self)
   return mrb_bool_value(TRUE);
 }
 
+// exp: self.inbound_stats  #=> {:queued_messages => 0, :dropped_messages => 12, ...}
+mrb_value
+mqtt_inbound_stats(mrb_state *mrb, mrb_value self)
+{
+  mqtt_state *m = DATA_PTR(_self);
+  check_mqtt_connected(mrb, m);
+
+  MQTTAsync_inboundStats stats;
+  mrb_value hash = mrb_hash_new(mrb);
+
+  MQTTAsync_getInboundStats(m->client, &stats);
+  mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "queued_messages")), mrb_fixnum_value(stats.queuedMessages));
+  mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "queued_bytes")), mrb_fixnum_value(stats.queuedBytes));
+  mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "dropped_messages")), mrb_fixnum_value(stats.droppedMessages));
+  mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "dropped_bytes")), mrb_fixnum_value(stats.droppedBytes));
+  mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "oversized_packets")), mrb_fixnum_value(stats.oversizedPackets));
+  mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "pauses")), mrb_fixnum_value(stats.pauses));
+
+  return hash;
+}
+
 mrb_value
 mqtt_publish(mrb_state *mrb, mrb_value self)
 {
@@ -392,19 +511,97 @@ mqtt_publish(mrb_state *mrb, mrb_value self)
   mrb_value payload;
   mrb_int qos;
   mrb_bool retain;
-  mrb_get_args(mrb, "ooib", &topic, &payload, &qos, &retain);
+  mrb_int priority;
+  mrb_get_args(mrb, "ooibi", &topic, &payload, &qos, &retain, &priority);
   char *topic_p = mrb_str_to_cstr(mrb, topic);
   char *payload_p = mrb_str_to_cstr(mrb, payload);
 
   opts.onSuccess = mqtt_on_publish;
+  opts.onFailure = mqtt_on_publish_failure;
   opts.context = m->client;
+  opts.timeout = fixnum_option_c(mrb, self, "request_timeout") * 1000;
+  opts.priority = priority;
 
   pubmsg.payload = payload_p;
   pubmsg.payloadlen = strlen(payload_p);
   pubmsg.qos = qos;
   pubmsg.retained = retain;
 
-  if ((rc = MQTTAsync_sendMessage(m->client, topic_p, &pubmsg, &opts)) != MQTTASYNC_SUCCESS) {
+  if ((rc = MQTTAsync_sendMessage(m->client, topic_p, &pubmsg, &opts)) == MQTTASYNC_WOULD_BLOCK) {
+    mrb_raise(mrb, E_MQTT_WOULD_BLOCK_ERROR, "publish would block");
+  } else if (rc != MQTTASYNC_SUCCESS) {
+    mrb_raise(mrb, E_MQTT_PUBLISH_ERROR, "publish failure");
+  }
+
+  return mrb_bool_value(TRUE);
+}
+
+/*******************************************************************
+  MQTTTopic Class
+ *******************************************************************/
+
+typedef struct _mqtt_topic {
+  MQTTAsync client;
+  MQTTAsync_topicHandle handle;
+} mqtt_topic;
+
+static void
+mqtt_topic_free(mrb_state *mrb, void *p)
+{
+  mqtt_topic *t = p;
+  MQTTAsync_unregisterTopic(&t->handle);
+  mrb_free(mrb, t);
+}
+
+static const struct mrb_data_type mqtt_topic_type = { "MQTTTopic", mqtt_topic_free };
+
+// exp: topic.publish_internal("mydata", 1, false, MQTTASYNC_PRIORITY_NORMAL)
+mrb_value
+mqtt_topic_publish(mrb_state *mrb, mrb_value self)
+{
+  mqtt_state *m = DATA_PTR(_self);
+  check_mqtt_connected(mrb, m);
+
+  int rc;
+  mqtt_topic *t = DATA_PTR(self);
+  MQTTAsync_responseOptions opts = MQTTAsync_responseOptions_initializer;
+
+  mrb_value payload;
+  mrb_int qos;
+  mrb_bool retain;
+  mrb_int priority;
+  mrb_get_args(mrb, "oibi", &payload, &qos, &retain, &priority);
+  char *payload_p = mrb_str_to_cstr(mrb, payload);
+
+  if (t == NULL) {
+    t = mrb_malloc(mrb, sizeof(mqtt_topic));
+    t->client = NULL;
+    t->handle = NULL;
+    DATA_TYPE(self) = &mqtt_topic_type;
+    DATA_PTR(self) = t;
+  }
+
+  // a new client is created on each connect, so register with the current one
+  if (t->client != m->client) {
+    char *name_p = mrb_str_to_cstr(mrb, mrb_iv_get(mrb, self, mrb_intern_lit(mrb, "@name")));
+
+    MQTTAsync_unregisterTopic(&t->handle);
+    t->client = NULL;
+    if (MQTTAsync_registerTopic(m->client, name_p, &t->handle) != MQTTASYNC_SUCCESS) {
+      mrb_raise(mrb, E_MQTT_PUBLISH_ERROR, "invalid topic");
+    }
+    t->client = m->client;
+  }
+
+  opts.onSuccess = mqtt_on_publish;
+  opts.onFailure = mqtt_on_publish_failure;
+  opts.context = m->client;
+  opts.timeout = fixnum_option_c(mrb, m->self, "request_timeout") * 1000;
+  opts.priority = priority;
+
+  if ((rc = MQTTAsync_sendTo(t->handle, strlen(payload_p), payload_p, qos, retain, &opts)) == MQTTASYNC_WOULD_BLOCK) {
+    mrb_raise(mrb, E_MQTT_WOULD_BLOCK_ERROR, "publish would block");
+  } else if (rc != MQTTASYNC_SUCCESS) {
     mrb_raise(mrb, E_MQTT_PUBLISH_ERROR, "publish failure");
   }
 
@@ -420,12 +617,15 @@ mqtt_subscribe(mrb_state *mrb, mrb_value self)
   int rc;
   mrb_value topic;
   mrb_int qos;
+  mrb_int priority;
   MQTTAsync_responseOptions opts = MQTTAsync_responseOptions_initializer;
   opts.onSuccess = mqtt_on_subscribe;
   opts.onFailure = mqtt_on_subscribe_failure;
   opts.context = m->client;
+  opts.timeout = fixnum_option_c(mrb, self, "request_timeout") * 1000;
 
-  mrb_get_args(mrb, "oi", &topic, &qos);
+  mrb_get_args(mrb, "oii", &topic, &qos, &priority);
+  opts.priority = priority;
   char *topic_p = mrb_str_to_cstr(mrb, topic);
   
   if ((rc = MQTTAsync_subscribe(m->client, topic_p, qos, &opts)) != MQTTASYNC_SUCCESS) {
@@ -440,7 +640,9 @@ mrb_mruby_mqtt_gem_init(mrb_state* mrb)
 {
   mrb_define_class(mrb, "MQTTConnectionFailureError", mrb->eStandardError_class);
   mrb_define_class(mrb, "MQTTSubscribeFailureError",  mrb->eStandardError_class);
-  mrb_define_class(mrb, "MQTTPublishFailureError",    mrb->eStandardError_class);
+  struct RClass *publish_error;
+  publish_error = mrb_define_class(mrb, "MQTTPublishFailureError", mrb->eStandardError_class);
+  mrb_define_class(mrb, "MQTTWouldBlockError",        publish_error);
   mrb_define_class(mrb, "MQTTDisconnectFailureError", mrb->eStandardError_class);
   mrb_define_class(mrb, "MQTTNullClientError",        mrb->eStandardError_class);
   mrb_define_class(mrb, "MQTTAlreadyConnectedError",  mrb->eStandardError_class);
@@ -454,6 +656,11 @@ mrb_mruby_mqtt_gem_init(mrb_state* mrb)
   mrb_define_method(mrb, d, "payload", mqtt_msg_payload, MRB_ARGS_NONE());
   mrb_define_method(mrb, d, "payload=", mqtt_set_msg_payload, MRB_ARGS_REQ(1));
 
+  struct RClass *t;
+  t = mrb_define_class(mrb, "MQTTTopic", mrb->object_class);
+  MRB_SET_INSTANCE_TT(t, MRB_TT_DATA);
+  mrb_define_method(mrb, t, "publish_internal", mqtt_topic_publish, MRB_ARGS_REQ(4));
+
   struct RClass *c;
   c = mrb_define_class(mrb, "MQTTClient", mrb->object_class);
   MRB_SET_INSTANCE_TT(c, MRB_TT_DATA);
@@ -469,9 +676,10 @@ mrb_mruby_mqtt_gem_init(mrb_state* mrb)
   mrb_define_method(mrb, c, "request_timeout=", mqtt_set_request_timeout, MRB_ARGS_NONE());
   mrb_define_method(mrb, c, "connect", mqtt_connect, MRB_ARGS_NONE());
   mrb_define_method(mrb, c, "connected?", mqtt_is_connected, MRB_ARGS_NONE());
-  mrb_define_method(mrb, c, "publish_internal", mqtt_publish, MRB_ARGS_REQ(4));
-  mrb_define_method(mrb, c, "subscribe_internal", mqtt_subscribe, MRB_ARGS_REQ(2));
+  mrb_define_method(mrb, c, "publish_internal", mqtt_publish, MRB_ARGS_REQ(5));
+  mrb_define_method(mrb, c, "subscribe_internal", mqtt_subscribe, MRB_ARGS_REQ(3));
   mrb_define_method(mrb, c, "disconnect", mqtt_disconnect, MRB_ARGS_NONE());
+  mrb_define_method(mrb, c, "inbound_stats", mqtt_inbound_stats, MRB_ARGS_NONE());
 }
 
 void
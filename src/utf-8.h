@@ -17,7 +17,18 @@
 #if !defined(UTF8_H)
 #define UTF8_H
 
-int UTF8_validate(int len, char* data);
+/**
+ * The implementations of UTF-8 validation, slowest first
+ */
+enum UTF8_implementations
+{
+	UTF8_SCALAR,	/**< one character at a time */
+	UTF8_SSE2,		/**< ASCII 16 bytes at a time */
+	UTF8_AVX2		/**< ASCII 32 bytes at a time */
+};
+
+int UTF8_setImplementation(int implementation);
+int UTF8_validate(int len, const char* data);
 int UTF8_validateString(const char* string);
 
 #endif
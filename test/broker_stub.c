@@ -0,0 +1,577 @@
+/*
+Copyright (c) 2014 Shin Hiroe
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/*
+ * A minimal MQTT 3.1.1 and 5 broker, just enough to test and benchmark the client against
+ * without an external server.
+ *
+ * It accepts connections on 127.0.0.1, and handles CONNECT, SUBSCRIBE, UNSUBSCRIBE, PINGREQ,
+ * DISCONNECT and PUBLISH at QoS 0, 1 and 2 with the acks of each flow.  Publications are
+ * forwarded to every connection with a matching subscription, including the publisher, at
+ * the lower of the two QoS, as soon as the PUBLISH is received.  There are no sessions,
+ * retained messages, wills or authentication, and acks from subscribers are not checked.
+ * MQTT 5 properties are skipped, and none are sent, so every ack is a plain success.  The
+ * acks of publications can be held back, to test what the client does when they are late.
+ *
+ * Everything runs in one thread, polling the sockets.  Built with BROKER_STUB_MAIN defined
+ * it is a standalone program, for benchmarks which are not written in C:
+ *
+ *   broker_stub [port]
+ */
+
+#include "broker_stub.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#define BROKER_MAX_CONNECTIONS 64
+#define BROKER_MAX_FILTERS 16
+
+enum { CONNECT = 1, CONNACK, PUBLISH, PUBACK, PUBREC, PUBREL, PUBCOMP, SUBSCRIBE, SUBACK,
+	UNSUBSCRIBE, UNSUBACK, PINGREQ, PINGRESP, DISCONNECT };
+
+/**
+ * A growable byte buffer
+ */
+typedef struct
+{
+	unsigned char* data;
+	size_t len;		/**< bytes held */
+	size_t start;	/**< bytes already consumed from the front */
+	size_t size;	/**< bytes allocated */
+} Buffer;
+
+/**
+ * One client connection
+ */
+typedef struct
+{
+	int fd;
+	Buffer in;
+	Buffer out;
+	char* filters[BROKER_MAX_FILTERS];
+	int qoss[BROKER_MAX_FILTERS];
+	int filter_count;
+	int next_msgid;
+	int version;	/**< the protocol level of the CONNECT */
+} Connection;
+
+static Connection* connections[BROKER_MAX_CONNECTIONS];
+static int listen_fd = -1;
+static volatile int stopping = 0;
+static volatile int holding_acks = 0;
+static pthread_t broker_thread;
+
+
+static void buffer_reserve(Buffer* buf, size_t extra)
+{
+	if (buf->start > 0 && buf->start == buf->len)
+		buf->start = buf->len = 0;
+	if (buf->len + extra <= buf->size)
+		return;
+	if (buf->start > 0)
+	{
+		memmove(buf->data, buf->data + buf->start, buf->len - buf->start);
+		buf->len -= buf->start;
+		buf->start = 0;
+	}
+	if (buf->len + extra > buf->size)
+	{
+		while (buf->len + extra > buf->size)
+			buf->size = (buf->size) ? buf->size * 2 : 65536;
+		buf->data = realloc(buf->data, buf->size);
+	}
+}
+
+
+static void flush(Connection* conn)
+{
+	while (conn->out.start < conn->out.len)
+	{
+		ssize_t rc = send(conn->fd, conn->out.data + conn->out.start, conn->out.len - conn->out.start, MSG_NOSIGNAL);
+
+		if (rc <= 0)
+			break; /* the rest is written when the socket is writable */
+		conn->out.start += rc;
+	}
+}
+
+
+/**
+ * Queue a packet for a connection
+ * @param header the first byte of the fixed header
+ * @param parts the variable header and payload, as a list of buffers
+ */
+static void send_packet(Connection* conn, unsigned char header, int count, const void** parts, const size_t* lens)
+{
+	size_t remaining = 0;
+	unsigned char* ptr;
+	int i;
+
+	for (i = 0; i < count; ++i)
+		remaining += lens[i];
+	buffer_reserve(&conn->out, remaining + 5);
+	ptr = conn->out.data + conn->out.len;
+	*ptr++ = header;
+	do
+	{
+		unsigned char digit = remaining % 128;
+
+		remaining /= 128;
+		*ptr++ = (remaining > 0) ? digit | 0x80 : digit;
+	} while (remaining > 0);
+	for (i = 0; i < count; ++i)
+	{
+		memcpy(ptr, parts[i], lens[i]);
+		ptr += lens[i];
+	}
+	conn->out.len = ptr - conn->out.data;
+}
+
+
+static void send_ack(Connection* conn, unsigned char header, const unsigned char* body, size_t len)
+{
+	const void* parts[1] = {body};
+
+	send_packet(conn, header, 1, parts, &len);
+}
+
+
+/**
+ * Does a topic match a subscription filter, with the + and # wildcards?
+ */
+static int matches(const char* filter, const char* topic)
+{
+	while (*filter)
+	{
+		if (*filter == '#')
+			return 1;
+		if (*filter == '+')
+		{
+			while (*topic && *topic != '/')
+				++topic;
+			++filter;
+		}
+		else if (*filter++ != *topic++)
+			return 0;
+	}
+	return *topic == '\0';
+}
+
+
+/**
+ * Skip the properties of an MQTT 5 packet
+ * @param offset the offset of the property length, updated to the offset after the properties
+ * @return 0 if the properties overrun the packet
+ */
+static int skip_properties(const unsigned char* data, size_t len, size_t* offset)
+{
+	size_t proplen = 0, multiplier = 1;
+
+	do
+	{
+		if (*offset >= len || multiplier > 128 * 128 * 128)
+			return 0;
+		proplen += (data[*offset] & 127) * multiplier;
+		multiplier *= 128;
+	} while (data[(*offset)++] & 128);
+	*offset += proplen;
+	return *offset <= len;
+}
+
+
+static void forward(const unsigned char* topic, int topiclen, const unsigned char* payload, size_t payloadlen, int qos)
+{
+	char name[65536 + 1];
+	int i, j;
+
+	memcpy(name, topic, topiclen);
+	name[topiclen] = '\0';
+	for (i = 0; i < BROKER_MAX_CONNECTIONS; ++i)
+	{
+		Connection* conn = connections[i];
+
+		if (conn == NULL)
+			continue;
+		for (j = 0; j < conn->filter_count; ++j)
+		{
+			if (matches(conn->filters[j], name))
+			{
+				int q = (qos < conn->qoss[j]) ? qos : conn->qoss[j];
+				unsigned char lenbuf[2] = {topiclen >> 8, topiclen & 0xff}, msgid[2], noprops = 0;
+				const void* parts[5] = {lenbuf, topic, msgid, &noprops, payload};
+				size_t lens[5] = {2, topiclen, 2, (conn->version == 5) ? 1 : 0, payloadlen};
+
+				if (q > 0)
+				{
+					conn->next_msgid = (conn->next_msgid % 65535) + 1;
+					msgid[0] = conn->next_msgid >> 8;
+					msgid[1] = conn->next_msgid & 0xff;
+				}
+				else
+					lens[2] = 0;
+				send_packet(conn, (PUBLISH << 4) | (q << 1), 5, parts, lens);
+				flush(conn);
+				break;
+			}
+		}
+	}
+}
+
+
+/**
+ * Handle one complete packet
+ * @return 0 if the connection is to be closed
+ */
+static int handle_packet(Connection* conn, unsigned char header, unsigned char* data, size_t len)
+{
+	int type = header >> 4;
+	int rc = 1;
+
+	if (type == CONNECT)
+	{	/* 3.1, 3.1.1 and 5 are understood */
+		int protocol_len = (len >= 2) ? (data[0] << 8) + data[1] : 0;
+		int level = (len > 2 + protocol_len) ? data[2 + protocol_len] : 0;
+		unsigned char connack[3] = {0, (level == 3 || level == 4 || level == 5) ? 0 : 1, 0};
+
+		conn->version = level;
+		send_ack(conn, CONNACK << 4, connack, (level == 5) ? 3 : 2);
+		rc = (connack[1] == 0);
+	}
+	else if (type == PUBLISH && len >= 2)
+	{
+		int qos = (header >> 1) & 3;
+		int topiclen = (data[0] << 8) + data[1];
+		size_t offset = 2 + topiclen + ((qos > 0) ? 2 : 0);
+
+		if (offset > len || qos > 2 || (conn->version == 5 && !skip_properties(data, len, &offset)))
+			return 0;
+		if (holding_acks)
+			;
+		else if (qos == 1)
+			send_ack(conn, PUBACK << 4, data + 2 + topiclen, 2);
+		else if (qos == 2)
+			send_ack(conn, PUBREC << 4, data + 2 + topiclen, 2);
+		forward(data + 2, topiclen, data + offset, len - offset, qos);
+	}
+	else if (type == PUBREC && len >= 2)
+		send_ack(conn, (PUBREL << 4) | 2, data, 2);
+	else if (type == PUBREL && len >= 2)
+		send_ack(conn, PUBCOMP << 4, data, 2);
+	else if (type == SUBSCRIBE && len >= 2)
+	{
+		unsigned char suback[3 + BROKER_MAX_FILTERS] = {data[0], data[1], 0};
+		size_t offset = 2, ackoffset = (conn->version == 5) ? 3 : 2;
+		int count = 0;
+
+		if (conn->version == 5 && !skip_properties(data, len, &offset))
+			return 0;
+		while (offset + 2 < len && count < BROKER_MAX_FILTERS)
+		{
+			int filterlen = (data[offset] << 8) + data[offset + 1];
+			char* filter = NULL;
+			int qos;
+
+			if (offset + 2 + filterlen >= len)
+				return 0;
+			qos = data[offset + 2 + filterlen] & 3;
+			if (conn->filter_count < BROKER_MAX_FILTERS)
+			{
+				filter = malloc(filterlen + 1);
+				memcpy(filter, data + offset + 2, filterlen);
+				filter[filterlen] = '\0';
+				conn->filters[conn->filter_count] = filter;
+				conn->qoss[conn->filter_count++] = qos;
+				suback[ackoffset + count++] = qos;
+			}
+			else
+				suback[ackoffset + count++] = 0x80;
+			offset += 3 + filterlen;
+		}
+		send_ack(conn, SUBACK << 4, suback, ackoffset + count);
+	}
+	else if (type == UNSUBSCRIBE && len >= 2)
+	{
+		unsigned char unsuback[3 + BROKER_MAX_FILTERS] = {data[0], data[1], 0};
+		size_t offset = 2, ackoffset = (conn->version == 5) ? 3 : 2;
+		int count = 0;
+
+		if (conn->version == 5 && !skip_properties(data, len, &offset))
+			return 0;
+		while (offset + 2 <= len && count < BROKER_MAX_FILTERS)
+		{
+			int filterlen = (data[offset] << 8) + data[offset + 1];
+			int i;
+
+			unsuback[ackoffset + count] = 0x11; /* no subscription existed */
+			for (i = 0; i < conn->filter_count; ++i)
+			{
+				if ((int)strlen(conn->filters[i]) == filterlen &&
+					memcmp(conn->filters[i], data + offset + 2, filterlen) == 0)
+				{
+					free(conn->filters[i]);
+					conn->filters[i] = conn->filters[--conn->filter_count];
+					conn->qoss[i] = conn->qoss[conn->filter_count];
+					unsuback[ackoffset + count] = 0;
+					break;
+				}
+			}
+			offset += 2 + filterlen;
+			++count;
+		}
+		/* only MQTT 5 has a reason code for each filter */
+		send_ack(conn, UNSUBACK << 4, unsuback, (conn->version == 5) ? ackoffset + count : 2);
+	}
+	else if (type == PINGREQ)
+		send_ack(conn, PINGRESP << 4, (const unsigned char*)"", 0);
+	else if (type == DISCONNECT)
+		rc = 0;
+	return rc;
+}
+
+
+/**
+ * Handle all the complete packets read from a connection
+ * @return 0 if the connection is to be closed
+ */
+static int handle_input(Connection* conn)
+{
+	Buffer* in = &conn->in;
+
+	while (in->len - in->start >= 2)
+	{
+		unsigned char* ptr = in->data + in->start;
+		size_t avail = in->len - in->start;
+		size_t remaining = 0, multiplier = 1, used = 1;
+
+		int complete = 1;
+
+		do
+		{
+			if (used > 4)
+				return 0; /* bad remaining length */
+			if (used >= avail)
+			{
+				complete = 0;
+				break;
+			}
+			remaining += (ptr[used] & 127) * multiplier;
+			multiplier *= 128;
+		} while (ptr[used++] & 128);
+		if (!complete || avail < used + remaining)
+			break;
+		in->start += used + remaining;
+		if (!handle_packet(conn, ptr[0], ptr + used, remaining))
+		{
+			flush(conn);
+			return 0;
+		}
+	}
+	flush(conn);
+	return 1;
+}
+
+
+static void close_connection(int i)
+{
+	Connection* conn = connections[i];
+	int j;
+
+	close(conn->fd);
+	for (j = 0; j < conn->filter_count; ++j)
+		free(conn->filters[j]);
+	free(conn->in.data);
+	free(conn->out.data);
+	free(conn);
+	connections[i] = NULL;
+}
+
+
+static void accept_connection(void)
+{
+	int fd = accept(listen_fd, NULL, NULL);
+	int on = 1, i;
+
+	if (fd < 0)
+		return;
+	for (i = 0; i < BROKER_MAX_CONNECTIONS; ++i)
+	{
+		if (connections[i] == NULL)
+		{
+			connections[i] = calloc(1, sizeof(Connection));
+			connections[i]->fd = fd;
+			fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+			setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+			return;
+		}
+	}
+	close(fd); /* too many connections */
+}
+
+
+static void* broker_run(void* arg)
+{
+	struct pollfd fds[BROKER_MAX_CONNECTIONS + 1];
+	int index[BROKER_MAX_CONNECTIONS + 1];
+
+	while (!stopping)
+	{
+		int count = 1, i;
+
+		fds[0].fd = listen_fd;
+		fds[0].events = POLLIN;
+		for (i = 0; i < BROKER_MAX_CONNECTIONS; ++i)
+		{
+			if (connections[i])
+			{
+				fds[count].fd = connections[i]->fd;
+				fds[count].events = POLLIN;
+				if (connections[i]->out.start < connections[i]->out.len)
+					fds[count].events |= POLLOUT;
+				index[count++] = i;
+			}
+		}
+		if (poll(fds, count, 100) <= 0)
+			continue;
+		if (fds[0].revents & POLLIN)
+			accept_connection();
+		for (i = 1; i < count; ++i)
+		{
+			Connection* conn = connections[index[i]];
+			int ok = 1;
+
+			if (conn == NULL)
+				continue;
+			if (fds[i].revents & POLLOUT)
+				flush(conn);
+			if (fds[i].revents & (POLLIN | POLLHUP | POLLERR))
+			{
+				ssize_t rc;
+
+				buffer_reserve(&conn->in, 65536);
+				rc = recv(conn->fd, conn->in.data + conn->in.len, conn->in.size - conn->in.len, 0);
+				if (rc == 0 || (rc < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+					ok = 0;
+				else if (rc > 0)
+				{
+					conn->in.len += rc;
+					ok = handle_input(conn);
+				}
+			}
+			if (!ok)
+				close_connection(index[i]);
+		}
+	}
+	return NULL;
+}
+
+
+/**
+ * Start the broker in a thread of its own
+ * @param port the port to listen on, or 0 for any free port
+ * @return the port listened on, or -1 on failure
+ */
+int broker_stub_start(int port)
+{
+	struct sockaddr_in addr;
+	socklen_t addrlen = sizeof(addr);
+	int on = 1;
+
+	if ((listen_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+		return -1;
+	setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	memset(&addr, '\0', sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(listen_fd, 64) != 0 ||
+		getsockname(listen_fd, (struct sockaddr*)&addr, &addrlen) != 0)
+	{
+		close(listen_fd);
+		return -1;
+	}
+	stopping = 0;
+	holding_acks = 0;
+	if (pthread_create(&broker_thread, NULL, broker_run, NULL) != 0)
+	{
+		close(listen_fd);
+		return -1;
+	}
+	return ntohs(addr.sin_port);
+}
+
+
+/**
+ * Stop the broker, closing all its connections
+ */
+void broker_stub_stop(void)
+{
+	int i;
+
+	stopping = 1;
+	pthread_join(broker_thread, NULL);
+	for (i = 0; i < BROKER_MAX_CONNECTIONS; ++i)
+	{
+		if (connections[i])
+			close_connection(i);
+	}
+	close(listen_fd);
+}
+
+
+/**
+ * Hold back, or stop holding back, the PUBACK or PUBREC of each publication received from now
+ * on.  The publications are still forwarded.
+ * @param hold boolean - hold the acks back?
+ */
+void broker_stub_hold_acks(int hold)
+{
+	holding_acks = hold;
+}
+
+
+#if defined(BROKER_STUB_MAIN)
+int main(int argc, char** argv)
+{
+	int port = broker_stub_start((argc > 1) ? atoi(argv[1]) : 1883);
+
+	if (port < 0)
+	{
+		perror("broker_stub");
+		return 1;
+	}
+	printf("listening on 127.0.0.1:%d\n", port);
+	fflush(stdout);
+	pthread_join(broker_thread, NULL);
+	return 0;
+}
+#endif
@@ -0,0 +1,651 @@
+/*
+Copyright (c) 2014 Shin Hiroe
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include "mruby.h"
+#include "mruby/string.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include "../src/MQTTAsync.h"
+#include "../src/MQTTPersistenceLog.h"
+#include "../src/MQTTPersistenceMemory.h"
+#include "../src/Heap.h"
+#include "broker_stub.h"
+
+#define LOG_CLIENT "mqtt-test-log"
+#define LOG_URI "tcp://127.0.0.1:1883"
+#define LOG_SEGMENTS LOG_CLIENT "-tcp---127.0.0.1-1883" // LOG_CLIENT-LOG_URI, as a directory name
+#define LOG_CHURN_SIZE (64 * 1024)
+#define SNAPSHOT_CLIENT "mqtt-test-snapshot"
+#define SNAPSHOT_HOST "127.0.0.1:1" // the server URI as the client passes it to its store
+#define SNAPSHOT_FILE SNAPSHOT_CLIENT "-127.0.0.1-1" MQTTPERSISTENCEMEMORY_EXTENSION
+
+/*******************************************************************
+  MQTTTest Module, helpers for test/mqtt_client_test.rb
+ *******************************************************************/
+
+static int
+raw_send(int fd, unsigned char header, const char *body, size_t len)
+{
+  unsigned char *buf = malloc(len + 5);
+  size_t remaining = len, used = 0;
+  ssize_t rc;
+
+  buf[used++] = header;
+  do {
+    unsigned char digit = remaining % 128;
+    remaining /= 128;
+    buf[used++] = (remaining > 0) ? digit | 0x80 : digit;
+  } while (remaining > 0);
+  memcpy(buf + used, body, len);
+  rc = send(fd, buf, used + len, 0);
+  free(buf);
+  return rc == (ssize_t)(used + len);
+}
+
+static int
+raw_connect(int port)
+{
+  static const char connect_body[] = "\0\4MQTT\4\2\0\x3c\0\15mqtt-test-raw";
+  struct sockaddr_in addr;
+  unsigned char connack[4];
+  size_t got = 0;
+  int fd;
+
+  if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) return -1;
+  memset(&addr, '\0', sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+      !raw_send(fd, 0x10, connect_body, sizeof(connect_body) - 1)) {
+    close(fd);
+    return -1;
+  }
+  while (got < sizeof(connack)) {
+    ssize_t rc = recv(fd, connack + got, sizeof(connack) - got, 0);
+    if (rc <= 0) break;
+    got += rc;
+  }
+  if (got < sizeof(connack) || connack[0] != 0x20 || connack[3] != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// exp: MQTTTest.broker_start  #=> 50123
+static mrb_value
+mqtt_test_broker_start(mrb_state *mrb, mrb_value self)
+{
+  int port = broker_stub_start(0);
+
+  if (port < 0) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "broker stub failed to start");
+  }
+  return mrb_fixnum_value(port);
+}
+
+// exp: MQTTTest.broker_stop
+static mrb_value
+mqtt_test_broker_stop(mrb_state *mrb, mrb_value self)
+{
+  broker_stub_stop();
+  return mrb_nil_value();
+}
+
+// exp: MQTTTest.hold_acks(true)
+static mrb_value
+mqtt_test_hold_acks(mrb_state *mrb, mrb_value self)
+{
+  mrb_bool hold;
+  mrb_get_args(mrb, "b", &hold);
+
+  broker_stub_hold_acks(hold);
+  return mrb_nil_value();
+}
+
+typedef struct _cancel_state {
+  volatile int connected;
+  volatile int successes;
+  volatile int failures;
+  volatile int code;
+} cancel_state;
+
+static void
+cancel_on_connect(void* context, MQTTAsync_successData* response)
+{
+  ((cancel_state*)context)->connected = 1;
+}
+
+static void
+cancel_on_success(void* context, MQTTAsync_successData* response)
+{
+  ++((cancel_state*)context)->successes;
+}
+
+static void
+cancel_on_failure(void* context, MQTTAsync_failureData* response)
+{
+  ((cancel_state*)context)->code = response->code;
+  ++((cancel_state*)context)->failures;
+}
+
+static int
+cancel_wait(volatile int *value, int expected, int millis)
+{
+  for (; millis > 0 && *value != expected; millis -= 10) {
+    usleep(10000);
+  }
+  return *value == expected;
+}
+
+// exp: MQTTTest.cancel_once(port)  #=> nil | "what went wrong"
+//      MQTTAsync_cancel is not in the Ruby API, so this drives the client
+//      from C: one publication waits behind another whose PUBACK the broker
+//      stub holds back, and both must have their onFailure called once, the
+//      waiting one by cancelling it and the sent one by its timeout
+static mrb_value
+mqtt_test_cancel_once(mrb_state *mrb, mrb_value self)
+{
+  mrb_int port;
+  mrb_get_args(mrb, "i", &port);
+
+  char uri[32];
+  const char *error = NULL;
+  cancel_state connection = {0, 0, 0, 0}, sent = {0, 0, 0, 0}, waiting = {0, 0, 0, 0};
+  MQTTAsync client;
+  MQTTAsync_connectOptions conn_opts = MQTTAsync_connectOptions_initializer;
+  MQTTAsync_disconnectOptions disc_opts = MQTTAsync_disconnectOptions_initializer;
+  MQTTAsync_responseOptions sent_opts = MQTTAsync_responseOptions_initializer;
+  MQTTAsync_responseOptions waiting_opts = MQTTAsync_responseOptions_initializer;
+
+  snprintf(uri, sizeof(uri), "tcp://127.0.0.1:%d", (int)port);
+  if (MQTTAsync_create(&client, uri, "mqtt-test-cancel", MQTTCLIENT_PERSISTENCE_NONE, NULL) != MQTTASYNC_SUCCESS) {
+    return mrb_str_new_cstr(mrb, "create failure");
+  }
+  conn_opts.maxInflight = 1; // so the second publication waits in the command queue
+  conn_opts.onSuccess = cancel_on_connect;
+  conn_opts.context = &connection;
+  if (MQTTAsync_connect(client, &conn_opts) != MQTTASYNC_SUCCESS || !cancel_wait(&connection.connected, 1, 5000)) {
+    error = "connection failure";
+    goto exit;
+  }
+
+  broker_stub_hold_acks(1);
+  sent_opts.onSuccess = waiting_opts.onSuccess = cancel_on_success;
+  sent_opts.onFailure = waiting_opts.onFailure = cancel_on_failure;
+  sent_opts.context = &sent;
+  waiting_opts.context = &waiting;
+  sent_opts.timeout = waiting_opts.timeout = 500;
+  if (MQTTAsync_send(client, "c/x", 4, "sent", 1, 0, &sent_opts) != MQTTASYNC_SUCCESS ||
+      MQTTAsync_send(client, "c/x", 7, "waiting", 1, 0, &waiting_opts) != MQTTASYNC_SUCCESS) {
+    error = "publish failure";
+    goto exit;
+  }
+  usleep(100000); // until the first has been sent
+
+  if (MQTTAsync_cancel(client, waiting_opts.token) != MQTTASYNC_SUCCESS) {
+    error = "a waiting publication could not be cancelled";
+  } else if (waiting.failures != 1 || waiting.code != MQTTASYNC_OPERATION_CANCELLED) {
+    error = "a cancelled publication did not have onFailure called with MQTTASYNC_OPERATION_CANCELLED";
+  } else if (MQTTAsync_cancel(client, sent_opts.token) != MQTTASYNC_FAILURE) {
+    error = "a publication already sent was cancelled";
+  } else if (sent.failures != 0 || !cancel_wait(&sent.failures, 1, 2000) || sent.code != MQTTASYNC_OPERATION_TIMEOUT) {
+    error = "a publication whose PUBACK was held back did not time out";
+  } else {
+    usleep(700000); // longer than the timeout of the cancelled publication
+    if (waiting.failures != 1 || sent.failures != 1 || waiting.successes + sent.successes != 0) {
+      error = "a callback was called more than once";
+    }
+  }
+
+exit:
+  broker_stub_hold_acks(0);
+  MQTTAsync_disconnect(client, &disc_opts);
+  usleep(100000);
+  MQTTAsync_destroy(&client);
+  return error ? mrb_str_new_cstr(mrb, error) : mrb_nil_value();
+}
+
+static void
+remove_tree(const char *path)
+{
+  DIR *dp = opendir(path);
+  struct dirent *entry;
+
+  if (dp) {
+    while ((entry = readdir(dp)) != NULL) {
+      char child[256];
+
+      if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
+        snprintf(child, sizeof(child), "%s/%s", path, entry->d_name);
+        remove_tree(child);
+      }
+    }
+    closedir(dp);
+  }
+  remove(path);
+}
+
+// puts the data in two buffers, as the client puts the header and the payload of a message
+static int
+log_put(void *h, char *key, const char *data, int len)
+{
+  char *buffers[2] = {(char*)data, (char*)data + len / 2};
+  int buflens[2] = {len / 2, len - len / 2};
+
+  return MQTTPersistenceLog_put(h, key, 2, buffers, buflens);
+}
+
+// gets the data twice, because the first get after opening the store is
+// answered from what was read when it was opened, and later ones from the file
+static int
+log_has(void *h, char *key, const char *data, int len)
+{
+  int i, ok = 1;
+
+  for (i = 0; i < 2 && ok; ++i) {
+    char *buffer = NULL;
+    int buflen = 0;
+
+    ok = MQTTPersistenceLog_get(h, key, &buffer, &buflen) == 0 && buflen == len && memcmp(buffer, data, len) == 0;
+    if (buffer) {
+      free(buffer); // from the heap of the library
+    }
+  }
+  return ok;
+}
+
+static int
+log_count(void *h)
+{
+  char **keys = NULL;
+  int i, nkeys = -1;
+
+  if (MQTTPersistenceLog_keys(h, &keys, &nkeys) != 0) return -1;
+  for (i = 0; i < nkeys; ++i) {
+    free(keys[i]);
+  }
+  if (keys) {
+    free(keys);
+  }
+  return nkeys;
+}
+
+static void
+log_churn(char *data, int i)
+{
+  memset(data, i & 0xff, LOG_CHURN_SIZE);
+  memcpy(data, &i, sizeof(i));
+}
+
+// exp: MQTTTest.log_reopen  #=> nil | "what went wrong"
+//      puts, puts again, removes and syncs, and finds the same keys and data
+//      in the store after it is closed and opened again
+static mrb_value
+mqtt_test_log_reopen(mrb_state *mrb, mrb_value self)
+{
+  char dir[] = "/tmp/mqtt-test-XXXXXX";
+  const char *error = NULL;
+  void *h = NULL;
+
+  if (mkdtemp(dir) == NULL) {
+    return mrb_str_new_cstr(mrb, "mkdtemp failure");
+  }
+  if (MQTTPersistenceLog_open(&h, LOG_CLIENT, LOG_URI, dir) != 0) {
+    error = "open failure";
+  } else if (log_put(h, "k1", "one", 3) || log_put(h, "k2", "two", 3) || log_put(h, "k1", "uno", 3) ||
+             log_put(h, "k3", "three", 5) || MQTTPersistenceLog_remove(h, "k3") != 0) {
+    error = "put failure";
+  } else if (log_count(h) != 2 || !log_has(h, "k1", "uno", 3) || MQTTPersistenceLog_containskey(h, "k3") == 0) {
+    error = "the store does not hold what was put";
+  } else if (MQTTPersistenceLog_sync(h) != 0 || MQTTPersistenceLog_sync(h) != 0 || MQTTPersistenceLog_sync(NULL) == 0) {
+    error = "sync failure";
+  } else {
+    MQTTPersistenceLog_close(h);
+    h = NULL;
+    if (MQTTPersistenceLog_open(&h, LOG_CLIENT, LOG_URI, dir) != 0) {
+      error = "reopen failure";
+    } else if (log_count(h) != 2 || !log_has(h, "k1", "uno", 3) || !log_has(h, "k2", "two", 3) ||
+               MQTTPersistenceLog_containskey(h, "k3") == 0) {
+      error = "the reopened store does not hold what was put";
+    }
+  }
+
+  if (h) {
+    MQTTPersistenceLog_close(h);
+  }
+  remove_tree(dir);
+  return error ? mrb_str_new_cstr(mrb, error) : mrb_nil_value();
+}
+
+// exp: MQTTTest.log_torn_tail  #=> nil | "what went wrong"
+//      appends half a record to a segment, as a write cut short by a crash
+//      would, and checks that opening the store cuts it off and keeps the rest
+static mrb_value
+mqtt_test_log_torn_tail(mrb_state *mrb, mrb_value self)
+{
+  char dir[] = "/tmp/mqtt-test-XXXXXX";
+  char file[128];
+  const char *error = NULL;
+  void *h = NULL;
+  unsigned int header[3] = {0, 2, 100}; // crc, keylen, datalen
+  struct stat before, after;
+  FILE *f;
+
+  if (mkdtemp(dir) == NULL) {
+    return mrb_str_new_cstr(mrb, "mkdtemp failure");
+  }
+  snprintf(file, sizeof(file), "%s/" LOG_SEGMENTS "/00000000.log", dir);
+  if (MQTTPersistenceLog_open(&h, LOG_CLIENT, LOG_URI, dir) != 0 ||
+      log_put(h, "k1", "one", 3) || log_put(h, "k2", "two", 3)) {
+    error = "put failure";
+    goto exit;
+  }
+  MQTTPersistenceLog_close(h);
+  h = NULL;
+
+  if (stat(file, &before) != 0 || (f = fopen(file, "ab")) == NULL) {
+    error = "no segment file";
+    goto exit;
+  }
+  fwrite(header, sizeof(header), 1, f);
+  fwrite("k3partial", 9, 1, f);
+  fclose(f);
+
+  if (MQTTPersistenceLog_open(&h, LOG_CLIENT, LOG_URI, dir) != 0) {
+    error = "reopen failure";
+  } else if (log_count(h) != 2 || !log_has(h, "k1", "one", 3) || !log_has(h, "k2", "two", 3)) {
+    error = "records before the torn one were lost";
+  } else if (stat(file, &after) != 0 || after.st_size != before.st_size) {
+    error = "the torn record was not cut off";
+  } else if (log_put(h, "k3", "three", 5)) {
+    error = "put failure after the torn record was cut off";
+  } else {
+    MQTTPersistenceLog_close(h);
+    h = NULL;
+    if (MQTTPersistenceLog_open(&h, LOG_CLIENT, LOG_URI, dir) != 0 || log_count(h) != 3 ||
+        !log_has(h, "k1", "one", 3) || !log_has(h, "k3", "three", 5)) {
+      error = "a record put after the torn one was cut off was lost";
+    }
+  }
+
+exit:
+  if (h) {
+    MQTTPersistenceLog_close(h);
+  }
+  remove_tree(dir);
+  return error ? mrb_str_new_cstr(mrb, error) : mrb_nil_value();
+}
+
+// exp: MQTTTest.log_compaction  #=> nil | "what went wrong"
+//      puts a few keys which stay live in the first segment, then writes
+//      other keys over and over, past several segments, until the first
+//      segment is compacted away, and checks that every live key survives,
+//      also after the store is opened again
+static mrb_value
+mqtt_test_log_compaction(mrb_state *mrb, mrb_value self)
+{
+  static char *live[] = {"live0", "live1", "live2", "live3"};
+  static char *churn[] = {"churn0", "churn1", "churn2", "churn3"};
+  const int writes = 5 * MQTTPERSISTENCELOG_SEGMENT_SIZE / LOG_CHURN_SIZE;
+  char dir[] = "/tmp/mqtt-test-XXXXXX";
+  char first[128];
+  const char *error = NULL;
+  void *h = NULL;
+  char *data = malloc(LOG_CHURN_SIZE);
+  int i, pass, waited;
+
+  if (mkdtemp(dir) == NULL) {
+    free(data);
+    return mrb_str_new_cstr(mrb, "mkdtemp failure");
+  }
+  snprintf(first, sizeof(first), "%s/" LOG_SEGMENTS "/00000000.log", dir);
+  if (MQTTPersistenceLog_open(&h, LOG_CLIENT, LOG_URI, dir) != 0) {
+    error = "open failure";
+    goto exit;
+  }
+  for (i = 0; i < 4; ++i) {
+    if (log_put(h, live[i], live[i], strlen(live[i]))) {
+      error = "put failure";
+      goto exit;
+    }
+  }
+  if (access(first, F_OK) != 0) {
+    error = "no first segment";
+    goto exit;
+  }
+  for (i = 0; i < writes; ++i) {
+    log_churn(data, i);
+    if (log_put(h, churn[i % 4], data, LOG_CHURN_SIZE)) {
+      error = "put failure";
+      goto exit;
+    }
+  }
+  for (waited = 0; waited < 10000 && access(first, F_OK) == 0; waited += 10) {
+    usleep(10000);
+  }
+  if (access(first, F_OK) == 0) {
+    error = "the first segment was not compacted";
+    goto exit;
+  }
+
+  for (pass = 0; pass < 2 && error == NULL; ++pass) {
+    if (pass == 1) {
+      MQTTPersistenceLog_close(h);
+      h = NULL;
+      if (MQTTPersistenceLog_open(&h, LOG_CLIENT, LOG_URI, dir) != 0) {
+        error = "reopen failure";
+        break;
+      }
+    }
+    if (log_count(h) != 8) {
+      error = "a key was lost in compaction";
+    }
+    for (i = 0; i < 4 && error == NULL; ++i) {
+      log_churn(data, writes - 4 + i);
+      if (!log_has(h, live[i], live[i], strlen(live[i])) || !log_has(h, churn[i], data, LOG_CHURN_SIZE)) {
+        error = "the data of a key was lost in compaction";
+      }
+    }
+  }
+
+exit:
+  if (h) {
+    MQTTPersistenceLog_close(h);
+  }
+  remove_tree(dir);
+  free(data);
+  return error ? mrb_str_new_cstr(mrb, error) : mrb_nil_value();
+}
+
+// the number of records in a memory store which hold each of the payloads
+static int
+snapshot_count(void *h, const char **payloads, int count)
+{
+  char **keys = NULL;
+  int i, j, nkeys = 0, found = 0;
+
+  if (MQTTPersistenceMemory_keys(h, &keys, &nkeys) != 0) return -1;
+  for (i = 0; i < nkeys; ++i) {
+    char *buffer = NULL;
+    int buflen = 0;
+
+    if (MQTTPersistenceMemory_get(h, keys[i], &buffer, &buflen) == 0) {
+      for (j = 0; j < count; ++j) {
+        int len = strlen(payloads[j]), pos;
+
+        for (pos = 0; pos + len <= buflen && memcmp(buffer + pos, payloads[j], len) != 0; ++pos)
+          ;
+        found += (pos + len <= buflen);
+      }
+      free(buffer);
+    }
+    free(keys[i]);
+  }
+  if (keys) {
+    free(keys);
+  }
+  return (found == count && nkeys == count) ? nkeys : -1;
+}
+
+// exp: MQTTTest.snapshot  #=> nil | "what went wrong"
+//      persists publications buffered while offline in memory, writes them
+//      to the snapshot file with MQTTAsync_snapshot, and reads them back
+//      from it, then damages one byte of the file and checks that the
+//      store opens empty rather than with damaged records
+static mrb_value
+mqtt_test_snapshot(mrb_state *mrb, mrb_value self)
+{
+  static const char *payloads[] = {"snapshot one", "snapshot two", "snapshot three"};
+  char dir[] = "/tmp/mqtt-test-XXXXXX";
+  char file[128];
+  const char *error = NULL;
+  void *h = NULL;
+  MQTTAsync client = NULL;
+  MQTTAsync_offlineOptions offline = MQTTAsync_offlineOptions_initializer;
+  int i;
+  FILE *f;
+
+  if (mkdtemp(dir) == NULL) {
+    return mrb_str_new_cstr(mrb, "mkdtemp failure");
+  }
+  snprintf(file, sizeof(file), "%s/" SNAPSHOT_FILE, dir);
+  if (MQTTAsync_create(&client, "tcp://" SNAPSHOT_HOST, SNAPSHOT_CLIENT, MQTTCLIENT_PERSISTENCE_MEMORY, dir) != MQTTASYNC_SUCCESS ||
+      MQTTAsync_setOfflineBuffer(client, &offline) != MQTTASYNC_SUCCESS) {
+    error = "create failure";
+    goto exit;
+  }
+  for (i = 0; i < 3; ++i) {
+    if (MQTTAsync_send(client, "s/x", strlen(payloads[i]), (void*)payloads[i], 1, 0, NULL) != MQTTASYNC_SUCCESS) {
+      error = "publish failure";
+      goto exit;
+    }
+  }
+  if (MQTTAsync_snapshot(client) != MQTTASYNC_SUCCESS) {
+    error = "snapshot failure";
+    goto exit;
+  }
+
+  // a second store opened on the snapshot, while the client keeps its own
+  if (MQTTPersistenceMemory_open(&h, SNAPSHOT_CLIENT, SNAPSHOT_HOST, dir) != 0) {
+    error = "open failure";
+  } else if (snapshot_count(h, payloads, 3) != 3) {
+    error = "the snapshot does not hold the publications";
+  } else {
+    MQTTPersistenceMemory_close(h); // which writes the same records to the snapshot again
+    h = NULL;
+    if ((f = fopen(file, "r+b")) == NULL) {
+      error = "no snapshot file";
+    } else {
+      int c;
+
+      // in the first record, after the magic, the count and the lengths
+      fseek(f, 20, SEEK_SET);
+      c = fgetc(f);
+      fseek(f, 20, SEEK_SET);
+      fputc(c ^ 0x01, f);
+      fclose(f);
+      if (MQTTPersistenceMemory_open(&h, SNAPSHOT_CLIENT, SNAPSHOT_HOST, dir) != 0) {
+        error = "open failure";
+      } else if (snapshot_count(h, payloads, 0) != 0) {
+        error = "a damaged snapshot was not ignored";
+      }
+    }
+  }
+
+exit:
+  if (h) {
+    MQTTPersistenceMemory_close(h);
+  }
+  if (client) {
+    MQTTAsync_destroy(&client);
+  }
+  remove_tree(dir);
+  return error ? mrb_str_new_cstr(mrb, error) : mrb_nil_value();
+}
+
+// exp: MQTTTest.publish_raw(port, "t/x", "\0MQZ...")
+//      publishes at QoS 0 from a connection of its own, sending the
+//      payload as it is, NUL bytes and all, whatever the client would do
+static mrb_value
+mqtt_test_publish_raw(mrb_state *mrb, mrb_value self)
+{
+  mrb_int port;
+  mrb_value topic;
+  mrb_value payload;
+  mrb_get_args(mrb, "iSS", &port, &topic, &payload);
+
+  size_t topic_len = RSTRING_LEN(topic);
+  size_t len = 2 + topic_len + RSTRING_LEN(payload);
+  char *body = malloc(len);
+  int fd, ok;
+
+  body[0] = topic_len >> 8;
+  body[1] = topic_len & 0xff;
+  memcpy(body + 2, RSTRING_PTR(topic), topic_len);
+  memcpy(body + 2 + topic_len, RSTRING_PTR(payload), RSTRING_LEN(payload));
+
+  if ((fd = raw_connect(port)) < 0) {
+    free(body);
+    mrb_raise(mrb, E_RUNTIME_ERROR, "raw connect failure");
+  }
+  ok = raw_send(fd, 0x30, body, len) && raw_send(fd, 0xe0, "", 0);
+  close(fd);
+  free(body);
+  if (!ok) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "raw publish failure");
+  }
+
+  return mrb_bool_value(TRUE);
+}
+
+void
+mrb_mruby_mqtt_gem_test(mrb_state* mrb)
+{
+  static MQTTAsync keeper = NULL;
+  struct RClass *t;
+
+  // a client which is never destroyed keeps the library initialized, so
+  // that memory from its heap, which malloc and free here are redefined to
+  // use by Heap.h, can be freed at any time during the tests
+  if (keeper == NULL) {
+    MQTTAsync_create(&keeper, "tcp://127.0.0.1:1", "mqtt-test-keeper", MQTTCLIENT_PERSISTENCE_NONE, NULL);
+  }
+  t = mrb_define_module(mrb, "MQTTTest");
+  mrb_define_module_function(mrb, t, "broker_start", mqtt_test_broker_start, MRB_ARGS_NONE());
+  mrb_define_module_function(mrb, t, "broker_stop", mqtt_test_broker_stop, MRB_ARGS_NONE());
+  mrb_define_module_function(mrb, t, "publish_raw", mqtt_test_publish_raw, MRB_ARGS_REQ(3));
+  mrb_define_module_function(mrb, t, "hold_acks", mqtt_test_hold_acks, MRB_ARGS_REQ(1));
+  mrb_define_module_function(mrb, t, "cancel_once", mqtt_test_cancel_once, MRB_ARGS_REQ(1));
+  mrb_define_module_function(mrb, t, "log_reopen", mqtt_test_log_reopen, MRB_ARGS_NONE());
+  mrb_define_module_function(mrb, t, "log_torn_tail", mqtt_test_log_torn_tail, MRB_ARGS_NONE());
+  mrb_define_module_function(mrb, t, "log_compaction", mqtt_test_log_compaction, MRB_ARGS_NONE());
+  mrb_define_module_function(mrb, t, "snapshot", mqtt_test_snapshot, MRB_ARGS_NONE());
+}
@@ -3,6 +3,38 @@ MQTT_TOPIC_2 = "/mqtttest/test2"
 MQTT_PAYLOAD_1 = "hello1"
 MQTT_PAYLOAD_2 = "hello2"
 
+# Puts every option of the singleton back to its default
+def reset_options(mqtt)
+  mqtt.instance_variables.each { |v| mqtt.instance_variable_set(v, nil) }
+end
+
+def wait_for(timeout = 5)
+  (timeout * 100).times do
+    return true if yield
+    Sleep.usleep 10_000
+  end
+  yield
+end
+
+# Connects to the broker stub of test/broker_stub.c, started with
+# MQTTTest.broker_start, and subscribes to the filter
+def connect_stub(mqtt, port, filter)
+  subscribed = false
+  mqtt.on_connlost = -> { }
+  mqtt.on_connect = -> { mqtt.subscribe(filter, qos:0) }
+  mqtt.on_subscribe = -> { subscribed = true }
+  MQTTClient.connect("tcp://127.0.0.1:#{port}", "mruby-test")
+  wait_for { subscribed }
+end
+
+def disconnect_stub(mqtt)
+  if mqtt.connected?
+    mqtt.disconnect
+    wait_for { !mqtt.connected? }
+  end
+  MQTTTest.broker_stop
+end
+
 assert("MQTTClient.connect") do
   subscribe_count = 0
   publish_count = 0
@@ -49,6 +81,7 @@ end
 
 assert("MQTTClient#publish with invalid QoS") do
   mqtt = MQTTClient.instance
+  reset_options(mqtt)
 
   [3 .. 100].each do |qos|
     assert_raise(ArgumentError) {
@@ -66,6 +99,7 @@ end
 
 assert("MQTTClient#subscribe with invalid QoS") do
   mqtt = MQTTClient.instance
+  reset_options(mqtt)
 
   [3 .. 100].each do |qos|
     assert_raise(ArgumentError) {
@@ -84,6 +118,7 @@ end
 assert("MQTTClient.instance.clean_session = false") do
 
   mqtt = MQTTClient.instance
+  reset_options(mqtt)
   assert_equal true, mqtt.clean_session
 
   mqtt.clean_session = false
@@ -102,6 +137,7 @@ end
 assert("MQTTClient.instance.reconnect_interval") do
 
   mqtt = MQTTClient.instance
+  reset_options(mqtt)
   assert_equal 5, mqtt.reconnect_interval
 
   mqtt.reconnect_interval = 10
@@ -112,3 +148,314 @@ assert("MQTTClient.instance.reconnect_interval") do
   assert_raise(ArgumentError) { mqtt.reconnect_interval = nil }
 
 end
+
+assert("MQTTClient.instance.max_queued_bytes") do
+
+  mqtt = MQTTClient.instance
+  reset_options(mqtt)
+  assert_equal 0, mqtt.max_inflight
+  assert_equal 0, mqtt.max_queued_bytes
+  assert_equal 0, mqtt.low_watermark_bytes
+
+  mqtt.max_inflight = 20
+  assert_equal 20, mqtt.max_inflight
+  mqtt.max_queued_bytes = 65536
+  assert_equal 65536, mqtt.max_queued_bytes
+  mqtt.low_watermark_bytes = 16384
+  assert_equal 16384, mqtt.low_watermark_bytes
+
+  assert_raise(ArgumentError) { mqtt.max_inflight = -1 }
+  assert_raise(ArgumentError) { mqtt.max_queued_bytes = "1024" }
+  assert_raise(ArgumentError) { mqtt.low_watermark_bytes = nil }
+
+end
+
+assert("MQTTClient#publish past max_queued_bytes") do
+  mqtt = MQTTClient.instance
+  reset_options(mqtt)
+  port = MQTTTest.broker_start
+  writable = false
+  published = 0
+
+  mqtt.max_queued_bytes = 300
+  mqtt.batch_messages = 100
+  mqtt.batch_linger = 500_000 # holds the publications in the queue
+  mqtt.on_writable = -> { writable = true }
+  assert_true connect_stub(mqtt, port, "q/#")
+
+  assert_raise(MQTTWouldBlockError) {
+    10.times { mqtt.publish("q/x", "x" * 100); published += 1 }
+  }
+  assert_true published > 0 && published < 10
+  assert_true wait_for { writable }
+  mqtt.publish("q/x", "x" * 100)
+
+  disconnect_stub(mqtt)
+end
+
+assert("MQTTClient#publish past request_timeout") do
+  mqtt = MQTTClient.instance
+  reset_options(mqtt)
+  port = MQTTTest.broker_start
+  codes = []
+  published = 0
+
+  mqtt.request_timeout = 1
+  mqtt.on_publish = -> { published += 1 }
+  mqtt.on_publish_failure = -> (code) { codes << code }
+  assert_true connect_stub(mqtt, port, "t/#")
+
+  # the stub never acks, so the publication fails once its timeout expires
+  MQTTTest.hold_acks(true)
+  mqtt.publish("t/x", "late", qos:1)
+  Sleep.usleep 500_000
+  assert_equal [], codes
+  assert_true wait_for(2) { codes.size == 1 }
+  assert_equal [MQTTClient::OPERATION_TIMEOUT], codes
+  assert_equal 0, published
+  MQTTTest.hold_acks(false)
+
+  disconnect_stub(mqtt)
+end
+
+assert("MQTTAsync_cancel") do
+  port = MQTTTest.broker_start
+  assert_nil MQTTTest.cancel_once(port)
+  MQTTTest.broker_stop
+end
+
+assert("MQTTClient.instance.mqtt_version") do
+
+  mqtt = MQTTClient.instance
+  reset_options(mqtt)
+  assert_equal 0, mqtt.mqtt_version
+  assert_equal 0, mqtt.topic_alias_maximum
+
+  mqtt.mqtt_version = 5
+  assert_equal 5, mqtt.mqtt_version
+  mqtt.topic_alias_maximum = 16
+  assert_equal 16, mqtt.topic_alias_maximum
+
+  assert_raise(ArgumentError) { mqtt.mqtt_version = 6 }
+  assert_raise(ArgumentError) { mqtt.topic_alias_maximum = 65536 }
+
+end
+
+assert("MQTTClient#publish with MQTT 5") do
+  mqtt = MQTTClient.instance
+  reset_options(mqtt)
+  port = MQTTTest.broker_start
+  received = []
+  published = 0
+
+  mqtt.mqtt_version = 5
+  mqtt.topic_alias_maximum = 4
+  mqtt.clean_session = false
+  mqtt.on_message = -> (message) { received << [message.topic, message.payload] }
+  assert_true connect_stub(mqtt, port, "v5/#")
+  mqtt.on_publish = -> { published += 1 }
+
+  mqtt.publish("v5/a", "one", qos:1)
+  mqtt.publish("v5/b", "two", qos:2)
+  assert_true wait_for { received.size == 2 && published == 2 }
+  assert_equal [["v5/a", "one"], ["v5/b", "two"]], received
+
+  disconnect_stub(mqtt)
+end
+
+assert("MQTTClient.instance.batch_messages") do
+
+  mqtt = MQTTClient.instance
+  reset_options(mqtt)
+  assert_equal 0, mqtt.batch_messages
+  assert_equal 1000, mqtt.batch_linger
+  assert_equal 4096, mqtt.batch_bytes
+  assert_equal false, mqtt.unpack_batches
+
+  mqtt.batch_messages = 32
+  assert_equal 32, mqtt.batch_messages
+  mqtt.unpack_batches = true
+  assert_equal true, mqtt.unpack_batches
+
+  assert_raise(ArgumentError) { mqtt.batch_linger = -1 }
+  assert_raise(ArgumentError) { mqtt.batch_bytes = 4 }
+  assert_raise(ArgumentError) { mqtt.unpack_batches = 1 }
+
+end
+
+assert("MQTTClient#publish with batch_messages") do
+  mqtt = MQTTClient.instance
+  reset_options(mqtt)
+  port = MQTTTest.broker_start
+  received = []
+
+  mqtt.batch_messages = 3
+  mqtt.batch_linger = 1_000_000
+  mqtt.on_message = -> (message) { received << message.payload }
+  assert_true connect_stub(mqtt, port, "b/#")
+
+  # the third publication fills the batch, so it is sent without lingering
+  mqtt.publish("b/x", "1")
+  mqtt.publish("b/x", "2")
+  mqtt.publish("b/x", "3")
+  assert_true wait_for(1) { received.size == 1 }
+  assert_equal ["\0MQB\x011\x012\x013"], received
+
+  disconnect_stub(mqtt)
+end
+
+assert("MQTTClient#unpack_batches") do
+  mqtt = MQTTClient.instance
+  reset_options(mqtt)
+  port = MQTTTest.broker_start
+  received = []
+
+  mqtt.batch_messages = 3
+  mqtt.unpack_batches = true
+  mqtt.on_message = -> (message) { received << [message.topic, message.payload] }
+  assert_true connect_stub(mqtt, port, "b/#")
+
+  mqtt.publish("b/x", "1")
+  mqtt.publish("b/x", "2")
+  mqtt.publish("b/x", "3")
+  assert_true wait_for { received.size == 3 }
+  MQTTTest.publish_raw(port, "b/y", "\0MQB\x03abc\x02de")
+  assert_true wait_for { received.size == 5 }
+  assert_equal [["b/x", "1"], ["b/x", "2"], ["b/x", "3"], ["b/y", "abc"], ["b/y", "de"]], received
+
+  disconnect_stub(mqtt)
+end
+
+assert("MQTTClient.instance.max_inbound_messages") do
+
+  mqtt = MQTTClient.instance
+  reset_options(mqtt)
+  assert_equal 0, mqtt.max_inbound_messages
+  assert_equal 0, mqtt.max_inbound_bytes
+  assert_equal 0, mqtt.max_inbound_packet
+  assert_equal :drop_oldest, mqtt.inbound_policy
+
+  mqtt.max_inbound_messages = 1000
+  assert_equal 1000, mqtt.max_inbound_messages
+  mqtt.inbound_policy = :pause
+  assert_equal :pause, mqtt.inbound_policy
+
+  assert_raise(ArgumentError) { mqtt.max_inbound_bytes = -1 }
+  assert_raise(ArgumentError) { mqtt.max_inbound_packet = "1024" }
+  assert_raise(ArgumentError) { mqtt.inbound_policy = :drop }
+
+end
+
+assert("MQTTClient#max_inbound_packet") do
+  mqtt = MQTTClient.instance
+  reset_options(mqtt)
+  port = MQTTTest.broker_start
+  received = []
+  lost = false
+
+  mqtt.max_inbound_packet = 200
+  mqtt.on_message = -> (message) { received << message.payload }
+  assert_true connect_stub(mqtt, port, "i/#")
+  mqtt.on_connlost = -> { lost = true }
+
+  mqtt.publish("i/x", "small")
+  assert_true wait_for { received.size == 1 }
+  assert_equal 0, mqtt.inbound_stats[:oversized_packets]
+
+  # only what arrives is limited, so the client can send it, but not receive it
+  mqtt.publish("i/x", "x" * 1000)
+  assert_true wait_for { lost }
+  assert_equal ["small"], received
+  assert_false mqtt.connected?
+
+  disconnect_stub(mqtt)
+end
+
+assert("MQTTClient#compress") do
+  mqtt = MQTTClient.instance
+  reset_options(mqtt)
+
+  assert_raise(ArgumentError) { mqtt.compress(nil) }
+  assert_raise(ArgumentError) { mqtt.compress("/my/#", min_bytes:-1) }
+  assert_raise(ArgumentError) { mqtt.compress("/my/#", level:10) }
+  assert_raise(ArgumentError) { mqtt.compress("/my/#", dictionary:1) }
+
+end
+
+assert("MQTTClient#compress round trip") do
+  mqtt = MQTTClient.instance
+  reset_options(mqtt)
+  port = MQTTTest.broker_start
+  received = []
+
+  mqtt.compress("z/#", min_bytes:0)
+  mqtt.compress("d/#", dictionary:"temperature humidity")
+  mqtt.on_message = -> (message) { received << [message.topic, message.payload] }
+  assert_true connect_stub(mqtt, port, "+/#")
+
+  mqtt.publish("z/x", "a" * 1000)
+  mqtt.publish("d/x", "temperature humidity " * 20)
+  mqtt.publish("z/x", "short")
+  assert_true wait_for { received.size == 3 }
+  assert_equal [["z/x", "a" * 1000], ["d/x", "temperature humidity " * 20], ["z/x", "short"]], received
+
+  # a marked payload declaring more than it is allowed to inflate to is delivered as it is
+  bomb = "\0MQZ\x80\x80\x80\x20junk"
+  MQTTTest.publish_raw(port, "z/y", bomb)
+  assert_true wait_for { received.size == 4 }
+  assert_equal ["z/y", bomb], received.last
+
+  disconnect_stub(mqtt)
+end
+
+assert("MQTTClient.instance.topic") do
+  mqtt = MQTTClient.instance
+  reset_options(mqtt)
+  topic = mqtt.topic("/my/topic")
+
+  assert_equal "/my/topic", topic.name
+  assert_raise(ArgumentError) { mqtt.topic(nil) }
+  assert_raise(ArgumentError) { topic.publish("payload", qos:3) }
+  assert_raise(ArgumentError) { topic.publish("payload", retain:1) }
+  assert_raise(ArgumentError) { topic.publish("payload", priority:0) }
+
+end
+
+assert("MQTTTopic#publish") do
+  mqtt = MQTTClient.instance
+  reset_options(mqtt)
+  topic = mqtt.topic("t/x")
+  received = []
+
+  2.times do
+    port = MQTTTest.broker_start
+    received.clear
+    mqtt.on_message = -> (message) { received << [message.topic, message.payload] }
+    assert_true connect_stub(mqtt, port, "t/#")
+
+    # a new client is created on each connect, and the topic follows it
+    topic.publish("1")
+    topic.publish("2", qos:1)
+    topic.publish("3")
+    assert_true wait_for { received.size == 3 }
+    assert_equal [["t/x", "1"], ["t/x", "2"], ["t/x", "3"]], received
+
+    disconnect_stub(mqtt)
+  end
+end
+
+assert("MQTTPersistenceLog reopen") do
+  assert_nil MQTTTest.log_reopen
+end
+
+assert("MQTTPersistenceLog torn tail") do
+  assert_nil MQTTTest.log_torn_tail
+end
+
+assert("MQTTPersistenceLog compaction") do
+  assert_nil MQTTTest.log_compaction
+end
+
+assert("MQTTPersistenceMemory snapshot") do
+  assert_nil MQTTTest.snapshot
+end